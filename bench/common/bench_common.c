@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "bench_common.h"
+
+#include <gutil_log.h>
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define BENCH_DEFAULT_TIME (200)
+#define BENCH_DEFAULT_REPEAT (3)
+
+/*
+ * Allocations are counted by wrapping glibc allocator, which is what
+ * g_malloc() ends up calling too. Nothing is counted elsewhere, or
+ * under AddressSanitizer which has its own allocator.
+ */
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static gint bench_alloc_count;
+
+void*
+malloc(
+    size_t size)
+{
+    g_atomic_int_inc(&bench_alloc_count);
+    return __libc_malloc(size);
+}
+
+void*
+calloc(
+    size_t nmemb,
+    size_t size)
+{
+    g_atomic_int_inc(&bench_alloc_count);
+    return __libc_calloc(nmemb, size);
+}
+
+void*
+realloc(
+    void* ptr,
+    size_t size)
+{
+    g_atomic_int_inc(&bench_alloc_count);
+    return __libc_realloc(ptr, size);
+}
+
+guint64
+bench_allocs(
+    void)
+{
+    return (guint)g_atomic_int_get(&bench_alloc_count);
+}
+
+gboolean
+bench_allocs_counted(
+    void)
+{
+    return TRUE;
+}
+
+#else /* !__GLIBC__ || __SANITIZE_ADDRESS__ */
+
+guint64
+bench_allocs(
+    void)
+{
+    return 0;
+}
+
+gboolean
+bench_allocs_counted(
+    void)
+{
+    return FALSE;
+}
+
+#endif /* !__GLIBC__ || __SANITIZE_ADDRESS__ */
+
+guint64
+bench_now(
+    void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (guint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+guint64
+bench_deadline(
+    const BenchOpt* opt)
+{
+    return bench_now() + (guint64)opt->time * 1000000;
+}
+
+gboolean
+bench_selected(
+    const BenchOpt* opt,
+    const char* name)
+{
+    if (opt->cases) {
+        char** ptr;
+
+        for (ptr = opt->cases; *ptr; ptr++) {
+            if (g_str_has_prefix(name, *ptr)) {
+                return TRUE;
+            }
+        }
+        return FALSE;
+    }
+    return TRUE;
+}
+
+guint
+bench_max_rss(
+    void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+void
+bench_samples_add(
+    BenchSamples* samples,
+    guint64 value)
+{
+    if (samples->count == samples->size) {
+        samples->size = MAX(2 * samples->size, 1024);
+        samples->values = g_renew(guint64, samples->values, samples->size);
+    }
+    samples->values[samples->count++] = value;
+}
+
+static
+int
+bench_samples_compare(
+    const void* a,
+    const void* b)
+{
+    const guint64 v1 = *(const guint64*)a;
+    const guint64 v2 = *(const guint64*)b;
+
+    return (v1 < v2) ? -1 : (v1 > v2) ? 1 : 0;
+}
+
+guint64
+bench_samples_percentile(
+    BenchSamples* samples,
+    guint pct)
+{
+    if (samples->count) {
+        qsort(samples->values, samples->count, sizeof(guint64),
+            bench_samples_compare);
+        return samples->values[(samples->count - 1) * MIN(pct, 100) / 100];
+    }
+    return 0;
+}
+
+void
+bench_samples_clear(
+    BenchSamples* samples)
+{
+    g_free(samples->values);
+    memset(samples, 0, sizeof(*samples));
+}
+
+static
+void
+bench_usage(
+    const char* exe,
+    const char* summary,
+    const BenchIntOption* extra)
+{
+    const BenchIntOption* opt;
+
+    fprintf(stderr, "Usage: %s [OPTION...] [CASE...]\n\n%s\n\n"
+        "  -v     Enable verbose log\n"
+        "  -t MS  Milliseconds per run [%d]\n"
+        "  -r N   Number of runs, the best one is reported [%d]\n", exe,
+        summary, BENCH_DEFAULT_TIME, BENCH_DEFAULT_REPEAT);
+    for (opt = extra; opt && opt->name; opt++) {
+        fprintf(stderr, "  -%c %-4s%s [%d]\n", opt->name, opt->arg,
+            opt->description, *opt->value);
+    }
+    fprintf(stderr, "\nCASE selects the cases whose names start "
+        "with it.\n");
+}
+
+gboolean
+bench_init(
+    BenchOpt* opt,
+    int argc,
+    char* argv[],
+    const char* summary)
+{
+    return bench_init_full(opt, argc, argv, summary, NULL);
+}
+
+gboolean
+bench_init_full(
+    BenchOpt* opt,
+    int argc,
+    char* argv[],
+    const char* summary,
+    const BenchIntOption* extra)
+{
+    const BenchIntOption* ext;
+    GString* optstring = g_string_new("vt:r:h");
+    int c;
+
+    for (ext = extra; ext && ext->name; ext++) {
+        g_string_append_c(optstring, ext->name);
+        g_string_append_c(optstring, ':');
+    }
+
+    memset(opt, 0, sizeof(*opt));
+    opt->time = BENCH_DEFAULT_TIME;
+    opt->repeat = BENCH_DEFAULT_REPEAT;
+    gutil_log_default.level = GLOG_LEVEL_NONE;
+    while ((c = getopt(argc, argv, optstring->str)) != -1) {
+        switch (c) {
+        case 'v':
+            gutil_log_default.level = GLOG_LEVEL_VERBOSE;
+            break;
+        case 't':
+            opt->time = atoi(optarg);
+            break;
+        case 'r':
+            opt->repeat = atoi(optarg);
+            break;
+        default:
+            for (ext = extra; ext && ext->name && ext->name != c; ext++);
+            if (ext && ext->name && c != '?') {
+                *ext->value = atoi(optarg);
+                break;
+            }
+            bench_usage(argv[0], summary, extra);
+            g_string_free(optstring, TRUE);
+            return FALSE;
+        }
+    }
+    g_string_free(optstring, TRUE);
+
+    opt->time = MAX(opt->time, 1);
+    opt->repeat = MAX(opt->repeat, 1);
+    if (optind < argc) {
+        opt->cases = g_strdupv(argv + optind);
+    }
+    return TRUE;
+}
+
+void
+bench_deinit(
+    BenchOpt* opt)
+{
+    g_strfreev(opt->cases);
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <gutil_types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Benchmarks print one line per case, the case name followed by
+ * space separated key=value pairs, e.g.
+ *
+ *   single packets=41943040 ns_per_packet=3.21 allocs_per_packet=0
+ *
+ * so that the output of two commits can be compared line by line.
+ */
+
+typedef struct bench_opt {
+    int time;           /* Milliseconds per run */
+    int repeat;         /* Best of that many runs is reported */
+    char** cases;       /* NULL means all */
+} BenchOpt;
+
+/* Benchmark specific integer option, e.g. -d for a delay */
+typedef struct bench_int_option {
+    char name;
+    const char* arg;
+    const char* description;
+    int* value;         /* Holds the default too */
+} BenchIntOption;
+
+/* Growable array of measurements, e.g. latencies */
+typedef struct bench_samples {
+    guint64* values;
+    guint count;
+    guint size;
+} BenchSamples;
+
+/* Should be called first thing in main */
+gboolean
+bench_init(
+    BenchOpt* opt,
+    int argc,
+    char* argv[],
+    const char* summary);
+
+/* The extra options array is terminated by an entry with zero name */
+gboolean
+bench_init_full(
+    BenchOpt* opt,
+    int argc,
+    char* argv[],
+    const char* summary,
+    const BenchIntOption* extra);
+
+void
+bench_deinit(
+    BenchOpt* opt);
+
+gboolean
+bench_selected(
+    const BenchOpt* opt,
+    const char* name);
+
+/* CLOCK_MONOTONIC, nanoseconds */
+guint64
+bench_now(
+    void);
+
+/* When the current run should stop */
+guint64
+bench_deadline(
+    const BenchOpt* opt);
+
+/* Number of malloc, calloc and realloc calls made so far */
+guint64
+bench_allocs(
+    void);
+
+/* FALSE if allocations can't be counted (not glibc, or ASan) */
+gboolean
+bench_allocs_counted(
+    void);
+
+/* Peak resident set size of this process, kilobytes */
+guint
+bench_max_rss(
+    void);
+
+void
+bench_samples_add(
+    BenchSamples* samples,
+    guint64 value);
+
+/* Sorts the samples, pct is 0..100 */
+guint64
+bench_samples_percentile(
+    BenchSamples* samples,
+    guint pct);
+
+void
+bench_samples_clear(
+    BenchSamples* samples);
+
+#endif /* BENCH_COMMON_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,463 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "bench_common.h"
+
+#include "pn54x_framer.h"
+#include "pn54x_util.h"
+
+/*
+ * Feeds synthetic read streams through the framer. Each case is a
+ * fixed sequence of reads (one round) which is repeated until the time
+ * budget runs out. Output is one line per case, see bench_common.h
+ */
+
+#define BENCH_READ_SIZE (512)   /* What the reader asks the driver for */
+#define BENCH_SPLIT_LEN (64)
+
+typedef struct bench_framer_read {
+    const guint8* data;
+    guint size;
+} BenchFramerRead;
+
+typedef struct bench_framer_case {
+    const char* name;
+    BenchFramerRead* reads;
+    guint nreads;
+    guint packets;              /* Per round */
+    GByteArray* bytes;
+} BenchFramerCase;
+
+typedef struct bench_framer_result {
+    guint64 count;              /* Packets or calls */
+    guint64 ns;
+    guint64 allocs;
+    guint64 copied;
+    guint64 padding;
+} BenchFramerResult;
+
+typedef struct bench_framer_sink {
+    guint64 packets;
+    guint64 sum;
+} BenchFramerSink;
+
+static
+void
+bench_framer_packet(
+    const void* pkt,
+    guint len,
+    void* user_data)
+{
+    BenchFramerSink* sink = user_data;
+    const guint8* bytes = pkt;
+
+    /* Touch the packet like the client would */
+    sink->packets++;
+    sink->sum += bytes[0] + bytes[len - 1];
+}
+
+static
+guint
+bench_framer_add_packet(
+    GByteArray* bytes,
+    guint8 gid,
+    guint8 oid,
+    guint payload)
+{
+    const guint8 hdr[3] = { 0x40 | gid, oid, (guint8)payload };
+    guint i;
+
+    g_byte_array_append(bytes, hdr, sizeof(hdr));
+    for (i = 0; i < payload; i++) {
+        const guint8 b = (guint8)i;
+
+        g_byte_array_append(bytes, &b, 1);
+    }
+    return sizeof(hdr) + payload;
+}
+
+static
+void
+bench_framer_add_padding(
+    GByteArray* bytes,
+    guint count)
+{
+    const guint8 ff = 0xff;
+
+    while (count--) {
+        g_byte_array_append(bytes, &ff, 1);
+    }
+}
+
+/*
+ * The reads point into the byte array, which is only complete after
+ * all the data have been added. Offsets are stored first, converted
+ * into pointers by bench_framer_case_done()
+ */
+
+static
+BenchFramerCase*
+bench_framer_case_new(
+    const char* name,
+    guint nreads)
+{
+    BenchFramerCase* test = g_new0(BenchFramerCase, 1);
+
+    test->name = name;
+    test->reads = g_new0(BenchFramerRead, nreads);
+    test->bytes = g_byte_array_new();
+    return test;
+}
+
+static
+void
+bench_framer_case_read(
+    BenchFramerCase* test,
+    guint start,
+    guint size)
+{
+    BenchFramerRead* read = test->reads + test->nreads++;
+
+    read->data = GSIZE_TO_POINTER(start);
+    read->size = size;
+}
+
+static
+BenchFramerCase*
+bench_framer_case_done(
+    BenchFramerCase* test)
+{
+    guint i;
+
+    for (i = 0; i < test->nreads; i++) {
+        BenchFramerRead* read = test->reads + i;
+
+        read->data = test->bytes->data + GPOINTER_TO_SIZE(read->data);
+    }
+    return test;
+}
+
+static
+void
+bench_framer_case_free(
+    BenchFramerCase* test)
+{
+    g_byte_array_free(test->bytes, TRUE);
+    g_free(test->reads);
+    g_free(test);
+}
+
+/* One short response per read */
+static
+BenchFramerCase*
+bench_framer_single(
+    void)
+{
+    BenchFramerCase* test = bench_framer_case_new("single", 1);
+
+    test->packets = 1;
+    bench_framer_add_packet(test->bytes, 0x00, 0x01, 1);
+    bench_framer_case_read(test, 0, test->bytes->len);
+    return bench_framer_case_done(test);
+}
+
+/* Notifications of various sizes back to back, all in one read */
+static
+BenchFramerCase*
+bench_framer_burst(
+    void)
+{
+    static const guint sizes[] = { 1, 5, 17, 2, 30, 8, 0, 12 };
+    BenchFramerCase* test = bench_framer_case_new("burst", 1);
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+        bench_framer_add_packet(test->bytes, 0x01, 0x05, sizes[i]);
+        test->packets++;
+    }
+    bench_framer_case_read(test, 0, test->bytes->len);
+    return bench_framer_case_done(test);
+}
+
+/* The same packet split in two at every possible offset */
+static
+BenchFramerCase*
+bench_framer_split(
+    void)
+{
+    BenchFramerCase* test = bench_framer_case_new("split",
+        2 * (BENCH_SPLIT_LEN - 1));
+    guint i;
+
+    for (i = 1; i < BENCH_SPLIT_LEN; i++) {
+        const guint start = test->bytes->len;
+
+        bench_framer_add_packet(test->bytes, 0x00, 0x03,
+            BENCH_SPLIT_LEN - PN54X_FRAMER_HEADER_SIZE);
+        bench_framer_case_read(test, start, i);
+        bench_framer_case_read(test, start + i, BENCH_SPLIT_LEN - i);
+        test->packets++;
+    }
+    return bench_framer_case_done(test);
+}
+
+/* Short packet and the rest of the read buffer filled with 0xff */
+static
+BenchFramerCase*
+bench_framer_padding(
+    void)
+{
+    BenchFramerCase* test = bench_framer_case_new("padding", 1);
+    const guint len = bench_framer_add_packet(test->bytes, 0x01, 0x05, 4);
+
+    test->packets = 1;
+    bench_framer_add_padding(test->bytes, BENCH_READ_SIZE - len);
+    bench_framer_case_read(test, 0, test->bytes->len);
+    return bench_framer_case_done(test);
+}
+
+/* Largest packets, one per read */
+static
+BenchFramerCase*
+bench_framer_max(
+    void)
+{
+    BenchFramerCase* test = bench_framer_case_new("max", 1);
+
+    test->packets = 1;
+    bench_framer_add_packet(test->bytes, 0x00, 0x00, 0xff);
+    bench_framer_case_read(test, 0, test->bytes->len);
+    return bench_framer_case_done(test);
+}
+
+/* Three largest packets in two reads, the middle one split */
+static
+BenchFramerCase*
+bench_framer_max_split(
+    void)
+{
+    BenchFramerCase* test = bench_framer_case_new("max_split", 2);
+
+    test->packets = 3;
+    bench_framer_add_packet(test->bytes, 0x00, 0x00, 0xff);
+    bench_framer_add_packet(test->bytes, 0x00, 0x00, 0xff);
+    bench_framer_add_packet(test->bytes, 0x00, 0x00, 0xff);
+    bench_framer_case_read(test, 0, test->bytes->len / 2);
+    bench_framer_case_read(test, test->bytes->len / 2,
+        test->bytes->len - test->bytes->len / 2);
+    return bench_framer_case_done(test);
+}
+
+/* Worst case, one byte per read */
+static
+BenchFramerCase*
+bench_framer_bytewise(
+    void)
+{
+    BenchFramerCase* test = bench_framer_case_new("bytewise", 32);
+    guint i;
+
+    test->packets = 1;
+    bench_framer_add_packet(test->bytes, 0x00, 0x01, 29);
+    for (i = 0; i < test->bytes->len; i++) {
+        bench_framer_case_read(test, i, 1);
+    }
+    return bench_framer_case_done(test);
+}
+
+/* Checks the clock every so many iterations */
+static
+gboolean
+bench_framer_running(
+    guint64 iterations,
+    guint64 deadline)
+{
+    return (iterations & 0x3f) || bench_now() < deadline;
+}
+
+/* Keeps the fastest run */
+static
+void
+bench_framer_result_min(
+    BenchFramerResult* best,
+    const BenchFramerResult* run)
+{
+    if (!best->count || run->ns * best->count < best->ns * run->count) {
+        *best = *run;
+    }
+}
+
+static
+void
+bench_framer_print(
+    const char* name,
+    const char* unit,
+    const BenchFramerResult* result)
+{
+    const double count = result->count;
+
+    printf("%s %ss=%" G_GUINT64_FORMAT " ns_per_%s=%.2f", name, unit,
+        result->count, unit, result->ns / count);
+    if (bench_allocs_counted()) {
+        printf(" allocs_per_%s=%.3f", unit, result->allocs / count);
+    }
+    printf(" copied_per_%s=%.1f padding_per_%s=%.1f\n", unit,
+        result->copied / count, unit, result->padding / count);
+}
+
+static
+void
+bench_framer_run(
+    const BenchOpt* opt,
+    BenchFramerCase* test)
+{
+    if (bench_selected(opt, test->name)) {
+        BenchFramerResult best;
+        int r;
+
+        memset(&best, 0, sizeof(best));
+        for (r = 0; r < opt->repeat; r++) {
+            Pn54xFramer framer;
+            BenchFramerSink sink;
+            BenchFramerResult run;
+            guint64 rounds = 0;
+            const guint64 allocs = bench_allocs();
+            const guint64 start = bench_now();
+            const guint64 deadline = bench_deadline(opt);
+
+            memset(&framer, 0, sizeof(framer));
+            memset(&sink, 0, sizeof(sink));
+            do {
+                guint i;
+
+                for (i = 0; i < test->nreads; i++) {
+                    const BenchFramerRead* read = test->reads + i;
+
+                    pn54x_framer_input(&framer, read->data, read->size,
+                        bench_framer_packet, &sink);
+                }
+                rounds++;
+            } while (bench_framer_running(rounds, deadline));
+
+            run.ns = bench_now() - start;
+            run.allocs = bench_allocs() - allocs;
+            run.count = sink.packets;
+            run.copied = framer.stats.copied;
+            run.padding = framer.stats.padding;
+
+            /* Sanity check */
+            if (sink.packets != rounds * test->packets) {
+                fprintf(stderr, "%s: %" G_GUINT64_FORMAT " packets, expected "
+                    "%" G_GUINT64_FORMAT "\n", test->name, sink.packets,
+                    rounds * test->packets);
+                exit(1);
+            }
+            bench_framer_result_min(&best, &run);
+        }
+        bench_framer_print(test->name, "packet", &best);
+    }
+    bench_framer_case_free(test);
+}
+
+/* Padding skipper alone, on a whole read buffer of 0xff's */
+static
+void
+bench_framer_skip_ff(
+    const BenchOpt* opt,
+    const char* name,
+    gsize (*skip)(const void* data, gsize len))
+{
+    if (bench_selected(opt, name)) {
+        guint8 buf[BENCH_READ_SIZE];
+        BenchFramerResult best;
+        int r;
+
+        memset(buf, 0xff, sizeof(buf));
+        memset(&best, 0, sizeof(best));
+        for (r = 0; r < opt->repeat; r++) {
+            volatile gsize sum = 0;
+            BenchFramerResult run;
+            guint64 calls = 0;
+            const guint64 allocs = bench_allocs();
+            const guint64 start = bench_now();
+            const guint64 deadline = bench_deadline(opt);
+
+            do {
+                sum += skip(buf, sizeof(buf));
+                calls++;
+            } while (bench_framer_running(calls, deadline));
+
+            memset(&run, 0, sizeof(run));
+            run.ns = bench_now() - start;
+            run.allocs = bench_allocs() - allocs;
+            run.count = calls;
+            run.padding = sum;
+            bench_framer_result_min(&best, &run);
+        }
+        bench_framer_print(name, "call", &best);
+    }
+}
+
+int
+main(
+    int argc,
+    char* argv[])
+{
+    BenchOpt opt;
+
+    if (!bench_init(&opt, argc, argv, "Framer benchmark")) {
+        return 1;
+    }
+    bench_framer_run(&opt, bench_framer_single());
+    bench_framer_run(&opt, bench_framer_burst());
+    bench_framer_run(&opt, bench_framer_split());
+    bench_framer_run(&opt, bench_framer_padding());
+    bench_framer_run(&opt, bench_framer_max());
+    bench_framer_run(&opt, bench_framer_max_split());
+    bench_framer_run(&opt, bench_framer_bytewise());
+    bench_framer_skip_ff(&opt, "skip_ff", pn54x_util_skip_ff);
+    bench_framer_skip_ff(&opt, "skip_ff_scalar", pn54x_util_skip_ff_scalar);
+    bench_deinit(&opt);
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,1065 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "bench_common.h"
+
+#include "pn54x_framer.h"
+#include "pn54x_io.h"
+#include "pn54x_system.h"
+#include "pn54x_uring.h"
+
+#include <gutil_macros.h>
+#include <gutil_log.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+
+/*
+ * Runs the whole Pn54xIo stack (reader, main loop, client callbacks and
+ * the write path) against a stand-in chip on the other end of a socket
+ * pair, the same way unit/pn54x_io does. The chip is a thread which
+ * answers each NCI command with a response, optionally after a delay,
+ * and on request floods the host with notifications.
+ *
+ * Each of the cases below runs for every reader backend available:
+ *
+ * <mode>_power  Power-on (and reader start) to the first packet
+ * <mode>_rx     Notification throughput, host bound
+ * <mode>_rtt    Command to response round trip and time per write
+ *
+ * plus a firmware download case, which doesn't depend on the reader.
+ *
+ * Each case runs in a child process of its own, together with its own
+ * chip thread. Otherwise the peak RSS (max_rss_kb) reported for a case
+ * would include whatever the cases before it have used.
+ */
+
+#define BENCH_PWR_OFF   (0)     /* Same as in pn54x_io.c */
+#define BENCH_PWR_ON    (1)
+#define BENCH_PWR_FW_DL (2)
+
+#define BENCH_FLOOD_GID (0x0f)  /* Proprietary */
+#define BENCH_FLOOD_OID (0x3f)
+#define BENCH_FLOOD_CHUNK (1000) /* Notifications per command */
+
+#define BENCH_FW_VERSION (0x0a12)
+#define BENCH_FW_FRAME (1023)   /* Image frame size */
+#define BENCH_FW_FRAMES (64)
+#define BENCH_FW_STATUS_OK (0x00)
+#define BENCH_FW_STATUS_FIRST_CHUNK (0x2d)
+#define BENCH_FW_STATUS_NEXT_CHUNK (0x2e)
+
+#define BENCH_STALL_TIMEOUT (10) /* Seconds */
+
+/* Options */
+static int bench_delay = 0;     /* Microseconds before each response */
+static int bench_boot = 0;      /* Microseconds from power-on to NTF */
+static int bench_payload = 32;  /* Notification payload size */
+
+static const BenchIntOption bench_options[] = {
+    { 'd', "US", "Chip response delay, microseconds", &bench_delay },
+    { 'b', "US", "Chip boot time, microseconds", &bench_boot },
+    { 's', "N", "Notification payload size", &bench_payload },
+    { 0 }
+};
+
+static const struct bench_io_mode {
+    const char* name;
+    PN54X_IO_READ_MODE mode;
+} bench_io_modes[] = {
+    { "direct", PN54X_IO_READ_DIRECT },
+    { "thread", PN54X_IO_READ_THREAD },
+    { "process", PN54X_IO_READ_PROCESS },
+    { "uring", PN54X_IO_READ_URING }
+};
+
+typedef struct bench_chip {
+    int fd;                     /* Chip end of the socket pair */
+    int host_fd;                /* What pn54x_system_open() dup's */
+    int ctl[2];                 /* Power state changes */
+    GThread* thread;
+    gboolean dl;                /* Download mode */
+    guint dl_frame;             /* Bytes of the current DL frame */
+} BenchChip;
+
+/* There's only one */
+static BenchChip bench_chip;
+
+/*==========================================================================*
+ * System calls
+ *==========================================================================*/
+
+int
+pn54x_system_open(
+    const char* dev)
+{
+    return dup(bench_chip.host_fd);
+}
+
+int
+pn54x_system_dup(
+    int fd)
+{
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+int
+pn54x_system_ioctl(
+    int fd,
+    unsigned int cmd,
+    unsigned long arg)
+{
+    const guint8 pwr = (guint8)arg;
+
+    /*
+     * Unlike open(), dup() shares the file status flags, don't let
+     * O_NONBLOCK set for the direct reader leak into the next session.
+     */
+    if (!pwr) {
+        fcntl(bench_chip.host_fd, F_SETFL,
+            fcntl(bench_chip.host_fd, F_GETFL) & ~O_NONBLOCK);
+    }
+
+    /* The only ioctl is PN54X_SET_PWR, let the chip know */
+    return (write(bench_chip.ctl[1], &pwr, 1) == 1) ? 0 : -1;
+}
+
+ssize_t
+pn54x_system_write(
+    int fd,
+    const void* buf,
+    size_t count)
+{
+    return write(fd, buf, count);
+}
+
+ssize_t
+pn54x_system_writev(
+    int fd,
+    const struct iovec* iov,
+    int iovcnt)
+{
+    return writev(fd, iov, iovcnt);
+}
+
+int
+pn54x_system_poll(
+    struct pollfd* fds,
+    unsigned int nfds,
+    int timeout)
+{
+    return poll(fds, nfds, timeout);
+}
+
+static
+void
+bench_interrupt_handler(
+    int sig)
+{
+}
+
+gboolean
+pn54x_system_interrupt_init(
+    void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = bench_interrupt_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(PN54X_SYSTEM_INTERRUPT_SIGNAL, &sa, NULL);
+    return TRUE;
+}
+
+/*==========================================================================*
+ * Chip
+ *==========================================================================*/
+
+static
+gboolean
+bench_chip_read(
+    BenchChip* chip,
+    guint8* buf,
+    guint len)
+{
+    while (len) {
+        const ssize_t n = read(chip->fd, buf, len);
+
+        if (n > 0) {
+            buf += n;
+            len -= n;
+        } else if (!n || errno != EINTR) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static
+gboolean
+bench_chip_write(
+    BenchChip* chip,
+    const void* data,
+    guint len)
+{
+    return write(chip->fd, data, len) == (ssize_t)len;
+}
+
+static
+gboolean
+bench_chip_boot(
+    BenchChip* chip)
+{
+    static const guint8 ntf[] = { 0x60, 0x00, 0x02, 0x00, 0x01 };
+
+    if (bench_boot > 0) {
+        g_usleep(bench_boot);
+    }
+    return bench_chip_write(chip, ntf, sizeof(ntf));
+}
+
+static
+gboolean
+bench_chip_flood(
+    BenchChip* chip,
+    guint count)
+{
+    const guint len = PN54X_FRAMER_HEADER_SIZE + bench_payload;
+    guint8* ntf = g_malloc(len);
+    gboolean ok = TRUE;
+    guint i;
+
+    ntf[0] = 0x60 | BENCH_FLOOD_GID;
+    ntf[1] = BENCH_FLOOD_OID;
+    ntf[2] = (guint8)bench_payload;
+    for (i = PN54X_FRAMER_HEADER_SIZE; i < len; i++) {
+        ntf[i] = (guint8)i;
+    }
+
+    /* One packet per write, like the driver returns them */
+    for (i = 0; i < count && ok; i++) {
+        ok = bench_chip_write(chip, ntf, len);
+    }
+    g_free(ntf);
+    return ok;
+}
+
+static
+gboolean
+bench_chip_nci(
+    BenchChip* chip)
+{
+    guint8 pkt[PN54X_FRAMER_MAX_PACKET_SIZE];
+    guint8 rsp[4];
+
+    if (!bench_chip_read(chip, pkt, PN54X_FRAMER_HEADER_SIZE) ||
+        !bench_chip_read(chip, pkt + PN54X_FRAMER_HEADER_SIZE, pkt[2])) {
+        return FALSE;
+    }
+
+    /* Every command gets STATUS_OK response */
+    rsp[0] = 0x40 | (pkt[0] & 0x0f);
+    rsp[1] = pkt[1];
+    rsp[2] = 1;
+    rsp[3] = 0;
+    if (bench_delay > 0) {
+        g_usleep(bench_delay);
+    }
+    if (!bench_chip_write(chip, rsp, sizeof(rsp))) {
+        return FALSE;
+    }
+
+    if ((pkt[0] & 0x0f) == BENCH_FLOOD_GID && pkt[1] == BENCH_FLOOD_OID &&
+        pkt[2] == 4) {
+        return bench_chip_flood(chip, (pkt[3] << 24) | (pkt[4] << 16) |
+            (pkt[5] << 8) | pkt[6]);
+    }
+    return TRUE;
+}
+
+static
+gboolean
+bench_chip_dl_status(
+    BenchChip* chip,
+    const guint8* payload,
+    guint len)
+{
+    guint8 buf[16];
+    guint16 crc;
+
+    buf[0] = 0;
+    buf[1] = (guint8)len;
+    memcpy(buf + 2, payload, len);
+    crc = pn54x_fw_crc16(0xffff, buf, len + 2);
+    buf[len + 2] = (guint8)(crc >> 8);
+    buf[len + 3] = (guint8)crc;
+    return bench_chip_write(chip, buf, len + 4);
+}
+
+/* Acks DL frames without looking at them, except for GET_VERSION */
+static
+gboolean
+bench_chip_dl(
+    BenchChip* chip)
+{
+    guint8 buf[0x3ff + 4];
+    guint len;
+    guint8 status;
+
+    if (!bench_chip_read(chip, buf, 2)) {
+        return FALSE;
+    }
+    len = ((buf[0] & 0x03) << 8) | buf[1];
+    if (!bench_chip_read(chip, buf + 2, len + 2)) {
+        return FALSE;
+    }
+
+    if (buf[0] & 0x04) {
+        status = chip->dl_frame ? BENCH_FW_STATUS_NEXT_CHUNK :
+            BENCH_FW_STATUS_FIRST_CHUNK;
+        chip->dl_frame += len;
+    } else if (!chip->dl_frame && len == 4 && buf[2] == 0xf1) {
+        /* Older version, so that the update goes ahead */
+        const guint16 version = BENCH_FW_VERSION - 1;
+        const guint8 rsp[] = {
+            BENCH_FW_STATUS_OK, 0x11, 0x10,
+            (guint8)version, (guint8)(version >> 8)
+        };
+
+        return bench_chip_dl_status(chip, rsp, sizeof(rsp));
+    } else {
+        status = BENCH_FW_STATUS_OK;
+        chip->dl_frame = 0;
+    }
+    return bench_chip_dl_status(chip, &status, 1);
+}
+
+static
+gpointer
+bench_chip_thread(
+    gpointer user_data)
+{
+    BenchChip* chip = user_data;
+    struct pollfd fds[2];
+    gboolean ok = TRUE;
+
+    memset(fds, 0, sizeof(fds));
+    fds[0].fd = chip->ctl[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = chip->fd;
+    fds[1].events = POLLIN;
+    while (ok && poll(fds, 2, -1) > 0) {
+        /* Power changes come before the data written after them */
+        if (fds[0].revents) {
+            guint8 pwr;
+
+            if (read(chip->ctl[0], &pwr, 1) != 1) {
+                break;
+            }
+            chip->dl = (pwr == BENCH_PWR_FW_DL);
+            chip->dl_frame = 0;
+            if (pwr == BENCH_PWR_ON) {
+                ok = bench_chip_boot(chip);
+            }
+        } else if (fds[1].revents) {
+            ok = chip->dl ? bench_chip_dl(chip) : bench_chip_nci(chip);
+        }
+    }
+    return NULL;
+}
+
+static
+void
+bench_chip_start(
+    BenchChip* chip)
+{
+    int fd[2];
+
+    memset(chip, 0, sizeof(*chip));
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) || pipe(chip->ctl)) {
+        fprintf(stderr, "%s\n", strerror(errno));
+        exit(1);
+    }
+    chip->host_fd = fd[0];
+    chip->fd = fd[1];
+    chip->thread = g_thread_new("chip", bench_chip_thread, chip);
+}
+
+static
+void
+bench_chip_stop(
+    BenchChip* chip)
+{
+    /* Closing the control pipe terminates the chip thread */
+    close(chip->ctl[1]);
+    g_thread_join(chip->thread);
+    close(chip->ctl[0]);
+    close(chip->host_fd);
+    close(chip->fd);
+}
+
+/*==========================================================================*
+ * Host
+ *==========================================================================*/
+
+typedef struct bench_host BenchHost;
+
+typedef
+void
+(*BenchHostReadFunc)(
+    BenchHost* host,
+    const guint8* pkt,
+    guint len);
+
+typedef
+void
+(*BenchHostFunc)(
+    BenchHost* host);
+
+struct bench_host {
+    NciHalClient client;
+    Pn54xHalIo* hal;
+    NciHalIo* io;
+    GMainLoop* loop;
+    BenchHostReadFunc read;
+    BenchHostFunc write_done;
+    guint stall_id;
+    guint64 packets;
+    guint64 expected;           /* Notifications */
+    guint64 deadline;
+    guint64 cmd_time;
+    guint64 write_time;
+    gboolean write_pending;
+    gboolean rsp_pending;
+    guint8 cmd[7];              /* Must stay valid until written */
+    BenchSamples rtt;
+    BenchSamples write;
+};
+
+static
+void
+bench_host_error(
+    NciHalClient* client)
+{
+    fprintf(stderr, "I/O error\n");
+    exit(1);
+}
+
+static
+void
+bench_host_read(
+    NciHalClient* client,
+    const void* data,
+    guint len)
+{
+    BenchHost* host = G_CAST(client, BenchHost, client);
+
+    host->packets++;
+    host->read(host, data, len);
+}
+
+static
+gboolean
+bench_host_stalled(
+    gpointer user_data)
+{
+    fprintf(stderr, "Stalled\n");
+    exit(1);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+bench_host_run(
+    BenchHost* host)
+{
+    host->stall_id = g_timeout_add_seconds(BENCH_STALL_TIMEOUT,
+        bench_host_stalled, host);
+    g_main_loop_run(host->loop);
+    g_source_remove(host->stall_id);
+}
+
+static
+void
+bench_host_write_done(
+    NciHalClient* client,
+    gboolean ok)
+{
+    BenchHost* host = G_CAST(client, BenchHost, client);
+
+    if (!ok) {
+        fprintf(stderr, "Write failed\n");
+        exit(1);
+    }
+    host->write_pending = FALSE;
+    bench_samples_add(&host->write, bench_now() - host->write_time);
+    if (host->write_done) {
+        host->write_done(host);
+    }
+}
+
+static
+void
+bench_host_write(
+    BenchHost* host,
+    const void* data,
+    guint len)
+{
+    GUtilData chunk;
+
+    chunk.bytes = data;
+    chunk.size = len;
+    host->write_time = bench_now();
+    host->write_pending = TRUE;
+    if (!host->io->fn->write(host->io, &chunk, 1, bench_host_write_done)) {
+        fprintf(stderr, "Write rejected\n");
+        exit(1);
+    }
+}
+
+static
+void
+bench_host_init(
+    BenchHost* host,
+    PN54X_IO_READ_MODE mode)
+{
+    static const NciHalClientFunctions bench_host_fn = {
+        bench_host_error, bench_host_read
+    };
+    Pn54xIoConfig config;
+
+    memset(host, 0, sizeof(*host));
+    memset(&config, 0, sizeof(config));
+    config.read_mode = mode;
+    host->client.fn = &bench_host_fn;
+    host->loop = g_main_loop_new(NULL, FALSE);
+    host->hal = pn54x_io_new_full("bench", &config);
+    host->io = &host->hal->hal_io;
+}
+
+static
+void
+bench_host_deinit(
+    BenchHost* host)
+{
+    pn54x_io_free(host->hal);
+    g_main_loop_unref(host->loop);
+    bench_samples_clear(&host->rtt);
+    bench_samples_clear(&host->write);
+}
+
+static
+void
+bench_host_quit(
+    BenchHost* host,
+    const guint8* pkt,
+    guint len)
+{
+    g_main_loop_quit(host->loop);
+}
+
+/* Returns time from power-on to the first packet */
+static
+guint64
+bench_host_power_on(
+    BenchHost* host)
+{
+    const guint64 start = bench_now();
+
+    host->read = bench_host_quit;
+    host->packets = 0;
+    pn54x_io_set_power(host->hal, TRUE);
+    host->io->fn->start(host->io, &host->client);
+    bench_host_run(host);
+    return bench_now() - start;
+}
+
+static
+void
+bench_host_power_off(
+    BenchHost* host)
+{
+    host->io->fn->stop(host->io);
+    pn54x_io_set_power(host->hal, FALSE);
+}
+
+/*==========================================================================*
+ * Cases
+ *==========================================================================*/
+
+static
+void
+bench_io_print_us(
+    const char* key,
+    guint64 ns)
+{
+    printf(" %s_us=%.1f", key, ns / 1000.0);
+}
+
+static
+void
+bench_io_print_percentiles(
+    const char* key,
+    BenchSamples* samples)
+{
+    static const struct bench_io_percentile {
+        const char* name;
+        guint pct;
+    } percentiles[] = {
+        { "p50", 50 }, { "p90", 90 }, { "p99", 99 }, { "max", 100 }
+    };
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(percentiles); i++) {
+        char* name = g_strconcat(key, "_", percentiles[i].name, NULL);
+
+        bench_io_print_us(name, bench_samples_percentile(samples,
+            percentiles[i].pct));
+        g_free(name);
+    }
+}
+
+static
+void
+bench_io_print_rss(
+    void)
+{
+    printf(" max_rss_kb=%u\n", bench_max_rss());
+}
+
+static
+void
+bench_io_power(
+    const BenchOpt* opt,
+    const char* name,
+    PN54X_IO_READ_MODE mode)
+{
+    BenchHost host;
+    BenchSamples samples;
+    int r;
+
+    memset(&samples, 0, sizeof(samples));
+    bench_host_init(&host, mode);
+    for (r = 0; r < opt->repeat; r++) {
+        const guint64 deadline = bench_deadline(opt);
+
+        do {
+            bench_samples_add(&samples, bench_host_power_on(&host));
+            bench_host_power_off(&host);
+        } while (bench_now() < deadline);
+    }
+    bench_host_deinit(&host);
+
+    printf("%s cycles=%u", name, samples.count);
+    bench_io_print_percentiles("first_packet", &samples);
+    bench_io_print_rss();
+    bench_samples_clear(&samples);
+}
+
+static
+void
+bench_io_flood(
+    BenchHost* host)
+{
+    guint8* cmd = host->cmd;
+
+    cmd[0] = 0x20 | BENCH_FLOOD_GID;
+    cmd[1] = BENCH_FLOOD_OID;
+    cmd[2] = 4;
+    cmd[3] = (guint8)(BENCH_FLOOD_CHUNK >> 24);
+    cmd[4] = (guint8)(BENCH_FLOOD_CHUNK >> 16);
+    cmd[5] = (guint8)(BENCH_FLOOD_CHUNK >> 8);
+    cmd[6] = (guint8)BENCH_FLOOD_CHUNK;
+    host->expected += BENCH_FLOOD_CHUNK;
+    bench_host_write(host, cmd, sizeof(host->cmd));
+}
+
+static
+void
+bench_io_rx_read(
+    BenchHost* host,
+    const guint8* pkt,
+    guint len)
+{
+    /* Keep the chip busy until the deadline */
+    if ((pkt[0] & 0xe0) == 0x60 && !--host->expected) {
+        if (bench_now() < host->deadline) {
+            bench_io_flood(host);
+        } else {
+            g_main_loop_quit(host->loop);
+        }
+    }
+}
+
+static
+void
+bench_io_rx(
+    const BenchOpt* opt,
+    const char* name,
+    PN54X_IO_READ_MODE mode)
+{
+    BenchHost host;
+    guint64 best_packets = 0, best_ns = 0, best_allocs = 0;
+    int r;
+
+    bench_host_init(&host, mode);
+    for (r = 0; r < opt->repeat; r++) {
+        guint64 start, ns, allocs;
+
+        bench_host_power_on(&host);
+        host.read = bench_io_rx_read;
+        host.packets = 0;
+        host.expected = 0;
+        host.deadline = bench_deadline(opt);
+        allocs = bench_allocs();
+        start = bench_now();
+        bench_io_flood(&host);
+        bench_host_run(&host);
+        ns = bench_now() - start;
+        allocs = bench_allocs() - allocs;
+        bench_host_power_off(&host);
+
+        if (!best_ns || host.packets * best_ns > best_packets * ns) {
+            best_packets = host.packets;
+            best_ns = ns;
+            best_allocs = allocs;
+        }
+    }
+    bench_host_deinit(&host);
+
+    printf("%s packets=%" G_GUINT64_FORMAT " packets_per_sec=%.0f", name,
+        best_packets, best_packets * 1e9 / best_ns);
+    bench_io_print_us("per_packet", best_ns / best_packets);
+    if (bench_allocs_counted()) {
+        printf(" allocs_per_packet=%.3f", (double)best_allocs / best_packets);
+    }
+    bench_io_print_rss();
+}
+
+static
+void
+bench_io_rtt_cmd(
+    BenchHost* host)
+{
+    static const guint8 cmd[] = { 0x20, 0x01, 0x00 };
+
+    host->cmd_time = bench_now();
+    host->rsp_pending = TRUE;
+    bench_host_write(host, cmd, sizeof(cmd));
+}
+
+/*
+ * The response may arrive before the write completion, like nfcd the
+ * host doesn't send the next command until both have been received.
+ */
+static
+void
+bench_io_rtt_next(
+    BenchHost* host)
+{
+    if (!host->rsp_pending && !host->write_pending) {
+        if (bench_now() < host->deadline) {
+            bench_io_rtt_cmd(host);
+        } else {
+            g_main_loop_quit(host->loop);
+        }
+    }
+}
+
+static
+void
+bench_io_rtt_read(
+    BenchHost* host,
+    const guint8* pkt,
+    guint len)
+{
+    bench_samples_add(&host->rtt, bench_now() - host->cmd_time);
+    host->rsp_pending = FALSE;
+    bench_io_rtt_next(host);
+}
+
+static
+void
+bench_io_rtt(
+    const BenchOpt* opt,
+    const char* name,
+    PN54X_IO_READ_MODE mode)
+{
+    BenchHost host;
+    guint64 total = 0;
+    int r;
+
+    bench_host_init(&host, mode);
+    for (r = 0; r < opt->repeat; r++) {
+        guint64 start;
+
+        bench_host_power_on(&host);
+        host.read = bench_io_rtt_read;
+        host.write_done = bench_io_rtt_next;
+        host.deadline = bench_deadline(opt);
+        start = bench_now();
+        bench_io_rtt_cmd(&host);
+        bench_host_run(&host);
+        total += bench_now() - start;
+        host.write_done = NULL;
+        bench_host_power_off(&host);
+    }
+
+    printf("%s exchanges=%u exchanges_per_sec=%.0f", name, host.rtt.count,
+        host.rtt.count * 1e9 / total);
+    bench_io_print_percentiles("rtt", &host.rtt);
+    bench_io_print_percentiles("write", &host.write);
+    bench_io_print_rss();
+    bench_host_deinit(&host);
+}
+
+typedef struct bench_fw_update {
+    BenchHost* host;
+    PN54X_FW_RESULT result;
+    Pn54xFwStats stats;
+} BenchFwUpdate;
+
+static
+void
+bench_io_fw_done(
+    Pn54xHalIo* io,
+    PN54X_FW_RESULT result,
+    const Pn54xFwStats* stats,
+    void* user_data)
+{
+    BenchFwUpdate* update = user_data;
+
+    update->result = result;
+    update->stats = *stats;
+    g_main_loop_quit(update->host->loop);
+}
+
+static
+void
+bench_io_fw(
+    const BenchOpt* opt,
+    const char* name,
+    PN54X_IO_READ_MODE mode)
+{
+    GByteArray* data = g_byte_array_new();
+    Pn54xFwImage* image;
+    Pn54xFwConfig config;
+    BenchHost host;
+    guint64 best_bytes = 0, best_us = 0;
+    guint best_updates = 0, updates = 0;
+    int r;
+    guint i, k;
+
+    /* Image frames carry the version at the same place as the real ones */
+    for (i = 0; i < BENCH_FW_FRAMES; i++) {
+        const guint8 hdr[2] = { BENCH_FW_FRAME >> 8, (guint8)BENCH_FW_FRAME };
+
+        g_byte_array_append(data, hdr, sizeof(hdr));
+        for (k = 0; k < BENCH_FW_FRAME; k++) {
+            const guint8 b = (guint8)(i + k);
+
+            g_byte_array_append(data, &b, 1);
+        }
+    }
+    data->data[4] = (guint8)BENCH_FW_VERSION;
+    data->data[5] = (guint8)(BENCH_FW_VERSION >> 8);
+    image = pn54x_fw_image_new(data->data, data->len);
+    memset(&config, 0, sizeof(config));
+
+    bench_host_init(&host, mode);
+    for (r = 0; r < opt->repeat; r++) {
+        const guint64 deadline = bench_deadline(opt);
+        guint64 bytes = 0, us = 0;
+        guint n = 0;
+
+        do {
+            BenchFwUpdate update;
+
+            update.host = &host;
+            update.result = PN54X_FW_BUSY;
+            if (pn54x_io_update_firmware(host.hal, image, &config,
+                bench_io_fw_done, &update)) {
+                bench_host_run(&host);
+            }
+            if (update.result != PN54X_FW_UPDATED) {
+                fprintf(stderr, "Firmware update failed\n");
+                exit(1);
+            }
+            bytes += update.stats.bytes;
+            us += update.stats.time;
+            n++;
+        } while (bench_now() < deadline);
+
+        updates += n;
+        if (!best_us || bytes * best_us > best_bytes * us) {
+            best_bytes = bytes;
+            best_us = us;
+            best_updates = n;
+        }
+    }
+    bench_host_deinit(&host);
+
+    printf("%s updates=%u image_bytes=%u kbytes_per_sec=%.0f", name,
+        updates, (guint)image->size, best_bytes * 1e6 / 1024 / best_us);
+    bench_io_print_us("per_update", best_us * 1000 / best_updates);
+    bench_io_print_rss();
+
+    pn54x_fw_image_free(image);
+    g_byte_array_free(data, TRUE);
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+typedef
+void
+(*BenchIoFunc)(
+    const BenchOpt* opt,
+    const char* name,
+    PN54X_IO_READ_MODE mode);
+
+static
+gboolean
+bench_io_fork(
+    const BenchOpt* opt,
+    const char* name,
+    PN54X_IO_READ_MODE mode,
+    BenchIoFunc fn)
+{
+    pid_t pid;
+    int status;
+
+    /* Don't let the child flush what the parent has buffered */
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        return FALSE;
+    } else if (!pid) {
+        bench_chip_start(&bench_chip);
+        fn(opt, name, mode);
+        bench_chip_stop(&bench_chip);
+        fflush(stdout);
+        _exit(0);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status)) {
+        fprintf(stderr, "%s failed\n", name);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static
+gboolean
+bench_io_available(
+    PN54X_IO_READ_MODE mode)
+{
+    if (mode == PN54X_IO_READ_URING) {
+        /* Otherwise it would silently fall back to the thread */
+        Pn54xUring* uring = pn54x_uring_new(1);
+
+        if (uring) {
+            pn54x_uring_free(uring);
+            return TRUE;
+        }
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static
+gboolean
+bench_io_run(
+    const BenchOpt* opt,
+    const char* suffix,
+    BenchIoFunc fn)
+{
+    gboolean ok = TRUE;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(bench_io_modes); i++) {
+        const struct bench_io_mode* mode = bench_io_modes + i;
+        char* name = g_strconcat(mode->name, "_", suffix, NULL);
+
+        if (bench_selected(opt, name) && bench_io_available(mode->mode) &&
+            !bench_io_fork(opt, name, mode->mode, fn)) {
+            ok = FALSE;
+        }
+        g_free(name);
+    }
+    return ok;
+}
+
+int
+main(
+    int argc,
+    char* argv[])
+{
+    BenchOpt opt;
+    gboolean ok = TRUE;
+
+    if (!bench_init_full(&opt, argc, argv, "End-to-end I/O benchmark",
+        bench_options)) {
+        return 1;
+    }
+
+    bench_payload = CLAMP(bench_payload, 0, 0xff);
+    signal(SIGPIPE, SIG_IGN);
+    ok &= bench_io_run(&opt, "power", bench_io_power);
+    ok &= bench_io_run(&opt, "rx", bench_io_rx);
+    ok &= bench_io_run(&opt, "rtt", bench_io_rtt);
+    if (bench_selected(&opt, "fw")) {
+        ok &= bench_io_fork(&opt, "fw", PN54X_IO_READ_AUTO, bench_io_fw);
+    }
+    bench_deinit(&opt);
+    return ok ? 0 : 1;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -8,12 +8,15 @@ Source: %{name}-%{version}.tar.bz2
 
 %define nfcd_version 1.0.20
 
+BuildRequires: pkgconfig(gio-2.0)
+BuildRequires: pkgconfig(libdbusaccess)
 BuildRequires: pkgconfig(libncicore)
 BuildRequires: pkgconfig(libnciplugin)
 BuildRequires: pkgconfig(nfcd-plugin) >= %{nfcd_version}
 Requires: nfcd >= %{nfcd_version}
 
 %define plugin_dir %{_libdir}/nfcd/plugins
+%define helper_dir %{_libexecdir}/nfcd
 
 %description
 NFC plugin that talks directly to pn54x driver.
@@ -22,11 +25,11 @@ NFC plugin that talks directly to pn54x driver.
 %setup -q
 
 %build
-make %{_smp_mflags} KEEP_SYMBOLS=1 release
+make %{_smp_mflags} KEEP_SYMBOLS=1 HELPER_DIR=%{helper_dir} release
 
 %install
 rm -rf %{buildroot}
-make DESTDIR=%{buildroot} PLUGIN_DIR=%{plugin_dir} install
+make DESTDIR=%{buildroot} PLUGIN_DIR=%{plugin_dir} HELPER_DIR=%{helper_dir} install
 
 %check
 make test
@@ -41,3 +44,4 @@ systemctl reload-or-try-restart nfcd.service ||:
 %defattr(-,root,root,-)
 %dir %{plugin_dir}
 %{plugin_dir}/*.so
+%{helper_dir}/pn54x-reader
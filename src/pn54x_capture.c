@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_capture.h"
+#include "pn54x_log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PN54X_CAPTURE_DEFAULT_SIZE (1024 * 1024)
+#define PN54X_CAPTURE_DEFAULT_COUNT (2)
+#define PN54X_CAPTURE_MIN_SIZE (4096)
+
+/* pcapng blocks */
+#define PCAPNG_SHB_TYPE (0x0a0d0d0a)
+#define PCAPNG_SHB_MAGIC (0x1a2b3c4d)
+#define PCAPNG_SHB_SIZE (28)
+#define PCAPNG_IDB_TYPE (0x00000001)
+#define PCAPNG_IDB_SIZE (20)
+#define PCAPNG_EPB_TYPE (0x00000006)
+#define PCAPNG_EPB_FLAGS (2)
+#define PCAPNG_EPB_FLAGS_IN (0x01)
+#define PCAPNG_EPB_FLAGS_OUT (0x02)
+
+/* Fixed part of EPB, epb_flags and opt_endofopt, trailing length */
+#define PCAPNG_EPB_SIZE(len) (28 + PCAPNG_ALIGN(len) + 12 + 4)
+#define PCAPNG_ALIGN(len) (((len) + 3) & ~3u)
+
+struct pn54x_capture {
+    char* path;
+    gsize size;
+    guint count;
+    int fd;
+    guint8* map;
+    gsize pos;
+    Pn54xCaptureStats stats;
+};
+
+static
+void
+pn54x_capture_close(
+    Pn54xCapture* self)
+{
+    if (self->map) {
+        munmap(self->map, self->size);
+        self->map = NULL;
+    }
+    if (self->fd >= 0) {
+        /* Cut off the unused tail, readers don't like zeros */
+        if (ftruncate(self->fd, self->pos) < 0) {
+            GWARN("Failed to truncate %s: %s", self->path, strerror(errno));
+        }
+        close(self->fd);
+        self->fd = -1;
+    }
+}
+
+static
+gboolean
+pn54x_capture_open(
+    Pn54xCapture* self)
+{
+    self->fd = open(self->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+        0644);
+    if (self->fd < 0) {
+        GERR("Can't create %s: %s", self->path, strerror(errno));
+    } else if (ftruncate(self->fd, self->size) < 0) {
+        GERR("Can't resize %s: %s", self->path, strerror(errno));
+    } else {
+        void* map = mmap(NULL, self->size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, self->fd, 0);
+
+        if (map == MAP_FAILED) {
+            GERR("Can't map %s: %s", self->path, strerror(errno));
+        } else {
+            guint32* shb = map;
+            guint32* idb = (guint32*)((guint8*)map + PCAPNG_SHB_SIZE);
+
+            /* Everything is in host byte order, that's what the magic is for */
+            shb[0] = PCAPNG_SHB_TYPE;
+            shb[1] = PCAPNG_SHB_SIZE;
+            shb[2] = PCAPNG_SHB_MAGIC;
+            ((guint16*)(shb + 3))[0] = 1; /* Major version */
+            ((guint16*)(shb + 3))[1] = 0; /* Minor version */
+            shb[4] = shb[5] = 0xffffffff; /* Section length unknown */
+            shb[6] = PCAPNG_SHB_SIZE;
+            idb[0] = PCAPNG_IDB_TYPE;
+            idb[1] = PCAPNG_IDB_SIZE;
+            ((guint16*)(idb + 2))[0] = PN54X_CAPTURE_LINKTYPE;
+            ((guint16*)(idb + 2))[1] = 0; /* Reserved */
+            idb[3] = 0;                   /* No snaplen */
+            idb[4] = PCAPNG_IDB_SIZE;
+            self->map = map;
+            self->pos = PCAPNG_SHB_SIZE + PCAPNG_IDB_SIZE;
+            return TRUE;
+        }
+    }
+    if (self->fd >= 0) {
+        close(self->fd);
+        self->fd = -1;
+    }
+    return FALSE;
+}
+
+static
+void
+pn54x_capture_rotate(
+    Pn54xCapture* self)
+{
+    guint i;
+
+    pn54x_capture_close(self);
+    for (i = self->count - 1; i > 0; i--) {
+        char* from = (i > 1) ? g_strdup_printf("%s.%u", self->path, i - 1) :
+            g_strdup(self->path);
+        char* to = g_strdup_printf("%s.%u", self->path, i);
+
+        if (rename(from, to) < 0 && errno != ENOENT) {
+            GWARN("Failed to rename %s: %s", from, strerror(errno));
+        }
+        g_free(from);
+        g_free(to);
+    }
+    self->stats.rotations++;
+    pn54x_capture_open(self);
+}
+
+Pn54xCapture*
+pn54x_capture_new(
+    const Pn54xCaptureConfig* config)
+{
+    if (config && config->path) {
+        Pn54xCapture* self = g_new0(Pn54xCapture, 1);
+
+        self->path = g_strdup(config->path);
+        self->size = config->size ? MAX(config->size,
+            PN54X_CAPTURE_MIN_SIZE) : PN54X_CAPTURE_DEFAULT_SIZE;
+        self->count = config->count ? config->count :
+            PN54X_CAPTURE_DEFAULT_COUNT;
+        self->fd = -1;
+        if (pn54x_capture_open(self)) {
+            GDEBUG("Capturing to %s", self->path);
+            return self;
+        }
+        pn54x_capture_free(self);
+    }
+    return NULL;
+}
+
+void
+pn54x_capture_free(
+    Pn54xCapture* self)
+{
+    if (self) {
+        pn54x_capture_close(self);
+        g_free(self->path);
+        g_free(self);
+    }
+}
+
+void
+pn54x_capture_packet(
+    Pn54xCapture* self,
+    PN54X_CAPTURE_DIR dir,
+    gint64 time,
+    const GUtilData* chunks,
+    guint count)
+{
+    gsize len = 0, block;
+    guint32* epb;
+    guint8* ptr;
+    guint i;
+
+    for (i = 0; i < count; i++) {
+        len += chunks[i].size;
+    }
+
+    block = PCAPNG_EPB_SIZE(len);
+    if (self->pos + block > self->size) {
+        if (block > self->size - PCAPNG_SHB_SIZE - PCAPNG_IDB_SIZE) {
+            self->stats.dropped++;
+            return;
+        }
+        pn54x_capture_rotate(self);
+    }
+    if (G_UNLIKELY(!self->map)) {
+        self->stats.dropped++;
+        return;
+    }
+
+    /* Blocks are 32-bit aligned and so are the mappings */
+    epb = (guint32*)(self->map + self->pos);
+    epb[0] = PCAPNG_EPB_TYPE;
+    epb[1] = block;
+    epb[2] = 0;                         /* Interface */
+    epb[3] = (guint32)((guint64)time >> 32);
+    epb[4] = (guint32)time;
+    epb[5] = epb[6] = len;              /* Captured and original */
+    ptr = (guint8*)(epb + 7);
+    for (i = 0; i < count; i++) {
+        memcpy(ptr, chunks[i].bytes, chunks[i].size);
+        ptr += chunks[i].size;
+    }
+    memset(ptr, 0, PCAPNG_ALIGN(len) - len);
+    epb = (guint32*)(ptr + PCAPNG_ALIGN(len) - len);
+    ((guint16*)epb)[0] = PCAPNG_EPB_FLAGS;
+    ((guint16*)epb)[1] = 4;             /* Option length */
+    epb[1] = (dir == PN54X_CAPTURE_IN) ? PCAPNG_EPB_FLAGS_IN :
+        PCAPNG_EPB_FLAGS_OUT;
+    epb[2] = 0;                         /* opt_endofopt */
+    epb[3] = block;
+    self->pos += block;
+    self->stats.packets++;
+    self->stats.bytes += len;
+}
+
+const Pn54xCaptureStats*
+pn54x_capture_stats(
+    Pn54xCapture* self)
+{
+    return &self->stats;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_CAPTURE_H
+#define PN54X_CAPTURE_H
+
+#include <gutil_types.h>
+
+/*
+ * Binary capture of NCI packets into a memory mapped pcapng file.
+ * Appending a packet is a few header stores and a memcpy. Once the
+ * file reaches the size limit, it's renamed to path.1 (path.1 to
+ * path.2 and so on, up to count - 1) and a new file is started. With
+ * count 1 the file simply starts over.
+ *
+ * Packets are written with LINKTYPE_USER0 (147) and the direction flag,
+ * timestamps are CLOCK_MONOTONIC microseconds.
+ */
+
+#define PN54X_CAPTURE_LINKTYPE (147)
+
+typedef enum pn54x_capture_dir {
+    PN54X_CAPTURE_IN,       /* From the chip */
+    PN54X_CAPTURE_OUT       /* To the chip */
+} PN54X_CAPTURE_DIR;
+
+/* Zero-initialized structure means defaults (except the path) */
+typedef struct pn54x_capture_config {
+    const char* path;       /* NULL disables the capture */
+    guint size;             /* Max file size, bytes */
+    guint count;            /* Number of files, including the current one */
+} Pn54xCaptureConfig;
+
+typedef struct pn54x_capture_stats {
+    guint64 packets;
+    guint64 bytes;          /* Packet bytes, not including pcapng blocks */
+    guint64 dropped;        /* Too large or no file */
+    guint rotations;
+} Pn54xCaptureStats;
+
+typedef struct pn54x_capture Pn54xCapture;
+
+/* Returns NULL if the file can't be created */
+Pn54xCapture*
+pn54x_capture_new(
+    const Pn54xCaptureConfig* config);
+
+void
+pn54x_capture_free(
+    Pn54xCapture* capture);
+
+void
+pn54x_capture_packet(
+    Pn54xCapture* capture,
+    PN54X_CAPTURE_DIR dir,
+    gint64 time,
+    const GUtilData* chunks,
+    guint count);
+
+const Pn54xCaptureStats*
+pn54x_capture_stats(
+    Pn54xCapture* capture);
+
+#endif /* PN54X_CAPTURE_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
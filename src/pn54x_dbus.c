@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_dbus.h"
+#include "pn54x_log.h"
+
+#include <dbusaccess_peer.h>
+#include <dbusaccess_policy.h>
+
+struct pn54x_dbus {
+    GDBusConnection* connection;
+    guint registration_id;
+    DA_BUS bus;
+    DAPolicy* policy;
+    const Pn54xDBusFunctions* fn;
+    void* user_data;
+};
+
+#define PN54X_DBUS_DEFAULT_ACCESS DA_POLICY_VERSION ";* = deny;" \
+    "user(root) = allow;group(privileged) = allow"
+
+/* Methods which change the state or write to the log */
+typedef enum pn54x_dbus_action {
+    PN54X_DBUS_ACTION_RESET_STATS = 1,
+    PN54X_DBUS_ACTION_DUMP_LATENCY,
+    PN54X_DBUS_ACTION_DUMP_PACKETS
+} PN54X_DBUS_ACTION;
+
+static const DA_ACTION pn54x_dbus_policy_actions[] = {
+    { "ResetStats", PN54X_DBUS_ACTION_RESET_STATS, 0 },
+    { "DumpLatency", PN54X_DBUS_ACTION_DUMP_LATENCY, 0 },
+    { "DumpPackets", PN54X_DBUS_ACTION_DUMP_PACKETS, 0 },
+    { NULL }
+};
+
+static const char pn54x_dbus_xml[] =
+    "<node>"
+    "  <interface name='" PN54X_DBUS_INTERFACE "'>"
+    "    <method name='GetInterfaceVersion'>"
+    "      <arg name='version' type='i' direction='out'/>"
+    "    </method>"
+    "    <method name='GetStats'>"
+    "      <arg name='stats' type='a{st}' direction='out'/>"
+    "    </method>"
+    "    <method name='ResetStats'/>"
+    "    <method name='DumpLatency'/>"
+    "    <method name='DumpPackets'/>"
+    "  </interface>"
+    "</node>";
+
+static
+GVariant*
+pn54x_dbus_stats(
+    Pn54xDBus* self)
+{
+    GVariantBuilder builder;
+    Pn54xDBusStats stats;
+
+    /*
+     * All counters are updated on the main thread, and so is this
+     * function invoked. The snapshot is therefore consistent.
+     */
+    memset(&stats, 0, sizeof(stats));
+    self->fn->get_stats(&stats, self->user_data);
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{st}"));
+    g_variant_builder_add(&builder, "{st}", "Reads", stats.io.reads);
+    g_variant_builder_add(&builder, "{st}", "ReadBytes", stats.io.read_bytes);
+    g_variant_builder_add(&builder, "{st}", "Packets", stats.io.packets);
+    g_variant_builder_add(&builder, "{st}", "Padding", stats.io.padding);
+    g_variant_builder_add(&builder, "{st}", "Carried", stats.io.carried);
+    g_variant_builder_add(&builder, "{st}", "Writes", stats.io.writes);
+    g_variant_builder_add(&builder, "{st}", "WriteBytes",
+        stats.io.write_bytes);
+    g_variant_builder_add(&builder, "{st}", "WriteErrors",
+        stats.io.write_errors);
+    g_variant_builder_add(&builder, "{st}", "PowerCycles",
+        stats.power_cycles);
+    g_variant_builder_add(&builder, "{st}", "ErrorResets",
+        stats.error_resets);
+    g_variant_builder_add(&builder, "{st}", "ColdStarts",
+        stats.cold_starts);
+    g_variant_builder_add(&builder, "{st}", "WarmStarts",
+        stats.warm_starts);
+    g_variant_builder_add(&builder, "{st}", "Boots", stats.boots);
+    g_variant_builder_add(&builder, "{st}", "BootsSignaled",
+        stats.boots_signaled);
+    g_variant_builder_add(&builder, "{st}", "BootTimeouts",
+        stats.boot_timeouts);
+    g_variant_builder_add(&builder, "{st}", "BootTime", stats.boot_time);
+    g_variant_builder_add(&builder, "{st}", "BootTimeMax",
+        stats.boot_time_max);
+    g_variant_builder_add(&builder, "{st}", "ChipErrors",
+        (guint64)stats.recovery.errors);
+    g_variant_builder_add(&builder, "{st}", "Recovered",
+        (guint64)stats.recovery.recovered);
+    g_variant_builder_add(&builder, "{st}", "RecoveryFailures",
+        (guint64)stats.recovery.failed);
+    g_variant_builder_add(&builder, "{st}", "RecoveryTime",
+        (guint64)MAX(stats.recovery.time, 0));
+    return g_variant_new("(a{st})", &builder);
+}
+
+static
+gboolean
+pn54x_dbus_access_allowed(
+    Pn54xDBus* self,
+    GDBusMethodInvocation* call,
+    PN54X_DBUS_ACTION action)
+{
+    const char* sender = g_dbus_method_invocation_get_sender(call);
+    DAPeer* peer = da_peer_get(self->bus, sender);
+
+    /* No information from dbus-daemon means that the peer is gone */
+    if (peer && da_policy_check(self->policy, &peer->cred, action, "",
+        DA_ACCESS_DENY) == DA_ACCESS_ALLOW) {
+        return TRUE;
+    }
+    GWARN("%s is not allowed to call %s", sender,
+        g_dbus_method_invocation_get_method_name(call));
+    g_dbus_method_invocation_return_error_literal(call, G_DBUS_ERROR,
+        G_DBUS_ERROR_ACCESS_DENIED, "Access denied");
+    return FALSE;
+}
+
+static
+void
+pn54x_dbus_method_call(
+    GDBusConnection* connection,
+    const char* sender,
+    const char* path,
+    const char* iface,
+    const char* method,
+    GVariant* params,
+    GDBusMethodInvocation* call,
+    gpointer user_data)
+{
+    Pn54xDBus* self = user_data;
+
+    GDEBUG("%s.%s", iface, method);
+    if (!g_strcmp0(method, "GetInterfaceVersion")) {
+        g_dbus_method_invocation_return_value(call,
+            g_variant_new("(i)", PN54X_DBUS_INTERFACE_VERSION));
+    } else if (!g_strcmp0(method, "GetStats")) {
+        g_dbus_method_invocation_return_value(call, pn54x_dbus_stats(self));
+    } else if (!g_strcmp0(method, "ResetStats")) {
+        if (pn54x_dbus_access_allowed(self, call,
+            PN54X_DBUS_ACTION_RESET_STATS)) {
+            self->fn->reset_stats(self->user_data);
+            g_dbus_method_invocation_return_value(call, NULL);
+        }
+    } else if (!g_strcmp0(method, "DumpLatency")) {
+        if (pn54x_dbus_access_allowed(self, call,
+            PN54X_DBUS_ACTION_DUMP_LATENCY)) {
+            self->fn->dump_latency(self->user_data);
+            g_dbus_method_invocation_return_value(call, NULL);
+        }
+    } else if (!g_strcmp0(method, "DumpPackets")) {
+        if (pn54x_dbus_access_allowed(self, call,
+            PN54X_DBUS_ACTION_DUMP_PACKETS)) {
+            self->fn->dump_packets(self->user_data);
+            g_dbus_method_invocation_return_value(call, NULL);
+        }
+    } else {
+        g_dbus_method_invocation_return_error(call, G_DBUS_ERROR,
+            G_DBUS_ERROR_UNKNOWN_METHOD, "Unknown method %s", method);
+    }
+}
+
+Pn54xDBus*
+pn54x_dbus_new(
+    GDBusConnection* connection,
+    GBusType bus,
+    const char* path,
+    const char* access,
+    const Pn54xDBusFunctions* fn,
+    void* user_data)
+{
+    static const GDBusInterfaceVTable vtable = {
+        pn54x_dbus_method_call, NULL, NULL
+    };
+    GError* error = NULL;
+    GDBusNodeInfo* info;
+    DAPolicy* policy;
+    Pn54xDBus* self = NULL;
+
+    if (!access) {
+        access = PN54X_DBUS_DEFAULT_ACCESS;
+    }
+    policy = da_policy_new_full(access, pn54x_dbus_policy_actions);
+    if (!policy) {
+        GERR("Invalid D-Bus access policy \"%s\"", access);
+        return NULL;
+    }
+
+    info = g_dbus_node_info_new_for_xml(pn54x_dbus_xml, NULL);
+    if (G_LIKELY(info)) {
+        self = g_new0(Pn54xDBus, 1);
+        self->bus = (bus == G_BUS_TYPE_SYSTEM) ? DA_BUS_SYSTEM :
+            DA_BUS_SESSION;
+        self->policy = policy;
+        self->fn = fn;
+        self->user_data = user_data;
+        self->registration_id = g_dbus_connection_register_object(connection,
+            path, info->interfaces[0], &vtable, self, NULL, &error);
+        if (self->registration_id) {
+            GDEBUG("Registered %s", path);
+            self->connection = g_object_ref(connection);
+        } else {
+            GERR("Failed to register %s: %s", path, error->message);
+            g_error_free(error);
+            g_free(self);
+            self = NULL;
+        }
+        g_dbus_node_info_unref(info);
+    }
+    if (!self) {
+        da_policy_unref(policy);
+    }
+    return self;
+}
+
+void
+pn54x_dbus_free(
+    Pn54xDBus* self)
+{
+    if (self) {
+        g_dbus_connection_unregister_object(self->connection,
+            self->registration_id);
+        g_object_unref(self->connection);
+        da_policy_unref(self->policy);
+        g_free(self);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
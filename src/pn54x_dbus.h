@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_DBUS_H
+#define PN54X_DBUS_H
+
+#include "pn54x_io.h"
+#include "pn54x_recovery.h"
+
+#include <gio/gio.h>
+
+/*
+ * Exports the plugin statistics over D-Bus. The interface is registered
+ * next to the nfcd adapter object, on the connection owned by nfcd:
+ *
+ * org.sailfishos.nfc.pn54x
+ *   GetInterfaceVersion() -> i
+ *   GetStats() -> a{st}
+ *   ResetStats()
+ *   DumpLatency()      Writes latency histograms to the log (info level)
+ *   DumpPackets()      Writes the last packets to the log
+ *
+ * ResetStats, DumpLatency and DumpPackets are subject to libdbusaccess
+ * policy (the same mechanism that nfcd uses), by default only root and
+ * the privileged group are allowed to call them. Others get
+ * org.freedesktop.DBus.Error.AccessDenied.
+ */
+
+#define PN54X_DBUS_INTERFACE "org.sailfishos.nfc.pn54x"
+#define PN54X_DBUS_INTERFACE_VERSION (1)
+
+typedef struct pn54x_dbus Pn54xDBus;
+
+typedef struct pn54x_dbus_stats {
+    Pn54xIoStats io;
+    guint64 power_cycles;   /* Chip powered on at nfcd request */
+    guint64 error_resets;   /* Chip power cycled by error recovery */
+    guint64 cold_starts;    /* Power-on requests which powered the chip */
+    guint64 warm_starts;    /* Power-on requests while kept powered */
+    guint64 boots;          /* NCI started after power-on */
+    guint64 boots_signaled; /* ... after the chip has signaled readiness */
+    guint64 boot_timeouts;  /* ... after BootTimeout has expired */
+    guint64 boot_time;      /* Total time of signaled boots, microseconds */
+    guint64 boot_time_max;  /* The longest signaled boot, microseconds */
+    Pn54xRecoveryStats recovery;
+} Pn54xDBusStats;
+
+typedef struct pn54x_dbus_functions {
+    void (*get_stats)(Pn54xDBusStats* stats, void* user_data);
+    void (*reset_stats)(void* user_data);
+    void (*dump_latency)(void* user_data);
+    void (*dump_packets)(void* user_data);
+} Pn54xDBusFunctions;
+
+/* NULL access means the default policy */
+Pn54xDBus*
+pn54x_dbus_new(
+    GDBusConnection* connection,
+    GBusType bus,
+    const char* path,
+    const char* access,
+    const Pn54xDBusFunctions* fn,
+    void* user_data);
+
+void
+pn54x_dbus_free(
+    Pn54xDBus* dbus);
+
+#endif /* PN54X_DBUS_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
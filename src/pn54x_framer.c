@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_framer.h"
+#include "pn54x_util.h"
+
+/* Driver fills unused part of the buffer with 0xff's */
+static inline
+const guint8*
+pn54x_framer_skip_padding(
+    Pn54xFramer* framer,
+    const guint8* ptr,
+    const guint8* end)
+{
+    const gsize n = pn54x_util_skip_ff(ptr, end - ptr);
+
+    framer->stats.padding += n;
+    return ptr + n;
+}
+
+static inline
+void
+pn54x_framer_carry(
+    Pn54xFramer* framer,
+    const guint8* ptr,
+    gsize n)
+{
+    memcpy(framer->buf + framer->len, ptr, n);
+    framer->len += n;
+    framer->stats.copied += n;
+}
+
+static inline
+guint
+pn54x_framer_packet_size(
+    const guint8* pkt)
+{
+    return PN54X_FRAMER_HEADER_SIZE + pkt[2];
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+void
+pn54x_framer_reset(
+    Pn54xFramer* framer)
+{
+    framer->len = 0;
+    framer->resets++;
+}
+
+void
+pn54x_framer_input(
+    Pn54xFramer* framer,
+    const void* data,
+    gsize size,
+    Pn54xFramerFunc fn,
+    void* user_data)
+{
+    const guint8* ptr = data;
+    const guint8* end = ptr + size;
+    const guint resets = framer->resets;
+
+    if (framer->len) {
+        /* Complete the packet left from the previous read */
+        guint need;
+
+        if (framer->len < PN54X_FRAMER_HEADER_SIZE) {
+            need = PN54X_FRAMER_HEADER_SIZE - framer->len;
+            if (size < need) {
+                pn54x_framer_carry(framer, ptr, size);
+                return;
+            }
+            pn54x_framer_carry(framer, ptr, need);
+            ptr += need;
+        }
+
+        need = pn54x_framer_packet_size(framer->buf) - framer->len;
+        if ((gsize)(end - ptr) < need) {
+            pn54x_framer_carry(framer, ptr, end - ptr);
+            return;
+        } else {
+            guint len;
+
+            pn54x_framer_carry(framer, ptr, need);
+            ptr += need;
+
+            /* The callback may reset the framer */
+            len = framer->len;
+            framer->len = 0;
+            framer->stats.packets++;
+            fn(framer->buf, len, user_data);
+            if (framer->resets != resets) {
+                return;
+            }
+        }
+    }
+
+    /* NCI packet can't start with 0xff */
+    ptr = pn54x_framer_skip_padding(framer, ptr, end);
+    while (end - ptr >= PN54X_FRAMER_HEADER_SIZE) {
+        const guint len = pn54x_framer_packet_size(ptr);
+
+        if ((gsize)(end - ptr) < len) {
+            break;
+        }
+        framer->stats.packets++;
+        fn(ptr, len, user_data);
+        if (framer->resets != resets) {
+            /* Whoever has reset us doesn't want the rest */
+            return;
+        }
+        ptr = pn54x_framer_skip_padding(framer, ptr + len, end);
+    }
+
+    if (ptr < end) {
+        /* Less than one packet, always fits */
+        framer->len = 0;
+        pn54x_framer_carry(framer, ptr, end - ptr);
+        framer->stats.carried++;
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
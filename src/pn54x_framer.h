@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_FRAMER_H
+#define PN54X_FRAMER_H
+
+#include <gutil_types.h>
+
+/*
+ * Splits the stream of bytes coming from the driver into NCI packets.
+ * Complete packets are passed to the callback in place, directly from
+ * the input buffer. Only a packet split between two reads is copied,
+ * into the fixed size carry buffer. Nothing is ever moved or allocated.
+ * If the callback resets the framer, the rest of the input is dropped.
+ */
+
+#define PN54X_FRAMER_HEADER_SIZE (3)
+#define PN54X_FRAMER_MAX_PACKET_SIZE (PN54X_FRAMER_HEADER_SIZE + 0xff)
+
+typedef
+void
+(*Pn54xFramerFunc)(
+    const void* pkt,
+    guint len,
+    void* user_data);
+
+/* Statistics survive pn54x_framer_reset() */
+typedef struct pn54x_framer_stats {
+    guint64 packets;    /* Packets passed to the callback */
+    guint64 padding;    /* 0xff bytes skipped */
+    guint64 carried;    /* Packets split between two or more inputs */
+    guint64 copied;     /* Bytes copied into the carry buffer */
+} Pn54xFramerStats;
+
+typedef struct pn54x_framer {
+    guint len;
+    guint resets;       /* Tells pn54x_framer_input() to stop */
+    Pn54xFramerStats stats;
+    guint8 buf[PN54X_FRAMER_MAX_PACKET_SIZE];
+} Pn54xFramer;
+
+void
+pn54x_framer_reset(
+    Pn54xFramer* framer);
+
+void
+pn54x_framer_input(
+    Pn54xFramer* framer,
+    const void* data,
+    gsize size,
+    Pn54xFramerFunc fn,
+    void* user_data);
+
+#endif /* PN54X_FRAMER_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,621 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_fw.h"
+#include "pn54x_system.h"
+#include "pn54x_util.h"
+#include "pn54x_log.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+/*
+ * The chip handles one DL command at a time, so there's nothing to
+ * pipeline on the wire. What can be overlapped is the host side: the
+ * next frame (including its CRC) gets built while the chip is busy
+ * flashing the current one, so the next write can go out as soon as
+ * the response arrives.
+ */
+
+#define PN54X_FW_HDR_SIZE (2)
+#define PN54X_FW_CRC_SIZE (2)
+#define PN54X_FW_CHUNK_FLAG (0x04)
+#define PN54X_FW_LEN_MASK (0x3ff)
+#define PN54X_FW_MAX_PAYLOAD (PN54X_FW_LEN_MASK)
+#define PN54X_FW_MAX_FRAME_SIZE \
+    (PN54X_FW_HDR_SIZE + PN54X_FW_MAX_PAYLOAD + PN54X_FW_CRC_SIZE)
+#define PN54X_FW_DEFAULT_MAX_FRAME (256)
+#define PN54X_FW_DEFAULT_TIMEOUT (1000) /* milliseconds */
+#define PN54X_FW_WRITE_RETRIES (3)
+#define PN54X_FW_WRITE_RETRY_DELAY (1000) /* microseconds */
+
+/* Image layout */
+#define PN54X_FW_IMAGE_VERSION_OFFSET (4)
+
+/* GET_VERSION response: status, hw, rom, fw minor, fw major */
+#define PN54X_FW_CMD_GET_VERSION (0xf1)
+#define PN54X_FW_GET_VERSION_RSP_MIN_SIZE (5)
+#define PN54X_FW_GET_VERSION_RSP_FW_MINOR (3)
+#define PN54X_FW_GET_VERSION_RSP_FW_MAJOR (4)
+
+#define PN54X_FW_STATUS_OK (0x00)
+#define PN54X_FW_STATUS_FIRST_CHUNK (0x2d)
+#define PN54X_FW_STATUS_NEXT_CHUNK (0x2e)
+
+typedef struct pn54x_fw_cursor {
+    const guint8* ptr;  /* Current image frame (header) */
+    const guint8* end;
+    guint offset;       /* Payload bytes already sent */
+    guint max_frame;
+} Pn54xFwCursor;
+
+typedef enum pn54x_fw_state {
+    PN54X_FW_STATE_SEND,    /* Frame is ready to be written */
+    PN54X_FW_STATE_RECEIVE, /* Waiting for the response */
+    PN54X_FW_STATE_DONE
+} PN54X_FW_STATE;
+
+struct pn54x_fw_download {
+    const Pn54xFwImage* image;
+    Pn54xFwCursor cursor;
+    guint timeout;
+    gboolean force;
+    gboolean version_checked;
+    PN54X_FW_STATE state;
+    PN54X_FW_RESULT result;
+    gint64 start;
+    Pn54xFwStats stats;
+
+    /* Two frame buffers, one is being sent while the other is built */
+    guint8 frame[2][PN54X_FW_MAX_FRAME_SIZE];
+    guint frame_len[2];
+    guint cur;
+
+    /* Response, possibly received in pieces */
+    guint8 rsp[PN54X_FW_MAX_FRAME_SIZE];
+    guint rsp_len;
+};
+
+static
+guint
+pn54x_fw_frame_len(
+    const guint8* hdr)
+{
+    return ((hdr[0] << 8) | hdr[1]) & PN54X_FW_LEN_MASK;
+}
+
+guint16
+pn54x_fw_crc16(
+    guint16 crc,
+    const void* data,
+    gsize len)
+{
+    const guint8* ptr = data;
+    const guint8* end = ptr + len;
+
+    while (ptr < end) {
+        crc = (crc >> 8) | (crc << 8);
+        crc ^= *ptr++;
+        crc ^= (crc & 0xff) >> 4;
+        crc ^= crc << 12;
+        crc ^= (crc & 0xff) << 5;
+    }
+    return crc;
+}
+
+static
+guint
+pn54x_fw_frame_build(
+    guint8* buf,
+    gboolean more,
+    const guint8* payload,
+    guint len)
+{
+    guint8* crc = buf + PN54X_FW_HDR_SIZE + len;
+    guint16 val;
+
+    buf[0] = (more ? PN54X_FW_CHUNK_FLAG : 0) | (guint8)(len >> 8);
+    buf[1] = (guint8)len;
+    memcpy(buf + PN54X_FW_HDR_SIZE, payload, len);
+    val = pn54x_fw_crc16(0xffff, buf, PN54X_FW_HDR_SIZE + len);
+    crc[0] = (guint8)(val >> 8);
+    crc[1] = (guint8)val;
+    return PN54X_FW_HDR_SIZE + len + PN54X_FW_CRC_SIZE;
+}
+
+/* Builds the next DL frame, returns zero when the image is done */
+static
+guint
+pn54x_fw_cursor_next(
+    Pn54xFwCursor* cursor,
+    guint8* buf)
+{
+    if (cursor->ptr < cursor->end) {
+        const guint total = pn54x_fw_frame_len(cursor->ptr);
+        const guint8* payload = cursor->ptr + PN54X_FW_HDR_SIZE;
+        const guint left = total - cursor->offset;
+        const guint len = MIN(left, cursor->max_frame);
+        const gboolean more = (len < left);
+        const guint size = pn54x_fw_frame_build(buf, more,
+            payload + cursor->offset, len);
+
+        if (more) {
+            cursor->offset += len;
+        } else {
+            cursor->ptr = payload + total;
+            cursor->offset = 0;
+        }
+        return size;
+    }
+    return 0;
+}
+
+static
+gboolean
+pn54x_fw_write(
+    int fd,
+    const guint8* buf,
+    guint len)
+{
+    int retry = 0;
+
+    while (TRUE) {
+        const ssize_t written = pn54x_system_write(fd, buf, len);
+
+        if (written == (ssize_t)len) {
+            return TRUE;
+        } else if (written >= 0) {
+            GERR("DL frame write truncated (%d/%u)", (int)written, len);
+            return FALSE;
+        } else if (errno != EINTR) {
+            if (pn54x_util_write_error_transient(errno) &&
+                retry++ < PN54X_FW_WRITE_RETRIES) {
+                GDEBUG("DL frame write error: %s, retrying", strerror(errno));
+                g_usleep(PN54X_FW_WRITE_RETRY_DELAY);
+            } else {
+                GERR("DL frame write error: %s", strerror(errno));
+                return FALSE;
+            }
+        }
+    }
+}
+
+static
+gssize
+pn54x_fw_read(
+    int fd,
+    guint8* buf,
+    guint len,
+    gint64 deadline)
+{
+    /*
+     * The driver may not support poll, in which case poll reports the
+     * descriptor as readable and read blocks until the chip responds.
+     */
+    for (;;) {
+        const gint64 left = deadline - g_get_monotonic_time();
+        struct pollfd pfd;
+        ssize_t n;
+        int ret;
+
+        memset(&pfd, 0, sizeof(pfd));
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        ret = poll(&pfd, 1, (left > 0) ? (int)((left + 999) / 1000) : 0);
+        if (ret < 0) {
+            if (errno != EINTR) {
+                GERR("DL poll error: %s", strerror(errno));
+                return -1;
+            }
+        } else if (!ret) {
+            GERR("DL response timeout");
+            return -1;
+        } else {
+            n = read(fd, buf, len);
+            if (n > 0) {
+                return n;
+            } else if (!n) {
+                GERR("DL device closed");
+                return -1;
+            } else if (errno != EINTR && errno != EAGAIN) {
+                GERR("DL read error: %s", strerror(errno));
+                return -1;
+            }
+        }
+    }
+}
+
+static
+void
+pn54x_fw_download_finish(
+    Pn54xFwDownload* self,
+    PN54X_FW_RESULT result)
+{
+    Pn54xFwStats* stats = &self->stats;
+
+    self->state = PN54X_FW_STATE_DONE;
+    self->result = result;
+    stats->time = g_get_monotonic_time() - self->start;
+    if (result == PN54X_FW_UPDATED) {
+        GDEBUG("Firmware updated in %d ms, %u DL frames, %u bytes",
+            (int)(stats->time / 1000), stats->chunks, (guint)stats->bytes);
+    }
+}
+
+static
+gboolean
+pn54x_fw_download_version(
+    Pn54xFwDownload* self,
+    const guint8* payload,
+    guint len)
+{
+    const guint8 status = payload[0];
+    guint16 version;
+
+    /* Status, hw, rom, fw minor, fw major, all in one frame */
+    if (self->rsp[0] & PN54X_FW_CHUNK_FLAG) {
+        GERR("Chunked GET_VERSION response");
+        return FALSE;
+    } else if (status != PN54X_FW_STATUS_OK) {
+        GERR("GET_VERSION error 0x%02x", status);
+        return FALSE;
+    } else if (len < PN54X_FW_GET_VERSION_RSP_MIN_SIZE) {
+        GERR("GET_VERSION response is too short (%u bytes)", len);
+        return FALSE;
+    }
+
+    version = (payload[PN54X_FW_GET_VERSION_RSP_FW_MAJOR] << 8) |
+        payload[PN54X_FW_GET_VERSION_RSP_FW_MINOR];
+    self->version_checked = TRUE;
+    self->stats.chip_version = version;
+    if (version == self->image->version && !self->force) {
+        GDEBUG("Firmware %04x is up to date", version);
+        pn54x_fw_download_finish(self, PN54X_FW_CURRENT);
+    } else {
+        GDEBUG("Updating firmware %04x => %04x", version,
+            self->image->version);
+        self->cur = !self->cur;
+        self->state = PN54X_FW_STATE_SEND;
+    }
+    return TRUE;
+}
+
+static
+gboolean
+pn54x_fw_download_response(
+    Pn54xFwDownload* self)
+{
+    const guint8* buf = self->rsp;
+    const guint len = pn54x_fw_frame_len(buf);
+    const guint8* payload = buf + PN54X_FW_HDR_SIZE;
+    const guint8* crc = payload + len;
+    const guint16 expected = pn54x_fw_crc16(0xffff, buf,
+        PN54X_FW_HDR_SIZE + len);
+
+    if (((crc[0] << 8) | crc[1]) != expected) {
+        GERR("DL response CRC mismatch");
+    } else if (!len) {
+        GERR("Empty DL response");
+    } else if (!self->version_checked) {
+        return pn54x_fw_download_version(self, payload, len);
+    } else {
+        const guint i = self->cur;
+        const gboolean more = (self->frame[i][0] & PN54X_FW_CHUNK_FLAG) != 0;
+        const guint8 status = payload[0];
+
+        if (more ? (status != PN54X_FW_STATUS_OK &&
+            status != PN54X_FW_STATUS_FIRST_CHUNK &&
+            status != PN54X_FW_STATUS_NEXT_CHUNK) :
+            (status != PN54X_FW_STATUS_OK)) {
+            GERR("DL frame %u error 0x%02x", self->stats.frames, status);
+        } else {
+            if (!more) {
+                self->stats.frames++;
+            }
+            if (self->frame_len[!i]) {
+                self->cur = !i;
+                self->state = PN54X_FW_STATE_SEND;
+            } else {
+                pn54x_fw_download_finish(self, PN54X_FW_UPDATED);
+            }
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+Pn54xFwImage*
+pn54x_fw_image_new(
+    const void* data,
+    gsize size)
+{
+    const guint8* ptr = data;
+    const guint8* end = ptr + size;
+    Pn54xFwImage* image;
+    guint8* copy;
+    guint frames = 0;
+
+    if (size < PN54X_FW_IMAGE_VERSION_OFFSET + 2) {
+        GERR("Firmware image is too short");
+        return NULL;
+    }
+
+    /* The image must consist of complete DL frames */
+    while (ptr < end) {
+        guint len;
+
+        if (ptr + PN54X_FW_HDR_SIZE > end) {
+            GERR("Truncated frame header in firmware image");
+            return NULL;
+        }
+        len = pn54x_fw_frame_len(ptr);
+        if (!len || (ptr[0] & PN54X_FW_CHUNK_FLAG)) {
+            GERR("Invalid frame header in firmware image");
+            return NULL;
+        }
+        ptr += PN54X_FW_HDR_SIZE + len;
+        if (ptr > end) {
+            GERR("Truncated frame in firmware image");
+            return NULL;
+        }
+        frames++;
+    }
+
+    /* Data are stored right after the structure */
+    image = g_malloc(sizeof(Pn54xFwImage) + size);
+    copy = (guint8*)(image + 1);
+    memcpy(copy, data, size);
+    image->data = copy;
+    image->size = size;
+    image->frames = frames;
+    image->version = (copy[PN54X_FW_IMAGE_VERSION_OFFSET + 1] << 8) |
+        copy[PN54X_FW_IMAGE_VERSION_OFFSET];
+    return image;
+}
+
+Pn54xFwImage*
+pn54x_fw_image_load(
+    const char* path)
+{
+    Pn54xFwImage* image = NULL;
+    GError* error = NULL;
+    gchar* data = NULL;
+    gsize size = 0;
+
+    if (g_file_get_contents(path, &data, &size, &error)) {
+        image = pn54x_fw_image_new(data, size);
+        if (image) {
+            GDEBUG("Firmware %s version %04x, %u frames", path,
+                image->version, image->frames);
+        }
+        g_free(data);
+    } else {
+        GERR("%s", error->message);
+        g_error_free(error);
+    }
+    return image;
+}
+
+void
+pn54x_fw_image_free(
+    Pn54xFwImage* image)
+{
+    g_free(image);
+}
+
+Pn54xFwDownload*
+pn54x_fw_download_new(
+    const Pn54xFwImage* image,
+    const Pn54xFwConfig* config)
+{
+    static const guint8 cmd[] = { PN54X_FW_CMD_GET_VERSION, 0, 0, 0 };
+    Pn54xFwDownload* self = g_new0(Pn54xFwDownload, 1);
+    Pn54xFwCursor* cursor = &self->cursor;
+
+    self->image = image;
+    self->timeout = PN54X_FW_DEFAULT_TIMEOUT;
+    cursor->ptr = image->data;
+    cursor->end = image->data + image->size;
+    cursor->max_frame = PN54X_FW_DEFAULT_MAX_FRAME;
+    if (config) {
+        if (config->max_frame) {
+            cursor->max_frame = MIN(config->max_frame, PN54X_FW_MAX_PAYLOAD);
+        }
+        if (config->timeout) {
+            self->timeout = config->timeout;
+        }
+        self->force = config->force;
+    }
+
+    /* The version is checked first */
+    self->frame_len[0] = pn54x_fw_frame_build(self->frame[0], FALSE,
+        cmd, sizeof(cmd));
+    self->state = PN54X_FW_STATE_SEND;
+    self->result = PN54X_FW_BUSY;
+    self->start = g_get_monotonic_time();
+    return self;
+}
+
+void
+pn54x_fw_download_free(
+    Pn54xFwDownload* self)
+{
+    g_free(self);
+}
+
+const void*
+pn54x_fw_download_output(
+    Pn54xFwDownload* self,
+    guint* len)
+{
+    if (self->state == PN54X_FW_STATE_SEND) {
+        *len = self->frame_len[self->cur];
+        return self->frame[self->cur];
+    } else {
+        *len = 0;
+        return NULL;
+    }
+}
+
+void
+pn54x_fw_download_sent(
+    Pn54xFwDownload* self)
+{
+    if (self->state == PN54X_FW_STATE_SEND) {
+        const guint i = self->cur;
+
+        self->state = PN54X_FW_STATE_RECEIVE;
+        self->rsp_len = 0;
+        self->stats.chunks++;
+        self->stats.bytes += self->frame_len[i];
+
+        /* Build the next frame while the chip is busy */
+        self->frame_len[!i] = pn54x_fw_cursor_next(&self->cursor,
+            self->frame[!i]);
+    }
+}
+
+void
+pn54x_fw_download_input(
+    Pn54xFwDownload* self,
+    const void* data,
+    gsize len)
+{
+    const guint8* ptr = data;
+    const guint8* end = ptr + len;
+
+    while (ptr < end && self->state != PN54X_FW_STATE_DONE) {
+        if (self->state == PN54X_FW_STATE_RECEIVE) {
+            /* Header first, then the payload and CRC */
+            const guint need = (self->rsp_len < PN54X_FW_HDR_SIZE) ?
+                PN54X_FW_HDR_SIZE : (PN54X_FW_HDR_SIZE +
+                pn54x_fw_frame_len(self->rsp) + PN54X_FW_CRC_SIZE);
+            const guint n = MIN(need - self->rsp_len, (guint)(end - ptr));
+
+            memcpy(self->rsp + self->rsp_len, ptr, n);
+            self->rsp_len += n;
+            ptr += n;
+            if (self->rsp_len == need && need > PN54X_FW_HDR_SIZE &&
+                !pn54x_fw_download_response(self)) {
+                pn54x_fw_download_finish(self, PN54X_FW_ERROR);
+            }
+        } else {
+            GERR("Unexpected DL data (%u byte(s))", (guint)(end - ptr));
+            pn54x_fw_download_finish(self, PN54X_FW_ERROR);
+        }
+    }
+}
+
+void
+pn54x_fw_download_abort(
+    Pn54xFwDownload* self)
+{
+    if (self->state != PN54X_FW_STATE_DONE) {
+        pn54x_fw_download_finish(self, PN54X_FW_ERROR);
+    }
+}
+
+PN54X_FW_RESULT
+pn54x_fw_download_result(
+    Pn54xFwDownload* self)
+{
+    return self->result;
+}
+
+guint
+pn54x_fw_download_timeout(
+    Pn54xFwDownload* self)
+{
+    return self->timeout;
+}
+
+const Pn54xFwStats*
+pn54x_fw_download_stats(
+    Pn54xFwDownload* self)
+{
+    return &self->stats;
+}
+
+PN54X_FW_RESULT
+pn54x_fw_download(
+    int fd,
+    const Pn54xFwImage* image,
+    const Pn54xFwConfig* config,
+    Pn54xFwStats* stats)
+{
+    Pn54xFwDownload* dl = pn54x_fw_download_new(image, config);
+    guint8* buf = g_malloc(PN54X_FW_MAX_FRAME_SIZE);
+    PN54X_FW_RESULT result;
+    gint64 deadline = 0;
+
+    while ((result = dl->result) == PN54X_FW_BUSY) {
+        guint len;
+        const void* frame = pn54x_fw_download_output(dl, &len);
+
+        if (frame) {
+            if (pn54x_fw_write(fd, frame, len)) {
+                deadline = g_get_monotonic_time() + dl->timeout * 1000;
+                pn54x_fw_download_sent(dl);
+            } else {
+                pn54x_fw_download_abort(dl);
+            }
+        } else {
+            const gssize n = pn54x_fw_read(fd, buf, PN54X_FW_MAX_FRAME_SIZE,
+                deadline);
+
+            if (n > 0) {
+                pn54x_fw_download_input(dl, buf, n);
+            } else {
+                pn54x_fw_download_abort(dl);
+            }
+        }
+    }
+    if (stats) {
+        *stats = dl->stats;
+    }
+    pn54x_fw_download_free(dl);
+    g_free(buf);
+    return result;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_FW_H
+#define PN54X_FW_H
+
+#include <gutil_types.h>
+
+/*
+ * Firmware download (DL) protocol spoken by PN54x chips powered up in
+ * download mode. Each frame consists of a 2-byte header (chunk flag and
+ * 10-bit payload length), the payload and CRC16-CCITT of the two.
+ *
+ * NXP firmware images (gphDnldNfc_DlSeq array from libpn54x_fw.so,
+ * e.g. extracted with objcopy) are a sequence of complete DL command
+ * frames without CRC. The firmware version is stored at offset 4.
+ */
+
+#define PN54X_FW_FRAME_OVERHEAD (4) /* Header and CRC */
+
+typedef struct pn54x_fw_image {
+    guint16 version;    /* Major in MSB, minor in LSB */
+    guint frames;       /* Number of DL frames in the image */
+    gsize size;
+    const guint8* data;
+} Pn54xFwImage;
+
+/* Zero-initialized structure means defaults */
+typedef struct pn54x_fw_config {
+    guint max_frame;    /* Max payload per DL frame, bytes */
+    guint timeout;      /* Response timeout, milliseconds */
+    gboolean force;     /* Update even if the version matches */
+} Pn54xFwConfig;
+
+typedef enum pn54x_fw_result {
+    PN54X_FW_UPDATED,
+    PN54X_FW_CURRENT,   /* Chip is already running this version */
+    PN54X_FW_ERROR,
+    PN54X_FW_BUSY       /* Download is still in progress */
+} PN54X_FW_RESULT;
+
+typedef struct pn54x_fw_stats {
+    guint16 chip_version;
+    guint frames;       /* Image frames written */
+    guint chunks;       /* DL frames written (including GET_VERSION) */
+    gsize bytes;        /* Bytes written, including DL framing */
+    gint64 time;        /* Microseconds */
+} Pn54xFwStats;
+
+Pn54xFwImage*
+pn54x_fw_image_new(
+    const void* data,
+    gsize size);
+
+Pn54xFwImage*
+pn54x_fw_image_load(
+    const char* path);
+
+void
+pn54x_fw_image_free(
+    Pn54xFwImage* image);
+
+/* CRC16-CCITT (polynomial 0x1021, MSB first), 0xffff for a new one */
+guint16
+pn54x_fw_crc16(
+    guint16 crc,
+    const void* data,
+    gsize len);
+
+/*
+ * The download state machine doesn't do any I/O by itself. The caller
+ * writes the frame returned by pn54x_fw_download_output(), tells that
+ * it has been submitted with pn54x_fw_download_sent() and passes the
+ * data coming from the chip to pn54x_fw_download_input(), in pieces of
+ * any size. That goes on until the result is something but BUSY.
+ */
+typedef struct pn54x_fw_download Pn54xFwDownload;
+
+/* The image must stay alive while the download is in progress */
+Pn54xFwDownload*
+pn54x_fw_download_new(
+    const Pn54xFwImage* image,
+    const Pn54xFwConfig* config);
+
+void
+pn54x_fw_download_free(
+    Pn54xFwDownload* dl);
+
+/* NULL if waiting for the response or done */
+const void*
+pn54x_fw_download_output(
+    Pn54xFwDownload* dl,
+    guint* len);
+
+void
+pn54x_fw_download_sent(
+    Pn54xFwDownload* dl);
+
+void
+pn54x_fw_download_input(
+    Pn54xFwDownload* dl,
+    const void* data,
+    gsize len);
+
+/* I/O error or response timeout */
+void
+pn54x_fw_download_abort(
+    Pn54xFwDownload* dl);
+
+PN54X_FW_RESULT
+pn54x_fw_download_result(
+    Pn54xFwDownload* dl);
+
+/* Response timeout, milliseconds */
+guint
+pn54x_fw_download_timeout(
+    Pn54xFwDownload* dl);
+
+const Pn54xFwStats*
+pn54x_fw_download_stats(
+    Pn54xFwDownload* dl);
+
+/* Blocking download, the chip must already be in download mode */
+PN54X_FW_RESULT
+pn54x_fw_download(
+    int fd,
+    const Pn54xFwImage* image,
+    const Pn54xFwConfig* config,
+    Pn54xFwStats* stats);
+
+#endif /* PN54X_FW_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,452 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_hexdump.h"
+#include "pn54x_log.h"
+#include "pn54x_util.h"
+
+#include <gutil_misc.h>
+
+#include <pthread.h>
+
+/*
+ * The queue is a byte ring. Each record is a header followed by chunk
+ * lengths, the text (if any) and the data, aligned at 8 bytes. A record
+ * never wraps, if there's not enough room at the end of the buffer, a
+ * zero size header sends the reader back to the beginning.
+ *
+ * The main thread writes records into the free space under the mutex.
+ * The hexdump thread formats the record at the head without holding
+ * the mutex, the space is only released when it's done with it.
+ */
+
+#define PN54X_HEXDUMP_MIN_SIZE (256)
+#define PN54X_HEXDUMP_ALIGN(n) (((n) + 7) & ~7)
+
+typedef struct pn54x_hexdump_rec {
+    guint32 size;           /* Zero means wrap around */
+    guint32 skipped;        /* Packets dropped before this one */
+    guint32 count;          /* Number of chunks */
+    guint32 text;           /* Length of the text, including NUL */
+    GLogModule* log;
+    int level;
+    char dir;
+    /* guint32 len[count], the text and the data follow */
+} Pn54xHexdumpRec;
+
+struct pn54x_hexdump_thread {
+    GLogModule* log;
+    int level;
+    gboolean stopped;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        /* Something has been queued */
+    pthread_cond_t drained;     /* The queue is empty */
+    guint8* buf;
+    guint size;
+    guint head;
+    guint tail;
+    guint used;
+    guint skipped;              /* Dropped since the last queued packet */
+    Pn54xHexdumpStats stats;    /* Updated by the main thread */
+};
+
+/*==========================================================================*
+ * Implementation
+ *==========================================================================*/
+
+static
+void
+pn54x_hexdump_rec_log(
+    Pn54xHexdumpThread* self,
+    const Pn54xHexdumpRec* rec)
+{
+    const guint32* lens = (const guint32*)(rec + 1);
+    const char* text = (const char*)(lens + rec->count);
+    const guint8* ptr = (const guint8*)(text + rec->text);
+    guint i, len = 0;
+
+    if (rec->skipped) {
+        gutil_log(self->log, self->level, "  %u packet(s) dropped",
+            rec->skipped);
+    }
+    if (rec->text) {
+        gutil_log(rec->log, rec->level, "%s", text);
+    } else {
+        for (i = 0; i < rec->count; i++) {
+            len += lens[i];
+        }
+        gutil_log(rec->log, rec->level, "%c %u byte(s)", rec->dir, len);
+    }
+    for (i = 0; i < rec->count; i++) {
+        pn54x_hexdump(rec->log, rec->level, rec->dir, ptr, lens[i]);
+        ptr += lens[i];
+    }
+}
+
+static
+void*
+pn54x_hexdump_thread_proc(
+    void* arg)
+{
+    Pn54xHexdumpThread* self = arg;
+
+    pthread_mutex_lock(&self->mutex);
+    for (;;) {
+        if (self->used) {
+            const Pn54xHexdumpRec* rec = (void*)(self->buf + self->head);
+            const guint size = rec->size;
+
+            if (size) {
+                pthread_mutex_unlock(&self->mutex);
+                pn54x_hexdump_rec_log(self, rec);
+                pthread_mutex_lock(&self->mutex);
+                self->head += size;
+                self->used -= size;
+            } else {
+                /* Wrap around */
+                self->used -= self->size - self->head;
+                self->head = 0;
+            }
+            if (self->head == self->size) {
+                self->head = 0;
+            }
+            if (!self->used) {
+                /* Start from the beginning, for the largest free space */
+                self->head = self->tail = 0;
+                pthread_cond_broadcast(&self->drained);
+            }
+        } else if (self->stopped) {
+            break;
+        } else {
+            pthread_cond_wait(&self->cond, &self->mutex);
+        }
+    }
+    pthread_mutex_unlock(&self->mutex);
+    return NULL;
+}
+
+static
+Pn54xHexdumpRec*
+pn54x_hexdump_thread_alloc(
+    Pn54xHexdumpThread* self,
+    guint size)
+{
+    /* Must be called under the mutex */
+    if (self->used + size <= self->size) {
+        guint offset = self->tail;
+
+        if (self->tail >= self->head) {
+            /* Free space is at the end and (maybe) at the beginning */
+            if (self->size - self->tail < size) {
+                if (self->head < size) {
+                    return NULL;
+                }
+                ((Pn54xHexdumpRec*)(self->buf + self->tail))->size = 0;
+                self->used += self->size - self->tail;
+                offset = 0;
+            }
+        } else if (self->head - self->tail < size) {
+            return NULL;
+        }
+        self->used += size;
+        self->tail = offset + size;
+        if (self->tail == self->size) {
+            self->tail = 0;
+        }
+        return (Pn54xHexdumpRec*)(self->buf + offset);
+    }
+    return NULL;
+}
+
+static
+gboolean
+pn54x_hexdump_thread_queue(
+    Pn54xHexdumpThread* self,
+    GLogModule* log,
+    int level,
+    const char* text,
+    char dir,
+    const GUtilData* chunks,
+    guint count)
+{
+    const guint text_len = text ? (strlen(text) + 1) : 0;
+    Pn54xHexdumpRec* rec;
+    guint i, size, n = 0, len = 0;
+
+    for (i = 0; i < count; i++) {
+        if (chunks[i].size) {
+            len += chunks[i].size;
+            n++;
+        }
+    }
+
+    size = PN54X_HEXDUMP_ALIGN(sizeof(*rec) + n * sizeof(guint32) +
+        text_len + len);
+    pthread_mutex_lock(&self->mutex);
+    rec = pn54x_hexdump_thread_alloc(self, size);
+    if (rec) {
+        guint32* lens = (guint32*)(rec + 1);
+        guint8* ptr = (guint8*)(lens + n);
+
+        rec->size = size;
+        rec->skipped = self->skipped;
+        rec->count = n;
+        rec->text = text_len;
+        rec->log = log;
+        rec->level = level;
+        rec->dir = dir;
+        if (text_len) {
+            memcpy(ptr, text, text_len);
+            ptr += text_len;
+        }
+        for (i = 0; i < count; i++) {
+            if (chunks[i].size) {
+                *lens++ = chunks[i].size;
+                memcpy(ptr, chunks[i].bytes, chunks[i].size);
+                ptr += chunks[i].size;
+            }
+        }
+        self->skipped = 0;
+        pthread_cond_signal(&self->cond);
+    } else {
+        self->skipped++;
+    }
+    pthread_mutex_unlock(&self->mutex);
+
+    if (rec) {
+        self->stats.packets++;
+        self->stats.bytes += len;
+        return TRUE;
+    }
+    self->stats.dropped++;
+    return FALSE;
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+void
+pn54x_hexdump(
+    GLogModule* log,
+    int level,
+    char dir,
+    const void* data,
+    guint len)
+{
+    const guint8* ptr = data;
+    gboolean empty = FALSE;
+    guint empty_len = 0, skip_count = 0;
+
+    while (len > 0) {
+        char buf[GUTIL_HEXDUMP_BUFSIZE];
+        const gboolean was_empty = empty;
+        guint consumed;
+
+        if (empty) {
+            /* Don't print boring ff's too many times */
+            const guint n = pn54x_util_skip_ff(ptr, len) / empty_len;
+
+            if (n) {
+                skip_count += n;
+                ptr += n * empty_len;
+                len -= n * empty_len;
+                if (!len) {
+                    break;
+                }
+            }
+        }
+
+        consumed = gutil_hexdump(buf, ptr, len);
+        empty = (pn54x_util_skip_ff(ptr, consumed) == consumed);
+        len -= consumed;
+        ptr += consumed;
+        if (was_empty && empty && empty_len == consumed) {
+            skip_count++;
+        } else {
+            if (skip_count) {
+                gutil_log(log, level, "  %u line(s) skipped", skip_count);
+                skip_count = 0;
+            }
+            gutil_log(log, level, "%c %s", dir, buf);
+            dir = ' ';
+        }
+        if (empty) {
+            empty_len = consumed;
+        }
+    }
+    if (skip_count) {
+        gutil_log(log, level, "  ... %u line(s) skipped", skip_count);
+    }
+}
+
+void
+pn54x_hexdump_packet(
+    GLogModule* log,
+    int level,
+    char dir,
+    const GUtilData* chunks,
+    guint count)
+{
+    guint i, len = 0;
+
+    for (i = 0; i < count; i++) {
+        len += chunks[i].size;
+    }
+    gutil_log(log, level, "%c %u byte(s)", dir, len);
+    for (i = 0; i < count; i++) {
+        pn54x_hexdump(log, level, dir, chunks[i].bytes, chunks[i].size);
+    }
+}
+
+Pn54xHexdumpThread*
+pn54x_hexdump_thread_start(
+    GLogModule* log,
+    int level,
+    guint size)
+{
+    Pn54xHexdumpThread* self = g_new0(Pn54xHexdumpThread, 1);
+    int err;
+
+    self->log = log;
+    self->level = level;
+    self->size = PN54X_HEXDUMP_ALIGN(MAX(size, PN54X_HEXDUMP_MIN_SIZE));
+    self->buf = g_malloc(self->size);
+    pthread_mutex_init(&self->mutex, NULL);
+    pthread_cond_init(&self->cond, NULL);
+    pthread_cond_init(&self->drained, NULL);
+    err = pthread_create(&self->thread, NULL, pn54x_hexdump_thread_proc,
+        self);
+    if (err) {
+        GERR("Failed to start hexdump thread: %s", strerror(err));
+        pthread_cond_destroy(&self->drained);
+        pthread_cond_destroy(&self->cond);
+        pthread_mutex_destroy(&self->mutex);
+        g_free(self->buf);
+        g_free(self);
+        return NULL;
+    }
+    GDEBUG("Started hexdump thread, %u byte queue", self->size);
+    return self;
+}
+
+gboolean
+pn54x_hexdump_thread_packet(
+    Pn54xHexdumpThread* self,
+    char dir,
+    const GUtilData* chunks,
+    guint count)
+{
+    return G_LIKELY(self) && pn54x_hexdump_thread_queue(self, self->log,
+        self->level, NULL, dir, chunks, count);
+}
+
+gboolean
+pn54x_hexdump_thread_dump(
+    Pn54xHexdumpThread* self,
+    GLogModule* log,
+    int level,
+    const char* text,
+    char dir,
+    const void* data,
+    guint len)
+{
+    if (G_LIKELY(self)) {
+        GUtilData chunk;
+
+        chunk.bytes = data;
+        chunk.size = len;
+        return pn54x_hexdump_thread_queue(self, log, level, text, dir,
+            &chunk, 1);
+    }
+    return FALSE;
+}
+
+void
+pn54x_hexdump_thread_flush(
+    Pn54xHexdumpThread* self)
+{
+    if (G_LIKELY(self)) {
+        pthread_mutex_lock(&self->mutex);
+        while (self->used) {
+            pthread_cond_wait(&self->drained, &self->mutex);
+        }
+        pthread_mutex_unlock(&self->mutex);
+    }
+}
+
+void
+pn54x_hexdump_thread_stats(
+    Pn54xHexdumpThread* self,
+    Pn54xHexdumpStats* stats)
+{
+    if (G_LIKELY(self)) {
+        *stats = self->stats;
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+}
+
+void
+pn54x_hexdump_thread_stop(
+    Pn54xHexdumpThread* self)
+{
+    if (G_LIKELY(self)) {
+        pthread_mutex_lock(&self->mutex);
+        self->stopped = TRUE;
+        pthread_cond_signal(&self->cond);
+        pthread_mutex_unlock(&self->mutex);
+        pthread_join(self->thread, NULL);
+        if (self->skipped) {
+            gutil_log(self->log, self->level, "  %u packet(s) dropped",
+                self->skipped);
+        }
+        pthread_cond_destroy(&self->drained);
+        pthread_cond_destroy(&self->cond);
+        pthread_mutex_destroy(&self->mutex);
+        g_free(self->buf);
+        g_free(self);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_HEXDUMP_H
+#define PN54X_HEXDUMP_H
+
+#include <gutil_types.h>
+
+/*
+ * Hexdump of NCI traffic, one log line per 16 bytes, with runs of
+ * 0xff padding collapsed.
+ *
+ * At verbose level that's a lot of gutil_log() calls per packet, which
+ * the hexdump thread takes off the main loop. Its caller only copies
+ * the bytes into a preallocated queue, the lines are formatted and
+ * emitted by the thread, exactly as pn54x_hexdump_packet() would have
+ * done it and in the same order. If the queue is full, the packet is
+ * dropped and the next one is preceded by the number of dropped ones.
+ *
+ * Note that the log function gets called by the hexdump thread, that
+ * requires it to be thread-safe. The stock ones (stdout, syslog, glib)
+ * are.
+ */
+
+typedef struct pn54x_hexdump_thread Pn54xHexdumpThread;
+
+typedef struct pn54x_hexdump_stats {
+    guint64 packets;        /* Queued */
+    guint64 bytes;
+    guint64 dropped;        /* Didn't fit into the queue */
+} Pn54xHexdumpStats;
+
+void
+pn54x_hexdump(
+    GLogModule* log,
+    int level,
+    char dir,
+    const void* data,
+    guint len);
+
+/* "<dir> <len> byte(s)" line followed by the dump of each chunk */
+void
+pn54x_hexdump_packet(
+    GLogModule* log,
+    int level,
+    char dir,
+    const GUtilData* chunks,
+    guint count);
+
+Pn54xHexdumpThread*
+pn54x_hexdump_thread_start(
+    GLogModule* log,
+    int level,
+    guint size); /* Queue size in bytes */
+
+gboolean
+pn54x_hexdump_thread_packet(
+    Pn54xHexdumpThread* thread,
+    char dir,
+    const GUtilData* chunks,
+    guint count); /* FALSE if the packet has been dropped */
+
+/* Text line (instead of the byte count) and the dump at the given level */
+gboolean
+pn54x_hexdump_thread_dump(
+    Pn54xHexdumpThread* thread,
+    GLogModule* log,
+    int level,
+    const char* text,
+    char dir,
+    const void* data,
+    guint len); /* FALSE if it didn't fit into the queue */
+
+void
+pn54x_hexdump_thread_flush(
+    Pn54xHexdumpThread* thread); /* Waits until the queue is empty */
+
+void
+pn54x_hexdump_thread_stats(
+    Pn54xHexdumpThread* thread,
+    Pn54xHexdumpStats* stats);
+
+void
+pn54x_hexdump_thread_stop(
+    Pn54xHexdumpThread* thread); /* Logs what's still queued */
+
+#endif /* PN54X_HEXDUMP_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
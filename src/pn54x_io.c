@@ -36,27 +36,58 @@
  * any official policies, either expressed or implied.
  */
 
+#include "pn54x_framer.h"
+#include "pn54x_hexdump.h"
 #include "pn54x_io.h"
+#include "pn54x_latency.h"
 #include "pn54x_log.h"
+#include "pn54x_reader_process.h"
+#include "pn54x_reader_thread.h"
 #include "pn54x_system.h"
+#include "pn54x_trace.h"
+#include "pn54x_uring.h"
+#include "pn54x_util.h"
+#include "pn54x_writer_thread.h"
 
 #include <gutil_macros.h>
 #include <gutil_misc.h>
 
+#include <glib-unix.h>
+
 #include <errno.h>
+#include <poll.h>
 #include <unistd.h>
-#include <stdlib.h>
-#include <signal.h>
 #include <sys/ioctl.h>
-#include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/stat.h>
 
 #define PN54X_MAX_PACKET_SIZE (512)
-#define NCI_PACKET_HEADER_SIZE (3)
+#define PN54X_URING_ENTRIES (8)
+#define PN54X_WRITE_QUEUE_SIZE (4)
+#define PN54X_WRITE_RETRIES (3)
+#define PN54X_WRITE_RETRY_DELAY (1000) /* microseconds */
+
+/* Reader helper executable, see pn54x_reader_main.c */
+#ifndef PN54X_READER_HELPER
+#  define PN54X_READER_HELPER NULL
+#endif
 
 #define PN54X_SET_PWR   _IOW(0xe9, 0x01, unsigned int)
 #define PN54X_PWR_ON    (1)
 #define PN54X_PWR_OFF   (0)
+#define PN54X_PWR_FW_DL (2)
+
+typedef struct pn54x_io_write {
+    guint64 id;         /* Writer thread or io_uring request */
+    gboolean done;
+    gboolean ok;
+    guint len;
+    guint retries;
+    gint64 queued;
+    gboolean timed;     /* Passed to the latency tracker */
+    guint8 hdr[2];
+    NciHalClientFunc cb;
+    guint8* data;       /* Staging buffer */
+} Pn54xIoWrite;
 
 typedef struct pn54x_io {
     Pn54xHalIo pn54x;
@@ -67,17 +98,66 @@ typedef struct pn54x_io {
     int fd;
 
     /* Read */
-    int read_fd;
-    pid_t read_pid;
+    PN54X_IO_READ_MODE read_mode;
+    gboolean read_probed;
+    gboolean read_direct;
+    gboolean read_started;
+    guint read_ring_size;
+    Pn54xReaderSched read_sched;
+    Pn54xReaderThread* read_thread;
+    Pn54xReaderProcess* read_process;
+    Pn54xUring* uring;
+    guint64 read_op;
     void* read_tmp_buf;
-    GByteArray* read_buf;
-    GIOChannel* read_channel;
+    guint read_tmp_len;
+    Pn54xFramer read_framer;
     guint read_watch_id;
+    guint read_probe_id;
 
     /* Write */
-    guint write_id;
-    NciHalClientFunc write_cb;
-    GByteArray* write_buf;
+    PN54X_IO_WRITE_GATHER write_gather;
+    Pn54xWriterThread* writer;
+    Pn54xIoWrite* write_queue;
+    guint8* write_buf; /* Staging buffers for the write queue */
+    guint write_queue_size;
+    guint write_first;
+    guint write_count;
+    guint write_flush_id;
+    guint write_retry_id;
+    Pn54xWriterRetry write_retry;
+    guint64 write_op;
+
+    /* Write statistics */
+    guint write_total;
+    guint write_max_depth;
+    gint64 write_latency_sum;
+    gint64 write_latency_max;
+    guint write_recovered;
+    guint write_unrecovered;
+
+    /* Always on statistics */
+    Pn54xIoStats stats;
+    Pn54xLatency* latency;
+    guint latency_log_id;
+    Pn54xCapture* capture;
+    Pn54xRecorder* recorder;
+    gboolean recorder_dumped;   /* Nothing new since the last dump */
+    Pn54xHexdumpThread* hexdump;
+
+    /* Waiting for the chip to boot */
+    guint ready_timeout_id;
+    Pn54xIoReadyFunc ready_fn;
+    void* ready_data;
+
+    /* Firmware download, the state machine acts as the client */
+    Pn54xFwDownload* fw;
+    NciHalClient fw_client;
+    guint fw_timeout_id;
+    guint fw_done_id;
+    PN54X_FW_RESULT fw_result;
+    Pn54xFwStats fw_stats;
+    Pn54xIoFwFunc fw_fn;
+    void* fw_data;
 } Pn54xIo;
 
 /* pn54x_hexdump_log is a sub-module, just to turn prefix off */
@@ -90,10 +170,14 @@ GLogModule pn54x_hexdump_log = {
     .flags = GLOG_FLAG_HIDE_NAME
 };
 
+typedef enum pn54x_io_probe {
+    PN54X_IO_PROBE_POLL,        /* Driver implements poll() */
+    PN54X_IO_PROBE_NO_POLL,     /* It doesn't or non-blocking read fails */
+    PN54X_IO_PROBE_UNKNOWN      /* Couldn't tell */
+} PN54X_IO_PROBE;
+
 #define DIR_IN  '>'
 #define DIR_OUT '<'
-#define DUMP(f,args...)  gutil_log(&pn54x_hexdump_log, \
-       GLOG_LEVEL_VERBOSE, f, ##args)
 
 /*==========================================================================*
  * Implementation
@@ -101,63 +185,95 @@ GLogModule pn54x_hexdump_log = {
 
 static
 void
-pn54x_hexdump(
-    GLogModule* log,
-    int level,
+pn54x_io_dump_packet(
+    Pn54xIo* self,
     char dir,
-    const void* data,
-    int len)
+    const GUtilData* chunks,
+    guint count)
 {
-    const guint8* ptr = data;
-    gboolean empty = FALSE;
-    guint empty_len = 0, skip_count = 0;
-
-    while (len > 0) {
-        char buf[GUTIL_HEXDUMP_BUFSIZE];
-        const gboolean was_empty = empty;
-        const guint consumed = gutil_hexdump(buf, ptr, len);
-        guint i;
+    const int level = GLOG_LEVEL_VERBOSE;
+    GLogModule* log = &pn54x_hexdump_log;
 
-        /* Don't print boring ff's too many times */
-        for (i = 0, empty = TRUE; i < consumed; i++) {
-            if (ptr[i] != 0xff) {
-                empty = FALSE;
-                break;
-            }
-        }
-        len -= consumed;
-        ptr += consumed;
-        if (was_empty && empty && empty_len == consumed) {
-            skip_count++;
+    if (gutil_log_enabled(log, level)) {
+        if (self->hexdump) {
+            pn54x_hexdump_thread_packet(self->hexdump, dir, chunks, count);
         } else {
-            if (skip_count) {
-                gutil_log(log, level, "  %u line(s) skipped", skip_count);
-                skip_count = 0;
-            }
-            gutil_log(log, level, "%c %s", dir, buf);
-            dir = ' ';
+            pn54x_hexdump_packet(log, level, dir, chunks, count);
         }
-        if (empty) {
-            empty_len = consumed;
-        }
-    }
-    if (skip_count) {
-        gutil_log(log, level, "  ... %u line(s) skipped", skip_count);
     }
 }
 
 static
 void
-pn54x_dump_data(
+pn54x_io_dump_data(
+    Pn54xIo* self,
     char dir,
     const void* data,
     guint len)
 {
-    const int level = GLOG_LEVEL_VERBOSE;
-    GLogModule* log = &pn54x_hexdump_log;
+    GUtilData chunk;
 
-    if (gutil_log_enabled(log, level)) {
-        pn54x_hexdump(log, level, dir, data, len);
+    chunk.bytes = data;
+    chunk.size = len;
+    pn54x_io_dump_packet(self, dir, &chunk, 1);
+}
+
+static
+void
+pn54x_io_dump_line(
+    Pn54xIo* self,
+    GLogModule* log,
+    const char* text,
+    char dir,
+    const void* data,
+    guint len)
+{
+    const int level = GLOG_LEVEL_WARN;
+
+    /*
+     * Queued behind the verbose hexdump (if any) so that the output
+     * doesn't get mixed up, and without waiting for it.
+     */
+    if (!pn54x_hexdump_thread_dump(self->hexdump, log, level, text, dir,
+        data, len)) {
+        gutil_log(log, level, "%s", text);
+        if (len) {
+            pn54x_hexdump(log, level, dir, data, len);
+        }
+    }
+}
+
+static
+void
+pn54x_io_dump_recorder(
+    Pn54xIo* self,
+    const char* reason,
+    gboolean always)
+{
+    if (always || !self->recorder_dumped) {
+        Pn54xRecorder* recorder = self->recorder;
+        const gint64 now = g_get_monotonic_time();
+        Pn54xRecorderPacket pkt;
+        char* text;
+        guint i;
+
+        /* Logged at warning level, verbose hexdump is normally off */
+        self->recorder_dumped = TRUE;
+        text = g_strdup_printf("Last %u packet(s) before %s:",
+            pn54x_recorder_count(recorder), reason);
+        pn54x_io_dump_line(self, GLOG_MODULE_CURRENT, text, 0, NULL, 0);
+        g_free(text);
+        for (i = 0; pn54x_recorder_get(recorder, i, &pkt); i++) {
+            const char dir = pkt.out ? DIR_OUT : DIR_IN;
+
+            text = g_strdup_printf("%c %u byte(s), %d us ago%s", dir,
+                pkt.len, (int)(now - pkt.time), (pkt.size < pkt.len) ?
+                " (truncated)" : "");
+            pn54x_io_dump_line(self, &pn54x_hexdump_log, text, dir,
+                pkt.data, pkt.size);
+            g_free(text);
+        }
+        pn54x_recorder_save(recorder, reason);
     }
 }
 
@@ -177,6 +293,301 @@ pn54x_hal_io_cast(
     return G_CAST(hal_io, Pn54xIo, pn54x.hal_io);
 }
 
+static
+gboolean
+pn54x_io_write_gather(
+    Pn54xIo* self,
+    int fd)
+{
+    struct stat st;
+
+    switch (self->write_gather) {
+    case PN54X_IO_WRITE_GATHER_ON:
+        return TRUE;
+    case PN54X_IO_WRITE_GATHER_OFF:
+        return FALSE;
+    case PN54X_IO_WRITE_GATHER_AUTO:
+        break;
+    }
+
+    /*
+     * Unless the driver implements write_iter, the kernel turns writev()
+     * into a series of write() calls, one per chunk. For an I2C device
+     * that would mean several transfers per packet.
+     */
+    return fstat(fd, &st) == 0 && !S_ISCHR(st.st_mode);
+}
+
+static
+Pn54xIoWrite*
+pn54x_io_write_at(
+    Pn54xIo* self,
+    guint i)
+{
+    return self->write_queue + (self->write_first + i) %
+        self->write_queue_size;
+}
+
+static
+void
+pn54x_io_write_buf_alloc(
+    Pn54xIo* self)
+{
+    guint i;
+
+    self->write_buf = g_malloc(self->write_queue_size *
+        PN54X_MAX_PACKET_SIZE);
+    for (i = 0; i < self->write_queue_size; i++) {
+        self->write_queue[i].data = self->write_buf +
+            i * PN54X_MAX_PACKET_SIZE;
+    }
+}
+
+static
+Pn54xIoWrite*
+pn54x_io_write_find(
+    Pn54xIo* self,
+    guint64 id)
+{
+    guint i;
+
+    for (i = 0; i < self->write_count; i++) {
+        Pn54xIoWrite* entry = pn54x_io_write_at(self, i);
+
+        if (entry->id == id && !entry->done) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static
+void
+pn54x_io_write_flush(
+    Pn54xIo* self)
+{
+    /* Completions are reported in the order in which writes were queued */
+    while (self->write_count) {
+        Pn54xIoWrite* entry = self->write_queue + self->write_first;
+        const gint64 latency = g_get_monotonic_time() - entry->queued;
+        NciHalClientFunc cb = entry->cb;
+
+        if (!entry->done) {
+            break;
+        }
+
+        self->write_total++;
+        self->write_latency_sum += latency;
+        if (self->write_latency_max < latency) {
+            self->write_latency_max = latency;
+        }
+        PN54X_TRACE3(write_done, entry->ok, entry->len, latency);
+        if (entry->ok) {
+            self->stats.writes++;
+            self->stats.write_bytes += entry->len;
+        } else {
+            self->stats.write_errors++;
+        }
+        self->write_first = (self->write_first + 1) % self->write_queue_size;
+        self->write_count--;
+        if (cb) {
+            cb(self->client, entry->ok);
+        }
+    }
+}
+
+static
+gboolean
+pn54x_io_write_flush_cb(
+    gpointer user_data)
+{
+    Pn54xIo* self = user_data;
+
+    self->write_flush_id = 0;
+    pn54x_io_write_flush(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+pn54x_io_write_cancel(
+    Pn54xIo* self)
+{
+    guint i;
+
+    /* The data are still written, completions are just not reported */
+    for (i = 0; i < self->write_count; i++) {
+        Pn54xIoWrite* entry = pn54x_io_write_at(self, i);
+
+        entry->cb = NULL;
+        if (self->writer && !entry->done) {
+            pn54x_writer_thread_release(self->writer, entry->id);
+        }
+    }
+}
+
+static
+void
+pn54x_io_write_clear(
+    Pn54xIo* self)
+{
+    /* Called after the writer has been stopped */
+    if (self->write_flush_id) {
+        g_source_remove(self->write_flush_id);
+        self->write_flush_id = 0;
+    }
+    if (self->write_retry_id) {
+        g_source_remove(self->write_retry_id);
+        self->write_retry_id = 0;
+    }
+    self->write_first = self->write_count = 0;
+    if (self->write_total) {
+        GDEBUG("%u write(s), max queue depth %u, latency %d us avg, "
+            "%d us max", self->write_total, self->write_max_depth,
+            (int)(self->write_latency_sum / self->write_total),
+            (int)self->write_latency_max);
+        self->write_total = self->write_max_depth = 0;
+        self->write_latency_sum = self->write_latency_max = 0;
+    }
+    if (self->write_recovered || self->write_unrecovered) {
+        GDEBUG("%u write(s) recovered, %u not", self->write_recovered,
+            self->write_unrecovered);
+        self->write_recovered = self->write_unrecovered = 0;
+    }
+}
+
+static
+void
+pn54x_io_write_written(
+    Pn54xIo* self,
+    Pn54xIoWrite* entry,
+    gint64 time)
+{
+    if (entry->ok && entry->timed) {
+        pn54x_latency_written(self->latency, entry->hdr, time);
+    }
+}
+
+static
+void
+pn54x_io_write_done(
+    guint id,
+    gboolean ok,
+    guint retries,
+    gint64 time,
+    void* user_data)
+{
+    Pn54xIo* self = user_data;
+    Pn54xIoWrite* entry = pn54x_io_write_find(self, id);
+
+    if (retries) {
+        if (ok) {
+            self->write_recovered++;
+        } else {
+            self->write_unrecovered++;
+        }
+    }
+    if (entry) {
+        entry->done = TRUE;
+        entry->ok = ok;
+        pn54x_io_write_written(self, entry, time);
+        pn54x_io_write_flush(self);
+    }
+}
+
+static
+gboolean
+pn54x_io_write_copy(
+    Pn54xIoWrite* entry,
+    const GUtilData* chunks,
+    guint count)
+{
+    guint8* ptr = entry->data;
+    guint i;
+
+    /* Has to be copied since the write may be deferred */
+    if (entry->len > PN54X_MAX_PACKET_SIZE) {
+        GERR("Can't write %u byte(s) at once", entry->len);
+        return FALSE;
+    }
+    for (i = 0; i < count; i++) {
+        memcpy(ptr, chunks[i].bytes, chunks[i].size);
+        ptr += chunks[i].size;
+    }
+    return TRUE;
+}
+
+static
+guint
+pn54x_io_write_retry_ms(
+    Pn54xIo* self)
+{
+    return (self->write_retry.delay + 999) / 1000;
+}
+
+static
+gboolean
+pn54x_io_write_sync_retry(
+    gpointer user_data);
+
+static
+void
+pn54x_io_write_sync(
+    Pn54xIo* self)
+{
+    guint i;
+
+    /* Writes are performed in order, the one being retried holds the rest */
+    for (i = 0; i < self->write_count && !self->write_retry_id; i++) {
+        Pn54xIoWrite* entry = pn54x_io_write_at(self, i);
+
+        if (!entry->done) {
+            const gssize written = pn54x_system_write(self->fd, entry->data,
+                entry->len);
+            const int err = (written < 0) ? errno : 0;
+
+            if (err && entry->retries < self->write_retry.count &&
+                pn54x_util_write_error_transient(err)) {
+                /* Try again once the chip has woken up */
+                entry->retries++;
+                self->write_retry_id = g_timeout_add(
+                    pn54x_io_write_retry_ms(self),
+                    pn54x_io_write_sync_retry, self);
+                break;
+            }
+
+            entry->done = TRUE;
+            entry->ok = (written == (gssize)entry->len);
+            if (entry->retries) {
+                if (entry->ok) {
+                    self->write_recovered++;
+                } else {
+                    self->write_unrecovered++;
+                }
+            }
+            if (err) {
+                GERR("Error writing %s: %s", self->dev, strerror(err));
+            } else if (!entry->ok) {
+                GERR("Error writing %s: %d out of %u byte(s) written",
+                    self->dev, (int)written, entry->len);
+            }
+        }
+    }
+}
+
+static
+gboolean
+pn54x_io_write_sync_retry(
+    gpointer user_data)
+{
+    Pn54xIo* self = user_data;
+
+    self->write_retry_id = 0;
+    pn54x_io_write_sync(self);
+    pn54x_io_write_flush(self);
+    return G_SOURCE_REMOVE;
+}
+
 static
 gboolean
 pn54x_io_open(
@@ -185,6 +596,13 @@ pn54x_io_open(
     if (self->fd >= 0) {
         return TRUE;
     } else {
+        /* The paused reader must not pick up data of the new session */
+        if (self->read_process &&
+            !pn54x_reader_process_wait_paused(self->read_process)) {
+            /* Will be restarted next time */
+            pn54x_reader_process_stop(self->read_process);
+            self->read_process = NULL;
+        }
         self->fd = pn54x_system_open(self->dev);
         if (self->fd >= 0) {
             GVERBOSE("Opened %s", self->dev);
@@ -196,37 +614,70 @@ pn54x_io_open(
     }
 }
 
+static
+void
+pn54x_io_ready_clear(
+    Pn54xIo* self)
+{
+    if (self->ready_timeout_id) {
+        g_source_remove(self->ready_timeout_id);
+        self->ready_timeout_id = 0;
+    }
+    self->ready_fn = NULL;
+    self->ready_data = NULL;
+}
+
 static
 void
 pn54x_io_close(
     Pn54xIo* self)
 {
+    pn54x_io_ready_clear(self);
     if (self->read_watch_id) {
         g_source_remove(self->read_watch_id);
         self->read_watch_id = 0;
     }
-    if (self->read_channel) {
-        g_io_channel_shutdown(self->read_channel, FALSE, NULL);
-        g_io_channel_unref(self->read_channel);
-        self->read_channel = NULL;
+    if (self->read_probe_id) {
+        g_source_remove(self->read_probe_id);
+        self->read_probe_id = 0;
     }
-    if (self->read_pid) {
-        int status;
-
-        GDEBUG("Killing child %d", self->read_pid);
-        kill(self->read_pid, SIGKILL);
-        waitpid(self->read_pid, &status, 0);
-        self->read_pid = 0;
+    if (self->read_thread) {
+        pn54x_reader_thread_stop(self->read_thread);
+        self->read_thread = NULL;
+    }
+    if (self->writer) {
+        pn54x_writer_thread_stop(self->writer);
+        self->writer = NULL;
+    }
+    if (self->uring) {
+        /* Cancels pending requests before the descriptor gets closed */
+        if (self->write_op) {
+            /* The kernel may still be reading the staging buffer */
+            pn54x_uring_free_full(self->uring, g_free, self->write_buf);
+            pn54x_io_write_buf_alloc(self);
+        } else {
+            pn54x_uring_free(self->uring);
+        }
+        self->uring = NULL;
+        self->read_op = 0;
+        self->write_op = 0;
     }
-    if (self->read_fd >= 0) {
-        close(self->read_fd);
-        self->read_fd = -1;
+    pn54x_io_write_clear(self);
+    if (self->read_process &&
+        !pn54x_reader_process_pause(self->read_process)) {
+        /* Will be restarted next time */
+        pn54x_reader_process_stop(self->read_process);
+        self->read_process = NULL;
     }
     if (self->fd >= 0) {
         close(self->fd);
         self->fd = -1;
         GVERBOSE("Closed %s", self->dev);
     }
+
+    /* The client has to start us again after power-off */
+    self->read_started = FALSE;
+    self->client = NULL;
 }
 
 static
@@ -234,24 +685,54 @@ void
 pn54x_io_stop(
     Pn54xIo* self)
 {
-    self->client = NULL;
-    self->write_cb = NULL;
-    g_byte_array_set_size(self->read_buf, 0);
-    if (self->write_id) {
-        g_source_remove(self->write_id);
-        self->write_id = 0;
-    }
+    PN54X_TRACE0(reader_stop);
+    pn54x_framer_reset(&self->read_framer);
+    pn54x_io_write_cancel(self);
     pn54x_io_close(self);
 }
 
+static
+void
+pn54x_io_fw_check(
+    Pn54xIo* self);
+
+static
+void
+pn54x_io_fw_cancel(
+    Pn54xIo* self);
+
 static
 void
 pn54x_io_finalize(
     Pn54xIo* self)
 {
+    pn54x_io_fw_cancel(self);
+    pn54x_reader_process_stop(self->read_process);
+    self->read_process = NULL;
     pn54x_io_stop(self);
-    g_byte_array_free(self->read_buf, TRUE);
-    g_byte_array_free(self->write_buf, TRUE);
+    if (self->latency_log_id) {
+        g_source_remove(self->latency_log_id);
+    }
+    pn54x_latency_log(self->latency, FALSE);
+    pn54x_latency_free(self->latency);
+    if (self->capture) {
+        const Pn54xCaptureStats* stats = pn54x_capture_stats(self->capture);
+
+        GDEBUG("Captured %u packet(s), %u dropped, %u rotation(s)",
+            (guint)stats->packets, (guint)stats->dropped, stats->rotations);
+        pn54x_capture_free(self->capture);
+    }
+    pn54x_recorder_free(self->recorder);
+    if (self->hexdump) {
+        Pn54xHexdumpStats stats;
+
+        pn54x_hexdump_thread_stats(self->hexdump, &stats);
+        pn54x_hexdump_thread_stop(self->hexdump);
+        GDEBUG("Hexdumped %u packet(s), %u dropped", (guint)stats.packets,
+            (guint)stats.dropped);
+    }
+    g_free(self->write_queue);
+    g_free(self->write_buf);
     g_free(self->read_tmp_buf);
     g_free(self->dev);
     g_free(self);
@@ -269,146 +750,513 @@ pn54x_io_unref(
 }
 
 static
-guint
-pn54x_io_read_packet_size(
-    const void* buf,
-    gsize size)
+void
+pn54x_io_ready_done(
+    Pn54xIo* self,
+    gboolean signaled)
 {
-    /* Octet 2 is the payload length in both control and data packets */
-    if (size >= NCI_PACKET_HEADER_SIZE) {
-        const guint8* pkt = buf;
-        const guint max_payload = size - NCI_PACKET_HEADER_SIZE;
-        const guint payload_len = pkt[2];
+    Pn54xIoReadyFunc fn = self->ready_fn;
+    void* user_data = self->ready_data;
 
-        if (payload_len <= max_payload) {
-            return NCI_PACKET_HEADER_SIZE + payload_len;
-        }
-    }
-    return 0;
+    pn54x_io_ready_clear(self);
+    fn(&self->pn54x, signaled, user_data);
 }
 
 static
 void
-pn54x_io_read_handle(
-    Pn54xIo* self,
-    const void* buf,
-    gsize size)
+pn54x_io_read_error(
+    Pn54xIo* self)
 {
     NciHalClient* client = self->client;
-    GByteArray* read_buf = self->read_buf;
-    gsize nbytes, pktsiz;
-    const guint8* ptr;
-
-    DUMP("%c %u byte(s)", DIR_IN, (guint)size);
-    pn54x_dump_data(DIR_IN, buf, size);
-
-    if (read_buf->len) {
-        /* Something left from the previous read */
-        g_byte_array_append(read_buf, buf, size);
-        ptr = read_buf->data;
-        nbytes = read_buf->len;
-    } else {
-        ptr = buf;
-        nbytes = size;
 
-        /* NCI packet can't start with 0xff */
-        while (nbytes > 0 && *ptr == 0xff) {
-            ptr++;
-            nbytes--;
-        }
+    pn54x_io_dump_recorder(self, "read error", FALSE);
+    if (client) {
+        client->fn->error(client);
+    } else if (self->ready_fn) {
+        /* NCI has to deal with the error, the client will restart us */
+        pn54x_io_close(self);
+        pn54x_io_ready_done(self, TRUE);
     }
+}
 
-    while ((pktsiz = pn54x_io_read_packet_size(ptr, nbytes)) > 0) {
-        client->fn->read(client, ptr, pktsiz);
-        ptr += pktsiz;
-        nbytes -= pktsiz;
-
-        /* Driver fills unused part of the buffer with 0xff's */
-        while (nbytes > 0 && *ptr == 0xff) {
-            ptr++;
-            nbytes--;
-        }
+static
+void
+pn54x_io_read_packet(
+    const void* pkt,
+    guint len,
+    void* user_data)
+{
+    Pn54xIo* self = user_data;
+    NciHalClient* client = self->client;
+    const gint64 now = g_get_monotonic_time();
+    GUtilData data;
+
+    data.bytes = pkt;
+    data.size = len;
+    pn54x_latency_received(self->latency, pkt, now);
+    pn54x_recorder_record(self->recorder, FALSE, now, &data, 1);
+    self->recorder_dumped = FALSE;
+    if (self->capture) {
+        pn54x_capture_packet(self->capture, PN54X_CAPTURE_IN, now, &data, 1);
     }
-
-    if (!nbytes) {
-        g_byte_array_set_size(read_buf, 0);
-    } else if (read_buf->len) {
-        /* Erase consumed data from read_buf */
-        g_byte_array_remove_range(read_buf, 0, read_buf->len - nbytes);
+    PN54X_TRACE3(packet, data.bytes[0], data.bytes[1], len);
+    if (client) {
+        client->fn->read(client, pkt, len);
+    } else if (len >= 2 && data.bytes[0] == 0x60 &&
+        (data.bytes[1] & 0x3f) == 0x00) {
+        GDEBUG("CORE_RESET_NTF");
     } else {
-        /* Move unused data to read_buf */
-        g_byte_array_append(read_buf, ptr, nbytes);
+        GDEBUG("%u byte(s) received while booting", len);
+    }
+
+    /* Anything but padding means that the chip has booted */
+    if (self->ready_fn) {
+        pn54x_io_ready_done(self, TRUE);
     }
 }
 
+
 static
-gboolean
-pn54x_io_read_chars(
-    GIOChannel* channel,
-    void* buf,
-    gsize count,
-    gsize* bytes_read)
-{
-    GError* error = NULL;
-    GIOStatus status = g_io_channel_read_chars(channel, buf, count,
-        bytes_read, &error);
-
-    if (error) {
-        GERR("Read failed: %s", error->message);
-        g_error_free(error);
-        return FALSE;
-    } else if (status == G_IO_STATUS_EOF) {
-        GDEBUG("End of stream");
-        return FALSE;
+void
+pn54x_io_read_handle(
+    Pn54xIo* self,
+    const void* buf,
+    gsize size)
+{
+    PN54X_TRACE1(read, size);
+    self->stats.reads++;
+    self->stats.read_bytes += size;
+    pn54x_io_dump_data(self, DIR_IN, buf, size);
+    if (self->fw) {
+        /* DL frames don't look like NCI packets */
+        pn54x_fw_download_input(self->fw, buf, size);
+        pn54x_io_fw_check(self);
     } else {
-        return TRUE;
+        pn54x_framer_input(&self->read_framer, buf, size,
+            pn54x_io_read_packet, self);
     }
 }
 
 static
 gboolean
-pn54x_io_read_callback(
-    GIOChannel* channel,
+pn54x_io_direct_read_callback(
+    gint fd,
     GIOCondition condition,
     gpointer user_data)
 {
     Pn54xIo* self = user_data;
-    NciHalClient* client;
 
     if (condition & G_IO_IN) {
-        gsize bytes_read;
+        const gssize len = read(fd, self->read_tmp_buf, PN54X_MAX_PACKET_SIZE);
 
-        if (pn54x_io_read_chars(channel, self->read_tmp_buf,
-            PN54X_MAX_PACKET_SIZE, &bytes_read)) {
-            pn54x_io_read_handle(self, self->read_tmp_buf, bytes_read);
+        if (len > 0) {
+            pn54x_io_read_handle(self, self->read_tmp_buf, len);
             return G_SOURCE_CONTINUE;
+        } else if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+            /* Spurious wakeup */
+            return G_SOURCE_CONTINUE;
+        } else if (len < 0) {
+            GERR("Read failed: %s", strerror(errno));
+        } else {
+            GDEBUG("End of stream");
         }
     } else {
         GERR("Read condition 0x%04X", condition);
     }
 
-    client = self->client;
     self->read_watch_id = 0;
-    client->fn->error(client);
+    pn54x_io_read_error(self);
     return G_SOURCE_REMOVE;
 }
 
+static
+void
+pn54x_io_direct_watch(
+    Pn54xIo* self)
+{
+    self->read_watch_id = g_unix_fd_add(self->fd,
+        G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+        pn54x_io_direct_read_callback, self);
+}
+
 static
 gboolean
-pn54x_hal_io_write_complete(
-    gpointer data)
+pn54x_io_probe_data(
+    gpointer user_data)
 {
-    Pn54xIo* self = data;
-    NciHalClientFunc cb = self->write_cb;
+    Pn54xIo* self = user_data;
 
-    GASSERT(self->write_id);
-    self->write_id = 0;
-    self->write_cb = NULL;
-    cb(self->client, TRUE);
+    /*
+     * Data picked up by pn54x_io_direct_probe() have to be handled
+     * before anything else, that's why the direct watch is added only
+     * now. The reader thread delivers its data at default priority,
+     * i.e. after this callback.
+     */
+    self->read_probe_id = 0;
+    if (!self->read_thread) {
+        pn54x_io_direct_watch(self);
+    }
+    pn54x_io_read_handle(self, self->read_tmp_buf, self->read_tmp_len);
     return G_SOURCE_REMOVE;
 }
 
-/*==========================================================================*
+static
+void
+pn54x_io_probe_data_later(
+    Pn54xIo* self)
+{
+    self->read_probe_id = g_idle_add_full(G_PRIORITY_HIGH,
+        pn54x_io_probe_data, self, NULL);
+}
+
+static
+gboolean
+pn54x_io_readable(
+    Pn54xIo* self)
+{
+    struct pollfd pfd;
+
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = self->fd;
+    pfd.events = POLLIN;
+    return pn54x_system_poll(&pfd, 1, 0) != 0;
+}
+
+static
+PN54X_IO_PROBE
+pn54x_io_direct_probe(
+    Pn54xIo* self)
+{
+    /*
+     * If the driver implements poll() and the descriptor is not readable
+     * right away, we are all set. If poll() isn't implemented, the kernel
+     * reports the descriptor as always readable and non-blocking read has
+     * to tell whether there's really something to read. Without any data,
+     * it fails with EAGAIN (if O_NONBLOCK is honored at all) and we have
+     * to fall back to blocking reads.
+     *
+     * If there are data (e.g. CORE_RESET_NTF right after power-on), the
+     * descriptor must become non-readable once they have been consumed,
+     * otherwise we can't tell real poll() from the default one.
+     */
+    self->read_tmp_len = 0;
+    if (!g_unix_set_fd_nonblocking(self->fd, TRUE, NULL)) {
+        GDEBUG("Failed to make %s non-blocking", self->dev);
+        return PN54X_IO_PROBE_NO_POLL;
+    }
+
+    if (!pn54x_io_readable(self)) {
+        GDEBUG("%s supports poll()", self->dev);
+        return PN54X_IO_PROBE_POLL;
+    } else {
+        const gssize len = read(self->fd, self->read_tmp_buf,
+            PN54X_MAX_PACKET_SIZE);
+
+        if (len > 0) {
+            GDEBUG("%s has %d byte(s) pending", self->dev, (int)len);
+            self->read_tmp_len = len;
+            if (!pn54x_io_readable(self)) {
+                GDEBUG("%s supports poll()", self->dev);
+                return PN54X_IO_PROBE_POLL;
+            }
+            GDEBUG("%s is still readable, can't tell if it supports poll()",
+                self->dev);
+            g_unix_set_fd_nonblocking(self->fd, FALSE, NULL);
+            return PN54X_IO_PROBE_UNKNOWN;
+        } else if (len < 0 && errno == EAGAIN) {
+            GDEBUG("%s doesn't support poll()", self->dev);
+        } else {
+            GDEBUG("%s doesn't support non-blocking read", self->dev);
+        }
+    }
+    g_unix_set_fd_nonblocking(self->fd, FALSE, NULL);
+    return PN54X_IO_PROBE_NO_POLL;
+}
+
+static
+void
+pn54x_io_start_direct(
+    Pn54xIo* self)
+{
+    if (self->read_tmp_len) {
+        pn54x_io_probe_data_later(self);
+    } else {
+        pn54x_io_direct_watch(self);
+    }
+    GDEBUG("Reading %s directly", self->dev);
+}
+
+static
+void
+pn54x_io_reader_data(
+    const void* data,
+    guint len,
+    void* user_data)
+{
+    pn54x_io_read_handle((Pn54xIo*)user_data, data, len);
+}
+
+static
+void
+pn54x_io_reader_error(
+    void* user_data)
+{
+    pn54x_io_read_error((Pn54xIo*)user_data);
+}
+
+static
+gboolean
+pn54x_io_start_thread(
+    Pn54xIo* self)
+{
+    self->read_thread = pn54x_reader_thread_start(self->fd,
+        self->read_ring_size, PN54X_MAX_PACKET_SIZE, &self->read_sched,
+        pn54x_io_reader_data, pn54x_io_reader_error, self);
+    if (self->read_thread) {
+        /* Inconclusive probe may have picked up some data */
+        if (self->read_tmp_len) {
+            pn54x_io_probe_data_later(self);
+        }
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static
+gboolean
+pn54x_io_start_process(
+    Pn54xIo* self)
+{
+    /* The process survives power cycles, unless something went wrong */
+    if (self->read_process) {
+        if (pn54x_reader_process_resume(self->read_process, self->fd)) {
+            return TRUE;
+        }
+        pn54x_reader_process_stop(self->read_process);
+    }
+    self->read_process = pn54x_reader_process_start(self->fd,
+        self->read_ring_size, PN54X_MAX_PACKET_SIZE, PN54X_READER_HELPER,
+        &self->read_sched, pn54x_io_reader_data, pn54x_io_reader_error,
+        self);
+    return self->read_process != NULL;
+}
+
+static
+gboolean
+pn54x_io_uring_submit_read(
+    Pn54xIo* self);
+
+static
+void
+pn54x_io_uring_read_done(
+    const void* data,
+    int result,
+    void* user_data)
+{
+    Pn54xIo* self = user_data;
+
+    self->read_op = 0;
+    if (result > 0) {
+        pn54x_io_read_handle(self, data, result);
+        /* The client may have stopped us */
+        if (!self->uring || pn54x_io_uring_submit_read(self)) {
+            return;
+        }
+    } else if (result == -EINTR || result == -EAGAIN) {
+        if (pn54x_io_uring_submit_read(self)) {
+            return;
+        }
+    } else if (result < 0) {
+        GERR("Read failed: %s", strerror(-result));
+    } else {
+        GDEBUG("End of stream");
+    }
+
+    pn54x_io_read_error(self);
+}
+
+static
+gboolean
+pn54x_io_uring_submit_read(
+    Pn54xIo* self)
+{
+    self->read_op = pn54x_uring_read(self->uring, self->fd,
+        PN54X_MAX_PACKET_SIZE, pn54x_io_uring_read_done, self);
+    return self->read_op != 0;
+}
+
+static
+void
+pn54x_io_uring_write_done(
+    const void* data,
+    int result,
+    void* user_data);
+
+static
+void
+pn54x_io_uring_submit_write(
+    Pn54xIo* self)
+{
+    guint i;
+
+    /* Writes are submitted one by one to keep them in order */
+    for (i = 0; i < self->write_count && !self->write_op &&
+        !self->write_retry_id; i++) {
+        Pn54xIoWrite* entry = pn54x_io_write_at(self, i);
+
+        if (!entry->done) {
+            self->write_op = entry->id = pn54x_uring_write(self->uring,
+                self->fd, entry->data, entry->len,
+                pn54x_io_uring_write_done, self);
+            if (!self->write_op) {
+                entry->done = TRUE;
+                entry->ok = FALSE;
+            }
+        }
+    }
+}
+
+static
+gboolean
+pn54x_io_uring_write_retry(
+    gpointer user_data)
+{
+    Pn54xIo* self = user_data;
+
+    self->write_retry_id = 0;
+    pn54x_io_uring_submit_write(self);
+    pn54x_io_write_flush(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+pn54x_io_uring_write_done(
+    const void* data,
+    int result,
+    void* user_data)
+{
+    Pn54xIo* self = user_data;
+    Pn54xIoWrite* entry = pn54x_io_write_find(self, self->write_op);
+
+    self->write_op = 0;
+    if (entry && result < 0 && entry->retries < self->write_retry.count &&
+        pn54x_util_write_error_transient(-result)) {
+        /* Resubmit the same write once the chip has woken up */
+        entry->id = 0;
+        entry->retries++;
+        self->write_retry_id = g_timeout_add(pn54x_io_write_retry_ms(self),
+            pn54x_io_uring_write_retry, self);
+        return;
+    }
+    if (entry) {
+        entry->done = TRUE;
+        entry->ok = (result == (int)entry->len);
+        pn54x_io_write_written(self, entry, g_get_monotonic_time());
+        if (entry->retries) {
+            if (entry->ok) {
+                self->write_recovered++;
+            } else {
+                self->write_unrecovered++;
+            }
+        }
+        if (result < 0) {
+            GERR("Error writing %s: %s", self->dev, strerror(-result));
+        } else if (!entry->ok) {
+            GERR("Error writing %s: %d out of %u byte(s) written",
+                self->dev, result, entry->len);
+        }
+    }
+    pn54x_io_uring_submit_write(self);
+    pn54x_io_write_flush(self);
+}
+
+static
+gboolean
+pn54x_io_start_uring(
+    Pn54xIo* self)
+{
+    self->uring = pn54x_uring_new(PN54X_URING_ENTRIES);
+    if (self->uring) {
+        if (pn54x_io_uring_submit_read(self)) {
+            GDEBUG("Reading %s with io_uring", self->dev);
+            return TRUE;
+        }
+        pn54x_uring_free(self->uring);
+        self->uring = NULL;
+    }
+    return FALSE;
+}
+
+static
+gboolean
+pn54x_io_start_reader_mode(
+    Pn54xIo* self)
+{
+    PN54X_IO_READ_MODE mode = self->read_mode;
+
+    self->read_tmp_len = 0;
+    if (mode == PN54X_IO_READ_AUTO) {
+        /* Probe the driver once, pick up the data if there are any */
+        if (!self->read_probed) {
+            const PN54X_IO_PROBE probe = pn54x_io_direct_probe(self);
+
+            /* Inconclusive probe is repeated next time */
+            if (probe != PN54X_IO_PROBE_UNKNOWN) {
+                self->read_probed = TRUE;
+                self->read_direct = (probe == PN54X_IO_PROBE_POLL);
+            }
+            mode = (probe == PN54X_IO_PROBE_POLL) ?
+                PN54X_IO_READ_DIRECT : PN54X_IO_READ_THREAD;
+        } else if (self->read_direct) {
+            g_unix_set_fd_nonblocking(self->fd, TRUE, NULL);
+            mode = PN54X_IO_READ_DIRECT;
+        } else {
+            mode = PN54X_IO_READ_THREAD;
+        }
+    } else if (mode == PN54X_IO_READ_DIRECT) {
+        g_unix_set_fd_nonblocking(self->fd, TRUE, NULL);
+    }
+
+    switch (mode) {
+    case PN54X_IO_READ_DIRECT:
+        pn54x_io_start_direct(self);
+        PN54X_TRACE2(reader_start, PN54X_IO_READ_DIRECT, self->fd);
+        return TRUE;
+    case PN54X_IO_READ_PROCESS:
+        if (pn54x_io_start_process(self)) {
+            PN54X_TRACE2(reader_start, PN54X_IO_READ_PROCESS, self->fd);
+            return TRUE;
+        }
+        break;
+    case PN54X_IO_READ_URING:
+        if (pn54x_io_start_uring(self)) {
+            PN54X_TRACE2(reader_start, PN54X_IO_READ_URING, self->fd);
+            return TRUE;
+        }
+        GDEBUG("Falling back to the reader thread");
+        /* fallthrough */
+    case PN54X_IO_READ_THREAD:
+    case PN54X_IO_READ_AUTO:
+        if (pn54x_io_start_thread(self)) {
+            PN54X_TRACE2(reader_start, PN54X_IO_READ_THREAD, self->fd);
+            return TRUE;
+        }
+        break;
+    }
+    return FALSE;
+}
+
+static
+gboolean
+pn54x_io_start_reader(
+    Pn54xIo* self)
+{
+    self->read_started = pn54x_io_start_reader_mode(self);
+    return self->read_started;
+}
+
+/*==========================================================================*
  * NFC HAL I/O
  *==========================================================================*/
 
@@ -420,52 +1268,13 @@ pn54x_hal_io_start(
 {
     Pn54xIo* self = pn54x_hal_io_cast(hal_io);
 
-    GASSERT(!self->read_pid);
-    if (pn54x_io_open(self)) {
-        int fd[2];
-
-        if (pipe(fd) == 0) {
-            /*
-             * The driver is primitive, read is blocking, we can't cancel
-             * the read - the only thing we can do is to perform the read
-             * in a separate process and kill it when we no longer need it.
-             */
-            self->client = client;
-            self->read_pid = fork();
-            if (self->read_pid > 0) {
-                close(fd[1]);
-                self->read_fd = fd[0];
-                self->read_channel = g_io_channel_unix_new(self->read_fd);
-                if (self->read_channel) {
-                    g_io_channel_set_flags(self->read_channel,
-                        G_IO_FLAG_NONBLOCK, NULL);
-                    g_io_channel_set_encoding(self->read_channel, NULL, NULL);
-                    g_io_channel_set_buffered(self->read_channel, FALSE);
-                    self->read_watch_id = g_io_add_watch(self->read_channel,
-                        G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
-                        pn54x_io_read_callback, self);
-                    GDEBUG("Started read process %d", self->read_pid);
-                    return TRUE;
-                }
-            } else if (self->read_pid == 0) {
-                gssize size;
-                close(fd[0]);
-                GDEBUG("Child %d is running", getpid());
-                while (((size = read(self->fd, self->read_tmp_buf,
-                    PN54X_MAX_PACKET_SIZE)) > 0)) {
-                    GVERBOSE("%d bytes read", (int)size);
-                    if (write(fd[1], self->read_tmp_buf, size) < size) {
-                        break;
-                    }
-                }
-                /* Normally, it never exits. It gets killed by the parent. */
-                GERR("Child exiting: %s", strerror(errno));
-                exit(0);
-            } else {
-                GERR("Failed to start read process: %s", strerror(errno));
-                self->read_pid = 0;
-                self->client = NULL;
-            }
+    if (self->fw) {
+        GWARN("Firmware download is in progress");
+    } else if (pn54x_io_open(self)) {
+        /* The reader may have been started by pn54x_io_wait_ready() */
+        self->client = client;
+        if (self->read_started || pn54x_io_start_reader(self)) {
+            return TRUE;
         }
         pn54x_io_close(self);
     }
@@ -482,62 +1291,307 @@ pn54x_hal_io_stop(
 
 static
 gboolean
-pn54x_hal_io_write(
-    NciHalIo* hal_io,
+pn54x_io_write_submit(
+    Pn54xIo* self,
     const GUtilData* chunks,
     guint count,
     NciHalClientFunc callback)
 {
-    Pn54xIo* self = pn54x_hal_io_cast(hal_io);
-
-    if (pn54x_io_open(self)) {
-        const guint8* data = NULL;
-        gssize len = 0;
+    if (self->write_count == self->write_queue_size) {
+        GERR("Too many writes in progress");
+    } else if (pn54x_io_open(self)) {
+        Pn54xIoWrite* entry = pn54x_io_write_at(self, self->write_count);
+        guint i, len = 0;
+
+        for (i = 0; i < count; i++) {
+            len += chunks[i].size;
+        }
 
-        GASSERT(!self->write_cb);
-        GASSERT(!self->write_id);
+        entry->id = 0;
+        entry->done = FALSE;
+        entry->ok = FALSE;
+        entry->len = len;
+        entry->retries = 0;
+        entry->queued = g_get_monotonic_time();
+        entry->timed = FALSE;
+        entry->cb = callback;
 
-        if (count == 1) {
-            data = chunks->bytes;
-            len = chunks->size;
-        } else {
-            guint i;
+        if (!self->uring && !self->writer) {
+            /*
+             * Some drivers can only be opened once, the writer gets
+             * a duplicate. It shares O_NONBLOCK set for the direct
+             * reader, the writer waits for POLLOUT if the write fails
+             * with EAGAIN.
+             */
+            const int fd = pn54x_system_dup(self->fd);
 
-            g_byte_array_set_size(self->write_buf, 0);
-            for (i = 0; i < count; i++) {
-                g_byte_array_append(self->write_buf, chunks[i].bytes,
-                    chunks[i].size);
+            if (fd >= 0) {
+                self->writer = pn54x_writer_thread_start(fd,
+                    self->write_queue_size, PN54X_MAX_PACKET_SIZE,
+                    pn54x_io_write_gather(self, fd), &self->write_retry,
+                    pn54x_io_write_done, self);
+            } else {
+                GERR("Failed to duplicate descriptor: %s", strerror(errno));
             }
-            data = self->write_buf->data;
-            len = self->write_buf->len;
         }
 
-        if (write(self->fd, data, len) == len) {
-            DUMP("%c %u byte(s)", DIR_OUT, (guint)len);
-            pn54x_dump_data(DIR_OUT, data, len);
-            if (callback) {
-                self->write_cb = callback;
-                self->write_id = g_idle_add(pn54x_hal_io_write_complete, self);
+        if (self->writer) {
+            entry->id = pn54x_writer_thread_write(self->writer,
+                chunks, count, !callback);
+            if (!entry->id) {
+                return FALSE;
             }
-            return TRUE;
+            self->write_count++;
+        } else {
+            if (!pn54x_io_write_copy(entry, chunks, count)) {
+                return FALSE;
+            }
+            self->write_count++;
+            if (self->uring) {
+                pn54x_io_uring_submit_write(self);
+            } else {
+                /* Fall back to writing from the main thread */
+                pn54x_io_write_sync(self);
+            }
+            if (entry->done && !self->write_flush_id) {
+                self->write_flush_id = g_idle_add_full(G_PRIORITY_HIGH,
+                    pn54x_io_write_flush_cb, self, NULL);
+            }
+        }
+
+        if (self->write_max_depth < self->write_count) {
+            self->write_max_depth = self->write_count;
         }
-        GERR("Error writing %s: %s", self->dev, strerror(errno));
+        pn54x_io_dump_packet(self, DIR_OUT, chunks, count);
+        return TRUE;
     }
     return FALSE;
 }
 
+static
+gboolean
+pn54x_io_chunks_header(
+    const GUtilData* chunks,
+    guint count,
+    guint8* hdr)
+{
+    guint i, n = 0;
+
+    /* The header is normally in the first chunk, but who knows */
+    for (i = 0; i < count && n < 2; i++) {
+        const guint8* ptr = chunks[i].bytes;
+        const guint8* end = ptr + chunks[i].size;
+
+        while (ptr < end && n < 2) {
+            hdr[n++] = *ptr++;
+        }
+    }
+    return n == 2;
+}
+
+static
+gboolean
+pn54x_hal_io_write(
+    NciHalIo* hal_io,
+    const GUtilData* chunks,
+    guint count,
+    NciHalClientFunc callback)
+{
+    Pn54xIo* self = pn54x_hal_io_cast(hal_io);
+
+    if (pn54x_io_write_submit(self, chunks, count, callback)) {
+        const gint64 now = g_get_monotonic_time();
+        guint8 hdr[2];
+
+        if (pn54x_io_chunks_header(chunks, count, hdr)) {
+            Pn54xIoWrite* entry = pn54x_io_write_at(self,
+                self->write_count - 1);
+
+            /* The response time is corrected once it has been written */
+            entry->timed = TRUE;
+            memcpy(entry->hdr, hdr, sizeof(entry->hdr));
+            pn54x_latency_sent(self->latency, hdr, now);
+            PN54X_TRACE3(write_submit, hdr[0], hdr[1], entry->len);
+        }
+        pn54x_recorder_record(self->recorder, TRUE, now, chunks, count);
+        self->recorder_dumped = FALSE;
+        if (self->capture) {
+            pn54x_capture_packet(self->capture, PN54X_CAPTURE_OUT, now,
+                chunks, count);
+        }
+        return TRUE;
+    } else {
+        /* Completed writes are counted by pn54x_io_write_flush() */
+        self->stats.write_errors++;
+        return FALSE;
+    }
+}
+
 static
 void
 pn54x_hal_io_cancel_write(
     NciHalIo* hal_io)
 {
-    Pn54xIo* self = pn54x_hal_io_cast(hal_io);
+    pn54x_io_write_cancel(pn54x_hal_io_cast(hal_io));
+}
+
+/*==========================================================================*
+ * Firmware download
+ *==========================================================================*/
+
+static
+void
+pn54x_io_fw_stop(
+    Pn54xIo* self)
+{
+    if (self->fw_timeout_id) {
+        g_source_remove(self->fw_timeout_id);
+        self->fw_timeout_id = 0;
+    }
+    pn54x_io_write_cancel(self);
+    if (self->fd >= 0) {
+        /* Turning power off also leaves download mode */
+        pn54x_io_set_power(&self->pn54x, FALSE);
+        pn54x_io_close(self);
+    }
+
+    /* Released writes don't refer to the frame buffers anymore */
+    pn54x_fw_download_free(self->fw);
+    self->fw = NULL;
+}
+
+static
+gboolean
+pn54x_io_fw_done(
+    gpointer user_data)
+{
+    Pn54xIo* self = user_data;
+    Pn54xIoFwFunc fn = self->fw_fn;
+    void* fn_data = self->fw_data;
+
+    self->fw_done_id = 0;
+    self->fw_fn = NULL;
+    self->fw_data = NULL;
+    fn(&self->pn54x, self->fw_result, &self->fw_stats, fn_data);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+pn54x_io_fw_finish(
+    Pn54xIo* self)
+{
+    self->fw_result = pn54x_fw_download_result(self->fw);
+    self->fw_stats = *pn54x_fw_download_stats(self->fw);
+    pn54x_io_fw_stop(self);
+
+    /*
+     * We may be deep inside the reader callback, and the completion
+     * callback is likely to power the chip on and restart the reader.
+     */
+    self->fw_done_id = g_idle_add(pn54x_io_fw_done, self);
+}
+
+static
+void
+pn54x_io_fw_abort(
+    Pn54xIo* self)
+{
+    pn54x_fw_download_abort(self->fw);
+    pn54x_io_fw_finish(self);
+}
+
+static
+gboolean
+pn54x_io_fw_timeout(
+    gpointer user_data)
+{
+    Pn54xIo* self = user_data;
 
-    self->write_cb = NULL;
-    if (self->write_id) {
-        g_source_remove(self->write_id);
-        self->write_id = 0;
+    GERR("DL response timeout");
+    self->fw_timeout_id = 0;
+    pn54x_io_fw_abort(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+pn54x_io_fw_written(
+    NciHalClient* client,
+    gboolean ok)
+{
+    Pn54xIo* self = G_CAST(client, Pn54xIo, fw_client);
+
+    if (!ok && self->fw) {
+        GERR("DL frame write failed");
+        pn54x_io_fw_abort(self);
+    }
+}
+
+static
+void
+pn54x_io_fw_check(
+    Pn54xIo* self)
+{
+    Pn54xFwDownload* fw = self->fw;
+
+    if (pn54x_fw_download_result(fw) == PN54X_FW_BUSY) {
+        GUtilData frame;
+        guint len;
+
+        /* Nothing to send while waiting for the (rest of) response */
+        frame.bytes = pn54x_fw_download_output(fw, &len);
+        if (frame.bytes) {
+            frame.size = len;
+            if (pn54x_io_write_submit(self, &frame, 1, pn54x_io_fw_written)) {
+                pn54x_fw_download_sent(fw);
+                if (self->fw_timeout_id) {
+                    g_source_remove(self->fw_timeout_id);
+                }
+                self->fw_timeout_id = g_timeout_add(
+                    pn54x_fw_download_timeout(fw), pn54x_io_fw_timeout, self);
+            } else {
+                pn54x_io_fw_abort(self);
+            }
+        }
+    } else {
+        pn54x_io_fw_finish(self);
+    }
+}
+
+static
+void
+pn54x_io_fw_read_error(
+    NciHalClient* client)
+{
+    pn54x_io_fw_abort(G_CAST(client, Pn54xIo, fw_client));
+}
+
+static
+void
+pn54x_io_fw_read(
+    NciHalClient* client,
+    const void* data,
+    guint len)
+{
+    /* Not used, DL data bypass the framer */
+}
+
+static
+void
+pn54x_io_fw_cancel(
+    Pn54xIo* self)
+{
+    if (self->fw) {
+        GDEBUG("Firmware download cancelled");
+        pn54x_io_fw_stop(self);
     }
+    if (self->fw_done_id) {
+        g_source_remove(self->fw_done_id);
+        self->fw_done_id = 0;
+    }
+    self->fw_fn = NULL;
+    self->fw_data = NULL;
 }
 
 /*==========================================================================*
@@ -547,6 +1601,25 @@ pn54x_hal_io_cancel_write(
 Pn54xHalIo*
 pn54x_io_new(
     const char* dev)
+{
+    return pn54x_io_new_full(dev, NULL);
+}
+
+static
+gboolean
+pn54x_io_latency_log(
+    gpointer user_data)
+{
+    Pn54xIo* self = user_data;
+
+    pn54x_latency_log(self->latency, FALSE);
+    return G_SOURCE_CONTINUE;
+}
+
+Pn54xHalIo*
+pn54x_io_new_full(
+    const char* dev,
+    const Pn54xIoConfig* config)
 {
     if (G_LIKELY(dev)) {
         static const NciHalIoFunctions pn54x_hal_io_functions = {
@@ -555,17 +1628,56 @@ pn54x_io_new(
             .write = pn54x_hal_io_write,
             .cancel_write = pn54x_hal_io_cancel_write
         };
+        static const NciHalClientFunctions pn54x_io_fw_client_fn = {
+            .error = pn54x_io_fw_read_error,
+            .read = pn54x_io_fw_read
+        };
 
         Pn54xIo* self = g_new0(Pn54xIo, 1);
         Pn54xHalIo* io = &self->pn54x;
 
         g_atomic_int_set(&self->refcount, 1);
         self->fd = -1;
-        self->read_fd = -1;
+        if (config) {
+            self->read_mode = config->read_mode;
+            self->read_ring_size = config->read_ring_size;
+            self->read_sched = config->read_sched;
+            self->write_gather = config->write_gather;
+            self->write_queue_size = config->write_queue_size;
+            if (config->write_retries > 0) {
+                self->write_retry.count = config->write_retries;
+            } else if (!config->write_retries) {
+                self->write_retry.count = PN54X_WRITE_RETRIES;
+            }
+            self->write_retry.delay = config->write_retry_delay;
+        } else {
+            self->write_retry.count = PN54X_WRITE_RETRIES;
+        }
         self->context = g_main_context_default();
+        self->fw_client.fn = &pn54x_io_fw_client_fn;
         self->read_tmp_buf = g_malloc(PN54X_MAX_PACKET_SIZE);
-        self->read_buf = g_byte_array_new();
-        self->write_buf = g_byte_array_new();
+        if (!self->write_retry.delay) {
+            self->write_retry.delay = PN54X_WRITE_RETRY_DELAY;
+        }
+        if (!self->write_queue_size) {
+            self->write_queue_size = PN54X_WRITE_QUEUE_SIZE;
+        }
+        self->latency = pn54x_latency_new();
+        self->recorder = pn54x_recorder_new(config ? &config->recorder : NULL);
+        if (config) {
+            if (config->latency_log_interval) {
+                self->latency_log_id = g_timeout_add_seconds(
+                    config->latency_log_interval, pn54x_io_latency_log, self);
+            }
+            self->capture = pn54x_capture_new(&config->capture);
+            if (config->hexdump_queue_size) {
+                self->hexdump = pn54x_hexdump_thread_start(
+                    &pn54x_hexdump_log, GLOG_LEVEL_VERBOSE,
+                    config->hexdump_queue_size);
+            }
+        }
+        self->write_queue = g_new0(Pn54xIoWrite, self->write_queue_size);
+        pn54x_io_write_buf_alloc(self);
         io->hal_io.fn = &pn54x_hal_io_functions;
         io->dev = self->dev = g_strdup(dev);
 
@@ -597,8 +1709,10 @@ pn54x_io_set_power(
 
         if (pn54x_io_open(self)) {
             const unsigned long pwr = on ? PN54X_PWR_ON : PN54X_PWR_OFF;
+            const int ret = pn54x_system_ioctl(self->fd, PN54X_SET_PWR, pwr);
 
-            if (pn54x_system_ioctl(self->fd, PN54X_SET_PWR, pwr) >= 0) {
+            PN54X_TRACE2(power, on, ret >= 0);
+            if (ret >= 0) {
                 GDEBUG("Power %s", on ? "on" : "off");
                 if (!on) {
                     pn54x_io_close(self);
@@ -611,6 +1725,181 @@ pn54x_io_set_power(
     return FALSE;
 }
 
+void
+pn54x_io_get_stats(
+    Pn54xHalIo* io,
+    Pn54xIoStats* stats)
+{
+    if (G_LIKELY(io)) {
+        Pn54xIo* self = pn54x_io_cast(io);
+        const Pn54xFramerStats* framer = &self->read_framer.stats;
+
+        *stats = self->stats;
+        stats->packets = framer->packets;
+        stats->padding = framer->padding;
+        stats->carried = framer->carried;
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+}
+
+void
+pn54x_io_reset_stats(
+    Pn54xHalIo* io)
+{
+    if (G_LIKELY(io)) {
+        Pn54xIo* self = pn54x_io_cast(io);
+
+        memset(&self->stats, 0, sizeof(self->stats));
+        memset(&self->read_framer.stats, 0, sizeof(self->read_framer.stats));
+    }
+}
+
+void
+pn54x_io_dump_packets(
+    Pn54xHalIo* io,
+    const char* reason)
+{
+    if (G_LIKELY(io)) {
+        pn54x_io_dump_recorder(pn54x_io_cast(io), reason, TRUE);
+    }
+}
+
+void
+pn54x_io_dump_packets_on_error(
+    Pn54xHalIo* io,
+    const char* reason)
+{
+    if (G_LIKELY(io)) {
+        pn54x_io_dump_recorder(pn54x_io_cast(io), reason, FALSE);
+    }
+}
+
+void
+pn54x_io_dump_latency(
+    Pn54xHalIo* io)
+{
+    if (G_LIKELY(io)) {
+        pn54x_latency_log(pn54x_io_cast(io)->latency, TRUE);
+    }
+}
+
+static
+gboolean
+pn54x_io_ready_timeout(
+    gpointer user_data)
+{
+    Pn54xIo* self = user_data;
+
+    GDEBUG("No CORE_RESET_NTF, assuming the chip is ready");
+    self->ready_timeout_id = 0;
+    pn54x_io_ready_done(self, FALSE);
+    return G_SOURCE_REMOVE;
+}
+
+gboolean
+pn54x_io_wait_ready(
+    Pn54xHalIo* io,
+    guint timeout,
+    Pn54xIoReadyFunc fn,
+    void* user_data)
+{
+    if (G_LIKELY(io) && G_LIKELY(fn)) {
+        Pn54xIo* self = pn54x_io_cast(io);
+
+        pn54x_io_ready_clear(self);
+        if (self->fd >= 0 && !self->client) {
+            /*
+             * CORE_RESET_NTF is picked up by the same reader that will
+             * later serve the client, and goes through the framer (and
+             * the recorder) like any other packet.
+             */
+            if (self->read_started || pn54x_io_start_reader(self)) {
+                self->ready_fn = fn;
+                self->ready_data = user_data;
+                self->ready_timeout_id = g_timeout_add(timeout,
+                    pn54x_io_ready_timeout, self);
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+void
+pn54x_io_cancel_ready(
+    Pn54xHalIo* io)
+{
+    if (G_LIKELY(io)) {
+        pn54x_io_ready_clear(pn54x_io_cast(io));
+    }
+}
+
+gboolean
+pn54x_io_update_firmware(
+    Pn54xHalIo* io,
+    const Pn54xFwImage* image,
+    const Pn54xFwConfig* config,
+    Pn54xIoFwFunc fn,
+    void* user_data)
+{
+    if (G_LIKELY(io) && G_LIKELY(image) && G_LIKELY(fn)) {
+        Pn54xIo* self = pn54x_io_cast(io);
+
+        if (self->fw_fn) {
+            GWARN("Firmware download is already in progress");
+        } else if (self->fd >= 0) {
+            GWARN("Can't update firmware while the chip is powered on");
+        } else if (pn54x_io_open(self)) {
+            if (pn54x_system_ioctl(self->fd, PN54X_SET_PWR,
+                PN54X_PWR_FW_DL) >= 0) {
+                const guint max_frame = PN54X_MAX_PACKET_SIZE -
+                    PN54X_FW_FRAME_OVERHEAD;
+                Pn54xFwConfig fw_config;
+
+                /* Each DL frame has to fit into a write staging buffer */
+                if (config) {
+                    fw_config = *config;
+                } else {
+                    memset(&fw_config, 0, sizeof(fw_config));
+                }
+                if (fw_config.max_frame > max_frame) {
+                    GWARN("Firmware frame size %u is too large, using %u",
+                        fw_config.max_frame, max_frame);
+                    fw_config.max_frame = max_frame;
+                }
+
+                GDEBUG("Power on (firmware download)");
+                self->fw = pn54x_fw_download_new(image, &fw_config);
+                self->fw_fn = fn;
+                self->fw_data = user_data;
+                self->client = &self->fw_client;
+                if (pn54x_io_start_reader(self)) {
+                    /* Errors from here on are reported via callback */
+                    pn54x_io_fw_check(self);
+                    return TRUE;
+                }
+                pn54x_io_fw_cancel(self);
+            } else {
+                GERR("PN54X_SET_PWR(%d) error: %s", PN54X_PWR_FW_DL,
+                    strerror(errno));
+                pn54x_io_set_power(io, FALSE);
+                pn54x_io_close(self);
+            }
+        }
+    }
+    return FALSE;
+}
+
+void
+pn54x_io_cancel_firmware(
+    Pn54xHalIo* io)
+{
+    if (G_LIKELY(io)) {
+        pn54x_io_fw_cancel(pn54x_io_cast(io));
+    }
+}
+
 /*
  * Local Variables:
  * mode: C
@@ -39,6 +39,11 @@
 #ifndef PN54X_IO_H
 #define PN54X_IO_H
 
+#include "pn54x_capture.h"
+#include "pn54x_fw.h"
+#include "pn54x_reader.h"
+#include "pn54x_recorder.h"
+
 #include <nci_hal.h>
 
 typedef struct Pn54xHalIo {
@@ -46,10 +51,56 @@ typedef struct Pn54xHalIo {
     const char* dev;
 } Pn54xHalIo;
 
+typedef enum pn54x_io_read_mode {
+    PN54X_IO_READ_AUTO,         /* Direct if supported, otherwise thread */
+    PN54X_IO_READ_THREAD,       /* Blocking read in a separate thread */
+    PN54X_IO_READ_PROCESS,      /* Blocking read in a forked process */
+    PN54X_IO_READ_DIRECT,       /* Non-blocking read from the main loop */
+    PN54X_IO_READ_URING         /* Cancellable read via io_uring */
+} PN54X_IO_READ_MODE;
+
+typedef enum pn54x_io_write_gather {
+    PN54X_IO_WRITE_GATHER_AUTO, /* Unless it's a character device */
+    PN54X_IO_WRITE_GATHER_OFF,  /* Copy the chunks into staging buffer */
+    PN54X_IO_WRITE_GATHER_ON    /* Pass the chunks to writev() */
+} PN54X_IO_WRITE_GATHER;
+
+/* Zero-initialized structure means defaults */
+typedef struct pn54x_io_config {
+    PN54X_IO_READ_MODE read_mode;
+    guint read_ring_size;   /* Number of read buffers (thread, process) */
+    Pn54xReaderSched read_sched; /* Reader scheduling (thread, process) */
+    PN54X_IO_WRITE_GATHER write_gather;
+    guint write_queue_size; /* Max number of writes in progress */
+    int write_retries;      /* Negative disables retries */
+    guint write_retry_delay; /* Chip wake-up time, microseconds */
+    guint latency_log_interval; /* Seconds, zero disables the summary */
+    Pn54xCaptureConfig capture; /* Binary packet capture */
+    Pn54xRecorderConfig recorder; /* Last packets, dumped on errors */
+    guint hexdump_queue_size; /* Bytes, non-zero formats in a thread */
+} Pn54xIoConfig;
+
+/* Always on, updated on the main thread */
+typedef struct pn54x_io_stats {
+    guint64 reads;          /* Chunks of data received from the chip */
+    guint64 read_bytes;
+    guint64 packets;        /* NCI packets framed */
+    guint64 padding;        /* 0xff bytes skipped */
+    guint64 carried;        /* Packets split between reads */
+    guint64 writes;         /* Completed writes */
+    guint64 write_bytes;
+    guint64 write_errors;   /* Rejected or failed writes */
+} Pn54xIoStats;
+
 Pn54xHalIo*
 pn54x_io_new(
     const char* dev);
 
+Pn54xHalIo*
+pn54x_io_new_full(
+    const char* dev,
+    const Pn54xIoConfig* config);
+
 void
 pn54x_io_free(
     Pn54xHalIo* io);
@@ -59,6 +110,84 @@ pn54x_io_set_power(
     Pn54xHalIo* io,
     gboolean on);
 
+typedef
+void
+(*Pn54xIoReadyFunc)(
+    Pn54xHalIo* io,
+    gboolean signaled,  /* FALSE if the timeout has expired */
+    void* user_data);
+
+/*
+ * Waits for the chip to boot after power-on, i.e. for the CORE_RESET_NTF
+ * sent by some firmware versions, but no longer than timeout ms. Returns
+ * FALSE if there's nothing to wait for (power is off or the client is
+ * already reading), in which case the callback is not invoked. The data
+ * are read by the reader which then gets handed over to the client.
+ */
+gboolean
+pn54x_io_wait_ready(
+    Pn54xHalIo* io,
+    guint timeout,
+    Pn54xIoReadyFunc fn,
+    void* user_data);
+
+void
+pn54x_io_cancel_ready(
+    Pn54xHalIo* io);
+
+void
+pn54x_io_get_stats(
+    Pn54xHalIo* io,
+    Pn54xIoStats* stats);
+
+void
+pn54x_io_reset_stats(
+    Pn54xHalIo* io);
+
+/* Logs command response times and NTF => CMD times, all buckets */
+void
+pn54x_io_dump_latency(
+    Pn54xHalIo* io);
+
+/* Logs the last packets, and saves them to a file if configured */
+void
+pn54x_io_dump_packets(
+    Pn54xHalIo* io,
+    const char* reason);
+
+/* Same but only if there's anything new since the last dump */
+void
+pn54x_io_dump_packets_on_error(
+    Pn54xHalIo* io,
+    const char* reason);
+
+typedef
+void
+(*Pn54xIoFwFunc)(
+    Pn54xHalIo* io,
+    PN54X_FW_RESULT result,
+    const Pn54xFwStats* stats,
+    void* user_data);
+
+/*
+ * Power must be off, and remains off afterwards. The download is driven
+ * by the configured reader and the writer, the callback is invoked when
+ * it's finished (and the power is off again), unless it's cancelled.
+ * The image must stay alive until then. Returns FALSE if the download
+ * couldn't be started, in which case the callback is not invoked.
+ */
+gboolean
+pn54x_io_update_firmware(
+    Pn54xHalIo* io,
+    const Pn54xFwImage* image,
+    const Pn54xFwConfig* config,
+    Pn54xIoFwFunc fn,
+    void* user_data);
+
+void
+pn54x_io_cancel_firmware(
+    Pn54xHalIo* io);
+
 #endif /* PN54X_IO_H */
 
 /*
@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_latency.h"
+#include "pn54x_log.h"
+
+#define NCI_MT_MASK   (0xe0)
+#define NCI_MT_CMD    (0x20)
+#define NCI_MT_RSP    (0x40)
+#define NCI_MT_NTF    (0x60)
+#define NCI_PBF       (0x10)
+#define NCI_GID_MASK  (0x0f)
+#define NCI_OID_MASK  (0x3f)
+
+#define PN54X_LATENCY_KEY(gid,oid) (((gid) << 6) | (oid))
+#define PN54X_LATENCY_KEYS (PN54X_LATENCY_KEY(NCI_GID_MASK, NCI_OID_MASK) + 1)
+
+struct pn54x_latency {
+    Pn54xHistogram* rsp[PN54X_LATENCY_KEYS];  /* Allocated on demand */
+    Pn54xHistogram* ntf[PN54X_LATENCY_KEYS];
+    gboolean cmd_pending;
+    guint cmd_key;
+    gint64 cmd_time;
+    gboolean ntf_pending;
+    guint ntf_key;
+    gint64 ntf_time;
+    guint unmatched;
+    guint64 samples;
+    guint64 samples_logged;
+};
+
+/*==========================================================================*
+ * Histogram
+ *==========================================================================*/
+
+guint
+pn54x_histogram_bucket(
+    guint32 value)
+{
+    if (value < 2 * PN54X_HISTOGRAM_SUB) {
+        return value;
+    } else {
+        /* Position of the most significant bit is at least SUB_BITS + 1 */
+        const guint shift = g_bit_storage(value) - 1 - PN54X_HISTOGRAM_SUB_BITS;
+
+        return (shift + 1) * PN54X_HISTOGRAM_SUB +
+            (value >> shift) - PN54X_HISTOGRAM_SUB;
+    }
+}
+
+guint32
+pn54x_histogram_bucket_min(
+    guint bucket)
+{
+    if (bucket < 2 * PN54X_HISTOGRAM_SUB) {
+        return bucket;
+    } else {
+        const guint shift = bucket / PN54X_HISTOGRAM_SUB - 1;
+
+        return (guint32)(PN54X_HISTOGRAM_SUB +
+            bucket % PN54X_HISTOGRAM_SUB) << shift;
+    }
+}
+
+static
+guint32
+pn54x_histogram_bucket_max(
+    guint bucket)
+{
+    return (bucket + 1 < PN54X_HISTOGRAM_BUCKETS) ?
+        (pn54x_histogram_bucket_min(bucket + 1) - 1) : G_MAXUINT32;
+}
+
+void
+pn54x_histogram_add(
+    Pn54xHistogram* h,
+    guint32 value)
+{
+    h->count++;
+    h->sum += value;
+    h->max = MAX(h->max, value);
+    h->bucket[pn54x_histogram_bucket(value)]++;
+}
+
+guint32
+pn54x_histogram_percentile(
+    const Pn54xHistogram* h,
+    guint percent)
+{
+    if (h->count) {
+        /* Rank of the sample, rounded up */
+        const guint64 rank = (h->count * MIN(percent, 100) + 99) / 100;
+        guint64 n = 0;
+        guint i;
+
+        for (i = 0; i < PN54X_HISTOGRAM_BUCKETS; i++) {
+            n += h->bucket[i];
+            if (n >= rank && n) {
+                return MIN(pn54x_histogram_bucket_max(i), h->max);
+            }
+        }
+    }
+    return 0;
+}
+
+/*==========================================================================*
+ * Tracker
+ *==========================================================================*/
+
+static
+void
+pn54x_latency_add(
+    Pn54xLatency* self,
+    Pn54xHistogram** table,
+    guint key,
+    gint64 delta)
+{
+    if (!table[key]) {
+        table[key] = g_new0(Pn54xHistogram, 1);
+    }
+    pn54x_histogram_add(table[key], (guint32)MIN(delta, G_MAXUINT32));
+    self->samples++;
+}
+
+Pn54xLatency*
+pn54x_latency_new(
+    void)
+{
+    return g_new0(Pn54xLatency, 1);
+}
+
+void
+pn54x_latency_free(
+    Pn54xLatency* self)
+{
+    if (self) {
+        pn54x_latency_reset(self);
+        g_free(self);
+    }
+}
+
+void
+pn54x_latency_sent(
+    Pn54xLatency* self,
+    const guint8* hdr,
+    gint64 time)
+{
+    /* Segmented commands are timed from the last segment */
+    if ((hdr[0] & (NCI_MT_MASK | NCI_PBF)) == NCI_MT_CMD) {
+        if (self->ntf_pending) {
+            self->ntf_pending = FALSE;
+            pn54x_latency_add(self, self->ntf, self->ntf_key,
+                time - self->ntf_time);
+        }
+        self->cmd_pending = TRUE;
+        self->cmd_key = PN54X_LATENCY_KEY(hdr[0] & NCI_GID_MASK,
+            hdr[1] & NCI_OID_MASK);
+        self->cmd_time = time;
+    }
+}
+
+void
+pn54x_latency_written(
+    Pn54xLatency* self,
+    const guint8* hdr,
+    gint64 time)
+{
+    /*
+     * Unless the response has already arrived, the response time is
+     * counted from the moment the command was actually written. That
+     * never goes backwards, a completion of an older command with the
+     * same GID/OID can't affect the one in flight.
+     */
+    if (self->cmd_pending && time > self->cmd_time &&
+        (hdr[0] & (NCI_MT_MASK | NCI_PBF)) == NCI_MT_CMD &&
+        self->cmd_key == PN54X_LATENCY_KEY(hdr[0] & NCI_GID_MASK,
+        hdr[1] & NCI_OID_MASK)) {
+        self->cmd_time = time;
+    }
+}
+
+void
+pn54x_latency_received(
+    Pn54xLatency* self,
+    const guint8* hdr,
+    gint64 time)
+{
+    const guint key = PN54X_LATENCY_KEY(hdr[0] & NCI_GID_MASK,
+        hdr[1] & NCI_OID_MASK);
+
+    /* And responses are complete when the last segment arrives */
+    switch (hdr[0] & (NCI_MT_MASK | NCI_PBF)) {
+    case NCI_MT_RSP:
+        if (self->cmd_pending && self->cmd_key == key) {
+            pn54x_latency_add(self, self->rsp, key, time - self->cmd_time);
+        } else {
+            self->unmatched++;
+        }
+        self->cmd_pending = FALSE;
+        break;
+    case NCI_MT_NTF:
+        /* The last one before the command counts */
+        self->ntf_pending = TRUE;
+        self->ntf_key = key;
+        self->ntf_time = time;
+        break;
+    }
+}
+
+const Pn54xHistogram*
+pn54x_latency_rsp(
+    Pn54xLatency* self,
+    guint gid,
+    guint oid)
+{
+    return self->rsp[PN54X_LATENCY_KEY(gid & NCI_GID_MASK,
+        oid & NCI_OID_MASK)];
+}
+
+const Pn54xHistogram*
+pn54x_latency_ntf(
+    Pn54xLatency* self,
+    guint gid,
+    guint oid)
+{
+    return self->ntf[PN54X_LATENCY_KEY(gid & NCI_GID_MASK,
+        oid & NCI_OID_MASK)];
+}
+
+guint
+pn54x_latency_unmatched(
+    Pn54xLatency* self)
+{
+    return self->unmatched;
+}
+
+static
+void
+pn54x_latency_log_table(
+    Pn54xHistogram** table,
+    const char* name,
+    gboolean full)
+{
+    guint key;
+
+    for (key = 0; key < PN54X_LATENCY_KEYS; key++) {
+        const Pn54xHistogram* h = table[key];
+
+        if (h) {
+            GINFO("%s %02x/%02x: %u sample(s), %u us avg, p50 %u, p90 %u, "
+                "p99 %u, max %u", name, key >> 6, key & NCI_OID_MASK,
+                (guint)h->count, (guint)(h->sum / h->count),
+                pn54x_histogram_percentile(h, 50),
+                pn54x_histogram_percentile(h, 90),
+                pn54x_histogram_percentile(h, 99), h->max);
+            if (full) {
+                guint i;
+
+                for (i = 0; i < PN54X_HISTOGRAM_BUCKETS; i++) {
+                    if (h->bucket[i]) {
+                        GINFO("  %u..%u us: %u",
+                            pn54x_histogram_bucket_min(i),
+                            pn54x_histogram_bucket_max(i), h->bucket[i]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void
+pn54x_latency_log(
+    Pn54xLatency* self,
+    gboolean full)
+{
+    if (self && (full || self->samples != self->samples_logged)) {
+        self->samples_logged = self->samples;
+        pn54x_latency_log_table(self->rsp, "CMD=>RSP", full);
+        pn54x_latency_log_table(self->ntf, "NTF=>CMD", full);
+        if (self->unmatched) {
+            GINFO("%u unmatched response(s)", self->unmatched);
+        }
+    }
+}
+
+void
+pn54x_latency_reset(
+    Pn54xLatency* self)
+{
+    guint key;
+
+    for (key = 0; key < PN54X_LATENCY_KEYS; key++) {
+        g_free(self->rsp[key]);
+        g_free(self->ntf[key]);
+    }
+    memset(self, 0, sizeof(*self));
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
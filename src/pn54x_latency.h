@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_LATENCY_H
+#define PN54X_LATENCY_H
+
+#include <gutil_types.h>
+
+/*
+ * Log-linear histogram of microsecond values. Each power of two is split
+ * into PN54X_HISTOGRAM_SUB linear buckets, i.e. the bucket width is
+ * within 1/PN54X_HISTOGRAM_SUB of the value. Values below
+ * 2 * PN54X_HISTOGRAM_SUB get a bucket each. Larger than 32-bit values
+ * end up in the last bucket.
+ */
+#define PN54X_HISTOGRAM_SUB_BITS (3)
+#define PN54X_HISTOGRAM_SUB (1 << PN54X_HISTOGRAM_SUB_BITS)
+#define PN54X_HISTOGRAM_BUCKETS ((32 - PN54X_HISTOGRAM_SUB_BITS + 1) * \
+    PN54X_HISTOGRAM_SUB)
+
+typedef struct pn54x_histogram {
+    guint64 count;
+    guint64 sum;
+    guint32 max;
+    guint32 bucket[PN54X_HISTOGRAM_BUCKETS];
+} Pn54xHistogram;
+
+guint
+pn54x_histogram_bucket(
+    guint32 value);
+
+/* Smallest value that falls into the bucket */
+guint32
+pn54x_histogram_bucket_min(
+    guint bucket);
+
+void
+pn54x_histogram_add(
+    Pn54xHistogram* histogram,
+    guint32 value);
+
+/* Upper bound of the bucket containing the percentile */
+guint32
+pn54x_histogram_percentile(
+    const Pn54xHistogram* histogram,
+    guint percent);
+
+/*
+ * Matches NCI responses to commands by GID/OID (there can be only one
+ * command in flight) and measures the time from a notification to the
+ * next command. Packets are passed in as they go through the I/O layer,
+ * only the first two bytes (the header) are looked at.
+ */
+
+typedef struct pn54x_latency Pn54xLatency;
+
+Pn54xLatency*
+pn54x_latency_new(
+    void);
+
+void
+pn54x_latency_free(
+    Pn54xLatency* latency);
+
+void
+pn54x_latency_sent(
+    Pn54xLatency* latency,
+    const guint8* hdr,
+    gint64 time);
+
+/* The write queue may hold the command back, time it from the write */
+void
+pn54x_latency_written(
+    Pn54xLatency* latency,
+    const guint8* hdr,
+    gint64 time);
+
+void
+pn54x_latency_received(
+    Pn54xLatency* latency,
+    const guint8* hdr,
+    gint64 time);
+
+/* Command => response, NULL if nothing has been recorded */
+const Pn54xHistogram*
+pn54x_latency_rsp(
+    Pn54xLatency* latency,
+    guint gid,
+    guint oid);
+
+/* Notification => next command */
+const Pn54xHistogram*
+pn54x_latency_ntf(
+    Pn54xLatency* latency,
+    guint gid,
+    guint oid);
+
+/* Responses that didn't match the command */
+guint
+pn54x_latency_unmatched(
+    Pn54xLatency* latency);
+
+/* Summary unless full, nothing if there's nothing new since last time */
+void
+pn54x_latency_log(
+    Pn54xLatency* latency,
+    gboolean full);
+
+void
+pn54x_latency_reset(
+    Pn54xLatency* latency);
+
+#endif /* PN54X_LATENCY_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
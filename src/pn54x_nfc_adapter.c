@@ -39,6 +39,8 @@
 #include "pn54x_plugin_p.h"
 #include "pn54x_log.h"
 #include "pn54x_io.h"
+#include "pn54x_recovery.h"
+#include "pn54x_trace.h"
 
 #include <nci_adapter_impl.h>
 
@@ -51,9 +53,28 @@ typedef NciAdapterClass Pn54xNfcAdapterClass;
 struct pn54x_nfc_adapter {
     NciAdapter adapter;
     Pn54xHalIo* io;
+    Pn54xRecovery* recovery;
     gboolean need_power;
     gboolean power_on;
     gboolean power_switch_pending;
+    guint power_off_delay;
+    guint power_off_id;
+    gint64 power_on_time;
+    guint cold_starts;
+    guint warm_starts;
+    guint boot_timeout;
+    gboolean booting;
+    gboolean boot_notify;
+    gint64 boot_start;
+    guint boots;
+    guint boot_signaled;
+    guint boot_timeouts;
+    gint64 boot_time_sum;
+    gint64 boot_time_max;
+    guint64 power_cycles;
+    guint64 error_resets;
+    Pn54xFwImage* fw_image;     /* Non-NULL while updating firmware */
+    gboolean fw_power_request;  /* Power request is waiting for it */
 };
 
 G_DEFINE_TYPE(Pn54xNfcAdapter, pn54x_nfc_adapter, NCI_TYPE_ADAPTER)
@@ -88,15 +109,141 @@ pn54x_nfc_adapter_can_power_off(
     return FALSE;
 }
 
+static
+void
+pn54x_nfc_adapter_cancel_power_off(
+    Pn54xNfcAdapter* self)
+{
+    if (self->power_off_id) {
+        g_source_remove(self->power_off_id);
+        self->power_off_id = 0;
+    }
+}
+
+static
+void
+pn54x_nfc_adapter_booted(
+    Pn54xNfcAdapter* self,
+    gboolean signaled)
+{
+    const gint64 boot_time = g_get_monotonic_time() - self->boot_start;
+
+    self->boots++;
+    if (signaled) {
+        GDEBUG("Chip booted in %d us", (int)boot_time);
+        self->boot_signaled++;
+        self->boot_time_sum += boot_time;
+        self->boot_time_max = MAX(self->boot_time_max, boot_time);
+    } else if (self->booting) {
+        self->boot_timeouts++;
+    }
+    self->booting = FALSE;
+    nci_core_restart(self->adapter.nci);
+    if (self->boot_notify) {
+        self->boot_notify = FALSE;
+        nfc_adapter_power_notify(NFC_ADAPTER(self), TRUE, TRUE);
+    }
+}
+
+static
+void
+pn54x_nfc_adapter_ready(
+    Pn54xHalIo* io,
+    gboolean signaled,
+    void* user_data)
+{
+    pn54x_nfc_adapter_booted(PN54X_NFC_ADAPTER(user_data), signaled);
+}
+
+/*
+ * Starts NCI once the chip is ready. Not all chips announce that they
+ * have booted, so unless BootTimeout is configured NCI gets started
+ * right away and the chip is expected to handle (or NACK and then
+ * handle) the first CORE_RESET_CMD.
+ */
+static
+void
+pn54x_nfc_adapter_boot(
+    Pn54xNfcAdapter* self,
+    gboolean notify)
+{
+    self->boot_start = g_get_monotonic_time();
+    self->boot_notify = notify;
+    self->booting = self->boot_timeout && pn54x_io_wait_ready(self->io,
+        self->boot_timeout, pn54x_nfc_adapter_ready, self);
+    if (!self->booting) {
+        pn54x_nfc_adapter_booted(self, FALSE);
+    }
+}
+
+static
+void
+pn54x_nfc_adapter_cancel_boot(
+    Pn54xNfcAdapter* self)
+{
+    if (self->booting) {
+        pn54x_io_cancel_ready(self->io);
+        self->booting = FALSE;
+        self->boot_notify = FALSE;
+    }
+}
+
+static
+void
+pn54x_nfc_adapter_power_off_now(
+    Pn54xNfcAdapter* self)
+{
+    pn54x_nfc_adapter_cancel_power_off(self);
+    pn54x_nfc_adapter_cancel_boot(self);
+    pn54x_recovery_cancel(self->recovery);
+    pn54x_io_set_power(self->io, FALSE);
+    self->power_on = FALSE;
+}
+
+static
+gboolean
+pn54x_nfc_adapter_power_off_timeout(
+    gpointer user_data)
+{
+    Pn54xNfcAdapter* self = PN54X_NFC_ADAPTER(user_data);
+
+    GDEBUG("Nobody needs the chip, powering it off");
+    self->power_off_id = 0;
+    pn54x_nfc_adapter_power_off_now(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+pn54x_nfc_adapter_power_off(
+    Pn54xNfcAdapter* self)
+{
+    /*
+     * As far as nfcd is concerned, power is off either way. If the
+     * power gets requested again before the timer expires, the chip
+     * is still initialized and the restart can be skipped.
+     */
+    if (self->power_off_delay &&
+        pn54x_recovery_state(self->recovery) == PN54X_RECOVERY_IDLE) {
+        if (!self->power_off_id) {
+            GDEBUG("Keeping the chip powered for %u ms",
+                self->power_off_delay);
+            self->power_off_id = g_timeout_add(self->power_off_delay,
+                pn54x_nfc_adapter_power_off_timeout, self);
+        }
+    } else {
+        pn54x_nfc_adapter_power_off_now(self);
+    }
+}
+
 static
 void
 pn54x_nfc_adapter_state_check(
     Pn54xNfcAdapter* self)
 {
-    if (self->power_on && !self->need_power &&
+    if (self->power_on && !self->power_off_id && !self->need_power &&
         pn54x_nfc_adapter_can_power_off(self)) {
-        pn54x_io_set_power(self->io, FALSE);
-        self->power_on = FALSE;
+        pn54x_nfc_adapter_power_off(self);
         if (self->power_switch_pending) {
             self->power_switch_pending = FALSE;
             nfc_adapter_power_notify(NFC_ADAPTER(self), FALSE, TRUE);
@@ -110,22 +257,197 @@ pn54x_nfc_adapter_state_check(
  * Interface
  *==========================================================================*/
 
+static
+gboolean
+pn54x_nfc_adapter_recovery_power(
+    gboolean on,
+    void* user_data)
+{
+    Pn54xNfcAdapter* self = PN54X_NFC_ADAPTER(user_data);
+
+    if (!on) {
+        self->error_resets++;
+        pn54x_nfc_adapter_cancel_boot(self);
+    }
+    return pn54x_io_set_power(self->io, on);
+}
+
+static
+void
+pn54x_nfc_adapter_recovery_restart(
+    void* user_data)
+{
+    pn54x_nfc_adapter_boot(PN54X_NFC_ADAPTER(user_data), FALSE);
+}
+
+static
+void
+pn54x_nfc_adapter_recovery_failed(
+    void* user_data)
+{
+    Pn54xNfcAdapter* self = PN54X_NFC_ADAPTER(user_data);
+
+    /* Power is off until nfcd asks to turn it on again */
+    self->power_on = FALSE;
+    if (self->power_switch_pending) {
+        self->power_switch_pending = FALSE;
+        nfc_adapter_power_notify(NFC_ADAPTER(self), FALSE, TRUE);
+    } else {
+        nfc_adapter_power_notify(NFC_ADAPTER(self), FALSE, FALSE);
+    }
+}
+
+static
+gboolean
+pn54x_nfc_adapter_power_request(
+    Pn54xNfcAdapter* self,
+    gboolean on);
+
+static
+void
+pn54x_nfc_adapter_firmware_done(
+    Pn54xHalIo* io,
+    PN54X_FW_RESULT result,
+    const Pn54xFwStats* stats,
+    void* user_data)
+{
+    Pn54xNfcAdapter* self = PN54X_NFC_ADAPTER(user_data);
+
+    switch (result) {
+    case PN54X_FW_UPDATED:
+        GDEBUG("Firmware %04x => %04x (%u frames, %d ms)",
+            stats->chip_version, self->fw_image->version, stats->frames,
+            (int)(stats->time / 1000));
+        break;
+    case PN54X_FW_CURRENT:
+        break;
+    case PN54X_FW_ERROR:
+    case PN54X_FW_BUSY:
+        GWARN("Firmware update failed");
+        break;
+    }
+    pn54x_fw_image_free(self->fw_image);
+    self->fw_image = NULL;
+
+    /* Now the power request can be handled */
+    if (self->fw_power_request) {
+        const gboolean on = self->need_power;
+
+        self->fw_power_request = FALSE;
+        if (!pn54x_nfc_adapter_power_request(self, on) && on &&
+            !self->power_on) {
+            nfc_adapter_power_notify(NFC_ADAPTER(self), FALSE, TRUE);
+        }
+    }
+}
+
+static
+void
+pn54x_nfc_adapter_update_firmware(
+    Pn54xNfcAdapter* self,
+    const char* path,
+    const Pn54xFwConfig* config)
+{
+    Pn54xFwImage* image = pn54x_fw_image_load(path);
+
+    /* Power requests are held until the download is finished */
+    if (image) {
+        if (pn54x_io_update_firmware(self->io, image, config,
+            pn54x_nfc_adapter_firmware_done, self)) {
+            self->fw_image = image;
+        } else {
+            GWARN("Firmware update failed");
+            pn54x_fw_image_free(image);
+        }
+    }
+}
+
 NfcAdapter*
 pn54x_nfc_adapter_new(
-    const char* dev)
+    const char* dev,
+    const Pn54xIoConfig* io_config,
+    const Pn54xNfcAdapterConfig* config)
 {
-    Pn54xHalIo* io = pn54x_io_new(dev);
+    Pn54xHalIo* io = pn54x_io_new_full(dev, io_config);
 
     if (io) {
+        static const Pn54xRecoveryFunctions recovery_fn = {
+            pn54x_nfc_adapter_recovery_power,
+            pn54x_nfc_adapter_recovery_restart,
+            pn54x_nfc_adapter_recovery_failed
+        };
         Pn54xNfcAdapter* self = g_object_new(PN54X_NFC_TYPE_ADAPTER, NULL);
 
         self->io = io;
+        self->recovery = pn54x_recovery_new(config ? &config->recovery :
+            NULL, &recovery_fn, self);
+        if (config) {
+            self->power_off_delay = config->power_off_delay;
+            self->boot_timeout = config->boot_timeout;
+            if (config->fw_image) {
+                pn54x_nfc_adapter_update_firmware(self, config->fw_image,
+                    &config->fw_config);
+            }
+        }
         nci_adapter_init_base(&self->adapter, &io->hal_io);
         return NFC_ADAPTER(self);
     }
     return NULL;
 }
 
+void
+pn54x_nfc_adapter_get_stats(
+    NfcAdapter* adapter,
+    Pn54xDBusStats* stats)
+{
+    Pn54xNfcAdapter* self = PN54X_NFC_ADAPTER(adapter);
+
+    pn54x_io_get_stats(self->io, &stats->io);
+    stats->power_cycles = self->power_cycles;
+    stats->error_resets = self->error_resets;
+    stats->cold_starts = self->cold_starts;
+    stats->warm_starts = self->warm_starts;
+    stats->boots = self->boots;
+    stats->boots_signaled = self->boot_signaled;
+    stats->boot_timeouts = self->boot_timeouts;
+    stats->boot_time = self->boot_time_sum;
+    stats->boot_time_max = self->boot_time_max;
+    stats->recovery = *pn54x_recovery_stats(self->recovery);
+}
+
+void
+pn54x_nfc_adapter_reset_stats(
+    NfcAdapter* adapter)
+{
+    Pn54xNfcAdapter* self = PN54X_NFC_ADAPTER(adapter);
+
+    pn54x_io_reset_stats(self->io);
+    self->power_cycles = 0;
+    self->error_resets = 0;
+    self->cold_starts = 0;
+    self->warm_starts = 0;
+    self->boots = 0;
+    self->boot_signaled = 0;
+    self->boot_timeouts = 0;
+    self->boot_time_sum = 0;
+    self->boot_time_max = 0;
+    pn54x_recovery_reset_stats(self->recovery);
+}
+
+void
+pn54x_nfc_adapter_dump_packets(
+    NfcAdapter* adapter)
+{
+    pn54x_io_dump_packets(PN54X_NFC_ADAPTER(adapter)->io, "D-Bus request");
+}
+
+void
+pn54x_nfc_adapter_dump_latency(
+    NfcAdapter* adapter)
+{
+    pn54x_io_dump_latency(PN54X_NFC_ADAPTER(adapter)->io);
+}
+
 /*==========================================================================*
  * Methods
  *==========================================================================*/
@@ -135,8 +457,20 @@ void
 pn54x_nfc_adapter_current_state_changed(
     NciAdapter* adapter)
 {
+    Pn54xNfcAdapter* self = PN54X_NFC_ADAPTER(adapter);
+
+    PN54X_TRACE2(state_reached, adapter->nci->current_state,
+        adapter->nci->next_state);
     NCI_ADAPTER_CLASS(SUPER_CLASS)->current_state_changed(adapter);
-    pn54x_nfc_adapter_state_check(PN54X_NFC_ADAPTER(adapter));
+    if (adapter->nci->current_state >= NCI_RFST_IDLE) {
+        pn54x_recovery_ok(self->recovery);
+    }
+    if (self->power_on_time && adapter->nci->current_state == NCI_RFST_IDLE) {
+        GDEBUG("Chip initialized in %d ms", (int)((g_get_monotonic_time() -
+            self->power_on_time) / 1000));
+        self->power_on_time = 0;
+    }
+    pn54x_nfc_adapter_state_check(self);
 }
 
 static
@@ -147,12 +481,18 @@ pn54x_nfc_adapter_next_state_changed(
     Pn54xNfcAdapter* self = PN54X_NFC_ADAPTER(adapter);
     NciCore* nci = adapter->nci;
 
+    PN54X_TRACE2(state_next, nci->current_state, nci->next_state);
     NCI_ADAPTER_CLASS(SUPER_CLASS)->next_state_changed(adapter);
+    if (nci->next_state == NCI_STATE_ERROR) {
+        pn54x_io_dump_packets_on_error(self->io, "NCI error");
+    }
     if (nci->next_state != NCI_RFST_POLL_ACTIVE) {
-        if (nci->next_state == NCI_STATE_ERROR && self->power_on) {
-            GDEBUG("Resetting the chip");
-            pn54x_io_set_power(self->io, FALSE);
-            pn54x_io_set_power(self->io, TRUE);
+        if (nci->next_state == NCI_STATE_ERROR && self->power_off_id) {
+            /* Nobody needs it anyway */
+            pn54x_nfc_adapter_power_off_now(self);
+        } else if (nci->next_state == NCI_STATE_ERROR && self->power_on) {
+            /* The chip gets power cycled later */
+            pn54x_recovery_error(self->recovery);
         }
     }
     pn54x_nfc_adapter_state_check(self);
@@ -160,31 +500,42 @@ pn54x_nfc_adapter_next_state_changed(
 
 static
 gboolean
-pn54x_nfc_adapter_submit_power_request(
-    NfcAdapter* adapter,
+pn54x_nfc_adapter_power_request(
+    Pn54xNfcAdapter* self,
     gboolean on)
 {
-    Pn54xNfcAdapter* self = PN54X_NFC_ADAPTER(adapter);
     NciCore* nci = self->adapter.nci;
 
-    GASSERT(!self->power_switch_pending);
-    self->need_power = on;
     if (on) {
-        if (self->power_on) {
+        if (pn54x_recovery_state(self->recovery) == PN54X_RECOVERY_FAILED) {
+            /* Give it another chance */
+            GDEBUG("Retrying failed chip");
+            pn54x_recovery_reset(self->recovery);
+        }
+        if (self->power_off_id) {
+            pn54x_nfc_adapter_cancel_power_off(self);
+            self->warm_starts++;
+            GDEBUG("Chip is still powered, %u cold start(s) avoided",
+                self->warm_starts);
+            nci_core_set_state(nci, NCI_RFST_IDLE);
+            nfc_adapter_power_notify(NFC_ADAPTER(self), TRUE, TRUE);
+        } else if (self->power_on) {
             GDEBUG("Power is already on");
             nci_core_set_state(nci, NCI_RFST_IDLE);
             /* Power stays on, we are done */
             nfc_adapter_power_notify(NFC_ADAPTER(self), TRUE, TRUE);
         } else if (pn54x_io_set_power(self->io, TRUE)) {
             self->power_on = TRUE;
-            nci_core_restart(nci);
-            nfc_adapter_power_notify(NFC_ADAPTER(self), TRUE, TRUE);
+            self->power_on_time = g_get_monotonic_time();
+            self->cold_starts++;
+            self->power_cycles++;
+            GDEBUG("Cold start #%u", self->cold_starts);
+            pn54x_nfc_adapter_boot(self, TRUE);
         }
     } else {
-        if (self->power_on) {
+        if (self->power_on && !self->power_off_id) {
             if (pn54x_nfc_adapter_can_power_off(self)) {
-                pn54x_io_set_power(self->io, FALSE);
-                self->power_on = FALSE;
+                pn54x_nfc_adapter_power_off(self);
                 nfc_adapter_power_notify(NFC_ADAPTER(self), FALSE, TRUE);
             } else {
                 GDEBUG("Waiting for NCI state machine to become idle");
@@ -199,7 +550,26 @@ pn54x_nfc_adapter_submit_power_request(
             nfc_adapter_power_notify(NFC_ADAPTER(self), FALSE, TRUE);
         }
     }
-    return self->power_switch_pending;
+    return self->power_switch_pending || self->boot_notify;
+}
+
+static
+gboolean
+pn54x_nfc_adapter_submit_power_request(
+    NfcAdapter* adapter,
+    gboolean on)
+{
+    Pn54xNfcAdapter* self = PN54X_NFC_ADAPTER(adapter);
+
+    PN54X_TRACE1(power_request, on);
+    GASSERT(!self->power_switch_pending);
+    self->need_power = on;
+    if (self->fw_image) {
+        GDEBUG("Waiting for firmware update to finish");
+        self->fw_power_request = TRUE;
+        return TRUE;
+    }
+    return pn54x_nfc_adapter_power_request(self, on);
 }
 
 static
@@ -209,8 +579,13 @@ pn54x_nfc_adapter_cancel_power_request(
 {
     Pn54xNfcAdapter* self = PN54X_NFC_ADAPTER(adapter);
 
-    self->need_power = self->power_on;
+    if (self->boot_notify) {
+        /* Power-on request is cancelled while the chip is booting */
+        pn54x_nfc_adapter_power_off_now(self);
+    }
+    self->need_power = self->power_on && !self->power_off_id;
     self->power_switch_pending = FALSE;
+    self->fw_power_request = FALSE;
 }
 
 /*==========================================================================*
@@ -231,8 +606,18 @@ pn54x_nfc_adapter_finalize(
 {
     Pn54xNfcAdapter* self = PN54X_NFC_ADAPTER(object);
 
+    pn54x_nfc_adapter_cancel_power_off(self);
+    pn54x_nfc_adapter_cancel_boot(self);
+    if (self->boot_signaled) {
+        GDEBUG("Chip booted %u time(s) in %d us on average, %d us max, "
+            "%u timeout(s)", self->boot_signaled, (int)(self->boot_time_sum /
+            self->boot_signaled), (int)self->boot_time_max,
+            self->boot_timeouts);
+    }
+    pn54x_recovery_free(self->recovery);
     nci_adapter_finalize_core(&self->adapter);
     pn54x_io_free(self->io);
+    pn54x_fw_image_free(self->fw_image);
     G_OBJECT_CLASS(SUPER_CLASS)->finalize(object);
 }
 
@@ -47,11 +47,41 @@
 
 #include <nci_types.h>
 
+#include <gutil_misc.h>
+
 GLOG_MODULE_DEFINE("pn54x");
 
 #define PN54X_CONFIG_FILE      "/etc/nfcd/plugins/pn54x.conf"
 #define PLUGIN_GROUP          "Plugin"
 #define PLUGIN_KEY_DEVICE     "Device"
+#define PLUGIN_KEY_READ_MODE  "ReadMode"
+#define PLUGIN_KEY_READ_RING_SIZE "ReadRingSize"
+#define PLUGIN_KEY_READER_SCHEDULER "ReaderScheduler"
+#define PLUGIN_KEY_READER_PRIORITY "ReaderPriority"
+#define PLUGIN_KEY_READER_NICE "ReaderNice"
+#define PLUGIN_KEY_READER_CPUS "ReaderCpus"
+#define PLUGIN_KEY_READER_LOCK_MEMORY "ReaderLockMemory"
+#define PLUGIN_KEY_WRITE_GATHER "WriteGather"
+#define PLUGIN_KEY_WRITE_QUEUE_SIZE "WriteQueueSize"
+#define PLUGIN_KEY_WRITE_RETRIES "WriteRetries"
+#define PLUGIN_KEY_WRITE_RETRY_DELAY "WriteRetryDelay"
+#define PLUGIN_KEY_LATENCY_LOG_INTERVAL "LatencyLogInterval"
+#define PLUGIN_KEY_CAPTURE_FILE "CaptureFile"
+#define PLUGIN_KEY_CAPTURE_FILE_SIZE "CaptureFileSize"
+#define PLUGIN_KEY_CAPTURE_FILES "CaptureFiles"
+#define PLUGIN_KEY_FLIGHT_RECORDER_PACKETS "FlightRecorderPackets"
+#define PLUGIN_KEY_FLIGHT_RECORDER_BYTES "FlightRecorderBytes"
+#define PLUGIN_KEY_FLIGHT_RECORDER_FILE "FlightRecorderFile"
+#define PLUGIN_KEY_HEXDUMP_QUEUE_SIZE "HexdumpQueueSize"
+#define PLUGIN_KEY_POWER_OFF_DELAY "PowerOffDelay"
+#define PLUGIN_KEY_BOOT_TIMEOUT "BootTimeout"
+#define PLUGIN_KEY_FIRMWARE_IMAGE "FirmwareImage"
+#define PLUGIN_KEY_FIRMWARE_FRAME_SIZE "FirmwareFrameSize"
+#define PLUGIN_KEY_RESET_PULSE "ResetPulse"
+#define PLUGIN_KEY_RESET_BACKOFF_MIN "ResetBackoffMin"
+#define PLUGIN_KEY_RESET_BACKOFF_MAX "ResetBackoffMax"
+#define PLUGIN_KEY_RESETS_PER_MINUTE "ResetsPerMinute"
+#define PLUGIN_KEY_RESET_ATTEMPTS "ResetAttempts"
 
 #define PN54X_DEFAULT_DEVICE  "/dev/pn54x"
 
@@ -60,6 +90,9 @@ typedef struct pn54x_nfc_plugin {
     NfcPlugin parent;
     NfcManager* manager;
     NfcAdapter* adapter;
+    GCancellable* cancel;
+    GDBusConnection* connection;
+    Pn54xDBus* dbus;
 } Pn54xNfcPlugin;
 
 G_DEFINE_TYPE(Pn54xNfcPlugin, pn54x_nfc_plugin, NFC_TYPE_PLUGIN)
@@ -67,6 +100,257 @@ G_DEFINE_TYPE(Pn54xNfcPlugin, pn54x_nfc_plugin, NFC_TYPE_PLUGIN)
 #define PN54X_NFC_PLUGIN(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), \
         PN54X_TYPE_PLUGIN, Pn54xNfcPlugin))
 
+static
+gboolean
+pn54x_nfc_plugin_get_uint(
+    GKeyFile* cfg,
+    const char* key,
+    guint* value)
+{
+    if (g_key_file_has_key(cfg, PLUGIN_GROUP, key, NULL)) {
+        GError* error = NULL;
+        const int ival = g_key_file_get_integer(cfg, PLUGIN_GROUP, key,
+            &error);
+
+        if (error) {
+            GWARN("Invalid %s value: %s", key, error->message);
+            g_error_free(error);
+        } else if (ival < 0) {
+            GWARN("Invalid %s value %d", key, ival);
+        } else {
+            GDEBUG("%s %d", key, ival);
+            *value = ival;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static
+void
+pn54x_nfc_plugin_read_mode(
+    GKeyFile* cfg,
+    Pn54xIoConfig* io_config)
+{
+    char* mode = g_key_file_get_string(cfg, PLUGIN_GROUP,
+        PLUGIN_KEY_READ_MODE, NULL);
+
+    if (mode) {
+        g_strstrip(mode);
+        if (!g_ascii_strcasecmp(mode, "auto")) {
+            io_config->read_mode = PN54X_IO_READ_AUTO;
+        } else if (!g_ascii_strcasecmp(mode, "direct")) {
+            io_config->read_mode = PN54X_IO_READ_DIRECT;
+        } else if (!g_ascii_strcasecmp(mode, "thread")) {
+            io_config->read_mode = PN54X_IO_READ_THREAD;
+        } else if (!g_ascii_strcasecmp(mode, "process")) {
+            io_config->read_mode = PN54X_IO_READ_PROCESS;
+        } else if (!g_ascii_strcasecmp(mode, "uring")) {
+            io_config->read_mode = PN54X_IO_READ_URING;
+        } else {
+            GWARN("Invalid %s value '%s'", PLUGIN_KEY_READ_MODE, mode);
+            g_free(mode);
+            return;
+        }
+        GDEBUG("Read mode %s", mode);
+        g_free(mode);
+    }
+}
+
+static
+gboolean
+pn54x_nfc_plugin_get_int(
+    GKeyFile* cfg,
+    const char* key,
+    int* value)
+{
+    if (g_key_file_has_key(cfg, PLUGIN_GROUP, key, NULL)) {
+        GError* error = NULL;
+        const int ival = g_key_file_get_integer(cfg, PLUGIN_GROUP, key,
+            &error);
+
+        if (error) {
+            GWARN("Invalid %s value: %s", key, error->message);
+            g_error_free(error);
+        } else {
+            GDEBUG("%s %d", key, ival);
+            *value = ival;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static
+gboolean
+pn54x_nfc_plugin_parse_cpus(
+    const char* str,
+    guint64* mask)
+{
+    char** ranges = g_strsplit(str, ",", -1);
+    char** ptr;
+    guint64 cpus = 0;
+    gboolean ok = TRUE;
+
+    /* Comma separated list of CPUs and ranges, e.g. 0,2-3 */
+    for (ptr = ranges; *ptr && ok; ptr++) {
+        char* range = g_strstrip(*ptr);
+        char* dash = strchr(range, '-');
+        int first, last;
+
+        if (dash) {
+            *dash++ = 0;
+            ok = gutil_parse_int(range, 10, &first) &&
+                gutil_parse_int(dash, 10, &last);
+        } else {
+            ok = gutil_parse_int(range, 10, &first);
+            last = first;
+        }
+        if (ok && first >= 0 && first <= last && last < 64) {
+            int i;
+
+            for (i = first; i <= last; i++) {
+                cpus |= G_GUINT64_CONSTANT(1) << i;
+            }
+        } else {
+            ok = FALSE;
+        }
+    }
+    g_strfreev(ranges);
+    if (ok && cpus) {
+        *mask = cpus;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static
+void
+pn54x_nfc_plugin_reader_sched(
+    GKeyFile* cfg,
+    Pn54xReaderSched* sched)
+{
+    char* str = g_key_file_get_string(cfg, PLUGIN_GROUP,
+        PLUGIN_KEY_READER_SCHEDULER, NULL);
+
+    if (str) {
+        g_strstrip(str);
+        if (!g_ascii_strcasecmp(str, "other")) {
+            sched->policy = PN54X_READER_POLICY_OTHER;
+        } else if (!g_ascii_strcasecmp(str, "fifo")) {
+            sched->policy = PN54X_READER_POLICY_FIFO;
+        } else if (!g_ascii_strcasecmp(str, "rr")) {
+            sched->policy = PN54X_READER_POLICY_RR;
+        } else {
+            GWARN("Invalid %s value '%s'", PLUGIN_KEY_READER_SCHEDULER, str);
+        }
+        g_free(str);
+    }
+
+    pn54x_nfc_plugin_get_int(cfg, PLUGIN_KEY_READER_PRIORITY,
+        &sched->priority);
+    if (pn54x_nfc_plugin_get_int(cfg, PLUGIN_KEY_READER_NICE,
+        &sched->nice)) {
+        sched->flags |= PN54X_READER_SCHED_NICE;
+    }
+
+    str = g_key_file_get_string(cfg, PLUGIN_GROUP,
+        PLUGIN_KEY_READER_CPUS, NULL);
+    if (str) {
+        if (!pn54x_nfc_plugin_parse_cpus(str, &sched->cpus)) {
+            GWARN("Invalid %s value '%s'", PLUGIN_KEY_READER_CPUS, str);
+        }
+        g_free(str);
+    }
+
+    if (g_key_file_get_boolean(cfg, PLUGIN_GROUP,
+        PLUGIN_KEY_READER_LOCK_MEMORY, NULL)) {
+        GDEBUG("%s true", PLUGIN_KEY_READER_LOCK_MEMORY);
+        sched->flags |= PN54X_READER_SCHED_MLOCK;
+    }
+}
+
+static
+void
+pn54x_nfc_plugin_get_stats(
+    Pn54xDBusStats* stats,
+    void* user_data)
+{
+    Pn54xNfcPlugin* self = PN54X_NFC_PLUGIN(user_data);
+
+    pn54x_nfc_adapter_get_stats(self->adapter, stats);
+}
+
+static
+void
+pn54x_nfc_plugin_reset_stats(
+    void* user_data)
+{
+    Pn54xNfcPlugin* self = PN54X_NFC_PLUGIN(user_data);
+
+    GDEBUG("Resetting statistics");
+    pn54x_nfc_adapter_reset_stats(self->adapter);
+}
+
+static
+void
+pn54x_nfc_plugin_dump_latency(
+    void* user_data)
+{
+    pn54x_nfc_adapter_dump_latency(PN54X_NFC_PLUGIN(user_data)->adapter);
+}
+
+static
+void
+pn54x_nfc_plugin_dump_packets(
+    void* user_data)
+{
+    pn54x_nfc_adapter_dump_packets(PN54X_NFC_PLUGIN(user_data)->adapter);
+}
+
+static
+void
+pn54x_nfc_plugin_bus_get_done(
+    GObject* object,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    Pn54xNfcPlugin* self = PN54X_NFC_PLUGIN(user_data);
+    GError* error = NULL;
+    GDBusConnection* connection = g_bus_get_finish(result, &error);
+
+    if (!self->cancel) {
+        /* The plugin has been stopped */
+        if (connection) {
+            g_object_unref(connection);
+        } else {
+            g_error_free(error);
+        }
+    } else {
+        g_object_unref(self->cancel);
+        self->cancel = NULL;
+        if (connection) {
+            static const Pn54xDBusFunctions dbus_fn = {
+                pn54x_nfc_plugin_get_stats,
+                pn54x_nfc_plugin_reset_stats,
+                pn54x_nfc_plugin_dump_latency,
+                pn54x_nfc_plugin_dump_packets
+            };
+            char* path = g_strconcat("/", self->adapter->name, "/pn54x",
+                NULL);
+
+            self->connection = connection;
+            self->dbus = pn54x_dbus_new(connection, G_BUS_TYPE_SYSTEM,
+                path, NULL, &dbus_fn, self);
+            g_free(path);
+        } else {
+            GWARN("Failed to attach to the system bus: %s", error->message);
+            g_error_free(error);
+        }
+    }
+    g_object_unref(self);
+}
+
 static
 gboolean
 pn54x_nfc_plugin_start(
@@ -76,9 +360,16 @@ pn54x_nfc_plugin_start(
     Pn54xNfcPlugin* self = PN54X_NFC_PLUGIN(plugin);
     GKeyFile* cfg = g_key_file_new();
     char* tmp_dev = NULL;
+    char* fw_image = NULL;
+    char* capture_file = NULL;
+    char* recorder_file = NULL;
     const char* dev = PN54X_DEFAULT_DEVICE;
+    Pn54xIoConfig io_config;
+    Pn54xNfcAdapterConfig config;
 
     GVERBOSE("Starting");
+    memset(&io_config, 0, sizeof(io_config));
+    memset(&config, 0, sizeof(config));
     if (g_key_file_load_from_file(cfg, PN54X_CONFIG_FILE, 0, NULL)) {
         tmp_dev = g_key_file_get_string(cfg, PLUGIN_GROUP,
             PLUGIN_KEY_DEVICE, NULL);
@@ -86,13 +377,88 @@ pn54x_nfc_plugin_start(
             dev = tmp_dev;
             GDEBUG("Device %s", dev);
         }
+        pn54x_nfc_plugin_read_mode(cfg, &io_config);
+        pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_READ_RING_SIZE,
+            &io_config.read_ring_size);
+        pn54x_nfc_plugin_reader_sched(cfg, &io_config.read_sched);
+        if (g_key_file_has_key(cfg, PLUGIN_GROUP,
+            PLUGIN_KEY_WRITE_GATHER, NULL)) {
+            const gboolean gather = g_key_file_get_boolean(cfg, PLUGIN_GROUP,
+                PLUGIN_KEY_WRITE_GATHER, NULL);
+
+            GDEBUG("%s %s", PLUGIN_KEY_WRITE_GATHER, gather ? "on" : "off");
+            io_config.write_gather = gather ? PN54X_IO_WRITE_GATHER_ON :
+                PN54X_IO_WRITE_GATHER_OFF;
+        }
+        pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_WRITE_QUEUE_SIZE,
+            &io_config.write_queue_size);
+        if (pn54x_nfc_plugin_get_int(cfg, PLUGIN_KEY_WRITE_RETRIES,
+            &io_config.write_retries) && io_config.write_retries <= 0) {
+            io_config.write_retries = -1; /* Zero would mean default */
+        }
+        pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_WRITE_RETRY_DELAY,
+            &io_config.write_retry_delay);
+        pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_LATENCY_LOG_INTERVAL,
+            &io_config.latency_log_interval);
+        capture_file = g_key_file_get_string(cfg, PLUGIN_GROUP,
+            PLUGIN_KEY_CAPTURE_FILE, NULL);
+        if (capture_file && capture_file[0]) {
+            GDEBUG("Capture file %s", capture_file);
+            io_config.capture.path = capture_file;
+            pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_CAPTURE_FILE_SIZE,
+                &io_config.capture.size);
+            pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_CAPTURE_FILES,
+                &io_config.capture.count);
+        }
+        pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_FLIGHT_RECORDER_PACKETS,
+            &io_config.recorder.packets);
+        pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_FLIGHT_RECORDER_BYTES,
+            &io_config.recorder.bytes);
+        recorder_file = g_key_file_get_string(cfg, PLUGIN_GROUP,
+            PLUGIN_KEY_FLIGHT_RECORDER_FILE, NULL);
+        if (recorder_file && recorder_file[0]) {
+            GDEBUG("Flight recorder file %s", recorder_file);
+            io_config.recorder.file = recorder_file;
+        }
+        pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_HEXDUMP_QUEUE_SIZE,
+            &io_config.hexdump_queue_size);
+        pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_POWER_OFF_DELAY,
+            &config.power_off_delay);
+        pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_BOOT_TIMEOUT,
+            &config.boot_timeout);
+        pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_RESET_PULSE,
+            &config.recovery.pulse);
+        pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_RESET_BACKOFF_MIN,
+            &config.recovery.backoff_min);
+        pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_RESET_BACKOFF_MAX,
+            &config.recovery.backoff_max);
+        pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_RESETS_PER_MINUTE,
+            &config.recovery.rate_limit);
+        pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_RESET_ATTEMPTS,
+            &config.recovery.max_attempts);
+        fw_image = g_key_file_get_string(cfg, PLUGIN_GROUP,
+            PLUGIN_KEY_FIRMWARE_IMAGE, NULL);
+        if (fw_image && fw_image[0]) {
+            GDEBUG("Firmware %s", fw_image);
+            config.fw_image = fw_image;
+            pn54x_nfc_plugin_get_uint(cfg, PLUGIN_KEY_FIRMWARE_FRAME_SIZE,
+                &config.fw_config.max_frame);
+        }
     }
 
     self->manager = nfc_manager_ref(manager);
-    self->adapter = pn54x_nfc_adapter_new(dev);
-    nfc_manager_add_adapter(self->manager, self->adapter);
+    self->adapter = pn54x_nfc_adapter_new(dev, &io_config, &config);
+    if (nfc_manager_add_adapter(self->manager, self->adapter)) {
+        /* Statistics are exported next to the adapter object */
+        self->cancel = g_cancellable_new();
+        g_bus_get(G_BUS_TYPE_SYSTEM, self->cancel,
+            pn54x_nfc_plugin_bus_get_done, g_object_ref(self));
+    }
     g_key_file_free(cfg);
     g_free(tmp_dev);
+    g_free(fw_image);
+    g_free(capture_file);
+    g_free(recorder_file);
     return TRUE;
 }
 
@@ -104,6 +470,17 @@ pn54x_nfc_plugin_stop(
     Pn54xNfcPlugin* self = PN54X_NFC_PLUGIN(plugin);
 
     GVERBOSE("Stopping");
+    if (self->cancel) {
+        g_cancellable_cancel(self->cancel);
+        g_object_unref(self->cancel);
+        self->cancel = NULL;
+    }
+    pn54x_dbus_free(self->dbus);
+    self->dbus = NULL;
+    if (self->connection) {
+        g_object_unref(self->connection);
+        self->connection = NULL;
+    }
     if (self->adapter) {
         nfc_manager_remove_adapter(self->manager, self->adapter->name);
         nfc_adapter_unref(self->adapter);
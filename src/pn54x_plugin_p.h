@@ -39,13 +39,45 @@
 #ifndef PN54X_PLUGIN_PRIVATE_H
 #define PN54X_PLUGIN_PRIVATE_H
 
+#include "pn54x_dbus.h"
+#include "pn54x_io.h"
+#include "pn54x_recovery.h"
+
 #include <nfc_types.h>
 
 /* Internal header file for pn54x plugin implementation */
 
+/* Zero-initialized structure means defaults */
+typedef struct pn54x_nfc_adapter_config {
+    guint power_off_delay;  /* ms to keep the chip powered after it's idle */
+    guint boot_timeout;     /* Max ms to wait for CORE_RESET_NTF, 0 = don't */
+    const char* fw_image;   /* Firmware to download on startup */
+    Pn54xFwConfig fw_config;
+    Pn54xRecoveryConfig recovery;
+} Pn54xNfcAdapterConfig;
+
 NfcAdapter*
 pn54x_nfc_adapter_new(
-    const char* dev);
+    const char* dev,
+    const Pn54xIoConfig* io_config,
+    const Pn54xNfcAdapterConfig* config);
+
+void
+pn54x_nfc_adapter_get_stats(
+    NfcAdapter* adapter,
+    Pn54xDBusStats* stats);
+
+void
+pn54x_nfc_adapter_reset_stats(
+    NfcAdapter* adapter);
+
+void
+pn54x_nfc_adapter_dump_packets(
+    NfcAdapter* adapter);
+
+void
+pn54x_nfc_adapter_dump_latency(
+    NfcAdapter* adapter);
 
 #endif /* PN54X_PLUGIN_PRIVATE_H */
 
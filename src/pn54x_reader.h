@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_READER_H
+#define PN54X_READER_H
+
+#include <gutil_types.h>
+
+#include <sys/types.h>
+
+/*
+ * Callbacks shared by the readers performing blocking reads outside
+ * of the main loop. They are invoked by the default main context.
+ */
+
+typedef
+void
+(*Pn54xReaderDataFunc)(
+    const void* data,
+    guint len,
+    void* user_data);
+
+typedef
+void
+(*Pn54xReaderErrorFunc)(
+    void* user_data);
+
+/* Scheduling of the reader. Zero-initialized structure changes nothing. */
+
+typedef enum pn54x_reader_policy {
+    PN54X_READER_POLICY_DEFAULT,    /* Inherited */
+    PN54X_READER_POLICY_OTHER,      /* SCHED_OTHER */
+    PN54X_READER_POLICY_FIFO,       /* SCHED_FIFO */
+    PN54X_READER_POLICY_RR          /* SCHED_RR */
+} PN54X_READER_POLICY;
+
+typedef enum pn54x_reader_sched_flags {
+    PN54X_READER_SCHED_NO_FLAGS = 0x00,
+    PN54X_READER_SCHED_NICE = 0x01,     /* Apply the nice value */
+    PN54X_READER_SCHED_MLOCK = 0x02     /* Lock the buffers and the stack */
+} PN54X_READER_SCHED_FLAGS;
+
+typedef struct pn54x_reader_sched {
+    PN54X_READER_POLICY policy;
+    PN54X_READER_SCHED_FLAGS flags;
+    int priority;       /* SCHED_FIFO and SCHED_RR */
+    int nice;           /* If PN54X_READER_SCHED_NICE is set */
+    guint64 cpus;       /* CPU mask, zero means any CPU */
+} Pn54xReaderSched;
+
+/* Applies the settings to the thread or process, zero means self */
+void
+pn54x_reader_sched_apply(
+    const Pn54xReaderSched* sched,
+    pid_t tid);
+
+#endif /* PN54X_READER_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_reader_child.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+/* The read loop doesn't need much */
+#define PN54X_READER_CHILD_STACK_SIZE (16 * 1024)
+
+static int pn54x_reader_child_pause_request;
+
+static
+void
+pn54x_reader_child_signal_handler(
+    int sig)
+{
+    __atomic_store_n(&pn54x_reader_child_pause_request, 1, __ATOMIC_SEQ_CST);
+}
+
+static
+int
+pn54x_reader_child_wait(
+    int ctl)
+{
+    for (;;) {
+        char cmd;
+        char cbuf[CMSG_SPACE(sizeof(int))];
+        struct iovec iov;
+        struct msghdr msg;
+        ssize_t len;
+
+        iov.iov_base = &cmd;
+        iov.iov_len = 1;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        len = recvmsg(ctl, &msg, MSG_CMSG_CLOEXEC);
+        if (len == 1 && cmd == PN54X_READER_CMD_RESUME) {
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+
+            if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_RIGHTS) {
+                int fd;
+
+                /* Signals that arrived while we were paused are stale */
+                __atomic_store_n(&pn54x_reader_child_pause_request, 0,
+                    __ATOMIC_SEQ_CST);
+                memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+                return fd;
+            }
+            return -1;
+        } else if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len <= 0) {
+            /* The parent has gone */
+            return -1;
+        }
+        /* Ignore the pause command, we are already paused */
+    }
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+void
+pn54x_reader_child_signal_init(
+    void)
+{
+    struct sigaction sa;
+
+    /* No SA_RESTART, we want read() to fail with EINTR */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = pn54x_reader_child_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(PN54X_READER_CHILD_SIGNAL, &sa, NULL);
+}
+
+/*
+ * Must be called from the same or deeper stack frame than the read
+ * loop. The locked part of the stack is below the caller's frame.
+ */
+int
+pn54x_reader_child_lock_memory(
+    const Pn54xRingProducer* ring)
+{
+    volatile char stack[PN54X_READER_CHILD_STACK_SIZE];
+
+    memset((char*)stack, 0, sizeof(stack));
+    if (mlock(ring->shm, pn54x_ring_shm_size(ring->slots,
+        ring->slot_size)) < 0 || mlock((char*)stack, sizeof(stack)) < 0) {
+        return errno;
+    }
+    return 0;
+}
+
+void
+pn54x_reader_child_run(
+    const Pn54xRingProducer* ring,
+    int fd,
+    int ctl)
+{
+    const char ack = PN54X_READER_CMD_PAUSE;
+
+    while (fd >= 0) {
+        pn54x_ring_producer_read(ring, fd, &pn54x_reader_child_pause_request);
+        close(fd);
+        if (!__atomic_load_n(&pn54x_reader_child_pause_request,
+            __ATOMIC_SEQ_CST) || send(ctl, &ack, 1, MSG_NOSIGNAL) != 1) {
+            /* Read has failed, the parent has been notified via the ring */
+            break;
+        }
+        fd = pn54x_reader_child_wait(ctl);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
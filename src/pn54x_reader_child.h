@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_READER_CHILD_H
+#define PN54X_READER_CHILD_H
+
+/*
+ * The loop running in the reader process, either forked or exec'd.
+ * Doesn't depend on glib and doesn't log anything.
+ *
+ * The control protocol is a single byte command per message. Pause is
+ * acknowledged by the child with the same byte, after it has closed
+ * the device. Resume carries the new device descriptor (SCM_RIGHTS).
+ */
+
+#include "pn54x_ring_shm.h"
+
+#include <signal.h>
+
+#define PN54X_READER_CHILD_SIGNAL (SIGRTMIN + 1)
+
+#define PN54X_READER_CMD_PAUSE  'P'
+#define PN54X_READER_CMD_RESUME 'R'
+
+/* Arguments of the helper binary */
+#define PN54X_READER_HELPER_NAME "pn54x-reader"
+#define PN54X_READER_HELPER_FD_DEV   (3)
+#define PN54X_READER_HELPER_FD_CTL   (4)
+#define PN54X_READER_HELPER_FD_MEM   (5)
+#define PN54X_READER_HELPER_FD_DATA  (6)
+#define PN54X_READER_HELPER_FD_SPACE (7)
+#define PN54X_READER_HELPER_FD_COUNT (5)
+#define PN54X_READER_HELPER_ARG_MLOCK "mlock"
+
+/* Invoked by the child, the signal must be blocked until then */
+void
+pn54x_reader_child_signal_init(
+    void);
+
+/* Locks the ring and the stack, returns zero or errno */
+int
+pn54x_reader_child_lock_memory(
+    const Pn54xRingProducer* ring);
+
+void
+pn54x_reader_child_run(
+    const Pn54xRingProducer* ring,
+    int fd,
+    int ctl);
+
+#endif /* PN54X_READER_CHILD_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_reader_child.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+/*
+ * Minimal reader helper executable. The plugin spawns it with the
+ * device, control socket, ring memory and ring eventfd descriptors at
+ * fixed positions, see pn54x_reader_child.h. The signal used to pause
+ * it is blocked until the handler is installed.
+ */
+
+int
+main(
+    int argc,
+    char* argv[])
+{
+    Pn54xRingProducer ring;
+    sigset_t set;
+    char* end;
+    unsigned long slots, slot_size;
+
+    if (argc < 3 || argc > 4 || (argc == 4 &&
+        strcmp(argv[3], PN54X_READER_HELPER_ARG_MLOCK))) {
+        fprintf(stderr, "Usage: %s SLOTS SLOT_SIZE [%s]\n", argv[0],
+            PN54X_READER_HELPER_ARG_MLOCK);
+        return 1;
+    }
+
+    slots = strtoul(argv[1], &end, 0);
+    if (*end || !slots) {
+        fprintf(stderr, "Invalid slot count %s\n", argv[1]);
+        return 1;
+    }
+
+    slot_size = strtoul(argv[2], &end, 0);
+    if (*end || !slot_size) {
+        fprintf(stderr, "Invalid slot size %s\n", argv[2]);
+        return 1;
+    }
+
+    memset(&ring, 0, sizeof(ring));
+    ring.data_fd = PN54X_READER_HELPER_FD_DATA;
+    ring.space_fd = PN54X_READER_HELPER_FD_SPACE;
+    if (!pn54x_ring_producer_map(&ring, PN54X_READER_HELPER_FD_MEM,
+        slots, slot_size)) {
+        perror("mmap");
+        return 1;
+    }
+
+    /* The whole helper is small enough to keep it all in memory */
+    if (argc == 4 && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        perror("mlockall");
+    }
+
+    /* Don't outlive the parent */
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    pn54x_reader_child_signal_init();
+    sigemptyset(&set);
+    sigaddset(&set, PN54X_READER_CHILD_SIGNAL);
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+    pn54x_reader_child_run(&ring, PN54X_READER_HELPER_FD_DEV,
+        PN54X_READER_HELPER_FD_CTL);
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,666 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_reader_process.h"
+#include "pn54x_reader_child.h"
+#include "pn54x_ring.h"
+#include "pn54x_log.h"
+
+#include <glib-unix.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/*
+ * The child process reads directly into the shared ring, which is
+ * parsed in place by the parent. If the helper executable is there,
+ * the child is spawned from it. Otherwise, we fork.
+ *
+ * The child is controlled over a socket. Pausing it takes a message
+ * and a signal to interrupt the blocking read. The child closes the
+ * device and acknowledges that it's paused. Resuming passes it the
+ * new device descriptor with SCM_RIGHTS. That way the same child keeps
+ * running while the chip is being powered on and off. The child is
+ * only killed when it's no longer needed or something goes wrong.
+ *
+ * The signal may arrive right before the child enters read(), in which
+ * case it gets stuck until the next chunk of data arrives. Therefore,
+ * the signal is repeated until the child responds. The acknowledgement
+ * is waited for asynchronously, resume requested in the meantime is
+ * sent to the child once it has responded.
+ *
+ * Until then, the child may still be reading the old descriptor, and
+ * if the chip gets powered on again, it would read the first packet
+ * of the new session, which would then be dropped as stale. The owner
+ * of the device must therefore call pn54x_reader_process_wait_paused()
+ * before opening it again.
+ */
+
+#define PN54X_READER_PROCESS_PAUSE_POLL_MS (10)
+#define PN54X_READER_PROCESS_PAUSE_TIMEOUT_MS (500)
+#define PN54X_READER_PROCESS_WAIT_POLL_MS (1)
+
+struct pn54x_reader_process {
+    gint refcount;
+    gboolean stopped;
+    gboolean paused;
+    gboolean draining;
+    gboolean failed;
+    pid_t pid;
+    int ctl_fd;
+    int resume_fd;
+    int pause_waited;
+    guint data_id;
+    guint ctl_id;
+    guint pause_id;
+    guint kick_id;
+    Pn54xRing* ring;
+    Pn54xReaderDataFunc data_fn;
+    Pn54xReaderErrorFunc error_fn;
+    void* user_data;
+};
+
+static
+Pn54xReaderProcess*
+pn54x_reader_process_ref(
+    Pn54xReaderProcess* self)
+{
+    GASSERT(self->refcount > 0);
+    self->refcount++;
+    return self;
+}
+
+static
+void
+pn54x_reader_process_unref(
+    Pn54xReaderProcess* self)
+{
+    GASSERT(self->refcount > 0);
+    if (!--self->refcount) {
+        if (self->ctl_fd >= 0) {
+            close(self->ctl_fd);
+        }
+        if (self->resume_fd >= 0) {
+            close(self->resume_fd);
+        }
+        pn54x_ring_unref(self->ring);
+        g_free(self);
+    }
+}
+
+static
+void
+pn54x_reader_process_remove_watches(
+    Pn54xReaderProcess* self)
+{
+    if (self->data_id) {
+        g_source_remove(self->data_id);
+        self->data_id = 0;
+    }
+    if (self->ctl_id) {
+        g_source_remove(self->ctl_id);
+        self->ctl_id = 0;
+    }
+    if (self->pause_id) {
+        g_source_remove(self->pause_id);
+        self->pause_id = 0;
+    }
+    if (self->kick_id) {
+        g_source_remove(self->kick_id);
+        self->kick_id = 0;
+    }
+}
+
+static
+void
+pn54x_reader_process_drain(
+    Pn54xReaderProcess* self)
+{
+    Pn54xRing* ring = self->ring;
+    const void* data;
+    guint len;
+
+    /* The callback may pause us, which drains the ring too */
+    self->draining = TRUE;
+    pn54x_ring_clear(ring);
+    while ((data = pn54x_ring_peek(ring, &len)) != NULL) {
+        if (!self->stopped && !self->paused) {
+            self->data_fn(data, len, self->user_data);
+        }
+        pn54x_ring_release(ring);
+    }
+    self->draining = FALSE;
+}
+
+static
+void
+pn54x_reader_process_error(
+    Pn54xReaderProcess* self)
+{
+    if (!self->failed) {
+        self->failed = TRUE;
+        pn54x_reader_process_remove_watches(self);
+
+        /* Resume that hasn't reached the child yet counts as resumed */
+        if (!self->stopped && (!self->paused || self->resume_fd >= 0)) {
+            self->error_fn(self->user_data);
+        }
+    }
+}
+
+static
+gboolean
+pn54x_reader_process_data(
+    gint fd,
+    GIOCondition condition,
+    gpointer user_data)
+{
+    Pn54xReaderProcess* self = pn54x_reader_process_ref(user_data);
+    int error;
+
+    pn54x_reader_process_drain(self);
+    if (!self->stopped && pn54x_ring_failed(self->ring, &error)) {
+        if (error) {
+            GERR("Read failed: %s", strerror(error));
+        } else {
+            GDEBUG("End of stream");
+        }
+        pn54x_reader_process_error(self);
+    }
+    pn54x_reader_process_unref(self);
+    return G_SOURCE_CONTINUE;
+}
+
+static
+gboolean
+pn54x_reader_process_death(
+    gint fd,
+    GIOCondition condition,
+    gpointer user_data)
+{
+    Pn54xReaderProcess* self = pn54x_reader_process_ref(user_data);
+
+    /* Pick up whatever the child has managed to read before dying */
+    pn54x_reader_process_drain(self);
+    if (!self->stopped) {
+        int error;
+
+        if (!pn54x_ring_failed(self->ring, &error)) {
+            GERR("Read process %d died", self->pid);
+        } else if (error) {
+            GERR("Read failed: %s", strerror(error));
+        } else {
+            GDEBUG("End of stream");
+        }
+        pn54x_reader_process_error(self);
+    }
+    pn54x_reader_process_unref(self);
+    return G_SOURCE_CONTINUE;
+}
+
+static
+void
+pn54x_reader_process_add_watches(
+    Pn54xReaderProcess* self)
+{
+    self->data_id = g_unix_fd_add(self->ring->data_fd, G_IO_IN,
+        pn54x_reader_process_data, self);
+    self->ctl_id = g_unix_fd_add(self->ctl_fd, G_IO_ERR | G_IO_HUP,
+        pn54x_reader_process_death, self);
+}
+
+static
+gboolean
+pn54x_reader_process_send_resume(
+    Pn54xReaderProcess* self,
+    int fd)
+{
+    char cmd = PN54X_READER_CMD_RESUME;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr* cmsg;
+    struct iovec iov;
+    struct msghdr msg;
+
+    iov.iov_base = &cmd;
+    iov.iov_len = 1;
+    memset(cbuf, 0, sizeof(cbuf));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+    if (sendmsg(self->ctl_fd, &msg, MSG_NOSIGNAL) == 1) {
+        self->paused = FALSE;
+        GDEBUG("Resumed read process %d", self->pid);
+        return TRUE;
+    }
+    GERR("Failed to resume read process %d: %s", self->pid,
+        strerror(errno));
+    return FALSE;
+}
+
+static
+void
+pn54x_reader_process_pause_done(
+    Pn54xReaderProcess* self,
+    gboolean ok)
+{
+    if (self->pause_id) {
+        g_source_remove(self->pause_id);
+        self->pause_id = 0;
+    }
+    if (self->kick_id) {
+        g_source_remove(self->kick_id);
+        self->kick_id = 0;
+    }
+    if (ok) {
+        /* Whatever has been read before the pause is stale */
+        if (!self->draining) {
+            pn54x_reader_process_drain(self);
+        }
+        ok = !pn54x_ring_failed(self->ring, NULL);
+    }
+    if (ok) {
+        GDEBUG("Paused read process %d", self->pid);
+        if (self->resume_fd >= 0) {
+            if (pn54x_reader_process_send_resume(self, self->resume_fd)) {
+                close(self->resume_fd);
+                self->resume_fd = -1;
+            } else {
+                pn54x_reader_process_error(self);
+            }
+        }
+    } else {
+        pn54x_reader_process_error(self);
+    }
+}
+
+static
+gboolean
+pn54x_reader_process_ack(
+    gint fd,
+    GIOCondition condition,
+    gpointer user_data)
+{
+    Pn54xReaderProcess* self = pn54x_reader_process_ref(user_data);
+    char ack;
+
+    self->pause_id = 0;
+    pn54x_reader_process_pause_done(self, (condition & G_IO_IN) &&
+        recv(fd, &ack, 1, 0) == 1 && ack == PN54X_READER_CMD_PAUSE);
+    pn54x_reader_process_unref(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+gboolean
+pn54x_reader_process_kick(
+    gpointer user_data)
+{
+    Pn54xReaderProcess* self = user_data;
+
+    /* Keep kicking the child until it responds */
+    self->pause_waited += PN54X_READER_PROCESS_PAUSE_POLL_MS;
+    if (self->pause_waited < PN54X_READER_PROCESS_PAUSE_TIMEOUT_MS) {
+        kill(self->pid, PN54X_READER_CHILD_SIGNAL);
+        return G_SOURCE_CONTINUE;
+    }
+    GWARN("Read process %d is not responding", self->pid);
+    self->kick_id = 0;
+    pn54x_reader_process_ref(self);
+    pn54x_reader_process_pause_done(self, FALSE);
+    pn54x_reader_process_unref(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+pid_t
+pn54x_reader_process_spawn(
+    const char* helper,
+    gboolean mlock,
+    Pn54xRing* ring,
+    int fd,
+    int ctl)
+{
+    const int src[PN54X_READER_HELPER_FD_COUNT] = {
+        fd, ctl, ring->memfd, ring->data_fd, ring->space_fd
+    };
+    int tmp[PN54X_READER_HELPER_FD_COUNT];
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t set;
+    char slots[16], slot_size[16];
+    char* argv[5];
+    char* envp[1];
+    pid_t pid = 0;
+    guint i, n;
+    int err = 0;
+
+    /* Get the descriptors out of the way of the target numbers */
+    for (n = 0; n < G_N_ELEMENTS(src); n++) {
+        tmp[n] = fcntl(src[n], F_DUPFD_CLOEXEC, PN54X_READER_HELPER_FD_DEV +
+            PN54X_READER_HELPER_FD_COUNT);
+        if (tmp[n] < 0) {
+            err = errno;
+            break;
+        }
+    }
+
+    if (!err) {
+        posix_spawn_file_actions_init(&actions);
+        for (i = 0; i < n; i++) {
+            /* The copies made by dup2() are inherited */
+            posix_spawn_file_actions_adddup2(&actions, tmp[i],
+                PN54X_READER_HELPER_FD_DEV + i);
+        }
+
+        /* The signal is blocked until the helper sets up the handler */
+        sigemptyset(&set);
+        sigaddset(&set, PN54X_READER_CHILD_SIGNAL);
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+            POSIX_SPAWN_SETSIGDEF);
+        posix_spawnattr_setsigmask(&attr, &set);
+        posix_spawnattr_setsigdefault(&attr, &set);
+
+        snprintf(slots, sizeof(slots), "%u", ring->slots);
+        snprintf(slot_size, sizeof(slot_size), "%u", ring->slot_size);
+        argv[0] = (char*)helper;
+        argv[1] = slots;
+        argv[2] = slot_size;
+        argv[3] = mlock ? PN54X_READER_HELPER_ARG_MLOCK : NULL;
+        argv[4] = NULL;
+        envp[0] = NULL;
+        err = posix_spawn(&pid, helper, &actions, &attr, argv, envp);
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+    }
+
+    for (i = 0; i < n; i++) {
+        close(tmp[i]);
+    }
+
+    if (err) {
+        GDEBUG("Failed to spawn %s: %s", helper, strerror(err));
+        return 0;
+    }
+    return pid;
+}
+
+static
+pid_t
+pn54x_reader_process_fork(
+    gboolean mlock,
+    Pn54xRing* ring,
+    int fd,
+    int ctl[2])
+{
+    sigset_t set, saved;
+    pid_t pid;
+
+    /*
+     * The handler is installed by the child, not to mess with signal
+     * dispositions of the parent. The signal is blocked until then, so
+     * that the child never misses it.
+     */
+    sigemptyset(&set);
+    sigaddset(&set, PN54X_READER_CHILD_SIGNAL);
+    pthread_sigmask(SIG_BLOCK, &set, &saved);
+    pid = fork();
+    if (pid == 0) {
+        /* Nothing but the read loop, which doesn't log anything */
+        pn54x_reader_child_signal_init();
+        sigprocmask(SIG_UNBLOCK, &set, NULL);
+        close(ctl[0]);
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (mlock) {
+            /* Not the whole copy of the parent, just what we touch */
+            pn54x_reader_child_lock_memory(pn54x_ring_producer(ring));
+        }
+        pn54x_reader_child_run(pn54x_ring_producer(ring), fd, ctl[1]);
+        _exit(0);
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (pid < 0) {
+        GERR("Failed to start read process: %s", strerror(errno));
+        return 0;
+    }
+    return pid;
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+Pn54xReaderProcess*
+pn54x_reader_process_start(
+    int fd,
+    guint slots,
+    guint chunk_size,
+    const char* helper,
+    const Pn54xReaderSched* sched,
+    Pn54xReaderDataFunc data_fn,
+    Pn54xReaderErrorFunc error_fn,
+    void* user_data)
+{
+    Pn54xRing* ring = pn54x_ring_new(slots, chunk_size);
+    int ctl[2];
+
+    if (ring && socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+        ctl) == 0) {
+        /*
+         * The driver is primitive, read is blocking, we can't cancel
+         * the read - the only thing we can do is to perform the read
+         * in a separate process and interrupt it with a signal.
+         */
+        const gboolean mlock = sched &&
+            (sched->flags & PN54X_READER_SCHED_MLOCK);
+        pid_t pid = 0;
+
+        if (helper) {
+            pid = pn54x_reader_process_spawn(helper, mlock, ring, fd, ctl[1]);
+        }
+        if (!pid) {
+            pid = pn54x_reader_process_fork(mlock, ring, fd, ctl);
+        }
+        close(ctl[1]);
+        if (pid) {
+            Pn54xReaderProcess* self = g_new0(Pn54xReaderProcess, 1);
+
+            self->refcount = 1;
+            self->pid = pid;
+            self->ring = ring;
+            self->ctl_fd = ctl[0];
+            self->resume_fd = -1;
+            self->data_fn = data_fn;
+            self->error_fn = error_fn;
+            self->user_data = user_data;
+            pn54x_reader_process_add_watches(self);
+            GDEBUG("Started read process %d", pid);
+            pn54x_reader_sched_apply(sched, pid);
+            return self;
+        }
+        close(ctl[0]);
+    }
+    pn54x_ring_unref(ring);
+    return NULL;
+}
+
+/*
+ * Makes the child close the device. Returns FALSE if the child is
+ * unusable and has to be stopped. The child acknowledges the pause
+ * asynchronously, no more data are passed to the callback either way.
+ */
+gboolean
+pn54x_reader_process_pause(
+    Pn54xReaderProcess* self)
+{
+    if (G_LIKELY(self) && !self->failed) {
+        const char cmd = PN54X_READER_CMD_PAUSE;
+
+        if (self->paused) {
+            /* Cancel the resume if it hasn't been sent yet */
+            if (self->resume_fd >= 0) {
+                close(self->resume_fd);
+                self->resume_fd = -1;
+            }
+            return TRUE;
+        }
+        self->paused = TRUE;
+        if (send(self->ctl_fd, &cmd, 1, MSG_NOSIGNAL) == 1) {
+            kill(self->pid, PN54X_READER_CHILD_SIGNAL);
+            self->pause_waited = 0;
+            self->pause_id = g_unix_fd_add(self->ctl_fd, G_IO_IN,
+                pn54x_reader_process_ack, self);
+            self->kick_id = g_timeout_add(PN54X_READER_PROCESS_PAUSE_POLL_MS,
+                pn54x_reader_process_kick, self);
+            return TRUE;
+        }
+        self->failed = TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * Blocks until the child acknowledges the pause (if it's being paused)
+ * and closes its copy of the descriptor. Normally that's a matter of
+ * microseconds, the child is kicked every millisecond in case if it's
+ * stuck in read(). Returns FALSE if the child is unusable and has to be
+ * stopped.
+ */
+gboolean
+pn54x_reader_process_wait_paused(
+    Pn54xReaderProcess* self)
+{
+    if (G_LIKELY(self) && !self->failed) {
+        if (self->pause_id) {
+            const gint64 deadline = g_get_monotonic_time() +
+                PN54X_READER_PROCESS_PAUSE_TIMEOUT_MS * 1000;
+            struct pollfd pfd;
+            char ack;
+            int n;
+
+            memset(&pfd, 0, sizeof(pfd));
+            pfd.fd = self->ctl_fd;
+            pfd.events = POLLIN;
+            while ((n = poll(&pfd, 1, PN54X_READER_PROCESS_WAIT_POLL_MS)) <= 0
+                && (n == 0 || errno == EINTR)) {
+                if (g_get_monotonic_time() >= deadline) {
+                    GWARN("Read process %d is not responding", self->pid);
+                    break;
+                }
+                kill(self->pid, PN54X_READER_CHILD_SIGNAL);
+            }
+            pn54x_reader_process_ref(self);
+            pn54x_reader_process_pause_done(self, (pfd.revents & POLLIN) &&
+                recv(self->ctl_fd, &ack, 1, 0) == 1 &&
+                ack == PN54X_READER_CMD_PAUSE);
+            pn54x_reader_process_unref(self);
+        }
+        return !self->failed;
+    }
+    return FALSE;
+}
+
+gboolean
+pn54x_reader_process_resume(
+    Pn54xReaderProcess* self,
+    int fd)
+{
+    if (G_LIKELY(self) && self->paused && !self->failed) {
+        if (self->pause_id) {
+            /* The child will get it after it has acknowledged the pause */
+            if (self->resume_fd >= 0) {
+                close(self->resume_fd);
+            }
+            self->resume_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+            if (self->resume_fd >= 0) {
+                return TRUE;
+            }
+            GERR("Failed to duplicate descriptor: %s", strerror(errno));
+            self->failed = TRUE;
+            return FALSE;
+        }
+        if (pn54x_reader_process_send_resume(self, fd)) {
+            return TRUE;
+        }
+        self->failed = TRUE;
+    }
+    return FALSE;
+}
+
+void
+pn54x_reader_process_stop(
+    Pn54xReaderProcess* self)
+{
+    if (G_LIKELY(self)) {
+        const guint overflows = pn54x_ring_overflows(self->ring);
+        int status;
+
+        pn54x_reader_process_remove_watches(self);
+        self->stopped = TRUE;
+        GDEBUG("Killing child %d", self->pid);
+        kill(self->pid, SIGKILL);
+        waitpid(self->pid, &status, 0);
+        if (overflows) {
+            GDEBUG("%u overflow(s)", overflows);
+        }
+        pn54x_reader_process_unref(self);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_READER_PROCESS_H
+#define PN54X_READER_PROCESS_H
+
+#include "pn54x_reader.h"
+
+/*
+ * Blocking reads from the device performed by a child process. The
+ * child outlives the device descriptor. It can be paused, which makes
+ * it close its copy of the descriptor, and resumed with a new one.
+ * If helper is NULL or can't be executed, the child is forked.
+ */
+
+typedef struct pn54x_reader_process Pn54xReaderProcess;
+
+Pn54xReaderProcess*
+pn54x_reader_process_start(
+    int fd,
+    guint slots,
+    guint chunk_size,
+    const char* helper,
+    const Pn54xReaderSched* sched,
+    Pn54xReaderDataFunc data_fn,
+    Pn54xReaderErrorFunc error_fn,
+    void* user_data);
+
+gboolean
+pn54x_reader_process_pause(
+    Pn54xReaderProcess* reader);
+
+gboolean
+pn54x_reader_process_wait_paused(
+    Pn54xReaderProcess* reader); /* Blocks, call before reopening */
+
+gboolean
+pn54x_reader_process_resume(
+    Pn54xReaderProcess* reader,
+    int fd);
+
+void
+pn54x_reader_process_stop(
+    Pn54xReaderProcess* reader);
+
+#endif /* PN54X_READER_PROCESS_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_reader.h"
+#include "pn54x_log.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+static
+const char*
+pn54x_reader_sched_policy_name(
+    int policy)
+{
+    switch (policy) {
+    case SCHED_OTHER: return "other";
+    case SCHED_FIFO: return "fifo";
+    case SCHED_RR: return "rr";
+#ifdef SCHED_BATCH
+    case SCHED_BATCH: return "batch";
+#endif
+#ifdef SCHED_IDLE
+    case SCHED_IDLE: return "idle";
+#endif
+    }
+    return "?";
+}
+
+static
+void
+pn54x_reader_sched_dump(
+    pid_t tid)
+{
+    if (GLOG_ENABLED(GLOG_LEVEL_DEBUG)) {
+        const int policy = sched_getscheduler(tid);
+        struct sched_param param;
+        cpu_set_t cpus;
+        GString* buf = g_string_new(NULL);
+        int prio;
+
+        memset(&param, 0, sizeof(param));
+        sched_getparam(tid, &param);
+        errno = 0;
+        prio = getpriority(PRIO_PROCESS, tid);
+        CPU_ZERO(&cpus);
+        if (sched_getaffinity(tid, sizeof(cpus), &cpus) == 0) {
+            int i, n = 0;
+
+            for (i = 0; i < CPU_SETSIZE; i++) {
+                if (CPU_ISSET(i, &cpus)) {
+                    g_string_append_printf(buf, n++ ? ",%d" : "%d", i);
+                }
+            }
+        }
+        GDEBUG("Reader %d: %s priority %d nice %d cpus %s",
+            tid ? tid : (int)syscall(SYS_gettid),
+            pn54x_reader_sched_policy_name(policy), param.sched_priority,
+            errno ? 0 : prio, buf->str);
+        g_string_free(buf, TRUE);
+    }
+}
+
+void
+pn54x_reader_sched_apply(
+    const Pn54xReaderSched* sched,
+    pid_t tid)
+{
+    if (sched && (sched->policy || sched->flags || sched->cpus)) {
+        if (sched->policy != PN54X_READER_POLICY_DEFAULT) {
+            struct sched_param param;
+            int policy;
+
+            memset(&param, 0, sizeof(param));
+            switch (sched->policy) {
+            case PN54X_READER_POLICY_FIFO:
+                policy = SCHED_FIFO;
+                param.sched_priority = sched->priority;
+                break;
+            case PN54X_READER_POLICY_RR:
+                policy = SCHED_RR;
+                param.sched_priority = sched->priority;
+                break;
+            case PN54X_READER_POLICY_OTHER:
+            default:
+                policy = SCHED_OTHER;
+                break;
+            }
+            if (sched_setscheduler(tid, policy, &param) < 0) {
+                GWARN("Failed to set %s scheduling policy: %s",
+                    pn54x_reader_sched_policy_name(policy), strerror(errno));
+            }
+        }
+        if ((sched->flags & PN54X_READER_SCHED_NICE) &&
+            setpriority(PRIO_PROCESS, tid, sched->nice) < 0) {
+            GWARN("Failed to set nice %d: %s", sched->nice, strerror(errno));
+        }
+        if (sched->cpus) {
+            cpu_set_t cpus;
+            int i;
+
+            CPU_ZERO(&cpus);
+            for (i = 0; i < 64; i++) {
+                if (sched->cpus & (G_GUINT64_CONSTANT(1) << i)) {
+                    CPU_SET(i, &cpus);
+                }
+            }
+            if (sched_setaffinity(tid, sizeof(cpus), &cpus) < 0) {
+                GWARN("Failed to set CPU affinity: %s", strerror(errno));
+            }
+        }
+        pn54x_reader_sched_dump(tid);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
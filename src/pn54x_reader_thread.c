@@ -0,0 +1,408 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_reader_thread.h"
+#include "pn54x_reader_child.h"
+#include "pn54x_ring.h"
+#include "pn54x_system.h"
+#include "pn54x_log.h"
+
+#include <glib-unix.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+/*
+ * The reader thread owns a duplicate of the device descriptor and
+ * reads directly into the ring, which is parsed in place by the main
+ * thread.
+ *
+ * The read is blocking and can't be cancelled, and closing the
+ * descriptor doesn't interrupt it either. Stopping the thread sends
+ * it a signal with a no-op handler to interrupt read() with EINTR.
+ * If the signal arrives before the thread enters read(), the thread
+ * stays blocked, keeps the device open and would swallow the first
+ * packet of the next session. Therefore, the signal is repeated until
+ * the thread confirms that it's done with reading, and no new thread
+ * is started while an old one is still blocked. The main loop doesn't
+ * wait for that, the start is deferred until the old threads are gone,
+ * and fails (asynchronously) if that doesn't happen in time.
+ */
+
+#define PN54X_READER_SIGNAL PN54X_SYSTEM_INTERRUPT_SIGNAL
+#define PN54X_READER_KICK_MS (10)
+#define PN54X_READER_START_TIMEOUT_MS (500)
+
+struct pn54x_reader_thread {
+    gint refcount;
+    gint stopped;
+    gint done;
+    gboolean started;
+    gint64 deadline; /* For the deferred start */
+    int fd;
+    pthread_t thread;
+    guint watch_id;
+    Pn54xRing* ring;
+    Pn54xReaderSched sched;
+    Pn54xReaderDataFunc data_fn;
+    Pn54xReaderErrorFunc error_fn;
+    void* user_data;
+};
+
+/* Stopped threads which haven't confirmed it yet, main thread only */
+static GSList* pn54x_reader_thread_stale = NULL;
+static guint pn54x_reader_thread_kick_id = 0;
+
+/* Threads waiting for the stale ones to go away, main thread only */
+static GSList* pn54x_reader_thread_pending = NULL;
+
+static
+Pn54xReaderThread*
+pn54x_reader_thread_ref(
+    Pn54xReaderThread* self)
+{
+    GASSERT(self->refcount > 0);
+    g_atomic_int_inc(&self->refcount);
+    return self;
+}
+
+static
+void
+pn54x_reader_thread_unref(
+    Pn54xReaderThread* self)
+{
+    GASSERT(self->refcount > 0);
+    if (g_atomic_int_dec_and_test(&self->refcount)) {
+        if (self->fd >= 0) {
+            close(self->fd);
+        }
+        pn54x_ring_unref(self->ring);
+        g_free(self);
+    }
+}
+
+static
+void*
+pn54x_reader_thread_proc(
+    void* arg)
+{
+    Pn54xReaderThread* self = arg;
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, PN54X_READER_SIGNAL);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+    pn54x_reader_sched_apply(&self->sched, 0);
+    if (self->sched.flags & PN54X_READER_SCHED_MLOCK) {
+        const int err = pn54x_reader_child_lock_memory(
+            pn54x_ring_producer(self->ring));
+
+        if (err) {
+            GWARN("Failed to lock reader memory: %s", strerror(err));
+        }
+    }
+    pn54x_ring_read(self->ring, self->fd, &self->stopped);
+
+    /* Release the device as soon as possible */
+    close(self->fd);
+    self->fd = -1;
+    g_atomic_int_set(&self->done, TRUE);
+
+    /* Don't exit until we are stopped, see pn54x_reader_thread_stop() */
+    while (!g_atomic_int_get(&self->stopped)) {
+        pn54x_ring_wait(self->ring);
+    }
+    pn54x_reader_thread_unref(self);
+    return NULL;
+}
+
+static
+gboolean
+pn54x_reader_thread_data(
+    gint fd,
+    GIOCondition condition,
+    gpointer user_data)
+{
+    Pn54xReaderThread* self = pn54x_reader_thread_ref(user_data);
+    Pn54xRing* ring = self->ring;
+    gboolean result = G_SOURCE_CONTINUE;
+    const void* data;
+    guint len;
+    int error;
+
+    pn54x_ring_clear(ring);
+    while (!self->stopped && (data = pn54x_ring_peek(ring, &len)) != NULL) {
+        /* The data are passed to the callback in place */
+        self->data_fn(data, len, self->user_data);
+        pn54x_ring_release(ring);
+    }
+
+    if (!self->stopped && pn54x_ring_failed(ring, &error)) {
+        if (error) {
+            GERR("Read failed: %s", strerror(error));
+        } else {
+            GDEBUG("End of stream");
+        }
+        self->watch_id = 0;
+        result = G_SOURCE_REMOVE;
+        self->error_fn(self->user_data);
+    }
+    pn54x_reader_thread_unref(self);
+    return result;
+}
+
+static
+gboolean
+pn54x_reader_thread_reap(
+    void)
+{
+    GSList* l = pn54x_reader_thread_stale;
+
+    while (l) {
+        GSList* next = l->next;
+        Pn54xReaderThread* self = l->data;
+
+        if (g_atomic_int_get(&self->done)) {
+            /* The thread is about to exit, if it hasn't yet */
+            pthread_join(self->thread, NULL);
+            pn54x_reader_thread_stale =
+                g_slist_delete_link(pn54x_reader_thread_stale, l);
+            pn54x_reader_thread_unref(self);
+        } else {
+            /* Not joined yet, the thread id is still valid */
+            pthread_kill(self->thread, PN54X_READER_SIGNAL);
+        }
+        l = next;
+    }
+    return pn54x_reader_thread_stale == NULL;
+}
+
+static
+gboolean
+pn54x_reader_thread_create(
+    Pn54xReaderThread* self)
+{
+    int err;
+
+    pn54x_reader_thread_ref(self); /* Reference owned by the thread */
+    err = pthread_create(&self->thread, NULL, pn54x_reader_thread_proc, self);
+    if (err) {
+        GERR("Failed to start reader thread: %s", strerror(err));
+        pn54x_reader_thread_unref(self);
+        return FALSE;
+    }
+    self->started = TRUE;
+    GDEBUG("Started reader thread");
+    return TRUE;
+}
+
+static
+void
+pn54x_reader_thread_start_pending(
+    gboolean ok)
+{
+    GSList* list = pn54x_reader_thread_pending;
+    GSList* l;
+
+    /* Callbacks may stop other pending threads */
+    pn54x_reader_thread_pending = NULL;
+    for (l = list; l; l = l->next) {
+        pn54x_reader_thread_ref(l->data);
+    }
+    for (l = list; l; l = l->next) {
+        Pn54xReaderThread* self = l->data;
+
+        if (!g_atomic_int_get(&self->stopped) &&
+            !(ok && pn54x_reader_thread_create(self))) {
+            if (self->watch_id) {
+                g_source_remove(self->watch_id);
+                self->watch_id = 0;
+            }
+            self->error_fn(self->user_data);
+        }
+        pn54x_reader_thread_unref(self);
+    }
+    g_slist_free(list);
+}
+
+static
+gboolean
+pn54x_reader_thread_kick(
+    gpointer user_data)
+{
+    if (pn54x_reader_thread_reap()) {
+        pn54x_reader_thread_kick_id = 0;
+        pn54x_reader_thread_start_pending(TRUE);
+        return G_SOURCE_REMOVE;
+    } else if (pn54x_reader_thread_pending) {
+        const Pn54xReaderThread* first = pn54x_reader_thread_pending->data;
+
+        /* All of them are waiting for the same threads, oldest first */
+        if (g_get_monotonic_time() >= first->deadline) {
+            GERR("%u reader thread(s) stuck in read()",
+                g_slist_length(pn54x_reader_thread_stale));
+            pn54x_reader_thread_start_pending(FALSE);
+        }
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+Pn54xReaderThread*
+pn54x_reader_thread_start(
+    int fd,
+    guint slots,
+    guint chunk_size,
+    const Pn54xReaderSched* sched,
+    Pn54xReaderDataFunc data_fn,
+    Pn54xReaderErrorFunc error_fn,
+    void* user_data)
+{
+    Pn54xRing* ring;
+
+    /* Blocking read can't be interrupted without the signal */
+    if (!pn54x_system_interrupt_init()) {
+        GERR("Can't use reader thread");
+        return NULL;
+    }
+
+    ring = pn54x_ring_new(slots, chunk_size);
+    if (ring) {
+        Pn54xReaderThread* self = g_new0(Pn54xReaderThread, 1);
+
+        g_atomic_int_set(&self->refcount, 1);
+        self->ring = ring;
+        if (sched) {
+            self->sched = *sched;
+        }
+        self->data_fn = data_fn;
+        self->error_fn = error_fn;
+        self->user_data = user_data;
+        self->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (self->fd < 0) {
+            GERR("Failed to duplicate descriptor: %s", strerror(errno));
+            pn54x_reader_thread_unref(self);
+            return NULL;
+        }
+
+        /*
+         * The old thread would steal the data from the new one. It's
+         * normally out of read() by now or about to be, it may just not
+         * have been scheduled since it was signalled.
+         */
+        if (!pn54x_reader_thread_reap()) {
+            g_thread_yield();
+        }
+        if (pn54x_reader_thread_reap() && !pn54x_reader_thread_pending) {
+            if (pn54x_reader_thread_kick_id) {
+                g_source_remove(pn54x_reader_thread_kick_id);
+                pn54x_reader_thread_kick_id = 0;
+            }
+            if (!pn54x_reader_thread_create(self)) {
+                pn54x_reader_thread_unref(self);
+                return NULL;
+            }
+        } else {
+            /* The kick timer is running, it will start the thread(s) */
+            GDEBUG("Reader thread will be started later");
+            self->deadline = g_get_monotonic_time() +
+                PN54X_READER_START_TIMEOUT_MS * 1000;
+            pn54x_reader_thread_pending =
+                g_slist_append(pn54x_reader_thread_pending, self);
+        }
+
+        self->watch_id = g_unix_fd_add(ring->data_fd, G_IO_IN,
+            pn54x_reader_thread_data, self);
+        return self;
+    }
+    return NULL;
+}
+
+void
+pn54x_reader_thread_stop(
+    Pn54xReaderThread* self)
+{
+    if (G_LIKELY(self)) {
+        const guint overflows = pn54x_ring_overflows(self->ring);
+
+        if (self->watch_id) {
+            g_source_remove(self->watch_id);
+            self->watch_id = 0;
+        }
+        g_atomic_int_set(&self->stopped, TRUE);
+        if (!self->started) {
+            /* Still waiting for the stale threads (or failed to start) */
+            pn54x_reader_thread_pending =
+                g_slist_remove(pn54x_reader_thread_pending, self);
+            GDEBUG("Stopped reader thread before it has started");
+            pn54x_reader_thread_unref(self);
+            return;
+        }
+        pn54x_ring_wakeup(self->ring);
+
+        /*
+         * The thread doesn't exit until it's stopped and isn't detached,
+         * so the thread id remains valid until it's joined. The signal
+         * keeps being sent until the thread gets out of read().
+         */
+        pthread_kill(self->thread, PN54X_READER_SIGNAL);
+        pn54x_reader_thread_stale =
+            g_slist_append(pn54x_reader_thread_stale, self);
+        if (!pn54x_reader_thread_kick_id) {
+            pn54x_reader_thread_kick_id = g_timeout_add(PN54X_READER_KICK_MS,
+                pn54x_reader_thread_kick, NULL);
+        }
+        if (overflows) {
+            GDEBUG("Stopped reader thread, %u overflow(s)", overflows);
+        } else {
+            GDEBUG("Stopped reader thread");
+        }
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_recorder.h"
+#include "pn54x_log.h"
+
+#define PN54X_RECORDER_DEFAULT_PACKETS (32)
+#define PN54X_RECORDER_DEFAULT_BYTES (64)
+#define PN54X_RECORDER_MAX_BYTES (258) /* Max NCI packet size */
+
+typedef struct pn54x_recorder_entry {
+    gint64 time;
+    guint16 len;
+    guint16 size;
+    gboolean out;
+} Pn54xRecorderEntry;
+
+struct pn54x_recorder {
+    Pn54xRecorderEntry* entries;
+    guint8* data;           /* packets * bytes */
+    guint packets;
+    guint bytes;
+    guint first;
+    guint count;
+    char* file;
+};
+
+Pn54xRecorder*
+pn54x_recorder_new(
+    const Pn54xRecorderConfig* config)
+{
+    Pn54xRecorder* self = g_new0(Pn54xRecorder, 1);
+
+    self->packets = PN54X_RECORDER_DEFAULT_PACKETS;
+    self->bytes = PN54X_RECORDER_DEFAULT_BYTES;
+    if (config) {
+        if (config->packets) {
+            self->packets = config->packets;
+        }
+        if (config->bytes) {
+            self->bytes = MIN(config->bytes, PN54X_RECORDER_MAX_BYTES);
+        }
+        self->file = g_strdup(config->file);
+    }
+    self->entries = g_new0(Pn54xRecorderEntry, self->packets);
+    self->data = g_malloc(self->packets * self->bytes);
+    return self;
+}
+
+void
+pn54x_recorder_free(
+    Pn54xRecorder* self)
+{
+    if (self) {
+        g_free(self->entries);
+        g_free(self->data);
+        g_free(self->file);
+        g_free(self);
+    }
+}
+
+void
+pn54x_recorder_record(
+    Pn54xRecorder* self,
+    gboolean out,
+    gint64 time,
+    const GUtilData* chunks,
+    guint count)
+{
+    guint slot, i, len = 0, size = 0;
+    Pn54xRecorderEntry* entry;
+    guint8* ptr;
+
+    if (self->count < self->packets) {
+        slot = (self->first + self->count++) % self->packets;
+    } else {
+        /* Overwrite the oldest one */
+        slot = self->first;
+        self->first = (self->first + 1) % self->packets;
+    }
+
+    entry = self->entries + slot;
+    ptr = self->data + slot * self->bytes;
+    for (i = 0; i < count; i++) {
+        const guint n = MIN(chunks[i].size, self->bytes - size);
+
+        memcpy(ptr + size, chunks[i].bytes, n);
+        size += n;
+        len += chunks[i].size;
+    }
+    entry->time = time;
+    entry->len = MIN(len, G_MAXUINT16);
+    entry->size = size;
+    entry->out = out;
+}
+
+guint
+pn54x_recorder_count(
+    Pn54xRecorder* self)
+{
+    return self->count;
+}
+
+gboolean
+pn54x_recorder_get(
+    Pn54xRecorder* self,
+    guint i,
+    Pn54xRecorderPacket* packet)
+{
+    if (i < self->count) {
+        const guint slot = (self->first + i) % self->packets;
+        const Pn54xRecorderEntry* entry = self->entries + slot;
+
+        packet->time = entry->time;
+        packet->out = entry->out;
+        packet->len = entry->len;
+        packet->size = entry->size;
+        packet->data = self->data + slot * self->bytes;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+gboolean
+pn54x_recorder_save(
+    Pn54xRecorder* self,
+    const char* reason)
+{
+    if (self->file) {
+        GString* buf = g_string_new(NULL);
+        GError* error = NULL;
+        Pn54xRecorderPacket packet;
+        gboolean ok;
+        guint i, k;
+
+        g_string_append_printf(buf, "# %s\n", reason);
+        for (i = 0; pn54x_recorder_get(self, i, &packet); i++) {
+            g_string_append_printf(buf, "%" G_GINT64_FORMAT " %c %u",
+                packet.time, packet.out ? '<' : '>', packet.len);
+            for (k = 0; k < packet.size; k++) {
+                g_string_append_printf(buf, " %02x", packet.data[k]);
+            }
+            g_string_append(buf, (packet.size < packet.len) ? " ...\n" :
+                "\n");
+        }
+        ok = g_file_set_contents(self->file, buf->str, buf->len, &error);
+        if (ok) {
+            GDEBUG("Packets saved to %s", self->file);
+        } else {
+            GERR("Failed to save packets: %s", error->message);
+            g_error_free(error);
+        }
+        g_string_free(buf, TRUE);
+        return ok;
+    }
+    return FALSE;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_RECORDER_H
+#define PN54X_RECORDER_H
+
+#include <gutil_types.h>
+
+/*
+ * Flight recorder, i.e. a ring of the last packets. All the memory is
+ * allocated upfront, recording a packet is a memcpy of its first bytes.
+ */
+
+typedef struct pn54x_recorder Pn54xRecorder;
+
+/* Zero-initialized structure means defaults */
+typedef struct pn54x_recorder_config {
+    guint packets;          /* Number of packets to keep */
+    guint bytes;            /* Max bytes kept per packet */
+    const char* file;       /* Dump file, if any */
+} Pn54xRecorderConfig;
+
+typedef struct pn54x_recorder_packet {
+    gint64 time;            /* Monotonic, microseconds */
+    gboolean out;           /* TRUE if sent to the chip */
+    guint len;              /* Packet length */
+    guint size;             /* Bytes recorded, no more than len */
+    const guint8* data;
+} Pn54xRecorderPacket;
+
+Pn54xRecorder*
+pn54x_recorder_new(
+    const Pn54xRecorderConfig* config);
+
+void
+pn54x_recorder_free(
+    Pn54xRecorder* recorder);
+
+void
+pn54x_recorder_record(
+    Pn54xRecorder* recorder,
+    gboolean out,
+    gint64 time,
+    const GUtilData* chunks,
+    guint count);
+
+/* Number of packets in the ring */
+guint
+pn54x_recorder_count(
+    Pn54xRecorder* recorder);
+
+/* Zero is the oldest one */
+gboolean
+pn54x_recorder_get(
+    Pn54xRecorder* recorder,
+    guint i,
+    Pn54xRecorderPacket* packet);
+
+/* Writes the packets to the configured file, if there is one */
+gboolean
+pn54x_recorder_save(
+    Pn54xRecorder* recorder,
+    const char* reason);
+
+#endif /* PN54X_RECORDER_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_recovery.h"
+#include "pn54x_log.h"
+
+#define PN54X_RECOVERY_DEFAULT_PULSE (100)
+#define PN54X_RECOVERY_DEFAULT_BACKOFF_MIN (500)
+#define PN54X_RECOVERY_DEFAULT_BACKOFF_MAX (30000)
+#define PN54X_RECOVERY_DEFAULT_RATE_LIMIT (6)
+#define PN54X_RECOVERY_DEFAULT_RATE_PERIOD (60000)
+#define PN54X_RECOVERY_DEFAULT_MAX_ATTEMPTS (5)
+
+struct pn54x_recovery {
+    Pn54xRecoveryConfig config;
+    const Pn54xRecoveryFunctions* fn;
+    void* user_data;
+    PN54X_RECOVERY_STATE state;
+    Pn54xRecoveryStats stats;
+    guint timer_id;
+    guint attempt;          /* Resets in the current episode */
+    gint64 start;           /* When the current episode has started */
+    gint64* reset_times;    /* Ring of rate_limit last reset times */
+    guint reset_pos;
+    guint reset_count;
+};
+
+static
+void
+pn54x_recovery_schedule(
+    Pn54xRecovery* self);
+
+static
+void
+pn54x_recovery_stop_timer(
+    Pn54xRecovery* self)
+{
+    if (self->timer_id) {
+        g_source_remove(self->timer_id);
+        self->timer_id = 0;
+    }
+}
+
+static
+void
+pn54x_recovery_finish(
+    Pn54xRecovery* self,
+    PN54X_RECOVERY_STATE state)
+{
+    pn54x_recovery_stop_timer(self);
+    self->stats.time += g_get_monotonic_time() - self->start;
+    self->state = state;
+    self->attempt = 0;
+}
+
+static
+gboolean
+pn54x_recovery_pulse_done(
+    gpointer user_data)
+{
+    Pn54xRecovery* self = user_data;
+
+    self->timer_id = 0;
+    if (self->fn->power(TRUE, self->user_data)) {
+        GDEBUG("Chip reset #%u done", self->attempt);
+        self->state = PN54X_RECOVERY_VERIFY;
+        self->fn->restart(self->user_data);
+    } else {
+        /* Counts as a failed attempt */
+        pn54x_recovery_schedule(self);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static
+gboolean
+pn54x_recovery_backoff_done(
+    gpointer user_data)
+{
+    Pn54xRecovery* self = user_data;
+    const Pn54xRecoveryConfig* config = &self->config;
+
+    self->timer_id = 0;
+    self->attempt++;
+    self->stats.resets++;
+    self->reset_times[self->reset_pos] = g_get_monotonic_time();
+    self->reset_pos = (self->reset_pos + 1) % config->rate_limit;
+    if (self->reset_count < config->rate_limit) {
+        self->reset_count++;
+    }
+    GDEBUG("Resetting the chip (attempt %u)", self->attempt);
+    self->fn->power(FALSE, self->user_data);
+    self->state = PN54X_RECOVERY_RESET;
+    self->timer_id = g_timeout_add(config->pulse,
+        pn54x_recovery_pulse_done, self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+pn54x_recovery_schedule(
+    Pn54xRecovery* self)
+{
+    const Pn54xRecoveryConfig* config = &self->config;
+
+    if (self->attempt >= config->max_attempts) {
+        GERR("Chip has failed %u time(s) in a row, giving up",
+            self->attempt);
+        pn54x_recovery_finish(self, PN54X_RECOVERY_FAILED);
+        self->stats.failed++;
+        self->fn->power(FALSE, self->user_data);
+        self->fn->failed(self->user_data);
+    } else {
+        guint delay = 0;
+
+        /* The first reset happens right away */
+        if (self->attempt) {
+            const guint shift = MIN(self->attempt - 1, 16);
+
+            delay = MIN((guint64)config->backoff_min << shift,
+                config->backoff_max);
+        }
+
+        /* The oldest reset must leave the rate window */
+        if (self->reset_count == config->rate_limit) {
+            const gint64 next = self->reset_times[self->reset_pos] +
+                (gint64)config->rate_period * 1000;
+            const gint64 wait = next - g_get_monotonic_time();
+
+            if (wait > (gint64)delay * 1000) {
+                GDEBUG("Too many resets, throttling");
+                delay = (guint)((wait + 999) / 1000);
+            }
+        }
+
+        GDEBUG("Next reset in %u ms", delay);
+        self->state = PN54X_RECOVERY_BACKOFF;
+        self->timer_id = g_timeout_add(delay,
+            pn54x_recovery_backoff_done, self);
+    }
+}
+
+Pn54xRecovery*
+pn54x_recovery_new(
+    const Pn54xRecoveryConfig* config,
+    const Pn54xRecoveryFunctions* fn,
+    void* user_data)
+{
+    Pn54xRecovery* self = g_new0(Pn54xRecovery, 1);
+    Pn54xRecoveryConfig* cfg = &self->config;
+
+    if (config) {
+        *cfg = *config;
+    }
+    if (!cfg->pulse) {
+        cfg->pulse = PN54X_RECOVERY_DEFAULT_PULSE;
+    }
+    if (!cfg->backoff_min) {
+        cfg->backoff_min = PN54X_RECOVERY_DEFAULT_BACKOFF_MIN;
+    }
+    if (!cfg->backoff_max) {
+        cfg->backoff_max = PN54X_RECOVERY_DEFAULT_BACKOFF_MAX;
+    }
+    cfg->backoff_max = MAX(cfg->backoff_max, cfg->backoff_min);
+    if (!cfg->rate_limit) {
+        cfg->rate_limit = PN54X_RECOVERY_DEFAULT_RATE_LIMIT;
+    }
+    if (!cfg->rate_period) {
+        cfg->rate_period = PN54X_RECOVERY_DEFAULT_RATE_PERIOD;
+    }
+    if (!cfg->max_attempts) {
+        cfg->max_attempts = PN54X_RECOVERY_DEFAULT_MAX_ATTEMPTS;
+    }
+    self->fn = fn;
+    self->user_data = user_data;
+    self->reset_times = g_new0(gint64, cfg->rate_limit);
+    return self;
+}
+
+void
+pn54x_recovery_free(
+    Pn54xRecovery* self)
+{
+    if (G_LIKELY(self)) {
+        const Pn54xRecoveryStats* stats = &self->stats;
+
+        pn54x_recovery_stop_timer(self);
+        if (stats->errors) {
+            GDEBUG("Chip errors: %u, resets: %u, recovered: %u, "
+                "failed: %u, %d ms spent recovering", stats->errors,
+                stats->resets, stats->recovered, stats->failed,
+                (int)(stats->time / 1000));
+        }
+        g_free(self->reset_times);
+        g_free(self);
+    }
+}
+
+PN54X_RECOVERY_STATE
+pn54x_recovery_state(
+    Pn54xRecovery* self)
+{
+    return G_LIKELY(self) ? self->state : PN54X_RECOVERY_IDLE;
+}
+
+const Pn54xRecoveryStats*
+pn54x_recovery_stats(
+    Pn54xRecovery* self)
+{
+    return G_LIKELY(self) ? &self->stats : NULL;
+}
+
+void
+pn54x_recovery_reset_stats(
+    Pn54xRecovery* self)
+{
+    if (G_LIKELY(self)) {
+        memset(&self->stats, 0, sizeof(self->stats));
+        if (self->state != PN54X_RECOVERY_IDLE &&
+            self->state != PN54X_RECOVERY_FAILED) {
+            /* Only count the rest of the current episode */
+            self->start = g_get_monotonic_time();
+        }
+    }
+}
+
+void
+pn54x_recovery_error(
+    Pn54xRecovery* self)
+{
+    if (G_LIKELY(self)) {
+        self->stats.errors++;
+        switch (self->state) {
+        case PN54X_RECOVERY_IDLE:
+            self->start = g_get_monotonic_time();
+            self->attempt = 0;
+            pn54x_recovery_schedule(self);
+            break;
+        case PN54X_RECOVERY_VERIFY:
+            pn54x_recovery_schedule(self);
+            break;
+        case PN54X_RECOVERY_BACKOFF:
+        case PN54X_RECOVERY_RESET:
+        case PN54X_RECOVERY_FAILED:
+            /* Nothing new */
+            break;
+        }
+    }
+}
+
+void
+pn54x_recovery_ok(
+    Pn54xRecovery* self)
+{
+    if (G_LIKELY(self) && self->state == PN54X_RECOVERY_VERIFY) {
+        GDEBUG("Chip has recovered after %u reset(s)", self->attempt);
+        self->stats.recovered++;
+        pn54x_recovery_finish(self, PN54X_RECOVERY_IDLE);
+    }
+}
+
+void
+pn54x_recovery_cancel(
+    Pn54xRecovery* self)
+{
+    if (G_LIKELY(self) && self->state != PN54X_RECOVERY_IDLE &&
+        self->state != PN54X_RECOVERY_FAILED) {
+        GDEBUG("Recovery cancelled");
+        pn54x_recovery_finish(self, PN54X_RECOVERY_IDLE);
+    }
+}
+
+void
+pn54x_recovery_reset(
+    Pn54xRecovery* self)
+{
+    if (G_LIKELY(self)) {
+        pn54x_recovery_cancel(self);
+        self->state = PN54X_RECOVERY_IDLE;
+        self->reset_count = 0;
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_RECOVERY_H
+#define PN54X_RECOVERY_H
+
+#include <gutil_types.h>
+
+/*
+ * Chip recovery state machine. Each error triggers a power cycle
+ * (power stays off for the reset pulse width), consecutive failures
+ * back off exponentially and the number of resets per period is
+ * limited. After too many failed attempts the recovery gives up
+ * (the circuit breaker trips) until it's explicitly reset.
+ *
+ * Everything is driven by the main loop timers, nothing blocks.
+ */
+
+typedef struct pn54x_recovery Pn54xRecovery;
+
+typedef enum pn54x_recovery_state {
+    PN54X_RECOVERY_IDLE,
+    PN54X_RECOVERY_BACKOFF, /* Waiting for the next reset */
+    PN54X_RECOVERY_RESET,   /* Power is off for the reset pulse */
+    PN54X_RECOVERY_VERIFY,  /* Powered back on, waiting for NCI */
+    PN54X_RECOVERY_FAILED   /* Gave up */
+} PN54X_RECOVERY_STATE;
+
+/* Zero-initialized structure means defaults */
+typedef struct pn54x_recovery_config {
+    guint pulse;            /* Reset pulse width, ms */
+    guint backoff_min;      /* Delay before the second reset, ms */
+    guint backoff_max;      /* Max delay between resets, ms */
+    guint rate_limit;       /* Max resets per period */
+    guint rate_period;      /* ms */
+    guint max_attempts;     /* Consecutive resets before giving up */
+} Pn54xRecoveryConfig;
+
+typedef struct pn54x_recovery_stats {
+    guint errors;           /* Errors reported */
+    guint resets;           /* Power cycles */
+    guint recovered;        /* Successful recoveries */
+    guint failed;           /* Times the circuit breaker tripped */
+    gint64 time;            /* Microseconds spent recovering */
+} Pn54xRecoveryStats;
+
+typedef struct pn54x_recovery_functions {
+    gboolean (*power)(gboolean on, void* user_data);
+    void (*restart)(void* user_data);  /* Power is back on */
+    void (*failed)(void* user_data);   /* Power is off for good */
+} Pn54xRecoveryFunctions;
+
+Pn54xRecovery*
+pn54x_recovery_new(
+    const Pn54xRecoveryConfig* config,
+    const Pn54xRecoveryFunctions* fn,
+    void* user_data);
+
+void
+pn54x_recovery_free(
+    Pn54xRecovery* recovery);
+
+PN54X_RECOVERY_STATE
+pn54x_recovery_state(
+    Pn54xRecovery* recovery);
+
+const Pn54xRecoveryStats*
+pn54x_recovery_stats(
+    Pn54xRecovery* recovery);
+
+void
+pn54x_recovery_reset_stats(
+    Pn54xRecovery* recovery);
+
+/* Chip has failed (again) */
+void
+pn54x_recovery_error(
+    Pn54xRecovery* recovery);
+
+/* Chip is working (again) */
+void
+pn54x_recovery_ok(
+    Pn54xRecovery* recovery);
+
+/* Stops the recovery in progress, power may remain off */
+void
+pn54x_recovery_cancel(
+    Pn54xRecovery* recovery);
+
+/* Also closes the circuit breaker */
+void
+pn54x_recovery_reset(
+    Pn54xRecovery* recovery);
+
+#endif /* PN54X_RECOVERY_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_ring.h"
+#include "pn54x_log.h"
+
+#include <gutil_macros.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+/*
+ * The ring header and the slots live in memfd-backed shared memory,
+ * see pn54x_ring_shm.h for the layout. The producer only moves the
+ * head, the consumer only moves the tail. The producer reads the data
+ * from the device directly into the slot and the consumer parses it
+ * in place, i.e. nothing gets copied.
+ *
+ * When all slots are taken, the producer raises the waiting flag and
+ * blocks on space_fd until the consumer releases a slot. That counts
+ * as an overflow.
+ */
+
+typedef struct pn54x_ring_priv {
+    Pn54xRing pub;
+    gint refcount;
+    gsize size;
+    Pn54xRingProducer producer;
+} Pn54xRingPriv;
+
+static inline
+Pn54xRingPriv*
+pn54x_ring_cast(
+    Pn54xRing* ring)
+{
+    return G_CAST(ring, Pn54xRingPriv, pub);
+}
+
+static inline
+Pn54xRingShm*
+pn54x_ring_shm(
+    Pn54xRing* ring)
+{
+    return pn54x_ring_cast(ring)->producer.shm;
+}
+
+static
+void
+pn54x_ring_finalize(
+    Pn54xRingPriv* self)
+{
+    Pn54xRing* ring = &self->pub;
+
+    if (self->producer.shm) {
+        munmap(self->producer.shm, self->size);
+    }
+    if (ring->memfd >= 0) {
+        close(ring->memfd);
+    }
+    if (ring->data_fd >= 0) {
+        close(ring->data_fd);
+    }
+    if (ring->space_fd >= 0) {
+        close(ring->space_fd);
+    }
+    g_free(self);
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+Pn54xRing*
+pn54x_ring_new(
+    guint slots,
+    guint slot_size)
+{
+    Pn54xRingPriv* self = g_new0(Pn54xRingPriv, 1);
+    Pn54xRing* ring = &self->pub;
+    const guint n = slots ? slots : PN54X_RING_DEFAULT_SLOTS;
+
+    g_atomic_int_set(&self->refcount, 1);
+    ring->slots = n;
+    ring->slot_size = slot_size;
+    ring->memfd = memfd_create("pn54x-ring", MFD_CLOEXEC);
+    ring->data_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ring->space_fd = eventfd(0, EFD_CLOEXEC);
+    self->size = pn54x_ring_shm_size(n, slot_size);
+    if (ring->memfd < 0 || ring->data_fd < 0 || ring->space_fd < 0 ||
+        ftruncate(ring->memfd, self->size) < 0) {
+        GERR("Failed to allocate %u x %u byte ring: %s", ring->slots,
+            slot_size, strerror(errno));
+        pn54x_ring_finalize(self);
+        return NULL;
+    }
+
+    /* Fresh memfd is zero-filled */
+    if (!pn54x_ring_producer_map(&self->producer, ring->memfd, n,
+        slot_size)) {
+        GERR("Failed to map the ring: %s", strerror(errno));
+        pn54x_ring_finalize(self);
+        return NULL;
+    }
+    self->producer.data_fd = ring->data_fd;
+    self->producer.space_fd = ring->space_fd;
+    return ring;
+}
+
+Pn54xRing*
+pn54x_ring_ref(
+    Pn54xRing* ring)
+{
+    if (G_LIKELY(ring)) {
+        Pn54xRingPriv* self = pn54x_ring_cast(ring);
+
+        GASSERT(self->refcount > 0);
+        g_atomic_int_inc(&self->refcount);
+    }
+    return ring;
+}
+
+void
+pn54x_ring_unref(
+    Pn54xRing* ring)
+{
+    if (G_LIKELY(ring)) {
+        Pn54xRingPriv* self = pn54x_ring_cast(ring);
+
+        GASSERT(self->refcount > 0);
+        if (g_atomic_int_dec_and_test(&self->refcount)) {
+            pn54x_ring_finalize(self);
+        }
+    }
+}
+
+/* For passing to a child process */
+const Pn54xRingProducer*
+pn54x_ring_producer(
+    Pn54xRing* ring)
+{
+    return &pn54x_ring_cast(ring)->producer;
+}
+
+/* Producer side, see pn54x_ring_producer_read() */
+void
+pn54x_ring_read(
+    Pn54xRing* ring,
+    int fd,
+    const gint* stop)
+{
+    pn54x_ring_producer_read(&pn54x_ring_cast(ring)->producer, fd, stop);
+}
+
+/* Blocks the producer until pn54x_ring_wakeup() or a signal */
+void
+pn54x_ring_wait(
+    Pn54xRing* ring)
+{
+    pn54x_ring_shm_consume_event(ring->space_fd);
+}
+
+/* Consumer side. Returns the oldest filled slot, if there is one. */
+const void*
+pn54x_ring_peek(
+    Pn54xRing* ring,
+    guint* len)
+{
+    Pn54xRingPriv* self = pn54x_ring_cast(ring);
+    Pn54xRingShm* shm = self->producer.shm;
+    const guint tail = shm->tail;
+
+    if (tail != g_atomic_int_get(&shm->head)) {
+        const guint i = tail % ring->slots;
+
+        *len = shm->len[i];
+        return self->producer.data + i * ring->slot_size;
+    }
+    return NULL;
+}
+
+/* Gives the slot returned by pn54x_ring_peek() back to the producer */
+void
+pn54x_ring_release(
+    Pn54xRing* ring)
+{
+    Pn54xRingShm* shm = pn54x_ring_shm(ring);
+
+    GASSERT(shm->tail != g_atomic_int_get(&shm->head));
+    g_atomic_int_set(&shm->tail, shm->tail + 1);
+    if (g_atomic_int_get(&shm->waiting)) {
+        pn54x_ring_shm_notify(ring->space_fd);
+    }
+}
+
+/* Resets data_fd before the consumer starts picking up the slots */
+void
+pn54x_ring_clear(
+    Pn54xRing* ring)
+{
+    pn54x_ring_shm_consume_event(ring->data_fd);
+}
+
+void
+pn54x_ring_wakeup(
+    Pn54xRing* ring)
+{
+    pn54x_ring_shm_notify(ring->space_fd);
+}
+
+/* Only returns TRUE when the producer has stopped and the ring is empty */
+gboolean
+pn54x_ring_failed(
+    Pn54xRing* ring,
+    int* error)
+{
+    Pn54xRingShm* shm = pn54x_ring_shm(ring);
+
+    if (g_atomic_int_get(&shm->failed) &&
+        shm->tail == g_atomic_int_get(&shm->head)) {
+        if (error) {
+            *error = shm->error;
+        }
+        return TRUE;
+    }
+    return FALSE;
+}
+
+guint
+pn54x_ring_overflows(
+    Pn54xRing* ring)
+{
+    return g_atomic_int_get(&pn54x_ring_shm(ring)->overflows);
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
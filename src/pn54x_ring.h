@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_RING_H
+#define PN54X_RING_H
+
+#include "pn54x_ring_shm.h"
+
+#include <gutil_types.h>
+
+/*
+ * Single-producer/single-consumer ring of fixed size slots in shared
+ * memory. The producer can be a thread or a separate process, in which
+ * case it has to inherit memfd, data_fd and space_fd descriptors.
+ */
+
+typedef struct pn54x_ring {
+    int memfd;          /* Shared memory */
+    int data_fd;        /* eventfd signaled by the producer */
+    int space_fd;       /* eventfd signaled by the consumer */
+    guint slots;
+    guint slot_size;
+} Pn54xRing;
+
+#define PN54X_RING_DEFAULT_SLOTS (8)
+
+Pn54xRing*
+pn54x_ring_new(
+    guint slots,
+    guint slot_size);
+
+Pn54xRing*
+pn54x_ring_ref(
+    Pn54xRing* ring);
+
+void
+pn54x_ring_unref(
+    Pn54xRing* ring);
+
+/* Producer */
+
+const Pn54xRingProducer*
+pn54x_ring_producer(
+    Pn54xRing* ring);
+
+void
+pn54x_ring_read(
+    Pn54xRing* ring,
+    int fd,
+    const gint* stop);
+
+void
+pn54x_ring_wait(
+    Pn54xRing* ring);
+
+/* Consumer */
+
+const void*
+pn54x_ring_peek(
+    Pn54xRing* ring,
+    guint* len);
+
+void
+pn54x_ring_release(
+    Pn54xRing* ring);
+
+void
+pn54x_ring_clear(
+    Pn54xRing* ring);
+
+void
+pn54x_ring_wakeup(
+    Pn54xRing* ring);
+
+gboolean
+pn54x_ring_failed(
+    Pn54xRing* ring,
+    int* error);
+
+guint
+pn54x_ring_overflows(
+    Pn54xRing* ring);
+
+#endif /* PN54X_RING_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_ring_shm.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Same semantics as g_atomic_int_get/set/inc */
+#define ATOMIC_GET(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define ATOMIC_SET(p,v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define ATOMIC_INC(p) __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST)
+
+static
+int
+pn54x_ring_shm_stopped(
+    const int* stop)
+{
+    return stop && ATOMIC_GET(stop);
+}
+
+void
+pn54x_ring_shm_notify(
+    int fd)
+{
+    const uint64_t one = 1;
+
+    /* Can only fail if the counter overflows, which is impossible */
+    (void)(write(fd, &one, sizeof(one)) < 0);
+}
+
+void
+pn54x_ring_shm_consume_event(
+    int fd)
+{
+    uint64_t count;
+
+    /* Resets the counter. May return early on signal or spuriously */
+    (void)(read(fd, &count, sizeof(count)) < 0);
+}
+
+size_t
+pn54x_ring_shm_header_size(
+    unsigned int slots)
+{
+    const size_t size = offsetof(Pn54xRingShm, len) +
+        slots * sizeof(unsigned int);
+
+    return (size + 7) & ~(size_t)7;
+}
+
+size_t
+pn54x_ring_shm_size(
+    unsigned int slots,
+    unsigned int slot_size)
+{
+    return pn54x_ring_shm_header_size(slots) + (size_t)slots * slot_size;
+}
+
+int
+pn54x_ring_producer_map(
+    Pn54xRingProducer* producer,
+    int memfd,
+    unsigned int slots,
+    unsigned int slot_size)
+{
+    void* shm = mmap(NULL, pn54x_ring_shm_size(slots, slot_size),
+        PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+
+    if (shm != MAP_FAILED) {
+        producer->shm = shm;
+        producer->data = (unsigned char*)shm +
+            pn54x_ring_shm_header_size(slots);
+        producer->slots = slots;
+        producer->slot_size = slot_size;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Reads the data into the ring until read() fails or until *stop
+ * becomes non-zero. Doesn't log anything because it may be running
+ * in a forked child.
+ */
+void
+pn54x_ring_producer_read(
+    const Pn54xRingProducer* producer,
+    int fd,
+    const int* stop)
+{
+    Pn54xRingShm* shm = producer->shm;
+    const unsigned int n = producer->slots;
+
+    while (!pn54x_ring_shm_stopped(stop)) {
+        const unsigned int head = shm->head;
+
+        if (head - ATOMIC_GET(&shm->tail) < n) {
+            const unsigned int i = head % n;
+            const ssize_t len = read(fd, producer->data +
+                (size_t)i * producer->slot_size, producer->slot_size);
+
+            if (len > 0) {
+                shm->len[i] = len;
+                ATOMIC_SET(&shm->head, head + 1);
+                pn54x_ring_shm_notify(producer->data_fd);
+            } else if (len < 0 && errno == EINTR) {
+                /* Most likely, we are being stopped */
+                continue;
+            } else {
+                shm->error = len ? errno : 0;
+                ATOMIC_SET(&shm->failed, 1);
+                pn54x_ring_shm_notify(producer->data_fd);
+                break;
+            }
+        } else {
+            ATOMIC_INC(&shm->overflows);
+            ATOMIC_SET(&shm->waiting, 1);
+            while (head - ATOMIC_GET(&shm->tail) >= n &&
+                !pn54x_ring_shm_stopped(stop)) {
+                pn54x_ring_shm_consume_event(producer->space_fd);
+            }
+            ATOMIC_SET(&shm->waiting, 0);
+        }
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_RING_SHM_H
+#define PN54X_RING_SHM_H
+
+/*
+ * Shared memory layout and the producer side of the ring. Doesn't
+ * depend on glib, because it's also linked into the reader helper.
+ */
+
+#include <stddef.h>
+
+typedef struct pn54x_ring_shm {
+    unsigned int head;      /* Moved by the producer */
+    unsigned int tail;      /* Moved by the consumer */
+    int waiting;            /* Producer is waiting for a free slot */
+    int failed;             /* Producer has stopped reading */
+    int error;              /* errno if failed, zero on end of stream */
+    unsigned int overflows; /* Number of times the ring got full */
+    unsigned int len[1];    /* Actually, one per slot */
+} Pn54xRingShm;
+
+typedef struct pn54x_ring_producer {
+    Pn54xRingShm* shm;
+    unsigned char* data;
+    unsigned int slots;
+    unsigned int slot_size;
+    int data_fd;
+    int space_fd;
+} Pn54xRingProducer;
+
+/* Header size, followed by the slots */
+size_t
+pn54x_ring_shm_header_size(
+    unsigned int slots);
+
+size_t
+pn54x_ring_shm_size(
+    unsigned int slots,
+    unsigned int slot_size);
+
+/* Maps memfd, returns non-zero on success */
+int
+pn54x_ring_producer_map(
+    Pn54xRingProducer* producer,
+    int memfd,
+    unsigned int slots,
+    unsigned int slot_size);
+
+void
+pn54x_ring_producer_read(
+    const Pn54xRingProducer* producer,
+    int fd,
+    const int* stop);
+
+void
+pn54x_ring_shm_notify(
+    int fd);
+
+void
+pn54x_ring_shm_consume_event(
+    int fd);
+
+#endif /* PN54X_RING_SHM_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -39,11 +39,15 @@
 #include "pn54x_system.h"
 #include "pn54x_log.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 int
 pn54x_system_open(
@@ -52,6 +56,13 @@ pn54x_system_open(
     return open(dev, O_RDWR);
 }
 
+int
+pn54x_system_dup(
+    int fd)
+{
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
 int
 pn54x_system_ioctl(
     int fd,
@@ -61,6 +72,77 @@ pn54x_system_ioctl(
     return ioctl(fd, cmd, arg);
 }
 
+ssize_t
+pn54x_system_write(
+    int fd,
+    const void* buf,
+    size_t count)
+{
+    return write(fd, buf, count);
+}
+
+ssize_t
+pn54x_system_writev(
+    int fd,
+    const struct iovec* iov,
+    int iovcnt)
+{
+    return writev(fd, iov, iovcnt);
+}
+
+int
+pn54x_system_poll(
+    struct pollfd* fds,
+    unsigned int nfds,
+    int timeout)
+{
+    return poll(fds, nfds, timeout);
+}
+
+static
+void
+pn54x_system_interrupt_handler(
+    int sig)
+{
+    /* The only purpose is to interrupt the blocking call */
+}
+
+/*
+ * The handler is installed for the whole process and stays there. If
+ * something else has already claimed the signal, it's left alone and
+ * our blocking calls can't be interrupted.
+ */
+gboolean
+pn54x_system_interrupt_init(
+    void)
+{
+    static gsize init = 0;
+    static gboolean ok = FALSE;
+
+    if (g_once_init_enter(&init)) {
+        const int sig = PN54X_SYSTEM_INTERRUPT_SIGNAL;
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        if (sigaction(sig, NULL, &sa) < 0) {
+            GERR("Failed to query signal %d: %s", sig, strerror(errno));
+        } else if ((sa.sa_flags & SA_SIGINFO) || sa.sa_handler != SIG_DFL) {
+            GERR("Signal %d (SIGRTMIN) is already in use", sig);
+        } else {
+            /* No SA_RESTART, read() and write() must fail with EINTR */
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = pn54x_system_interrupt_handler;
+            sigemptyset(&sa.sa_mask);
+            ok = (sigaction(sig, &sa, NULL) == 0);
+            if (!ok) {
+                GERR("Failed to set up signal %d: %s", sig, strerror(errno));
+            }
+        }
+        g_once_init_leave(&init, 1);
+    }
+    return ok;
+}
+
 /*
  * Local Variables:
  * mode: C
@@ -41,16 +41,57 @@
 
 /* Mostly for unit testing */
 
+#include <gutil_types.h>
+
+#include <signal.h>
+#include <sys/types.h>
+
+/*
+ * Interrupts blocking reads and writes performed by our threads. The
+ * plugin takes this signal over for the whole process (the handler does
+ * nothing) but only if nothing else has installed a handler for it.
+ */
+#define PN54X_SYSTEM_INTERRUPT_SIGNAL (SIGRTMIN)
+
+struct iovec;
+struct pollfd;
+
 int
 pn54x_system_open(
     const char* dev);
 
+int
+pn54x_system_dup(
+    int fd); /* Close-on-exec */
+
 int
 pn54x_system_ioctl(
     int fd,
     unsigned int cmd,
     unsigned long arg);
 
+ssize_t
+pn54x_system_write(
+    int fd,
+    const void* buf,
+    size_t count);
+
+ssize_t
+pn54x_system_writev(
+    int fd,
+    const struct iovec* iov,
+    int iovcnt);
+
+int
+pn54x_system_poll(
+    struct pollfd* fds,
+    unsigned int nfds,
+    int timeout);
+
+gboolean
+pn54x_system_interrupt_init(
+    void); /* FALSE if the signal is taken */
+
 #endif /* PN54X_SYSTEM_H */
 
 /*
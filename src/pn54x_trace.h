@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_TRACE_H
+#define PN54X_TRACE_H
+
+/*
+ * Static tracepoints (USDT) in the pn54x provider, compiled in by
+ * "make USDT=1" (requires <sys/sdt.h>) or if the build environment
+ * defines HAVE_SDT. Each one is a single nop until a tracer attaches
+ * to it. Without USDT the macros expand to nothing and their arguments
+ * are not evaluated.
+ *
+ * reader_start(mode, fd)           PN54X_IO_READ_xxx actually used
+ * reader_stop()
+ * read(size)                       Chunk of data from the driver
+ * packet(hdr0, hdr1, len)          Framed packet passed to the client
+ * write_submit(hdr0, hdr1, len)    Write has been queued
+ * write_done(ok, len, usec)        Completion, usec since submission
+ * power(on, ok)                    PN54X_SET_PWR ioctl
+ * state_next(current, next)        NCI state machine transition started
+ * state_reached(current, next)     NCI state machine transition finished
+ * power_request(on)                Power request from nfcd
+ *
+ * hdr0 and hdr1 are the first two bytes of the NCI packet (MT/PBF/GID
+ * and OID), len is the packet size including the 3-byte header.
+ */
+
+#if defined(PN54X_USDT) || defined(HAVE_SDT)
+#  include <sys/sdt.h>
+#  define PN54X_TRACE_ENABLED (1)
+#  define PN54X_TRACE0(name) \
+    DTRACE_PROBE(pn54x, name)
+#  define PN54X_TRACE1(name,a1) \
+    DTRACE_PROBE1(pn54x, name, a1)
+#  define PN54X_TRACE2(name,a1,a2) \
+    DTRACE_PROBE2(pn54x, name, a1, a2)
+#  define PN54X_TRACE3(name,a1,a2,a3) \
+    DTRACE_PROBE3(pn54x, name, a1, a2, a3)
+#else
+#  define PN54X_TRACE_ENABLED (0)
+#  define PN54X_TRACE0(name) ((void)0)
+#  define PN54X_TRACE1(name,a1) ((void)0)
+#  define PN54X_TRACE2(name,a1,a2) ((void)0)
+#  define PN54X_TRACE3(name,a1,a2,a3) ((void)0)
+#endif
+
+#endif /* PN54X_TRACE_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
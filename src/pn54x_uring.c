@@ -0,0 +1,639 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_uring.h"
+#include "pn54x_log.h"
+
+#ifdef HAVE_IO_URING
+
+#include <glib-unix.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * A read from the device which doesn't support non-blocking I/O gets
+ * punted by the kernel to a worker thread, where it blocks. Unlike a
+ * read performed by our own thread, it can be cancelled.
+ */
+
+#define PN54X_URING_CANCEL_ID (0)
+#define PN54X_URING_DRAIN_TIMEOUT_MS (500)
+
+/* Only a handful of requests are ever in flight, a list is good enough */
+typedef struct pn54x_uring_op Pn54xUringOp;
+struct pn54x_uring_op {
+    Pn54xUringOp* next;
+    guint64 id;
+    gboolean cancelled;
+    Pn54xUringFunc fn;
+    void* user_data;
+    const void* data; /* Either buf or the caller's buffer */
+    guint8 buf[1]; /* Actually, as big as needed */
+};
+
+struct pn54x_uring {
+    gint refcount;
+    gboolean freed;
+    int fd;
+    int event_fd;
+    guint event_id;
+    guint drain_id;
+    guint64 last_id;
+    Pn54xUringOp* ops;
+    guint nops;
+    /* Submission queue */
+    void* sq_ptr;
+    gsize sq_size;
+    guint* sq_head;
+    guint* sq_tail;
+    guint* sq_array;
+    guint sq_mask;
+    guint sq_entries;
+    struct io_uring_sqe* sqes;
+    gsize sqes_size;
+    /* Completion queue */
+    void* cq_ptr;
+    gsize cq_size;
+    guint* cq_head;
+    guint* cq_tail;
+    guint cq_mask;
+    struct io_uring_cqe* cqes;
+    /* Released when the ring is gone */
+    GDestroyNotify destroy;
+    void* destroy_data;
+};
+
+#define LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p,v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static
+int
+pn54x_uring_sys_setup(
+    guint entries,
+    struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static
+int
+pn54x_uring_sys_enter(
+    int fd,
+    guint to_submit)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static
+int
+pn54x_uring_sys_register(
+    int fd,
+    guint opcode,
+    void* arg,
+    guint nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static
+gboolean
+pn54x_uring_probe(
+    int fd)
+{
+    static const guint8 required[] = {
+        IORING_OP_READ, IORING_OP_WRITE, IORING_OP_ASYNC_CANCEL
+    };
+    const guint nops = 256;
+    struct io_uring_probe* probe = g_malloc0(sizeof(*probe) +
+        nops * sizeof(struct io_uring_probe_op));
+    gboolean ok = FALSE;
+
+    if (pn54x_uring_sys_register(fd, IORING_REGISTER_PROBE, probe,
+        nops) == 0) {
+        guint i;
+
+        for (i = 0, ok = TRUE; i < G_N_ELEMENTS(required) && ok; i++) {
+            const guint op = required[i];
+
+            ok = op <= probe->last_op &&
+                (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+        }
+    }
+    g_free(probe);
+    return ok;
+}
+
+static
+void
+pn54x_uring_finalize(
+    Pn54xUring* self)
+{
+    if (self->nops) {
+        /* The kernel may still be using the buffers, leave them alone */
+        GWARN("%u io_uring request(s) didn't complete", self->nops);
+        return;
+    }
+    if (self->sqes) {
+        munmap(self->sqes, self->sqes_size);
+    }
+    if (self->cq_ptr && self->cq_ptr != self->sq_ptr) {
+        munmap(self->cq_ptr, self->cq_size);
+    }
+    if (self->sq_ptr) {
+        munmap(self->sq_ptr, self->sq_size);
+    }
+    if (self->event_fd >= 0) {
+        close(self->event_fd);
+    }
+    if (self->fd >= 0) {
+        close(self->fd);
+    }
+    if (self->destroy) {
+        self->destroy(self->destroy_data);
+    }
+    g_free(self);
+}
+
+static
+void
+pn54x_uring_unref(
+    Pn54xUring* self)
+{
+    GASSERT(self->refcount > 0);
+    if (!--self->refcount) {
+        pn54x_uring_finalize(self);
+    }
+}
+
+static
+gboolean
+pn54x_uring_map(
+    Pn54xUring* self,
+    const struct io_uring_params* p)
+{
+    self->sq_size = p->sq_off.array + p->sq_entries * sizeof(guint);
+    self->cq_size = p->cq_off.cqes + p->cq_entries *
+        sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        self->sq_size = self->cq_size = MAX(self->sq_size, self->cq_size);
+    }
+
+    self->sq_ptr = mmap(NULL, self->sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_SQ_RING);
+    if (self->sq_ptr == MAP_FAILED) {
+        self->sq_ptr = NULL;
+        return FALSE;
+    }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        self->cq_ptr = self->sq_ptr;
+    } else {
+        self->cq_ptr = mmap(NULL, self->cq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_CQ_RING);
+        if (self->cq_ptr == MAP_FAILED) {
+            self->cq_ptr = NULL;
+            return FALSE;
+        }
+    }
+
+    self->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    self->sqes = mmap(NULL, self->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, self->fd, IORING_OFF_SQES);
+    if (self->sqes == MAP_FAILED) {
+        self->sqes = NULL;
+        return FALSE;
+    }
+
+    self->sq_head = (guint*)((guint8*)self->sq_ptr + p->sq_off.head);
+    self->sq_tail = (guint*)((guint8*)self->sq_ptr + p->sq_off.tail);
+    self->sq_array = (guint*)((guint8*)self->sq_ptr + p->sq_off.array);
+    self->sq_mask = *(guint*)((guint8*)self->sq_ptr + p->sq_off.ring_mask);
+    self->sq_entries = p->sq_entries;
+    self->cq_head = (guint*)((guint8*)self->cq_ptr + p->cq_off.head);
+    self->cq_tail = (guint*)((guint8*)self->cq_ptr + p->cq_off.tail);
+    self->cq_mask = *(guint*)((guint8*)self->cq_ptr + p->cq_off.ring_mask);
+    self->cqes = (struct io_uring_cqe*)((guint8*)self->cq_ptr +
+        p->cq_off.cqes);
+    return TRUE;
+}
+
+static
+Pn54xUringOp*
+pn54x_uring_op_take(
+    Pn54xUring* self,
+    guint64 id)
+{
+    Pn54xUringOp* prev = NULL;
+    Pn54xUringOp* op;
+
+    for (op = self->ops; op; prev = op, op = op->next) {
+        if (op->id == id) {
+            if (prev) {
+                prev->next = op->next;
+            } else {
+                self->ops = op->next;
+            }
+            self->nops--;
+            return op;
+        }
+    }
+    return NULL;
+}
+
+static
+gboolean
+pn54x_uring_submit(
+    Pn54xUring* self,
+    guint8 opcode,
+    int fd,
+    guint64 addr,
+    guint len,
+    guint64 user_data)
+{
+    const guint head = LOAD_ACQUIRE(self->sq_head);
+    const guint tail = *self->sq_tail;
+
+    if (tail - head < self->sq_entries) {
+        const guint i = tail & self->sq_mask;
+        struct io_uring_sqe* sqe = self->sqes + i;
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        if (opcode != IORING_OP_ASYNC_CANCEL) {
+            sqe->off = (guint64)-1; /* Current position */
+        }
+        sqe->addr = addr;
+        sqe->len = len;
+        sqe->user_data = user_data;
+        self->sq_array[i] = i;
+        STORE_RELEASE(self->sq_tail, tail + 1);
+        if (pn54x_uring_sys_enter(self->fd, 1) >= 0) {
+            return TRUE;
+        }
+        GERR("io_uring_enter failed: %s", strerror(errno));
+    } else {
+        GWARN("io_uring submission queue is full");
+    }
+    return FALSE;
+}
+
+static
+void
+pn54x_uring_reap(
+    Pn54xUring* self)
+{
+    /* The caller holds a reference, the callback may free the ring */
+    for (;;) {
+        const guint head = *self->cq_head;
+        const struct io_uring_cqe* cqe;
+        guint64 id;
+        int res;
+
+        if (head == LOAD_ACQUIRE(self->cq_tail)) {
+            break;
+        }
+
+        cqe = self->cqes + (head & self->cq_mask);
+        id = cqe->user_data;
+        res = cqe->res;
+        STORE_RELEASE(self->cq_head, head + 1);
+        if (id != PN54X_URING_CANCEL_ID) {
+            Pn54xUringOp* op = pn54x_uring_op_take(self, id);
+
+            if (op) {
+                if (!op->cancelled) {
+                    op->fn(op->data, res, op->user_data);
+                }
+                g_free(op);
+            }
+        }
+    }
+}
+
+static
+void
+pn54x_uring_drained(
+    Pn54xUring* self)
+{
+    if (self->drain_id) {
+        g_source_remove(self->drain_id);
+        self->drain_id = 0;
+    }
+    if (self->event_id) {
+        g_source_remove(self->event_id);
+        self->event_id = 0;
+    }
+    /* Drops the reference which was held by pn54x_uring_free() caller */
+    pn54x_uring_unref(self);
+}
+
+static
+gboolean
+pn54x_uring_drain_timeout(
+    gpointer user_data)
+{
+    Pn54xUring* self = user_data;
+
+    /* Give up, the remaining requests will be reported by finalize */
+    self->drain_id = 0;
+    pn54x_uring_drained(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+gboolean
+pn54x_uring_event(
+    gint fd,
+    GIOCondition condition,
+    gpointer user_data)
+{
+    Pn54xUring* self = user_data;
+    gboolean keep;
+    guint64 count;
+
+    self->refcount++;
+    (void)(read(fd, &count, sizeof(count)) < 0);
+    pn54x_uring_reap(self);
+    if (self->freed && !self->nops && self->event_id) {
+        /* The last cancelled request has completed */
+        pn54x_uring_drained(self);
+    }
+    keep = (self->event_id != 0);
+    pn54x_uring_unref(self);
+    return keep ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static
+Pn54xUringOp*
+pn54x_uring_op_new(
+    Pn54xUring* self,
+    guint len,
+    Pn54xUringFunc fn,
+    void* user_data)
+{
+    Pn54xUringOp* op = g_malloc(G_STRUCT_OFFSET(Pn54xUringOp, buf) +
+        MAX(len, 1));
+
+    op->id = ++self->last_id;
+    op->cancelled = FALSE;
+    op->fn = fn;
+    op->user_data = user_data;
+    op->data = op->buf;
+    return op;
+}
+
+static
+guint64
+pn54x_uring_op_submit(
+    Pn54xUring* self,
+    Pn54xUringOp* op,
+    guint8 opcode,
+    int fd,
+    guint len)
+{
+    if (pn54x_uring_submit(self, opcode, fd, GPOINTER_TO_SIZE(op->data), len,
+        op->id)) {
+        op->next = self->ops;
+        self->ops = op;
+        self->nops++;
+        return op->id;
+    }
+    g_free(op);
+    return 0;
+}
+
+static
+void
+pn54x_uring_cancel_op(
+    Pn54xUring* self,
+    Pn54xUringOp* op)
+{
+    if (!op->cancelled) {
+        op->cancelled = TRUE;
+        pn54x_uring_submit(self, IORING_OP_ASYNC_CANCEL, -1, op->id, 0,
+            PN54X_URING_CANCEL_ID);
+    }
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+Pn54xUring*
+pn54x_uring_new(
+    guint entries)
+{
+    struct io_uring_params params;
+    Pn54xUring* self;
+    int fd;
+
+    memset(&params, 0, sizeof(params));
+    fd = pn54x_uring_sys_setup(entries, &params);
+    if (fd < 0) {
+        GDEBUG("io_uring_setup failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    self = g_new0(Pn54xUring, 1);
+    self->refcount = 1;
+    self->fd = fd;
+    self->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (pn54x_uring_probe(fd) && pn54x_uring_map(self, &params) &&
+        self->event_fd >= 0 && pn54x_uring_sys_register(fd,
+        IORING_REGISTER_EVENTFD, &self->event_fd, 1) == 0) {
+        self->event_id = g_unix_fd_add(self->event_fd, G_IO_IN,
+            pn54x_uring_event, self);
+        return self;
+    }
+    GDEBUG("io_uring is not usable");
+    pn54x_uring_finalize(self);
+    return NULL;
+}
+
+void
+pn54x_uring_free(
+    Pn54xUring* self)
+{
+    pn54x_uring_free_full(self, NULL, NULL);
+}
+
+void
+pn54x_uring_free_full(
+    Pn54xUring* self,
+    GDestroyNotify destroy,
+    void* data)
+{
+    if (G_LIKELY(self)) {
+        Pn54xUringOp* op;
+
+        self->freed = TRUE;
+        self->destroy = destroy;
+        self->destroy_data = data;
+        for (op = self->ops; op; op = op->next) {
+            pn54x_uring_cancel_op(self, op);
+        }
+
+        if (self->nops) {
+            /*
+             * The cancelled requests complete asynchronously, the event
+             * source keeps reaping them until they are all gone.
+             */
+            GDEBUG("Waiting for %u io_uring request(s)", self->nops);
+            self->drain_id = g_timeout_add(PN54X_URING_DRAIN_TIMEOUT_MS,
+                pn54x_uring_drain_timeout, self);
+        } else {
+            pn54x_uring_drained(self);
+        }
+    }
+}
+
+guint64
+pn54x_uring_read(
+    Pn54xUring* self,
+    int fd,
+    guint len,
+    Pn54xUringFunc fn,
+    void* user_data)
+{
+    return pn54x_uring_op_submit(self, pn54x_uring_op_new(self, len, fn,
+        user_data), IORING_OP_READ, fd, len);
+}
+
+guint64
+pn54x_uring_write(
+    Pn54xUring* self,
+    int fd,
+    const void* buf,
+    guint len,
+    Pn54xUringFunc fn,
+    void* user_data)
+{
+    Pn54xUringOp* op = pn54x_uring_op_new(self, 0, fn, user_data);
+
+    /* Written in place, no copying */
+    op->data = buf;
+    return pn54x_uring_op_submit(self, op, IORING_OP_WRITE, fd, len);
+}
+
+void
+pn54x_uring_cancel(
+    Pn54xUring* self,
+    guint64 id)
+{
+    if (G_LIKELY(self) && id) {
+        Pn54xUringOp* op;
+
+        for (op = self->ops; op; op = op->next) {
+            if (op->id == id) {
+                pn54x_uring_cancel_op(self, op);
+                break;
+            }
+        }
+    }
+}
+
+#else /* !HAVE_IO_URING */
+
+Pn54xUring*
+pn54x_uring_new(
+    guint entries)
+{
+    GDEBUG("Built without io_uring support");
+    return NULL;
+}
+
+void
+pn54x_uring_free(
+    Pn54xUring* uring)
+{
+}
+
+void
+pn54x_uring_free_full(
+    Pn54xUring* uring,
+    GDestroyNotify destroy,
+    void* data)
+{
+    if (destroy) {
+        destroy(data);
+    }
+}
+
+guint64
+pn54x_uring_read(
+    Pn54xUring* uring,
+    int fd,
+    guint len,
+    Pn54xUringFunc fn,
+    void* user_data)
+{
+    return 0;
+}
+
+guint64
+pn54x_uring_write(
+    Pn54xUring* uring,
+    int fd,
+    const void* buf,
+    guint len,
+    Pn54xUringFunc fn,
+    void* user_data)
+{
+    return 0;
+}
+
+void
+pn54x_uring_cancel(
+    Pn54xUring* uring,
+    guint64 id)
+{
+}
+
+#endif /* !HAVE_IO_URING */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
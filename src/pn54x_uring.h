@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_URING_H
+#define PN54X_URING_H
+
+#include <gutil_types.h>
+
+/*
+ * Minimal io_uring wrapper driven by the default main context. Only
+ * supports what we need: reads, writes and cancellation. The data are
+ * read into the buffers owned by the ring, so that the kernel never
+ * touches memory which we may have already released. Writes are
+ * performed from the caller's buffer, which must stay valid until the
+ * write completes or, if it's cancelled, until the ring is gone. The
+ * latter is what pn54x_uring_free_full() is for.
+ *
+ * Freeing the ring cancels whatever is in flight and returns without
+ * waiting, the cancelled requests are reaped by the main loop.
+ *
+ * pn54x_uring_new() returns NULL if io_uring is not supported by the
+ * kernel (or by the headers at build time).
+ */
+
+typedef struct pn54x_uring Pn54xUring;
+
+typedef
+void
+(*Pn54xUringFunc)(
+    const void* data,
+    int result,
+    void* user_data);
+
+Pn54xUring*
+pn54x_uring_new(
+    guint entries);
+
+void
+pn54x_uring_free(
+    Pn54xUring* uring);
+
+void
+pn54x_uring_free_full(
+    Pn54xUring* uring,
+    GDestroyNotify destroy,
+    void* data); /* Released after the last request has completed */
+
+guint64
+pn54x_uring_read(
+    Pn54xUring* uring,
+    int fd,
+    guint len,
+    Pn54xUringFunc fn,
+    void* user_data);
+
+guint64
+pn54x_uring_write(
+    Pn54xUring* uring,
+    int fd,
+    const void* buf,
+    guint len,
+    Pn54xUringFunc fn,
+    void* user_data);
+
+/* Completion callback won't be invoked for a cancelled operation */
+void
+pn54x_uring_cancel(
+    Pn54xUring* uring,
+    guint64 id);
+
+#endif /* PN54X_URING_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
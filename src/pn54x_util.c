@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_util.h"
+
+#include <errno.h>
+
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#  define PN54X_UTIL_VECTOR_SIZE (32)
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#  define PN54X_UTIL_VECTOR_SIZE (16)
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#  define PN54X_UTIL_VECTOR_SIZE (16)
+#endif
+
+/* Short runs aren't worth setting up the vector loop */
+#define PN54X_UTIL_SCALAR_MAX (16)
+
+gboolean
+pn54x_util_write_error_transient(
+    int err)
+{
+    switch (err) {
+    case EREMOTEIO:     /* NACK from the chip (most I2C bus drivers) */
+    case EIO:           /* NACK from the chip (some I2C bus drivers) */
+    case EBUSY:         /* Lost I2C bus arbitration */
+    case ETIMEDOUT:     /* I2C transfer timed out */
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+gsize
+pn54x_util_skip_ff_scalar(
+    const void* data,
+    gsize len)
+{
+    const guint8* ptr = data;
+    gsize i;
+
+    for (i = 0; i < len && ptr[i] == 0xff; i++);
+    return i;
+}
+
+#ifdef PN54X_UTIL_VECTOR_SIZE
+
+/*
+ * Returns TRUE if the whole vector is 0xff, otherwise stores the
+ * offset of the first non-0xff byte (within the vector) to *pos.
+ */
+static inline
+gboolean
+pn54x_util_vector_ff(
+    const guint8* ptr,
+    gsize* pos)
+{
+#if defined(__AVX2__)
+    const __m256i v = _mm256_loadu_si256((const __m256i*)ptr);
+    const guint32 mask = (guint32)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)0xff)));
+
+    if (mask == 0xffffffff) {
+        return TRUE;
+    }
+    *pos = __builtin_ctz(~mask);
+    return FALSE;
+#elif defined(__SSE2__)
+    const __m128i v = _mm_loadu_si128((const __m128i*)ptr);
+    const guint mask = (guint)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xff)));
+
+    if (mask == 0xffff) {
+        return TRUE;
+    }
+    *pos = __builtin_ctz(~mask);
+    return FALSE;
+#else /* NEON */
+    const uint64x2_t v = vreinterpretq_u64_u8(vld1q_u8(ptr));
+    const guint64 lo = vgetq_lane_u64(v, 0);
+    const guint64 hi = vgetq_lane_u64(v, 1);
+
+    if ((lo & hi) == G_GUINT64_CONSTANT(0xffffffffffffffff)) {
+        return TRUE;
+    }
+    *pos = pn54x_util_skip_ff_scalar(ptr, PN54X_UTIL_VECTOR_SIZE);
+    return FALSE;
+#endif
+}
+
+gsize
+pn54x_util_skip_ff(
+    const void* data,
+    gsize len)
+{
+    const guint8* ptr = data;
+    gsize i = 0;
+
+    if (len <= PN54X_UTIL_SCALAR_MAX || ptr[0] != 0xff) {
+        /* Most packets aren't preceded by any padding at all */
+        return pn54x_util_skip_ff_scalar(ptr, len);
+    }
+    while (i + PN54X_UTIL_VECTOR_SIZE <= len) {
+        gsize pos;
+
+        if (!pn54x_util_vector_ff(ptr + i, &pos)) {
+            return i + pos;
+        }
+        i += PN54X_UTIL_VECTOR_SIZE;
+    }
+    return i + pn54x_util_skip_ff_scalar(ptr + i, len - i);
+}
+
+#else /* !PN54X_UTIL_VECTOR_SIZE */
+
+gsize
+pn54x_util_skip_ff(
+    const void* data,
+    gsize len)
+{
+    const guint8* ptr = data;
+    gsize i = 0;
+
+    /* Portable fallback, one machine word at a time */
+    if (len > PN54X_UTIL_SCALAR_MAX) {
+        while (i + sizeof(gsize) <= len) {
+            gsize word;
+
+            memcpy(&word, ptr + i, sizeof(word));
+            if (word != (gsize)-1) {
+                break;
+            }
+            i += sizeof(word);
+        }
+    }
+    return i + pn54x_util_skip_ff_scalar(ptr + i, len - i);
+}
+
+#endif /* !PN54X_UTIL_VECTOR_SIZE */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
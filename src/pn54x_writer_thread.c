@@ -0,0 +1,626 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "pn54x_writer_thread.h"
+#include "pn54x_system.h"
+#include "pn54x_util.h"
+#include "pn54x_log.h"
+
+#include <glib-unix.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <sys/uio.h>
+
+/*
+ * A write over I2C may take several milliseconds, much longer if the
+ * driver has to retry. The writer thread owns a duplicate of the device
+ * descriptor and performs the writes one by one, so that the main loop
+ * is never blocked by the driver. The file may have been switched to
+ * non-blocking mode for the direct reader, in which case the writer
+ * waits for POLLOUT when the driver isn't ready to accept the data.
+ *
+ * Submitted requests are queued under the mutex. Finished ones go to
+ * the completion list and the eventfd wakes up the main thread, which
+ * reports them in order.
+ *
+ * Requests are preallocated and recycled by the main thread, nothing
+ * gets allocated per write.
+ *
+ * Gathered requests refer to the caller's chunks, which are passed to
+ * writev() as is. Releasing a queued request copies its chunks into the
+ * staging buffer. If the request is being written, release waits for
+ * the write() call to return and then copies the data, so that retries
+ * (if any) are written from the staging buffer. Stop interrupts such
+ * a write and waits for it in the same way. Copied requests never make
+ * release or stop wait.
+ */
+
+#define PN54X_WRITER_SIGNAL PN54X_SYSTEM_INTERRUPT_SIGNAL
+#define PN54X_WRITER_POLL_MS (100) /* Checking for stop in between */
+#define PN54X_WRITER_MAX_IOV (4)
+
+typedef struct pn54x_writer_req Pn54xWriterReq;
+struct pn54x_writer_req {
+    Pn54xWriterReq* next;
+    guint id;
+    int error;
+    gsize len;
+    gssize written;
+    guint retries;
+    gint64 usec;
+    gint64 time;
+    gboolean staged;
+    guint niov;
+    struct iovec iov[PN54X_WRITER_MAX_IOV];
+    guint8* data; /* Staging buffer */
+};
+
+typedef struct pn54x_writer_queue {
+    Pn54xWriterReq* first;
+    Pn54xWriterReq* last;
+} Pn54xWriterQueue;
+
+struct pn54x_writer_thread {
+    gint refcount;
+    gboolean stopped;
+    gboolean gather;
+    gboolean interrupt;
+    int fd;
+    int event_fd;
+    guint event_id;
+    guint last_id;
+    guint max_size;
+    Pn54xWriterRetry retry;
+    guint64 bytes_copied;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_cond_t written;
+    Pn54xWriterReq* current; /* Picked up by the thread */
+    Pn54xWriterReq* writing; /* Passed to the driver */
+    Pn54xWriterQueue queue;
+    Pn54xWriterQueue done;
+    Pn54xWriterReq* free;
+    Pn54xWriterReq* reqs;
+    guint8* staging;
+    Pn54xWriterDoneFunc done_fn;
+    void* user_data;
+};
+
+static
+void
+pn54x_writer_queue_add(
+    Pn54xWriterQueue* queue,
+    Pn54xWriterReq* req)
+{
+    req->next = NULL;
+    if (queue->last) {
+        queue->last->next = req;
+    } else {
+        queue->first = req;
+    }
+    queue->last = req;
+}
+
+static
+Pn54xWriterReq*
+pn54x_writer_queue_take(
+    Pn54xWriterQueue* queue)
+{
+    Pn54xWriterReq* req = queue->first;
+
+    if (req) {
+        queue->first = req->next;
+        if (!queue->first) {
+            queue->last = NULL;
+        }
+        req->next = NULL;
+    }
+    return req;
+}
+
+static
+Pn54xWriterReq*
+pn54x_writer_queue_take_all(
+    Pn54xWriterQueue* queue)
+{
+    Pn54xWriterReq* req = queue->first;
+
+    queue->first = queue->last = NULL;
+    return req;
+}
+
+static
+void
+pn54x_writer_req_stage(
+    Pn54xWriterThread* self,
+    Pn54xWriterReq* req)
+{
+    guint8* ptr = req->data;
+    guint i;
+
+    /* Must be called under the mutex, the size has been checked */
+    for (i = 0; i < req->niov; i++) {
+        memcpy(ptr, req->iov[i].iov_base, req->iov[i].iov_len);
+        ptr += req->iov[i].iov_len;
+    }
+    req->iov[0].iov_base = req->data;
+    req->iov[0].iov_len = req->len;
+    req->niov = 1;
+    req->staged = TRUE;
+    self->bytes_copied += req->len;
+}
+
+static
+Pn54xWriterThread*
+pn54x_writer_thread_ref(
+    Pn54xWriterThread* self)
+{
+    GASSERT(self->refcount > 0);
+    g_atomic_int_inc(&self->refcount);
+    return self;
+}
+
+static
+void
+pn54x_writer_thread_unref(
+    Pn54xWriterThread* self)
+{
+    GASSERT(self->refcount > 0);
+    if (g_atomic_int_dec_and_test(&self->refcount)) {
+        pthread_cond_destroy(&self->written);
+        pthread_cond_destroy(&self->cond);
+        pthread_mutex_destroy(&self->mutex);
+        if (self->event_fd >= 0) {
+            close(self->event_fd);
+        }
+        if (self->fd >= 0) {
+            close(self->fd);
+        }
+        g_free(self->staging);
+        g_free(self->reqs);
+        g_free(self);
+    }
+}
+
+static
+void
+pn54x_writer_thread_wait_writable(
+    Pn54xWriterThread* self)
+{
+    struct pollfd pfd;
+
+    /* Non-blocking file shared with the direct reader */
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = self->fd;
+    pfd.events = POLLOUT;
+    pn54x_system_poll(&pfd, 1, PN54X_WRITER_POLL_MS);
+}
+
+static
+void
+pn54x_writer_thread_write_req(
+    Pn54xWriterThread* self,
+    Pn54xWriterReq* req)
+{
+    const gint64 start = g_get_monotonic_time();
+
+    /* Called under the mutex, which is released while writing */
+    req->retries = 0;
+    for (;;) {
+        struct iovec iov[PN54X_WRITER_MAX_IOV];
+        const guint niov = req->niov;
+
+        /* The request may get staged by release between the attempts */
+        memcpy(iov, req->iov, niov * sizeof(iov[0]));
+        self->writing = req;
+        pthread_mutex_unlock(&self->mutex);
+        for (;;) {
+            req->written = (niov == 1) ?
+                pn54x_system_write(self->fd, iov[0].iov_base, req->len) :
+                pn54x_system_writev(self->fd, iov, niov);
+            req->error = (req->written < 0) ? errno : 0;
+            if (req->error == EAGAIN) {
+                pn54x_writer_thread_wait_writable(self);
+            } else if (req->error != EINTR) {
+                break;
+            }
+            if (g_atomic_int_get(&self->stopped)) {
+                break;
+            }
+        }
+        pthread_mutex_lock(&self->mutex);
+        self->writing = NULL;
+        pthread_cond_broadcast(&self->written);
+
+        if (req->error && req->retries < self->retry.count &&
+            pn54x_util_write_error_transient(req->error) &&
+            !self->stopped) {
+            struct timespec ts;
+
+            /* Give the chip time to wake up (interrupted by stop) */
+            ts.tv_sec = self->retry.delay / 1000000;
+            ts.tv_nsec = (self->retry.delay % 1000000) * 1000;
+            pthread_mutex_unlock(&self->mutex);
+            nanosleep(&ts, NULL);
+            pthread_mutex_lock(&self->mutex);
+            req->retries++;
+            if (self->stopped) {
+                /* The caller's data may be gone by now */
+                break;
+            }
+        } else {
+            break;
+        }
+    }
+    req->time = g_get_monotonic_time();
+    req->usec = req->time - start;
+}
+
+static
+void*
+pn54x_writer_thread_proc(
+    void* arg)
+{
+    Pn54xWriterThread* self = arg;
+    const guint64 one = 1;
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, PN54X_WRITER_SIGNAL);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    pthread_mutex_lock(&self->mutex);
+    while (!self->stopped) {
+        Pn54xWriterReq* req = pn54x_writer_queue_take(&self->queue);
+
+        if (req) {
+            self->current = req;
+            pn54x_writer_thread_write_req(self, req);
+            self->current = NULL;
+            pn54x_writer_queue_add(&self->done, req);
+            (void)(write(self->event_fd, &one, sizeof(one)) < 0);
+        } else {
+            pthread_cond_wait(&self->cond, &self->mutex);
+        }
+    }
+    pthread_mutex_unlock(&self->mutex);
+    pn54x_writer_thread_unref(self);
+    return NULL;
+}
+
+static
+gboolean
+pn54x_writer_thread_event(
+    gint fd,
+    GIOCondition condition,
+    gpointer user_data)
+{
+    Pn54xWriterThread* self = pn54x_writer_thread_ref(user_data);
+    Pn54xWriterReq* req;
+    guint64 count;
+
+    (void)(read(fd, &count, sizeof(count)) < 0);
+    pthread_mutex_lock(&self->mutex);
+    req = pn54x_writer_queue_take_all(&self->done);
+    pthread_mutex_unlock(&self->mutex);
+
+    while (req) {
+        Pn54xWriterReq* next = req->next;
+        const guint id = req->id;
+        const guint retries = req->retries;
+        const gint64 time = req->time;
+        const gboolean ok = (req->written == (gssize)req->len);
+
+        if (req->error && retries) {
+            GERR("Write failed after %u retries: %s", retries,
+                strerror(req->error));
+        } else if (req->error) {
+            GERR("Write failed: %s", strerror(req->error));
+        } else if (!ok) {
+            GERR("Write failed: %d out of %u byte(s) written",
+                (int)req->written, (guint)req->len);
+        } else if (retries) {
+            GDEBUG("Wrote %u byte(s) in %d us after %u retries",
+                (guint)req->len, (int)req->usec, retries);
+        } else {
+            GVERBOSE("Wrote %u byte(s) in %d us", (guint)req->len,
+                (int)req->usec);
+        }
+
+        /* Recycle the request before the callback submits the next one */
+        req->next = self->free;
+        self->free = req;
+        if (!self->stopped) {
+            self->done_fn(id, ok, retries, time, self->user_data);
+        }
+        req = next;
+    }
+    pn54x_writer_thread_unref(self);
+    return G_SOURCE_CONTINUE;
+}
+
+static
+Pn54xWriterReq*
+pn54x_writer_thread_find_queued(
+    Pn54xWriterThread* self,
+    guint id)
+{
+    Pn54xWriterReq* req;
+
+    /* Must be called under the mutex */
+    for (req = self->queue.first; req; req = req->next) {
+        if (req->id == id) {
+            return req;
+        }
+    }
+    return NULL;
+}
+
+/*==========================================================================*
+ * Interface
+ *==========================================================================*/
+
+Pn54xWriterThread*
+pn54x_writer_thread_start(
+    int fd,
+    guint slots,
+    guint max_size,
+    gboolean gather,
+    const Pn54xWriterRetry* retry,
+    Pn54xWriterDoneFunc done_fn,
+    void* user_data)
+{
+    Pn54xWriterThread* self = g_new0(Pn54xWriterThread, 1);
+    guint i;
+    int err;
+
+    g_atomic_int_set(&self->refcount, 1);
+    pthread_mutex_init(&self->mutex, NULL);
+    pthread_cond_init(&self->cond, NULL);
+    pthread_cond_init(&self->written, NULL);
+    self->gather = gather;
+    self->max_size = max_size;
+    if (retry) {
+        self->retry = *retry;
+    }
+    self->done_fn = done_fn;
+    self->user_data = user_data;
+
+    /* Preallocate the requests and their staging buffers */
+    slots = MAX(slots, 1);
+    self->reqs = g_new0(Pn54xWriterReq, slots);
+    self->staging = g_malloc(slots * max_size);
+    for (i = 0; i < slots; i++) {
+        Pn54xWriterReq* req = self->reqs + i;
+
+        req->data = self->staging + i * max_size;
+        req->next = self->free;
+        self->free = req;
+    }
+
+    self->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    self->fd = fd;
+    if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    if (self->fd < 0 || self->event_fd < 0) {
+        GERR("Failed to set up writer thread: %s", strerror(errno));
+        pn54x_writer_thread_unref(self);
+        return NULL;
+    }
+
+    /* Without the signal, stop doesn't interrupt the write */
+    self->interrupt = pn54x_system_interrupt_init();
+    pn54x_writer_thread_ref(self); /* Reference owned by the thread */
+    err = pthread_create(&self->thread, NULL, pn54x_writer_thread_proc, self);
+    if (err) {
+        GERR("Failed to start writer thread: %s", strerror(err));
+        g_atomic_int_set(&self->refcount, 1);
+        pn54x_writer_thread_unref(self);
+        return NULL;
+    }
+
+    self->event_id = g_unix_fd_add_full(G_PRIORITY_HIGH, self->event_fd,
+        G_IO_IN, pn54x_writer_thread_event, self, NULL);
+    GDEBUG("Started writer thread%s", gather ? " (gather)" : "");
+    return self;
+}
+
+guint
+pn54x_writer_thread_write(
+    Pn54xWriterThread* self,
+    const GUtilData* chunks,
+    guint count,
+    gboolean copy)
+{
+    if (G_LIKELY(self) && self->free) {
+        Pn54xWriterReq* req = self->free;
+        gboolean gather;
+        guint i, n = 0;
+        gsize len = 0;
+
+        for (i = 0; i < count; i++) {
+            if (chunks[i].size) {
+                len += chunks[i].size;
+                n++;
+            }
+        }
+
+        if (len > self->max_size) {
+            GERR("Can't write %u byte(s) at once", (guint)len);
+            return 0;
+        }
+
+        /* Without a completion, the caller may free the data right away */
+        gather = self->gather && !copy && n && n <= PN54X_WRITER_MAX_IOV;
+
+        self->free = req->next;
+        req->next = NULL;
+        req->len = len;
+        if (gather) {
+            req->staged = FALSE;
+            req->niov = 0;
+            for (i = 0; i < count; i++) {
+                if (chunks[i].size) {
+                    req->iov[req->niov].iov_base = (void*)chunks[i].bytes;
+                    req->iov[req->niov].iov_len = chunks[i].size;
+                    req->niov++;
+                }
+            }
+        } else {
+            guint8* ptr = req->data;
+
+            for (i = 0; i < count; i++) {
+                memcpy(ptr, chunks[i].bytes, chunks[i].size);
+                ptr += chunks[i].size;
+            }
+            req->iov[0].iov_base = req->data;
+            req->iov[0].iov_len = len;
+            req->niov = 1;
+            req->staged = TRUE;
+        }
+
+        /* Zero is not a valid id */
+        req->id = ++self->last_id;
+        if (!req->id) {
+            req->id = ++self->last_id;
+        }
+
+        pthread_mutex_lock(&self->mutex);
+        if (req->staged) {
+            self->bytes_copied += len;
+        }
+        pn54x_writer_queue_add(&self->queue, req);
+        pthread_cond_signal(&self->cond);
+        pthread_mutex_unlock(&self->mutex);
+        return req->id;
+    } else if (self) {
+        GERR("Too many writes in progress");
+    }
+    return 0;
+}
+
+void
+pn54x_writer_thread_release(
+    Pn54xWriterThread* self,
+    guint id)
+{
+    if (G_LIKELY(self) && id) {
+        Pn54xWriterReq* req;
+
+        /*
+         * After that the caller may free the data. A gathered request
+         * which is being written has to wait until the driver is done
+         * with the caller's data. A completed one doesn't refer to it
+         * anymore.
+         */
+        pthread_mutex_lock(&self->mutex);
+        req = pn54x_writer_thread_find_queued(self, id);
+        if (!req && self->current && self->current->id == id) {
+            req = self->current;
+            while (self->writing == req && !req->staged) {
+                pthread_cond_wait(&self->written, &self->mutex);
+            }
+            if (self->current != req) {
+                /* Has been written while we were waiting */
+                req = NULL;
+            }
+        }
+        if (req && !req->staged) {
+            pn54x_writer_req_stage(self, req);
+        }
+        pthread_mutex_unlock(&self->mutex);
+    }
+}
+
+void
+pn54x_writer_thread_stop(
+    Pn54xWriterThread* self)
+{
+    if (G_LIKELY(self)) {
+        guint64 bytes_copied;
+
+        if (self->event_id) {
+            g_source_remove(self->event_id);
+            self->event_id = 0;
+        }
+
+        pthread_mutex_lock(&self->mutex);
+        self->stopped = TRUE;
+        bytes_copied = self->bytes_copied;
+        pthread_cond_signal(&self->cond);
+
+        /*
+         * The thread doesn't exit until it's stopped, so the thread id
+         * is still valid. The signal interrupts the write in progress.
+         * A gathered one refers to the caller's data, it has to be waited
+         * for. Otherwise, there's nothing to wait for, the thread drops
+         * its own reference when it's done.
+         */
+        if (self->interrupt) {
+            pthread_kill(self->thread, PN54X_WRITER_SIGNAL);
+        }
+        while (self->writing && !self->writing->staged) {
+            pthread_cond_wait(&self->written, &self->mutex);
+        }
+        pthread_mutex_unlock(&self->mutex);
+        pthread_detach(self->thread);
+        if (bytes_copied) {
+            GDEBUG("Stopped writer thread, %" G_GUINT64_FORMAT " byte(s) "
+                "copied", bytes_copied);
+        } else {
+            GDEBUG("Stopped writer thread");
+        }
+        pn54x_writer_thread_unref(self);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
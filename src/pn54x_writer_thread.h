@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#ifndef PN54X_WRITER_THREAD_H
+#define PN54X_WRITER_THREAD_H
+
+#include <gutil_types.h>
+
+/*
+ * Blocking writes to the device performed by a dedicated thread.
+ * Completions are delivered on the main thread, in the same order
+ * as the writes were submitted.
+ *
+ * Each write is copied into one of the preallocated staging buffers,
+ * unless gather is enabled, in which case the chunks are passed to
+ * writev() as is and must stay valid until the write completes or gets
+ * released. That's only safe if the driver doesn't split the write into
+ * several transfers (e.g. it implements write_iter). Writes submitted
+ * with copy set are always copied right away, e.g. when there's no
+ * completion to tell the caller when it's done with the data.
+ */
+
+typedef struct pn54x_writer_thread Pn54xWriterThread;
+
+/* Time is when the last write() call returned, g_get_monotonic_time() */
+typedef void (*Pn54xWriterDoneFunc)(guint id, gboolean ok, guint retries,
+    gint64 time, void* user_data);
+
+/* Transient errors are retried after a delay, without blocking the caller */
+typedef struct pn54x_writer_retry {
+    guint count;    /* Max number of retries */
+    guint delay;    /* Microseconds */
+} Pn54xWriterRetry;
+
+Pn54xWriterThread*
+pn54x_writer_thread_start(
+    int fd, /* Takes ownership, may be non-blocking */
+    guint slots,
+    guint max_size,
+    gboolean gather,
+    const Pn54xWriterRetry* retry,
+    Pn54xWriterDoneFunc done_fn,
+    void* user_data);
+
+guint
+pn54x_writer_thread_write(
+    Pn54xWriterThread* writer,
+    const GUtilData* chunks,
+    guint count,
+    gboolean copy);
+
+void
+pn54x_writer_thread_release(
+    Pn54xWriterThread* writer,
+    guint id); /* Drops the reference to the caller's data, may block */
+
+void
+pn54x_writer_thread_stop(
+    Pn54xWriterThread* writer);
+
+#endif /* PN54X_WRITER_THREAD_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "test_common.h"
+
+#include "pn54x_capture.h"
+
+#include <unistd.h>
+
+static TestOpt test_opt;
+
+typedef struct test_packet {
+    guint32 time_hi;
+    guint32 time_lo;
+    guint32 flags;
+    GUtilData data;
+} TestPacket;
+
+/* Validates the file and returns the number of packets */
+static
+guint
+test_capture_parse(
+    const char* path,
+    TestPacket* packets,
+    guint max)
+{
+    gchar* contents = NULL;
+    gsize size = 0;
+    const guint8* ptr;
+    const guint8* end;
+    const guint32* w;
+    guint n = 0;
+
+    g_assert(g_file_get_contents(path, &contents, &size, NULL));
+    ptr = (guint8*)contents;
+    end = ptr + size;
+
+    /* Section header */
+    g_assert_cmpuint(size, >= ,48);
+    w = (guint32*)ptr;
+    g_assert_cmpuint(w[0], == ,0x0a0d0d0a);
+    g_assert_cmpuint(w[1], == ,28);
+    g_assert_cmpuint(w[2], == ,0x1a2b3c4d);
+    g_assert_cmpuint(((guint16*)(w + 3))[0], == ,1);
+    g_assert_cmpuint(((guint16*)(w + 3))[1], == ,0);
+    g_assert_cmpuint(w[6], == ,28);
+    ptr += 28;
+
+    /* Interface description */
+    w = (guint32*)ptr;
+    g_assert_cmpuint(w[0], == ,1);
+    g_assert_cmpuint(w[1], == ,20);
+    g_assert_cmpuint(((guint16*)(w + 2))[0], == ,PN54X_CAPTURE_LINKTYPE);
+    g_assert_cmpuint(w[4], == ,20);
+    ptr += 20;
+
+    /* Enhanced packets */
+    while (ptr < end) {
+        guint32 block, len, pad;
+
+        w = (guint32*)ptr;
+        g_assert_cmpuint(end - ptr, >= ,44);
+        g_assert_cmpuint(w[0], == ,6);
+        block = w[1];
+        len = w[5];
+        pad = (len + 3) & ~3u;
+        g_assert_cmpuint(block, == ,44 + pad);
+        g_assert_cmpuint(end - ptr, >= ,block);
+        g_assert_cmpuint(w[2], == ,0);
+        g_assert_cmpuint(w[6], == ,len);
+        w = (guint32*)(ptr + 28 + pad);
+        g_assert_cmpuint(((guint16*)w)[0], == ,2);
+        g_assert_cmpuint(((guint16*)w)[1], == ,4);
+        g_assert_cmpuint(w[2], == ,0);
+        g_assert_cmpuint(w[3], == ,block);
+        if (n < max) {
+            packets[n].time_hi = ((guint32*)ptr)[3];
+            packets[n].time_lo = ((guint32*)ptr)[4];
+            packets[n].flags = w[1];
+            packets[n].data.bytes = g_memdup(ptr + 28, len);
+            packets[n].data.size = len;
+        }
+        n++;
+        ptr += block;
+    }
+    g_free(contents);
+    return n;
+}
+
+static
+void
+test_capture_free_packets(
+    TestPacket* packets,
+    guint n)
+{
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        g_free((void*)packets[i].data.bytes);
+    }
+}
+
+/*==========================================================================*
+ * null
+ *==========================================================================*/
+
+static
+void
+test_null(
+    void)
+{
+    Pn54xCaptureConfig config;
+
+    memset(&config, 0, sizeof(config));
+    g_assert_null(pn54x_capture_new(NULL));
+    g_assert_null(pn54x_capture_new(&config));
+    config.path = "/nonexistent/pn54x.pcapng";
+    g_assert_null(pn54x_capture_new(&config));
+    pn54x_capture_free(NULL);
+}
+
+/*==========================================================================*
+ * basic
+ *==========================================================================*/
+
+static
+void
+test_basic(
+    void)
+{
+    static const guint8 cmd_hdr[] = { 0x20, 0x00, 0x01 };
+    static const guint8 cmd_payload[] = { 0x00 };
+    static const guint8 rsp[] = { 0x40, 0x00, 0x03, 0x00, 0x11, 0x00 };
+    static const guint8 data[] = { 0x00, 0x00, 0x00 };
+    static const GUtilData cmd_chunks[] = {
+        { TEST_ARRAY_AND_SIZE(cmd_hdr) },
+        { TEST_ARRAY_AND_SIZE(cmd_payload) }
+    };
+    static const guint8 cmd[] = { 0x20, 0x00, 0x01, 0x00 };
+    const gint64 t = G_GINT64_CONSTANT(0x123456789a);
+    char* dir = g_dir_make_tmp("test_pn54x_capture_XXXXXX", NULL);
+    char* path = g_build_filename(dir, "nci.pcapng", NULL);
+    const Pn54xCaptureStats* stats;
+    Pn54xCaptureConfig config;
+    Pn54xCapture* capture;
+    TestPacket packets[3];
+    GUtilData chunk;
+
+    memset(&config, 0, sizeof(config));
+    config.path = path;
+    capture = pn54x_capture_new(&config);
+    g_assert(capture);
+
+    pn54x_capture_packet(capture, PN54X_CAPTURE_OUT, t, TEST_ARRAY_AND_COUNT(
+        cmd_chunks));
+    TEST_BYTES_SET(chunk, rsp);
+    pn54x_capture_packet(capture, PN54X_CAPTURE_IN, t + 1, &chunk, 1);
+    TEST_BYTES_SET(chunk, data);
+    pn54x_capture_packet(capture, PN54X_CAPTURE_IN, t + 2, &chunk, 1);
+
+    stats = pn54x_capture_stats(capture);
+    g_assert_cmpuint(stats->packets, == ,3);
+    g_assert_cmpuint(stats->bytes, == ,sizeof(cmd) + sizeof(rsp) +
+        sizeof(data));
+    g_assert_cmpuint(stats->dropped, == ,0);
+    g_assert_cmpuint(stats->rotations, == ,0);
+    pn54x_capture_free(capture);
+
+    g_assert_cmpuint(test_capture_parse(path, TEST_ARRAY_AND_COUNT(packets)),
+        == ,3);
+    g_assert_cmpuint(packets[0].time_hi, == ,0x12);
+    g_assert_cmpuint(packets[0].time_lo, == ,0x3456789a);
+    g_assert_cmpuint(packets[0].flags, == ,2);
+    g_assert_cmpuint(packets[0].data.size, == ,sizeof(cmd));
+    g_assert(!memcmp(packets[0].data.bytes, cmd, sizeof(cmd)));
+    g_assert_cmpuint(packets[1].time_lo, == ,0x3456789b);
+    g_assert_cmpuint(packets[1].flags, == ,1);
+    g_assert_cmpuint(packets[1].data.size, == ,sizeof(rsp));
+    g_assert(!memcmp(packets[1].data.bytes, rsp, sizeof(rsp)));
+    g_assert_cmpuint(packets[2].flags, == ,1);
+    g_assert_cmpuint(packets[2].data.size, == ,sizeof(data));
+    test_capture_free_packets(packets, G_N_ELEMENTS(packets));
+
+    g_assert_cmpint(g_unlink(path), == ,0);
+    g_assert_cmpint(g_rmdir(dir), == ,0);
+    g_free(path);
+    g_free(dir);
+}
+
+/*==========================================================================*
+ * rotate
+ *==========================================================================*/
+
+static
+void
+test_rotate(
+    gconstpointer param)
+{
+    const guint count = GPOINTER_TO_UINT(param);
+    char* dir = g_dir_make_tmp("test_pn54x_capture_XXXXXX", NULL);
+    char* path = g_build_filename(dir, "nci.pcapng", NULL);
+    const Pn54xCaptureStats* stats;
+    Pn54xCaptureConfig config;
+    Pn54xCapture* capture;
+    guint8 buf[255];
+    TestPacket last;
+    GUtilData chunk;
+    guint i, total;
+
+    /* 300 bytes per packet, 13 packets per file */
+    memset(&config, 0, sizeof(config));
+    config.path = path;
+    config.size = 1000; /* Gets rounded up to 4096 */
+    config.count = count;
+    capture = pn54x_capture_new(&config);
+    g_assert(capture);
+
+    chunk.bytes = buf;
+    chunk.size = sizeof(buf);
+    for (i = 0; i < 40; i++) {
+        memset(buf, i, sizeof(buf));
+        pn54x_capture_packet(capture, PN54X_CAPTURE_IN, i, &chunk, 1);
+    }
+
+    /* Too large */
+    chunk.size = 4096;
+    pn54x_capture_packet(capture, PN54X_CAPTURE_OUT, i, &chunk, 1);
+
+    stats = pn54x_capture_stats(capture);
+    g_assert_cmpuint(stats->packets, == ,40);
+    g_assert_cmpuint(stats->dropped, == ,1);
+    g_assert_cmpuint(stats->rotations, == ,3);
+    pn54x_capture_free(capture);
+
+    /* The current file has the last packet */
+    g_assert_cmpuint(test_capture_parse(path, &last, 1), == ,1);
+    g_assert_cmpuint(last.time_lo, == ,39);
+    g_assert_cmpuint(((guint8*)last.data.bytes)[0], == ,39);
+    test_capture_free_packets(&last, 1);
+    total = 1;
+
+    /* Older ones are full */
+    for (i = 1; i < count; i++) {
+        char* name = g_strdup_printf("%s.%u", path, i);
+        TestPacket first;
+
+        g_assert_cmpuint(test_capture_parse(name, &first, 1), == ,13);
+        g_assert_cmpuint(first.time_lo, == ,39 - 13 * i);
+        test_capture_free_packets(&first, 1);
+        g_assert_cmpint(g_unlink(name), == ,0);
+        g_free(name);
+        total += 13;
+    }
+    g_assert_cmpuint(total, <= ,40);
+
+    g_assert_cmpint(g_unlink(path), == ,0);
+    g_assert_cmpint(g_rmdir(dir), == ,0);
+    g_free(path);
+    g_free(dir);
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+#define TEST_(name) "/pn54x_capture/" name
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func(TEST_("null"), test_null);
+    g_test_add_func(TEST_("basic"), test_basic);
+    g_test_add_data_func(TEST_("rotate/1"), GUINT_TO_POINTER(1),
+        test_rotate);
+    g_test_add_data_func(TEST_("rotate/3"), GUINT_TO_POINTER(3),
+        test_rotate);
+    test_init(&test_opt, argc, argv);
+    return g_test_run();
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
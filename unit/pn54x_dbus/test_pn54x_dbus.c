@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "test_common.h"
+
+#include "pn54x_dbus.h"
+
+static TestOpt test_opt;
+
+#define TEST_PATH "/nfc0/pn54x"
+#define TEST_ALLOW "1;* = allow"
+#define TEST_DENY "1;* = deny"
+
+typedef struct test_dbus {
+    GMainLoop* loop;
+    GDBusConnection* connection;
+    GVariant* reply;
+    GError* error;
+    Pn54xDBusStats stats;
+    guint get_count;
+    guint reset_count;
+    guint dump_count;
+    guint dump_packets_count;
+} TestDBus;
+
+static
+void
+test_dbus_get_stats(
+    Pn54xDBusStats* stats,
+    void* user_data)
+{
+    TestDBus* test = user_data;
+
+    test->get_count++;
+    *stats = test->stats;
+}
+
+static
+void
+test_dbus_reset_stats(
+    void* user_data)
+{
+    TestDBus* test = user_data;
+
+    test->reset_count++;
+    memset(&test->stats, 0, sizeof(test->stats));
+}
+
+static
+void
+test_dbus_dump_latency(
+    void* user_data)
+{
+    TestDBus* test = user_data;
+
+    test->dump_count++;
+}
+
+static
+void
+test_dbus_dump_packets(
+    void* user_data)
+{
+    TestDBus* test = user_data;
+
+    test->dump_packets_count++;
+}
+
+static const Pn54xDBusFunctions test_dbus_fn = {
+    test_dbus_get_stats,
+    test_dbus_reset_stats,
+    test_dbus_dump_latency,
+    test_dbus_dump_packets
+};
+
+static
+void
+test_dbus_call_done(
+    GObject* object,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    TestDBus* test = user_data;
+
+    test->reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(object),
+        result, &test->error);
+    g_main_loop_quit(test->loop);
+}
+
+/* The object lives on the same connection, the call has to be async */
+static
+GVariant*
+test_dbus_call(
+    TestDBus* test,
+    const char* method)
+{
+    test->reply = NULL;
+    if (test->error) {
+        g_error_free(test->error);
+        test->error = NULL;
+    }
+    g_dbus_connection_call(test->connection,
+        g_dbus_connection_get_unique_name(test->connection), TEST_PATH,
+        PN54X_DBUS_INTERFACE, method, NULL, NULL, G_DBUS_CALL_FLAGS_NONE,
+        -1, NULL, test_dbus_call_done, test);
+    test_run(&test_opt, test->loop);
+    return test->reply;
+}
+
+static
+guint64
+test_dbus_lookup(
+    GVariant* reply,
+    const char* key)
+{
+    GVariant* dict = g_variant_get_child_value(reply, 0);
+    guint64 value = G_MAXUINT64;
+
+    g_assert(g_variant_lookup(dict, key, "t", &value));
+    g_variant_unref(dict);
+    return value;
+}
+
+static
+void
+test_dbus_init(
+    TestDBus* test,
+    GTestDBus* bus)
+{
+    memset(test, 0, sizeof(*test));
+    g_test_dbus_up(bus);
+    test->connection = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+    g_assert(test->connection);
+    test->loop = g_main_loop_new(NULL, FALSE);
+}
+
+static
+void
+test_dbus_deinit(
+    TestDBus* test,
+    GTestDBus* bus)
+{
+    if (test->error) {
+        g_error_free(test->error);
+    }
+    g_main_loop_unref(test->loop);
+    g_dbus_connection_close_sync(test->connection, NULL, NULL);
+    g_object_unref(test->connection);
+    g_test_dbus_down(bus);
+}
+
+/*==========================================================================*
+ * null
+ *==========================================================================*/
+
+static
+void
+test_null(
+    void)
+{
+    pn54x_dbus_free(NULL);
+}
+
+/*==========================================================================*
+ * basic
+ *==========================================================================*/
+
+static
+void
+test_basic(
+    void)
+{
+    GTestDBus* bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    Pn54xDBus* dbus;
+    GVariant* reply;
+    TestDBus test;
+    gint version = 0;
+
+    test_dbus_init(&test, bus);
+    dbus = pn54x_dbus_new(test.connection, G_BUS_TYPE_SESSION, TEST_PATH,
+        TEST_ALLOW, &test_dbus_fn, &test);
+    g_assert(dbus);
+
+    reply = test_dbus_call(&test, "GetInterfaceVersion");
+    g_assert(reply);
+    g_variant_get(reply, "(i)", &version);
+    g_assert_cmpint(version, == ,PN54X_DBUS_INTERFACE_VERSION);
+    g_variant_unref(reply);
+
+    test.stats.io.reads = 1;
+    test.stats.io.read_bytes = 2;
+    test.stats.io.packets = 3;
+    test.stats.io.padding = 4;
+    test.stats.io.carried = 5;
+    test.stats.io.writes = 6;
+    test.stats.io.write_bytes = 7;
+    test.stats.io.write_errors = 8;
+    test.stats.power_cycles = 9;
+    test.stats.error_resets = G_MAXUINT32 + G_GUINT64_CONSTANT(1);
+    test.stats.cold_starts = 14;
+    test.stats.warm_starts = 15;
+    test.stats.boots = 16;
+    test.stats.boots_signaled = 17;
+    test.stats.boot_timeouts = 18;
+    test.stats.boot_time = 19;
+    test.stats.boot_time_max = 20;
+    test.stats.recovery.errors = 10;
+    test.stats.recovery.recovered = 11;
+    test.stats.recovery.failed = 12;
+    test.stats.recovery.time = 13;
+
+    reply = test_dbus_call(&test, "GetStats");
+    g_assert(reply);
+    g_assert_cmpuint(test.get_count, == ,1);
+    g_assert_cmpuint(test_dbus_lookup(reply, "Reads"), == ,1);
+    g_assert_cmpuint(test_dbus_lookup(reply, "ReadBytes"), == ,2);
+    g_assert_cmpuint(test_dbus_lookup(reply, "Packets"), == ,3);
+    g_assert_cmpuint(test_dbus_lookup(reply, "Padding"), == ,4);
+    g_assert_cmpuint(test_dbus_lookup(reply, "Carried"), == ,5);
+    g_assert_cmpuint(test_dbus_lookup(reply, "Writes"), == ,6);
+    g_assert_cmpuint(test_dbus_lookup(reply, "WriteBytes"), == ,7);
+    g_assert_cmpuint(test_dbus_lookup(reply, "WriteErrors"), == ,8);
+    g_assert_cmpuint(test_dbus_lookup(reply, "PowerCycles"), == ,9);
+    g_assert_cmpuint(test_dbus_lookup(reply, "ErrorResets"), == ,
+        G_MAXUINT32 + G_GUINT64_CONSTANT(1));
+    g_assert_cmpuint(test_dbus_lookup(reply, "ColdStarts"), == ,14);
+    g_assert_cmpuint(test_dbus_lookup(reply, "WarmStarts"), == ,15);
+    g_assert_cmpuint(test_dbus_lookup(reply, "Boots"), == ,16);
+    g_assert_cmpuint(test_dbus_lookup(reply, "BootsSignaled"), == ,17);
+    g_assert_cmpuint(test_dbus_lookup(reply, "BootTimeouts"), == ,18);
+    g_assert_cmpuint(test_dbus_lookup(reply, "BootTime"), == ,19);
+    g_assert_cmpuint(test_dbus_lookup(reply, "BootTimeMax"), == ,20);
+    g_assert_cmpuint(test_dbus_lookup(reply, "ChipErrors"), == ,10);
+    g_assert_cmpuint(test_dbus_lookup(reply, "Recovered"), == ,11);
+    g_assert_cmpuint(test_dbus_lookup(reply, "RecoveryFailures"), == ,12);
+    g_assert_cmpuint(test_dbus_lookup(reply, "RecoveryTime"), == ,13);
+    g_variant_unref(reply);
+
+    reply = test_dbus_call(&test, "ResetStats");
+    g_assert(reply);
+    g_assert_cmpuint(test.reset_count, == ,1);
+    g_variant_unref(reply);
+
+    reply = test_dbus_call(&test, "GetStats");
+    g_assert(reply);
+    g_assert_cmpuint(test.get_count, == ,2);
+    g_assert_cmpuint(test_dbus_lookup(reply, "Reads"), == ,0);
+    g_assert_cmpuint(test_dbus_lookup(reply, "ErrorResets"), == ,0);
+    g_assert_cmpuint(test_dbus_lookup(reply, "RecoveryTime"), == ,0);
+    g_variant_unref(reply);
+
+    reply = test_dbus_call(&test, "DumpLatency");
+    g_assert(reply);
+    g_assert_cmpuint(test.dump_count, == ,1);
+    g_variant_unref(reply);
+
+    reply = test_dbus_call(&test, "DumpPackets");
+    g_assert(reply);
+    g_assert_cmpuint(test.dump_packets_count, == ,1);
+    g_variant_unref(reply);
+
+    /* Unregistered object no longer responds */
+    pn54x_dbus_free(dbus);
+    g_assert(!test_dbus_call(&test, "GetStats"));
+    g_assert(test.error);
+    g_assert_cmpuint(test.get_count, == ,2);
+
+    test_dbus_deinit(&test, bus);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * access
+ *==========================================================================*/
+
+static
+void
+test_access(
+    void)
+{
+    GTestDBus* bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    static const char* denied[] = {
+        "ResetStats", "DumpLatency", "DumpPackets"
+    };
+    Pn54xDBus* dbus;
+    GVariant* reply;
+    TestDBus test;
+    guint i;
+
+    test_dbus_init(&test, bus);
+    g_assert(!pn54x_dbus_new(test.connection, G_BUS_TYPE_SESSION, TEST_PATH,
+        "foo", &test_dbus_fn, &test));
+    dbus = pn54x_dbus_new(test.connection, G_BUS_TYPE_SESSION, TEST_PATH,
+        TEST_DENY, &test_dbus_fn, &test);
+    g_assert(dbus);
+
+    /* Statistics can be read by anyone */
+    reply = test_dbus_call(&test, "GetStats");
+    g_assert(reply);
+    g_assert_cmpuint(test.get_count, == ,1);
+    g_variant_unref(reply);
+
+    /* But not reset, and nothing gets written to the log */
+    for (i = 0; i < G_N_ELEMENTS(denied); i++) {
+        g_assert(!test_dbus_call(&test, denied[i]));
+        g_assert(g_error_matches(test.error, G_DBUS_ERROR,
+            G_DBUS_ERROR_ACCESS_DENIED));
+    }
+    g_assert_cmpuint(test.reset_count, == ,0);
+    g_assert_cmpuint(test.dump_count, == ,0);
+    g_assert_cmpuint(test.dump_packets_count, == ,0);
+
+    pn54x_dbus_free(dbus);
+    test_dbus_deinit(&test, bus);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * unknown
+ *==========================================================================*/
+
+static
+void
+test_unknown(
+    void)
+{
+    GTestDBus* bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    Pn54xDBus* dbus;
+    TestDBus test;
+
+    test_dbus_init(&test, bus);
+    dbus = pn54x_dbus_new(test.connection, G_BUS_TYPE_SESSION, TEST_PATH,
+        TEST_ALLOW, &test_dbus_fn, &test);
+    g_assert(dbus);
+
+    /* Introspection data makes GDBus reject this before it gets to us */
+    g_assert(!test_dbus_call(&test, "Foo"));
+    g_assert(g_error_matches(test.error, G_DBUS_ERROR,
+        G_DBUS_ERROR_UNKNOWN_METHOD));
+
+    pn54x_dbus_free(dbus);
+    test_dbus_deinit(&test, bus);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * dup
+ *==========================================================================*/
+
+static
+void
+test_dup(
+    void)
+{
+    GTestDBus* bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    Pn54xDBus* dbus;
+    TestDBus test;
+
+    test_dbus_init(&test, bus);
+    dbus = pn54x_dbus_new(test.connection, G_BUS_TYPE_SESSION, TEST_PATH,
+        TEST_ALLOW, &test_dbus_fn, &test);
+    g_assert(dbus);
+
+    /* The path is already taken */
+    g_assert(!pn54x_dbus_new(test.connection, G_BUS_TYPE_SESSION, TEST_PATH,
+        TEST_ALLOW, &test_dbus_fn, &test));
+
+    pn54x_dbus_free(dbus);
+    test_dbus_deinit(&test, bus);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+#define TEST_(name) "/pn54x_dbus/" name
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func(TEST_("null"), test_null);
+    g_test_add_func(TEST_("basic"), test_basic);
+    g_test_add_func(TEST_("access"), test_access);
+    g_test_add_func(TEST_("unknown"), test_unknown);
+    g_test_add_func(TEST_("dup"), test_dup);
+    test_init(&test_opt, argc, argv);
+    return g_test_run();
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "test_common.h"
+
+#include "pn54x_framer.h"
+
+#include <gutil_misc.h>
+
+static TestOpt test_opt;
+
+typedef struct test_framer_data {
+    const GUtilData* out;
+    guint out_count;
+    guint nout;
+} TestFramer;
+
+static const guint8 test_ntf[] = { 0x60, 0x00, 0x02, 0x00, 0x01 };
+static const guint8 test_rsp[] = { 0x40, 0x00, 0x01, 0x00 };
+static const guint8 test_empty[] = { 0x61, 0x05, 0x00 };
+
+static
+void
+test_framer_packet(
+    const void* pkt,
+    guint len,
+    void* user_data)
+{
+    TestFramer* test = user_data;
+    const GUtilData* out = test->out + test->nout;
+
+    g_assert_cmpuint(test->nout, < ,test->out_count);
+    g_assert_cmpuint(out->size, == ,len);
+    g_assert(!memcmp(out->bytes, pkt, len));
+    test->nout++;
+}
+
+static
+void
+test_framer_feed(
+    const GUtilData* in,
+    guint chunk,
+    const GUtilData* out,
+    guint out_count)
+{
+    Pn54xFramer framer;
+    TestFramer test;
+    gsize off;
+
+    memset(&test, 0, sizeof(test));
+    memset(&framer, 0, sizeof(framer));
+    test.out = out;
+    test.out_count = out_count;
+    pn54x_framer_reset(&framer);
+    for (off = 0; off < in->size; off += chunk) {
+        pn54x_framer_input(&framer, in->bytes + off,
+            MIN(chunk, in->size - off), test_framer_packet, &test);
+    }
+    g_assert_cmpuint(test.nout, == ,out_count);
+    g_assert_cmpuint(framer.len, == ,0);
+    g_assert_cmpuint(framer.stats.packets, == ,out_count);
+}
+
+/*==========================================================================*
+ * split
+ *==========================================================================*/
+
+static
+void
+test_split(
+    void)
+{
+    static const guint8 in_bytes[] = {
+        0xff, 0xff, 0x60, 0x00, 0x02, 0x00, 0x01, 0xff,
+        0x40, 0x00, 0x01, 0x00, 0x61, 0x05, 0x00, 0xff,
+        0xff, 0xff, 0x60, 0x00, 0x02, 0x00, 0x01
+    };
+    static const GUtilData out[] = {
+        { TEST_ARRAY_AND_SIZE(test_ntf) },
+        { TEST_ARRAY_AND_SIZE(test_rsp) },
+        { TEST_ARRAY_AND_SIZE(test_empty) },
+        { TEST_ARRAY_AND_SIZE(test_ntf) }
+    };
+    GUtilData in;
+    guint chunk;
+
+    /* Every chunk size, from byte by byte to all at once */
+    TEST_BYTES_SET(in, in_bytes);
+    for (chunk = 1; chunk <= in.size; chunk++) {
+        test_framer_feed(&in, chunk, TEST_ARRAY_AND_COUNT(out));
+    }
+}
+
+/*==========================================================================*
+ * max
+ *==========================================================================*/
+
+static
+void
+test_max(
+    void)
+{
+    guint8 pkt[PN54X_FRAMER_MAX_PACKET_SIZE];
+    guint8 in_bytes[3 * PN54X_FRAMER_MAX_PACKET_SIZE];
+    GUtilData out[3];
+    GUtilData in;
+    guint i, chunk;
+
+    /* Maximum size packets back to back */
+    pkt[0] = 0x00;
+    pkt[1] = 0x00;
+    pkt[2] = 0xff;
+    for (i = PN54X_FRAMER_HEADER_SIZE; i < sizeof(pkt); i++) {
+        pkt[i] = (guint8)i;
+    }
+    for (i = 0; i < G_N_ELEMENTS(out); i++) {
+        memcpy(in_bytes + i * sizeof(pkt), pkt, sizeof(pkt));
+        out[i].bytes = pkt;
+        out[i].size = sizeof(pkt);
+    }
+
+    TEST_BYTES_SET(in, in_bytes);
+    for (chunk = 1; chunk <= in.size; chunk++) {
+        test_framer_feed(&in, chunk, TEST_ARRAY_AND_COUNT(out));
+    }
+}
+
+/*==========================================================================*
+ * reset
+ *==========================================================================*/
+
+static
+void
+test_reset(
+    void)
+{
+    static const GUtilData out[] = {
+        { TEST_ARRAY_AND_SIZE(test_rsp) }
+    };
+    Pn54xFramer framer;
+    TestFramer test;
+
+    memset(&test, 0, sizeof(test));
+    memset(&framer, 0, sizeof(framer));
+    test.out = out;
+    test.out_count = G_N_ELEMENTS(out);
+
+    /* Incomplete packet gets dropped */
+    pn54x_framer_reset(&framer);
+    pn54x_framer_input(&framer, test_ntf, 4, test_framer_packet, &test);
+    g_assert_cmpuint(framer.len, == ,4);
+    pn54x_framer_reset(&framer);
+    pn54x_framer_input(&framer, TEST_ARRAY_AND_SIZE(test_rsp),
+        test_framer_packet, &test);
+    g_assert_cmpuint(test.nout, == ,1);
+    g_assert_cmpuint(framer.len, == ,0);
+}
+
+/*==========================================================================*
+ * reset_in_callback
+ *==========================================================================*/
+
+typedef struct test_reset_in_callback {
+    Pn54xFramer framer;
+    guint count;
+} TestResetInCallback;
+
+static
+void
+test_reset_in_callback_packet(
+    const void* pkt,
+    guint len,
+    void* user_data)
+{
+    TestResetInCallback* test = user_data;
+
+    test->count++;
+    pn54x_framer_reset(&test->framer);
+}
+
+static
+void
+test_reset_in_callback(
+    void)
+{
+    static const guint8 in[] = {
+        0x60, 0x00, 0x02, 0x00, 0x01,
+        0x40, 0x00, 0x01, 0x00,
+        0x61, 0x05
+    };
+    TestResetInCallback test;
+
+    memset(&test, 0, sizeof(test));
+
+    /* Nothing after the first packet gets handled */
+    pn54x_framer_input(&test.framer, TEST_ARRAY_AND_SIZE(in),
+        test_reset_in_callback_packet, &test);
+    g_assert_cmpuint(test.count, == ,1);
+    g_assert_cmpuint(test.framer.len, == ,0);
+    g_assert_cmpuint(test.framer.stats.packets, == ,1);
+
+    /* Same thing with the first packet carried over */
+    pn54x_framer_input(&test.framer, in, 2,
+        test_reset_in_callback_packet, &test);
+    g_assert_cmpuint(test.framer.len, == ,2);
+    pn54x_framer_input(&test.framer, in + 2, sizeof(in) - 2,
+        test_reset_in_callback_packet, &test);
+    g_assert_cmpuint(test.count, == ,2);
+    g_assert_cmpuint(test.framer.len, == ,0);
+    g_assert_cmpuint(test.framer.stats.packets, == ,2);
+}
+
+/*==========================================================================*
+ * stats
+ *==========================================================================*/
+
+static
+void
+test_stats(
+    void)
+{
+    static const guint8 in[] = {
+        0xff, 0xff, 0x60, 0x00, 0x02, 0x00, 0x01, 0xff,
+        0x40, 0x00, 0x01, 0x00, 0x61, 0x05, 0x00, 0xff,
+        0xff, 0xff, 0x60, 0x00, 0x02, 0x00, 0x01
+    };
+    static const GUtilData out[] = {
+        { TEST_ARRAY_AND_SIZE(test_ntf) },
+        { TEST_ARRAY_AND_SIZE(test_rsp) },
+        { TEST_ARRAY_AND_SIZE(test_empty) },
+        { TEST_ARRAY_AND_SIZE(test_ntf) }
+    };
+    Pn54xFramer framer;
+    TestFramer test;
+    guint i;
+
+    memset(&test, 0, sizeof(test));
+    memset(&framer, 0, sizeof(framer));
+    test.out = out;
+    test.out_count = G_N_ELEMENTS(out);
+
+    /* All at once */
+    pn54x_framer_input(&framer, TEST_ARRAY_AND_SIZE(in),
+        test_framer_packet, &test);
+    g_assert_cmpuint(framer.stats.packets, == ,4);
+    g_assert_cmpuint(framer.stats.padding, == ,6);
+    g_assert_cmpuint(framer.stats.carried, == ,0);
+    g_assert_cmpuint(framer.stats.copied, == ,0);
+
+    /* Byte by byte, each packet gets carried over once */
+    test.nout = 0;
+    for (i = 0; i < sizeof(in); i++) {
+        pn54x_framer_input(&framer, in + i, 1, test_framer_packet, &test);
+    }
+    g_assert_cmpuint(framer.stats.packets, == ,8);
+    g_assert_cmpuint(framer.stats.padding, == ,12);
+    g_assert_cmpuint(framer.stats.carried, == ,4);
+    g_assert_cmpuint(framer.stats.copied, == ,sizeof(test_ntf) +
+        sizeof(test_rsp) + sizeof(test_empty) + sizeof(test_ntf));
+
+    /* Reset doesn't touch the statistics */
+    pn54x_framer_reset(&framer);
+    g_assert_cmpuint(framer.stats.packets, == ,8);
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+#define TEST_(name) "/pn54x_framer/" name
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func(TEST_("split"), test_split);
+    g_test_add_func(TEST_("max"), test_max);
+    g_test_add_func(TEST_("reset"), test_reset);
+    g_test_add_func(TEST_("reset_in_callback"), test_reset_in_callback);
+    g_test_add_func(TEST_("stats"), test_stats);
+    test_init(&test_opt, argc, argv);
+    return g_test_run();
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
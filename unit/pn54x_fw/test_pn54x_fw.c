@@ -0,0 +1,813 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "test_common.h"
+
+#include "pn54x_fw.h"
+
+#include <gutil_log.h>
+
+#include <glib-unix.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+static TestOpt test_opt;
+
+#define TEST_VERSION (0x0a12)
+#define TEST_OLD_VERSION (0x0a11)
+#define TEST_HW_VERSION (0x11)
+#define TEST_ROM_VERSION (0x10)
+
+#define TEST_STATUS_OK (0x00)
+#define TEST_STATUS_FIRST_CHUNK (0x2d)
+#define TEST_STATUS_NEXT_CHUNK (0x2e)
+#define TEST_STATUS_CRC_ERROR (0x0b)
+#define TEST_STATUS_WRITE_FAILED (0x74)
+
+/*
+ * Stand-in chip speaking the DL protocol on the other end of a socket
+ * pair. Reassembles the image from the frames it receives.
+ */
+typedef struct test_chip {
+    int fd;
+    GThread* thread;
+    guint16 version;
+    guint fail_frame;       /* 1-based, fails that image frame */
+    gboolean bad_crc;       /* Corrupts CRC of the responses */
+    gboolean mute;          /* Only responds to GET_VERSION */
+    gboolean trickle;       /* Writes responses one byte at a time */
+    guint version_size;     /* Truncates GET_VERSION response */
+    guint8 version_flags;   /* Header flags of GET_VERSION response */
+    guint max_frame;        /* Largest payload received */
+    guint chunks;           /* DL frames received */
+    guint frames;           /* Image frames received */
+    GByteArray* frame;      /* Frame being reassembled */
+    GByteArray* image;      /* Reassembled image */
+} TestChip;
+
+static
+gboolean
+test_read_all(
+    int fd,
+    guint8* buf,
+    guint len)
+{
+    while (len) {
+        const ssize_t n = read(fd, buf, len);
+
+        if (n > 0) {
+            buf += n;
+            len -= n;
+        } else if (!n || errno != EINTR) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static
+guint
+test_build_frame(
+    guint8* buf,
+    guint8 flags,
+    const guint8* payload,
+    guint len)
+{
+    guint16 crc;
+
+    buf[0] = flags | (guint8)(len >> 8);
+    buf[1] = (guint8)len;
+    memcpy(buf + 2, payload, len);
+    crc = pn54x_fw_crc16(0xffff, buf, len + 2);
+    buf[len + 2] = (guint8)(crc >> 8);
+    buf[len + 3] = (guint8)crc;
+    return len + 4;
+}
+
+static
+void
+test_chip_respond_full(
+    TestChip* chip,
+    guint8 flags,
+    const guint8* payload,
+    guint len)
+{
+    guint8 buf[16];
+    const guint size = test_build_frame(buf, flags, payload, len);
+
+    if (chip->bad_crc) {
+        buf[size - 1] ^= 0xff;
+    }
+    if (chip->trickle) {
+        guint i;
+
+        /* Give the reader a chance to see each byte separately */
+        for (i = 0; i < size; i++) {
+            g_assert_cmpint(write(chip->fd, buf + i, 1), == ,1);
+            g_usleep(100);
+        }
+    } else {
+        g_assert_cmpint(write(chip->fd, buf, size), == ,size);
+    }
+}
+
+static
+void
+test_chip_respond(
+    TestChip* chip,
+    const guint8* payload,
+    guint len)
+{
+    test_chip_respond_full(chip, 0, payload, len);
+}
+
+static
+void
+test_chip_status(
+    TestChip* chip,
+    guint8 status)
+{
+    test_chip_respond(chip, &status, 1);
+}
+
+static
+gpointer
+test_chip_thread(
+    gpointer user_data)
+{
+    TestChip* chip = user_data;
+    guint8 hdr[2];
+
+    while (test_read_all(chip->fd, hdr, sizeof(hdr))) {
+        const guint len = ((hdr[0] & 0x03) << 8) | hdr[1];
+        const gboolean more = (hdr[0] & 0x04) != 0;
+        const gboolean first = !chip->frame->len;
+        guint8* buf = g_malloc(len + 4);
+        guint16 crc;
+
+        memcpy(buf, hdr, sizeof(hdr));
+        g_assert(test_read_all(chip->fd, buf + 2, len + 2));
+        chip->chunks++;
+        chip->max_frame = MAX(chip->max_frame, len);
+        crc = pn54x_fw_crc16(0xffff, buf, len + 2);
+        if (buf[len + 2] != (guint8)(crc >> 8) ||
+            buf[len + 3] != (guint8)crc) {
+            test_chip_status(chip, TEST_STATUS_CRC_ERROR);
+        } else {
+            g_byte_array_append(chip->frame, buf + 2, len);
+            if (more) {
+                if (!chip->mute) {
+                    test_chip_status(chip, first ? TEST_STATUS_FIRST_CHUNK :
+                        TEST_STATUS_NEXT_CHUNK);
+                }
+            } else if (chip->frame->len == 4 && chip->frame->data[0] == 0xf1) {
+                const guint8 rsp[] = {
+                    TEST_STATUS_OK, TEST_HW_VERSION, TEST_ROM_VERSION,
+                    (guint8)chip->version, (guint8)(chip->version >> 8)
+                };
+
+                test_chip_respond_full(chip, chip->version_flags, rsp,
+                    chip->version_size ? chip->version_size : sizeof(rsp));
+                g_byte_array_set_size(chip->frame, 0);
+            } else {
+                const guint total = chip->frame->len;
+                const guint8 frame_hdr[2] = {
+                    (guint8)(total >> 8), (guint8)total
+                };
+
+                chip->frames++;
+                g_byte_array_append(chip->image, frame_hdr, 2);
+                g_byte_array_append(chip->image, chip->frame->data, total);
+                g_byte_array_set_size(chip->frame, 0);
+                if (!chip->mute) {
+                    test_chip_status(chip, (chip->frames == chip->fail_frame) ?
+                        TEST_STATUS_WRITE_FAILED : TEST_STATUS_OK);
+                }
+            }
+        }
+        g_free(buf);
+    }
+    return NULL;
+}
+
+static
+int
+test_chip_start(
+    TestChip* chip,
+    guint16 version)
+{
+    int fd[2];
+
+    g_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fd));
+    memset(chip, 0, sizeof(*chip));
+    chip->fd = fd[1];
+    chip->version = version;
+    chip->frame = g_byte_array_new();
+    chip->image = g_byte_array_new();
+    chip->thread = g_thread_new("chip", test_chip_thread, chip);
+    return fd[0];
+}
+
+static
+void
+test_chip_stop(
+    TestChip* chip,
+    int fd)
+{
+    /* Closing our end terminates the chip thread */
+    close(fd);
+    g_thread_join(chip->thread);
+    close(chip->fd);
+}
+
+static
+void
+test_chip_free(
+    TestChip* chip)
+{
+    g_byte_array_free(chip->frame, TRUE);
+    g_byte_array_free(chip->image, TRUE);
+}
+
+/* Image with frames of the given sizes and firmware version */
+static
+GByteArray*
+test_image(
+    guint16 version,
+    const guint* sizes,
+    guint count)
+{
+    GByteArray* image = g_byte_array_new();
+    guint i, k;
+
+    for (i = 0; i < count; i++) {
+        const guint len = sizes[i];
+        const guint8 hdr[2] = { (guint8)(len >> 8), (guint8)len };
+
+        g_byte_array_append(image, hdr, sizeof(hdr));
+        for (k = 0; k < len; k++) {
+            const guint8 b = (guint8)(i + k);
+
+            g_byte_array_append(image, &b, 1);
+        }
+    }
+
+    /* Version is in the first frame */
+    g_assert_cmpuint(image->len, >= ,6);
+    image->data[4] = (guint8)version;
+    image->data[5] = (guint8)(version >> 8);
+    return image;
+}
+
+/*==========================================================================*
+ * crc
+ *==========================================================================*/
+
+static
+void
+test_crc(
+    void)
+{
+    static const char check[] = "123456789";
+
+    /* CRC-16/CCITT-FALSE check value */
+    g_assert_cmpuint(pn54x_fw_crc16(0xffff, check, 9), == ,0x29b1);
+    g_assert_cmpuint(pn54x_fw_crc16(0xffff, check, 0), == ,0xffff);
+    g_assert_cmpuint(pn54x_fw_crc16(pn54x_fw_crc16(0xffff, check, 4),
+        check + 4, 5), == ,0x29b1);
+}
+
+/*==========================================================================*
+ * image
+ *==========================================================================*/
+
+static
+void
+test_image_invalid(
+    void)
+{
+    static const guint8 too_short[] = { 0x00, 0x03, 0xc0, 0x00, 0x00 };
+    static const guint8 truncated_hdr[] = {
+        0x00, 0x04, 0xc0, 0x00, 0x12, 0x0a, 0x00
+    };
+    static const guint8 truncated_frame[] = {
+        0x00, 0x05, 0xc0, 0x00, 0x12, 0x0a
+    };
+    static const guint8 chunked[] = {
+        0x04, 0x04, 0xc0, 0x00, 0x12, 0x0a
+    };
+    static const guint8 empty_frame[] = {
+        0x00, 0x04, 0xc0, 0x00, 0x12, 0x0a, 0x00, 0x00
+    };
+
+    g_assert(!pn54x_fw_image_new(too_short, sizeof(too_short)));
+    g_assert(!pn54x_fw_image_new(truncated_hdr, sizeof(truncated_hdr)));
+    g_assert(!pn54x_fw_image_new(truncated_frame, sizeof(truncated_frame)));
+    g_assert(!pn54x_fw_image_new(chunked, sizeof(chunked)));
+    g_assert(!pn54x_fw_image_new(empty_frame, sizeof(empty_frame)));
+    g_assert(!pn54x_fw_image_load("/nonexistent"));
+    pn54x_fw_image_free(NULL);
+}
+
+static
+void
+test_image_load(
+    void)
+{
+    static const guint sizes[] = { 4, 300, 1, 1023 };
+    GByteArray* data = test_image(TEST_VERSION, sizes, G_N_ELEMENTS(sizes));
+    char* dir = g_dir_make_tmp("test_pn54x_fw_XXXXXX", NULL);
+    char* path = g_build_filename(dir, "fw.bin", NULL);
+    Pn54xFwImage* image;
+
+    g_assert(g_file_set_contents(path, (char*)data->data, data->len, NULL));
+    image = pn54x_fw_image_load(path);
+    g_assert(image);
+    g_assert_cmpuint(image->version, == ,TEST_VERSION);
+    g_assert_cmpuint(image->frames, == ,G_N_ELEMENTS(sizes));
+    g_assert_cmpuint(image->size, == ,data->len);
+    g_assert(!memcmp(image->data, data->data, data->len));
+    pn54x_fw_image_free(image);
+
+    g_unlink(path);
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+    g_byte_array_free(data, TRUE);
+}
+
+/*==========================================================================*
+ * download
+ *==========================================================================*/
+
+static
+void
+test_download_basic(
+    void)
+{
+    static const guint sizes[] = { 4, 16, 17, 1, 100, 1023, 33 };
+    GByteArray* data = test_image(TEST_VERSION, sizes, G_N_ELEMENTS(sizes));
+    Pn54xFwImage* image = pn54x_fw_image_new(data->data, data->len);
+    Pn54xFwConfig config;
+    Pn54xFwStats stats;
+    TestChip chip;
+    const int fd = test_chip_start(&chip, TEST_OLD_VERSION);
+
+    memset(&config, 0, sizeof(config));
+    config.max_frame = 16;
+    g_assert_cmpint(pn54x_fw_download(fd, image, &config, &stats), == ,
+        PN54X_FW_UPDATED);
+    g_assert_cmpuint(stats.chip_version, == ,TEST_OLD_VERSION);
+    g_assert_cmpuint(stats.frames, == ,G_N_ELEMENTS(sizes));
+    test_chip_stop(&chip, fd);
+
+    /* Frames have been split but the image arrived intact */
+    g_assert_cmpuint(chip.max_frame, == ,16);
+    g_assert_cmpuint(chip.frames, == ,G_N_ELEMENTS(sizes));
+    g_assert_cmpuint(chip.chunks, == ,stats.chunks);
+    g_assert_cmpuint(chip.chunks, > ,chip.frames + 1);
+    g_assert_cmpuint(chip.image->len, == ,data->len);
+    g_assert(!memcmp(chip.image->data, data->data, data->len));
+    test_chip_free(&chip);
+
+    pn54x_fw_image_free(image);
+    g_byte_array_free(data, TRUE);
+}
+
+static
+void
+test_download_max_frame(
+    void)
+{
+    static const guint sizes[] = { 4, 1023, 256, 257 };
+    GByteArray* data = test_image(TEST_VERSION, sizes, G_N_ELEMENTS(sizes));
+    Pn54xFwImage* image = pn54x_fw_image_new(data->data, data->len);
+    Pn54xFwConfig config;
+    Pn54xFwStats stats;
+    TestChip chip;
+    int fd;
+
+    /* Default frame size */
+    fd = test_chip_start(&chip, TEST_OLD_VERSION);
+    g_assert_cmpint(pn54x_fw_download(fd, image, NULL, &stats), == ,
+        PN54X_FW_UPDATED);
+    test_chip_stop(&chip, fd);
+    g_assert_cmpuint(chip.max_frame, == ,256);
+    g_assert_cmpuint(chip.image->len, == ,data->len);
+    g_assert(!memcmp(chip.image->data, data->data, data->len));
+    test_chip_free(&chip);
+
+    /* Too large value gets limited by the frame format */
+    memset(&config, 0, sizeof(config));
+    config.max_frame = 2000;
+    fd = test_chip_start(&chip, TEST_OLD_VERSION);
+    g_assert_cmpint(pn54x_fw_download(fd, image, &config, NULL), == ,
+        PN54X_FW_UPDATED);
+    test_chip_stop(&chip, fd);
+    g_assert_cmpuint(chip.max_frame, == ,1023);
+    g_assert_cmpuint(chip.chunks, == ,G_N_ELEMENTS(sizes) + 1);
+    test_chip_free(&chip);
+
+    pn54x_fw_image_free(image);
+    g_byte_array_free(data, TRUE);
+}
+
+static
+void
+test_download_current(
+    void)
+{
+    static const guint sizes[] = { 4, 20 };
+    GByteArray* data = test_image(TEST_VERSION, sizes, G_N_ELEMENTS(sizes));
+    Pn54xFwImage* image = pn54x_fw_image_new(data->data, data->len);
+    Pn54xFwConfig config;
+    Pn54xFwStats stats;
+    TestChip chip;
+    int fd;
+
+    /* Nothing but GET_VERSION is sent */
+    fd = test_chip_start(&chip, TEST_VERSION);
+    g_assert_cmpint(pn54x_fw_download(fd, image, NULL, &stats), == ,
+        PN54X_FW_CURRENT);
+    test_chip_stop(&chip, fd);
+    g_assert_cmpuint(stats.chip_version, == ,TEST_VERSION);
+    g_assert_cmpuint(chip.chunks, == ,1);
+    g_assert_cmpuint(chip.frames, == ,0);
+    test_chip_free(&chip);
+
+    /* Unless it's forced */
+    memset(&config, 0, sizeof(config));
+    config.force = TRUE;
+    fd = test_chip_start(&chip, TEST_VERSION);
+    g_assert_cmpint(pn54x_fw_download(fd, image, &config, &stats), == ,
+        PN54X_FW_UPDATED);
+    test_chip_stop(&chip, fd);
+    g_assert_cmpuint(chip.frames, == ,G_N_ELEMENTS(sizes));
+    test_chip_free(&chip);
+
+    pn54x_fw_image_free(image);
+    g_byte_array_free(data, TRUE);
+}
+
+static
+void
+test_download_error(
+    void)
+{
+    static const guint sizes[] = { 4, 20, 30 };
+    GByteArray* data = test_image(TEST_VERSION, sizes, G_N_ELEMENTS(sizes));
+    Pn54xFwImage* image = pn54x_fw_image_new(data->data, data->len);
+    Pn54xFwStats stats;
+    TestChip chip;
+    const int fd = test_chip_start(&chip, TEST_OLD_VERSION);
+
+    chip.fail_frame = 2;
+    g_assert_cmpint(pn54x_fw_download(fd, image, NULL, &stats), == ,
+        PN54X_FW_ERROR);
+    g_assert_cmpuint(stats.frames, == ,1);
+    test_chip_stop(&chip, fd);
+    g_assert_cmpuint(chip.frames, == ,2);
+    test_chip_free(&chip);
+
+    pn54x_fw_image_free(image);
+    g_byte_array_free(data, TRUE);
+}
+
+static
+void
+test_download_crc(
+    void)
+{
+    static const guint sizes[] = { 4 };
+    GByteArray* data = test_image(TEST_VERSION, sizes, G_N_ELEMENTS(sizes));
+    Pn54xFwImage* image = pn54x_fw_image_new(data->data, data->len);
+    TestChip chip;
+    const int fd = test_chip_start(&chip, TEST_OLD_VERSION);
+
+    chip.bad_crc = TRUE;
+    g_assert_cmpint(pn54x_fw_download(fd, image, NULL, NULL), == ,
+        PN54X_FW_ERROR);
+    test_chip_stop(&chip, fd);
+    g_assert_cmpuint(chip.frames, == ,0);
+    test_chip_free(&chip);
+
+    pn54x_fw_image_free(image);
+    g_byte_array_free(data, TRUE);
+}
+
+static
+void
+test_download_timeout(
+    void)
+{
+    static const guint sizes[] = { 4, 10 };
+    GByteArray* data = test_image(TEST_VERSION, sizes, G_N_ELEMENTS(sizes));
+    Pn54xFwImage* image = pn54x_fw_image_new(data->data, data->len);
+    Pn54xFwConfig config;
+    Pn54xFwStats stats;
+    TestChip chip;
+    const int fd = test_chip_start(&chip, TEST_OLD_VERSION);
+
+    memset(&config, 0, sizeof(config));
+    config.timeout = 100;
+    chip.mute = TRUE;
+    g_assert_cmpint(pn54x_fw_download(fd, image, &config, &stats), == ,
+        PN54X_FW_ERROR);
+    g_assert_cmpuint(stats.frames, == ,0);
+    g_assert_cmpint(stats.time, >= ,100000);
+    test_chip_stop(&chip, fd);
+    test_chip_free(&chip);
+
+    pn54x_fw_image_free(image);
+    g_byte_array_free(data, TRUE);
+}
+
+static
+void
+test_download_closed(
+    void)
+{
+    static const guint sizes[] = { 4 };
+    GByteArray* data = test_image(TEST_VERSION, sizes, G_N_ELEMENTS(sizes));
+    Pn54xFwImage* image = pn54x_fw_image_new(data->data, data->len);
+    int fd[2];
+
+    /* Peer closes the connection without responding */
+    g_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fd));
+    g_assert(!shutdown(fd[1], SHUT_WR));
+    g_assert_cmpint(pn54x_fw_download(fd[0], image, NULL, NULL), == ,
+        PN54X_FW_ERROR);
+    close(fd[1]);
+
+    /* And the write fails */
+    g_assert_cmpint(pn54x_fw_download(fd[0], image, NULL, NULL), == ,
+        PN54X_FW_ERROR);
+    close(fd[0]);
+
+    pn54x_fw_image_free(image);
+    g_byte_array_free(data, TRUE);
+}
+
+static
+void
+test_download_trickle(
+    void)
+{
+    static const guint sizes[] = { 4, 300, 1 };
+    GByteArray* data = test_image(TEST_VERSION, sizes, G_N_ELEMENTS(sizes));
+    Pn54xFwImage* image = pn54x_fw_image_new(data->data, data->len);
+    Pn54xFwStats stats;
+    TestChip chip;
+    const int fd = test_chip_start(&chip, TEST_OLD_VERSION);
+
+    /* Responses are reassembled from whatever read() returns */
+    chip.trickle = TRUE;
+    g_assert_cmpint(pn54x_fw_download(fd, image, NULL, &stats), == ,
+        PN54X_FW_UPDATED);
+    g_assert_cmpuint(stats.chip_version, == ,TEST_OLD_VERSION);
+    g_assert_cmpuint(stats.frames, == ,G_N_ELEMENTS(sizes));
+    test_chip_stop(&chip, fd);
+    g_assert_cmpuint(chip.image->len, == ,data->len);
+    g_assert(!memcmp(chip.image->data, data->data, data->len));
+    test_chip_free(&chip);
+
+    pn54x_fw_image_free(image);
+    g_byte_array_free(data, TRUE);
+}
+
+static
+void
+test_download_version(
+    void)
+{
+    static const guint sizes[] = { 4 };
+    GByteArray* data = test_image(TEST_VERSION, sizes, G_N_ELEMENTS(sizes));
+    Pn54xFwImage* image = pn54x_fw_image_new(data->data, data->len);
+    TestChip chip;
+    int fd;
+
+    /* GET_VERSION response without the major version */
+    fd = test_chip_start(&chip, TEST_OLD_VERSION);
+    chip.version_size = 4;
+    g_assert_cmpint(pn54x_fw_download(fd, image, NULL, NULL), == ,
+        PN54X_FW_ERROR);
+    test_chip_stop(&chip, fd);
+    g_assert_cmpuint(chip.chunks, == ,1);
+    test_chip_free(&chip);
+
+    /* Or the first part of something longer */
+    fd = test_chip_start(&chip, TEST_OLD_VERSION);
+    chip.version_flags = 0x04;
+    g_assert_cmpint(pn54x_fw_download(fd, image, NULL, NULL), == ,
+        PN54X_FW_ERROR);
+    test_chip_stop(&chip, fd);
+    g_assert_cmpuint(chip.chunks, == ,1);
+    test_chip_free(&chip);
+
+    pn54x_fw_image_free(image);
+    g_byte_array_free(data, TRUE);
+}
+
+static
+void
+test_download_unexpected(
+    void)
+{
+    static const guint sizes[] = { 4 };
+    static const guint8 rsp[] = { 0x00, 0x00, 0x1d, 0x0f };
+    GByteArray* data = test_image(TEST_VERSION, sizes, G_N_ELEMENTS(sizes));
+    Pn54xFwImage* image = pn54x_fw_image_new(data->data, data->len);
+    Pn54xFwDownload* dl;
+    guint len;
+
+    /* Chip isn't supposed to say anything before being asked */
+    dl = pn54x_fw_download_new(image, NULL);
+    g_assert(pn54x_fw_download_output(dl, &len));
+    g_assert_cmpuint(len, == ,8);
+    pn54x_fw_download_input(dl, rsp, sizeof(rsp));
+    g_assert_cmpint(pn54x_fw_download_result(dl), == ,PN54X_FW_ERROR);
+    g_assert(!pn54x_fw_download_output(dl, &len));
+    g_assert_cmpuint(len, == ,0);
+    pn54x_fw_download_free(dl);
+
+    /* Empty response (with valid CRC) */
+    dl = pn54x_fw_download_new(image, NULL);
+    g_assert(pn54x_fw_download_output(dl, &len));
+    pn54x_fw_download_sent(dl);
+    g_assert(!pn54x_fw_download_output(dl, &len));
+    pn54x_fw_download_input(dl, rsp, 3);
+    g_assert_cmpint(pn54x_fw_download_result(dl), == ,PN54X_FW_BUSY);
+    pn54x_fw_download_input(dl, rsp + 3, 1);
+    g_assert_cmpint(pn54x_fw_download_result(dl), == ,PN54X_FW_ERROR);
+    pn54x_fw_download_abort(dl);
+    g_assert_cmpint(pn54x_fw_download_result(dl), == ,PN54X_FW_ERROR);
+    g_assert_cmpuint(pn54x_fw_download_stats(dl)->chunks, == ,1);
+    pn54x_fw_download_free(dl);
+
+    pn54x_fw_image_free(image);
+    g_byte_array_free(data, TRUE);
+}
+
+/*==========================================================================*
+ * async
+ *==========================================================================*/
+
+typedef struct test_async {
+    Pn54xFwDownload* dl;
+    GMainLoop* loop;
+    int fd;
+    guint reads;
+} TestAsync;
+
+static
+void
+test_async_write(
+    TestAsync* test)
+{
+    guint len;
+    const void* frame = pn54x_fw_download_output(test->dl, &len);
+
+    if (frame) {
+        g_assert_cmpint(write(test->fd, frame, len), == ,len);
+        pn54x_fw_download_sent(test->dl);
+    }
+}
+
+static
+gboolean
+test_async_read(
+    gint fd,
+    GIOCondition condition,
+    gpointer user_data)
+{
+    TestAsync* test = user_data;
+    guint8 buf[16];
+    const ssize_t n = read(fd, buf, sizeof(buf));
+
+    g_assert_cmpint(n, > ,0);
+    test->reads++;
+    pn54x_fw_download_input(test->dl, buf, n);
+    if (pn54x_fw_download_result(test->dl) == PN54X_FW_BUSY) {
+        test_async_write(test);
+        return G_SOURCE_CONTINUE;
+    } else {
+        g_main_loop_quit(test->loop);
+        return G_SOURCE_REMOVE;
+    }
+}
+
+static
+void
+test_async(
+    void)
+{
+    static const guint sizes[] = { 4, 100, 40 };
+    GByteArray* data = test_image(TEST_VERSION, sizes, G_N_ELEMENTS(sizes));
+    Pn54xFwImage* image = pn54x_fw_image_new(data->data, data->len);
+    const Pn54xFwStats* stats;
+    Pn54xFwConfig config;
+    TestChip chip;
+    TestAsync test;
+
+    memset(&test, 0, sizeof(test));
+    memset(&config, 0, sizeof(config));
+    config.max_frame = 32;
+    test.fd = test_chip_start(&chip, TEST_OLD_VERSION);
+    test.loop = g_main_loop_new(NULL, FALSE);
+    test.dl = pn54x_fw_download_new(image, &config);
+    g_assert_cmpuint(pn54x_fw_download_timeout(test.dl), == ,1000);
+
+    /* Each response arrives in pieces, nothing blocks */
+    chip.trickle = TRUE;
+    g_unix_fd_add(test.fd, G_IO_IN, test_async_read, &test);
+    test_async_write(&test);
+    test_run(&test_opt, test.loop);
+
+    g_assert_cmpint(pn54x_fw_download_result(test.dl), == ,
+        PN54X_FW_UPDATED);
+    stats = pn54x_fw_download_stats(test.dl);
+    g_assert_cmpuint(stats->frames, == ,G_N_ELEMENTS(sizes));
+    g_assert_cmpuint(test.reads, > ,stats->chunks);
+    test_chip_stop(&chip, test.fd);
+    g_assert_cmpuint(chip.chunks, == ,stats->chunks);
+    g_assert_cmpuint(chip.image->len, == ,data->len);
+    g_assert(!memcmp(chip.image->data, data->data, data->len));
+    test_chip_free(&chip);
+
+    pn54x_fw_download_free(test.dl);
+    g_main_loop_unref(test.loop);
+    pn54x_fw_image_free(image);
+    g_byte_array_free(data, TRUE);
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+#define TEST_(name) "/pn54x_fw/" name
+
+int main(int argc, char* argv[])
+{
+    signal(SIGPIPE, SIG_IGN);
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func(TEST_("crc"), test_crc);
+    g_test_add_func(TEST_("image/invalid"), test_image_invalid);
+    g_test_add_func(TEST_("image/load"), test_image_load);
+    g_test_add_func(TEST_("download/basic"), test_download_basic);
+    g_test_add_func(TEST_("download/max_frame"), test_download_max_frame);
+    g_test_add_func(TEST_("download/current"), test_download_current);
+    g_test_add_func(TEST_("download/error"), test_download_error);
+    g_test_add_func(TEST_("download/crc"), test_download_crc);
+    g_test_add_func(TEST_("download/timeout"), test_download_timeout);
+    g_test_add_func(TEST_("download/closed"), test_download_closed);
+    g_test_add_func(TEST_("download/trickle"), test_download_trickle);
+    g_test_add_func(TEST_("download/version"), test_download_version);
+    g_test_add_func(TEST_("download/unexpected"), test_download_unexpected);
+    g_test_add_func(TEST_("async"), test_async);
+    test_init(&test_opt, argc, argv);
+    return g_test_run();
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,532 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "test_common.h"
+
+#include "pn54x_hexdump.h"
+
+#include <gutil_log.h>
+
+#include <pthread.h>
+
+static TestOpt test_opt;
+
+#define TEST_LEVEL GLOG_LEVEL_VERBOSE
+
+static GLogModule test_log_module = {
+    .name = "test-hexdump",
+    .max_level = GLOG_LEVEL_MAX,
+    .level = TEST_LEVEL
+};
+
+/* Collects the lines, blocking the caller while the gate is closed */
+typedef struct test_log {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    GString* out;
+    gboolean closed;
+    guint allow;        /* Lines let through the closed gate */
+    gboolean waiting;
+    GLogProc prev;
+} TestLog;
+
+static TestLog test_log;
+
+static
+void
+test_log_proc(
+    const char* name,
+    int level,
+    const char* format,
+    va_list va)
+{
+    if (!g_strcmp0(name, test_log_module.name)) {
+        pthread_mutex_lock(&test_log.mutex);
+        while (test_log.closed && !test_log.allow) {
+            test_log.waiting = TRUE;
+            pthread_cond_broadcast(&test_log.cond);
+            pthread_cond_wait(&test_log.cond, &test_log.mutex);
+        }
+        test_log.waiting = FALSE;
+        if (test_log.closed) {
+            test_log.allow--;
+        }
+        g_string_append_vprintf(test_log.out, format, va);
+        g_string_append_c(test_log.out, '\n');
+        pthread_mutex_unlock(&test_log.mutex);
+    } else if (test_log.prev) {
+        test_log.prev(name, level, format, va);
+    }
+}
+
+static
+void
+test_log_init(
+    void)
+{
+    memset(&test_log, 0, sizeof(test_log));
+    pthread_mutex_init(&test_log.mutex, NULL);
+    pthread_cond_init(&test_log.cond, NULL);
+    test_log.out = g_string_new(NULL);
+    test_log.prev = gutil_log_func;
+    gutil_log_func = test_log_proc;
+}
+
+static
+char*
+test_log_deinit(
+    void)
+{
+    gutil_log_func = test_log.prev;
+    pthread_cond_destroy(&test_log.cond);
+    pthread_mutex_destroy(&test_log.mutex);
+    return g_string_free(test_log.out, FALSE);
+}
+
+static
+void
+test_log_close(
+    guint allow)
+{
+    pthread_mutex_lock(&test_log.mutex);
+    test_log.closed = TRUE;
+    test_log.allow = allow;
+    pthread_mutex_unlock(&test_log.mutex);
+}
+
+static
+void
+test_log_wait(
+    void)
+{
+    /* Waits until something gets blocked by the gate */
+    pthread_mutex_lock(&test_log.mutex);
+    while (!test_log.waiting) {
+        pthread_cond_wait(&test_log.cond, &test_log.mutex);
+    }
+    pthread_mutex_unlock(&test_log.mutex);
+}
+
+static
+void
+test_log_open(
+    void)
+{
+    pthread_mutex_lock(&test_log.mutex);
+    test_log.closed = FALSE;
+    pthread_cond_broadcast(&test_log.cond);
+    pthread_mutex_unlock(&test_log.mutex);
+}
+
+/* A bit of everything, including the padding */
+
+static const guint8 test_cmd_hdr[] = { 0x20, 0x01 };
+static const guint8 test_cmd_payload[] = { 0x00 };
+static const guint8 test_rsp[] = { 0x40, 0x01, 0x01, 0x00 };
+static guint8 test_pad[100];
+static guint8 test_big[258];
+
+static
+void
+test_packets(
+    void (*fn)(char dir, const GUtilData* chunks, guint count, void* data),
+    void* data)
+{
+    GUtilData chunks[3];
+
+    chunks[0].bytes = test_cmd_hdr;
+    chunks[0].size = sizeof(test_cmd_hdr);
+    chunks[1].bytes = NULL;
+    chunks[1].size = 0;
+    chunks[2].bytes = test_cmd_payload;
+    chunks[2].size = sizeof(test_cmd_payload);
+    fn('<', chunks, 3, data);
+
+    chunks[0].bytes = test_rsp;
+    chunks[0].size = sizeof(test_rsp);
+    fn('>', chunks, 1, data);
+
+    chunks[0].bytes = test_pad;
+    chunks[0].size = sizeof(test_pad);
+    fn('>', chunks, 1, data);
+
+    chunks[0].size = 96;
+    fn('>', chunks, 1, data);
+
+    chunks[0].bytes = test_big;
+    chunks[0].size = sizeof(test_big);
+    fn('>', chunks, 1, data);
+}
+
+static
+void
+test_packet_sync(
+    char dir,
+    const GUtilData* chunks,
+    guint count,
+    void* data)
+{
+    pn54x_hexdump_packet(&test_log_module, TEST_LEVEL, dir, chunks, count);
+}
+
+static
+void
+test_packet_async(
+    char dir,
+    const GUtilData* chunks,
+    guint count,
+    void* thread)
+{
+    g_assert(pn54x_hexdump_thread_packet(thread, dir, chunks, count));
+}
+
+static
+char*
+test_sync_output(
+    void)
+{
+    test_log_init();
+    test_packets(test_packet_sync, NULL);
+    return test_log_deinit();
+}
+
+/*==========================================================================*
+ * null
+ *==========================================================================*/
+
+static
+void
+test_null(
+    void)
+{
+    Pn54xHexdumpStats stats;
+
+    memset(&stats, 0xaa, sizeof(stats));
+    g_assert(!pn54x_hexdump_thread_packet(NULL, '<', NULL, 0));
+    pn54x_hexdump_thread_flush(NULL);
+    pn54x_hexdump_thread_stats(NULL, &stats);
+    g_assert_cmpuint(stats.packets, == ,0);
+    g_assert_cmpuint(stats.dropped, == ,0);
+    pn54x_hexdump_thread_stop(NULL);
+}
+
+/*==========================================================================*
+ * sync
+ *==========================================================================*/
+
+static
+void
+test_sync(
+    void)
+{
+    char* out = test_sync_output();
+    char** lines = g_strsplit(out, "\n", -1);
+    const guint n = g_strv_length(lines);
+
+    GDEBUG("\n%s", out);
+    g_assert_cmpuint(n, > ,6);
+    g_assert_cmpstr(lines[0], == ,"< 3 byte(s)");
+    g_assert(g_str_has_prefix(lines[1], "< 20 01"));
+    g_assert(g_str_has_prefix(lines[2], "< 00"));
+    g_assert_cmpstr(lines[3], == ,"> 4 byte(s)");
+    g_assert(g_str_has_prefix(lines[4], "> 40 01 01 00"));
+    g_assert_cmpstr(lines[5], == ,"> 100 byte(s)");
+    g_assert(g_str_has_prefix(lines[6], "> ff ff"));
+    g_assert_cmpstr(lines[7], == ,"  5 line(s) skipped");
+    g_assert(g_str_has_prefix(lines[8], "  ff ff ff 60"));
+    g_assert_cmpstr(lines[9], == ,"> 96 byte(s)");
+    g_assert(g_str_has_prefix(lines[10], "> ff ff"));
+    g_assert_cmpstr(lines[11], == ,"  ... 5 line(s) skipped");
+    g_assert_cmpstr(lines[12], == ,"> 258 byte(s)");
+    g_assert_cmpstr(lines[n - 1], == ,"");
+    g_strfreev(lines);
+    g_free(out);
+}
+
+/*==========================================================================*
+ * async
+ *==========================================================================*/
+
+static
+void
+test_async(
+    void)
+{
+    char* expected = test_sync_output();
+    Pn54xHexdumpThread* thread;
+    Pn54xHexdumpStats stats;
+    char* out;
+    guint i;
+
+    test_log_init();
+    thread = pn54x_hexdump_thread_start(&test_log_module, TEST_LEVEL, 1024);
+    g_assert(thread);
+    for (i = 0; i < 10; i++) {
+        test_packets(test_packet_async, thread);
+        pn54x_hexdump_thread_flush(thread);
+        out = g_string_free(test_log.out, FALSE);
+        g_assert_cmpstr(out, == ,expected);
+        g_free(out);
+        test_log.out = g_string_new(NULL);
+    }
+    pn54x_hexdump_thread_stats(thread, &stats);
+    g_assert_cmpuint(stats.packets, == ,50);
+    g_assert_cmpuint(stats.bytes, == ,10 * (3 + 4 + 100 + 96 + 258));
+    g_assert_cmpuint(stats.dropped, == ,0);
+    pn54x_hexdump_thread_stop(thread);
+    g_free(test_log_deinit());
+    g_free(expected);
+}
+
+/*==========================================================================*
+ * wrap
+ *==========================================================================*/
+
+static
+void
+test_wrap_packets(
+    void (*fn)(char dir, const GUtilData* chunks, guint count, void* data),
+    void* data)
+{
+    static const guint8 small[] = { 0x40, 0x01, 0x01, 0x00 };
+    static const GUtilData a = { TEST_ARRAY_AND_SIZE(test_big) };
+    static const GUtilData b = { TEST_ARRAY_AND_SIZE(small) };
+    static const GUtilData c = { test_big, 100 };
+
+    fn('>', &a, 1, data);
+    fn('<', &b, 1, data);
+    if (data) {
+        test_log_wait();
+    }
+    fn('>', &c, 1, data);
+    fn('<', &c, 1, data);
+}
+
+static
+void
+test_wrap(
+    void)
+{
+    Pn54xHexdumpThread* thread;
+    char* expected;
+    char* out;
+
+    test_log_init();
+    test_wrap_packets(test_packet_sync, NULL);
+    expected = test_log_deinit();
+
+    /*
+     * The first packet (276 bytes with the header) is logged, and the
+     * thread gets blocked by the second one (24 bytes). The third one
+     * (120 bytes) still fits at the end of the 512 byte queue, and the
+     * last one has to wrap around.
+     */
+    test_log_init();
+    test_log_close(18);
+    thread = pn54x_hexdump_thread_start(&test_log_module, TEST_LEVEL, 512);
+    test_wrap_packets(test_packet_async, thread);
+    test_log_open();
+    pn54x_hexdump_thread_stop(thread);
+    out = test_log_deinit();
+    g_assert_cmpstr(out, == ,expected);
+    g_free(expected);
+    g_free(out);
+}
+
+/*==========================================================================*
+ * stop
+ *==========================================================================*/
+
+static
+void
+test_stop(
+    void)
+{
+    char* expected = test_sync_output();
+    Pn54xHexdumpThread* thread;
+    char* out;
+
+    /* Whatever is still queued gets logged by stop */
+    test_log_init();
+    test_log_close(0);
+    thread = pn54x_hexdump_thread_start(&test_log_module, TEST_LEVEL, 4096);
+    test_packets(test_packet_async, thread);
+    test_log_wait();
+    test_log_open();
+    pn54x_hexdump_thread_stop(thread);
+    out = test_log_deinit();
+    g_assert_cmpstr(out, == ,expected);
+    g_free(expected);
+    g_free(out);
+}
+
+/*==========================================================================*
+ * drop
+ *==========================================================================*/
+
+static
+void
+test_drop(
+    void)
+{
+    static const guint8 pkt[] = { 0x40, 0x01, 0x01, 0x00 };
+    static const GUtilData chunk = { TEST_ARRAY_AND_SIZE(pkt) };
+    static const GUtilData big = { TEST_ARRAY_AND_SIZE(test_big) };
+    Pn54xHexdumpThread* thread;
+    Pn54xHexdumpStats stats;
+    char* out;
+    char** lines;
+    guint i, queued;
+
+    test_log_init();
+    test_log_close(0);
+    thread = pn54x_hexdump_thread_start(&test_log_module, TEST_LEVEL, 0);
+
+    /* The first packet blocks the thread */
+    g_assert(pn54x_hexdump_thread_packet(thread, '>', &chunk, 1));
+    test_log_wait();
+
+    /* Fill the queue */
+    for (queued = 1;
+         pn54x_hexdump_thread_packet(thread, '>', &chunk, 1);
+         queued++);
+    g_assert_cmpuint(queued, > ,2);
+    g_assert(!pn54x_hexdump_thread_packet(thread, '>', &chunk, 1));
+    g_assert(!pn54x_hexdump_thread_packet(thread, '>', &big, 1));
+
+    test_log_open();
+    pn54x_hexdump_thread_flush(thread);
+    g_assert(pn54x_hexdump_thread_packet(thread, '<', &chunk, 1));
+    g_assert(!pn54x_hexdump_thread_packet(thread, '<', &big, 1));
+    pn54x_hexdump_thread_stats(thread, &stats);
+    g_assert_cmpuint(stats.packets, == ,queued + 1);
+    g_assert_cmpuint(stats.dropped, == ,4);
+    pn54x_hexdump_thread_stop(thread);
+
+    /* The drops are reported where they happened */
+    out = test_log_deinit();
+    lines = g_strsplit(out, "\n", -1);
+    g_assert_cmpuint(g_strv_length(lines), == ,2 * queued + 5);
+    for (i = 0; i < queued; i++) {
+        g_assert_cmpstr(lines[2 * i], == ,"> 4 byte(s)");
+    }
+    g_assert_cmpstr(lines[2 * queued], == ,"  3 packet(s) dropped");
+    g_assert_cmpstr(lines[2 * queued + 1], == ,"< 4 byte(s)");
+    g_assert_cmpstr(lines[2 * queued + 3], == ,"  1 packet(s) dropped");
+    g_strfreev(lines);
+    g_free(out);
+}
+
+/*==========================================================================*
+ * dump
+ *==========================================================================*/
+
+static
+void
+test_dump(
+    void)
+{
+    static const guint8 pkt[] = { 0x40, 0x01, 0x01, 0x00 };
+    static const GUtilData chunk = { TEST_ARRAY_AND_SIZE(pkt) };
+    Pn54xHexdumpThread* thread;
+    char* out;
+    char** lines;
+
+    g_assert(!pn54x_hexdump_thread_dump(NULL, &test_log_module,
+        GLOG_LEVEL_WARN, "test", '>', NULL, 0));
+
+    test_log_init();
+    test_log_close(0);
+    thread = pn54x_hexdump_thread_start(&test_log_module, TEST_LEVEL, 0);
+
+    /* Queued behind the packet which is blocking the thread */
+    g_assert(pn54x_hexdump_thread_packet(thread, '<', &chunk, 1));
+    test_log_wait();
+    g_assert(pn54x_hexdump_thread_dump(thread, &test_log_module,
+        GLOG_LEVEL_WARN, "Header", 0, NULL, 0));
+    g_assert(pn54x_hexdump_thread_dump(thread, &test_log_module,
+        GLOG_LEVEL_WARN, "> 4 byte(s), 1 us ago", '>',
+        TEST_ARRAY_AND_SIZE(pkt)));
+    test_log_open();
+    pn54x_hexdump_thread_stop(thread);
+
+    out = test_log_deinit();
+    lines = g_strsplit(out, "\n", -1);
+    g_assert_cmpuint(g_strv_length(lines), == ,6);
+    g_assert_cmpstr(lines[0], == ,"< 4 byte(s)");
+    g_assert(g_str_has_prefix(lines[1], "< 40 01 01 00"));
+    g_assert_cmpstr(lines[2], == ,"Header");
+    g_assert_cmpstr(lines[3], == ,"> 4 byte(s), 1 us ago");
+    g_assert(g_str_has_prefix(lines[4], "> 40 01 01 00"));
+    g_strfreev(lines);
+    g_free(out);
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+#define TEST_(name) "/pn54x_hexdump/" name
+
+int main(int argc, char* argv[])
+{
+    guint i;
+
+    memset(test_pad, 0xff, sizeof(test_pad));
+    test_pad[sizeof(test_pad) - 1] = 0x60;
+    for (i = 0; i < sizeof(test_big); i++) {
+        test_big[i] = (guint8)i;
+    }
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func(TEST_("null"), test_null);
+    g_test_add_func(TEST_("sync"), test_sync);
+    g_test_add_func(TEST_("async"), test_async);
+    g_test_add_func(TEST_("wrap"), test_wrap);
+    g_test_add_func(TEST_("stop"), test_stop);
+    g_test_add_func(TEST_("drop"), test_drop);
+    g_test_add_func(TEST_("dump"), test_dump);
+    test_init(&test_opt, argc, argv);
+    return g_test_run();
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -39,23 +39,46 @@
 #include "test_common.h"
 
 #include "pn54x_io.h"
+#include "pn54x_log.h"
+#include "pn54x_reader_child.h"
+#include "pn54x_system.h"
 
 #include <gutil_macros.h>
 #include <gutil_misc.h>
 #include <gutil_log.h>
 
+#include <glib-unix.h>
+
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 
 static TestOpt test_opt;
 
 static int test_fd = -1;
 static int test_ioctl_ret = -1;
+static unsigned long test_ioctl_arg = 0;
 static int test_open_errno = ENODEV;
+static gboolean test_dup_fail = FALSE;
 static int test_ioctl_errno = EINVAL;
+static gint test_write_fail = 0;
+static int test_write_errno = EREMOTEIO;
+static gboolean test_always_readable = FALSE;
+static gint test_writev_count = 0;
+static int test_power_on_fd = -1;
+static const GUtilData* test_power_on_packet = NULL;
+static int test_pause_signals_lost = 0;
+static gboolean test_interrupt_busy = FALSE;
+static gint test_interrupts_lost = 0;
+static gulong test_writev_delay = 0; /* Microseconds */
 
 int
 pn54x_system_open(
@@ -69,16 +92,150 @@ pn54x_system_open(
     }
 }
 
+int
+pn54x_system_dup(
+    int fd)
+{
+    if (test_dup_fail) {
+        errno = EMFILE;
+        return -1;
+    }
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
 int
 pn54x_system_ioctl(
     int fd,
     unsigned int cmd,
     unsigned long arg)
 {
+    test_ioctl_arg = arg;
+    if (arg == 1 /* PN54X_PWR_ON */ && test_ioctl_ret == 0 &&
+        test_power_on_fd >= 0 && test_power_on_packet) {
+        /* The chip starts talking the moment it's powered on */
+        g_assert_cmpint(write(test_power_on_fd, test_power_on_packet->bytes,
+            test_power_on_packet->size), == ,test_power_on_packet->size);
+    }
     errno = (test_ioctl_ret == 0) ? 0 : test_ioctl_errno;
     return test_ioctl_ret;
 }
 
+int
+pn54x_system_poll(
+    struct pollfd* fds,
+    unsigned int nfds,
+    int timeout)
+{
+    if (test_always_readable) {
+        unsigned int i;
+
+        /* That's what happens if the driver doesn't implement poll() */
+        for (i = 0; i < nfds; i++) {
+            fds[i].revents = POLLIN;
+        }
+        return nfds;
+    }
+    return poll(fds, nfds, timeout);
+}
+
+static
+void
+test_interrupt_handler(
+    int sig)
+{
+}
+
+gboolean
+pn54x_system_interrupt_init(
+    void)
+{
+    struct sigaction sa;
+
+    if (test_interrupt_busy) {
+        /* Someone else's handler is there */
+        return FALSE;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = test_interrupt_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(PN54X_SYSTEM_INTERRUPT_SIGNAL, &sa, NULL);
+    return TRUE;
+}
+
+int
+kill(
+    pid_t pid,
+    int sig)
+{
+    if (sig == PN54X_READER_CHILD_SIGNAL && test_pause_signals_lost > 0) {
+        /* As if it arrived right before the child entered read() */
+        test_pause_signals_lost--;
+        return 0;
+    }
+    return syscall(SYS_kill, pid, sig);
+}
+
+int
+pthread_kill(
+    pthread_t thread,
+    int sig)
+{
+    static int (*real_pthread_kill)(pthread_t, int) = NULL;
+    gint n;
+
+    while (sig == PN54X_SYSTEM_INTERRUPT_SIGNAL &&
+        (n = g_atomic_int_get(&test_interrupts_lost)) > 0) {
+        /* As if it arrived right before the thread entered read() */
+        if (g_atomic_int_compare_and_exchange(&test_interrupts_lost, n,
+            n - 1)) {
+            return 0;
+        }
+    }
+    if (!real_pthread_kill) {
+        real_pthread_kill = dlsym(RTLD_NEXT, "pthread_kill");
+    }
+    return real_pthread_kill(thread, sig);
+}
+
+static
+gboolean
+test_write_failed()
+{
+    gint n;
+
+    /* Writes are performed by the writer thread */
+    while ((n = g_atomic_int_get(&test_write_fail)) > 0) {
+        if (g_atomic_int_compare_and_exchange(&test_write_fail, n, n - 1)) {
+            errno = test_write_errno;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+ssize_t
+pn54x_system_write(
+    int fd,
+    const void* buf,
+    size_t count)
+{
+    return test_write_failed() ? -1 : write(fd, buf, count);
+}
+
+ssize_t
+pn54x_system_writev(
+    int fd,
+    const struct iovec* iov,
+    int iovcnt)
+{
+    g_atomic_int_inc(&test_writev_count);
+    if (test_writev_delay) {
+        /* Keep the driver busy with the caller's data */
+        g_usleep(test_writev_delay);
+    }
+    return test_write_failed() ? -1 : writev(fd, iov, iovcnt);
+}
+
 static
 void
 test_reset()
@@ -86,7 +243,18 @@ test_reset()
     test_fd = -1;
     test_ioctl_ret = -1;
     test_open_errno = ENODEV;
+    test_dup_fail = FALSE;
     test_ioctl_errno = EINVAL;
+    g_atomic_int_set(&test_write_fail, 0);
+    test_write_errno = EREMOTEIO;
+    test_always_readable = FALSE;
+    g_atomic_int_set(&test_writev_count, 0);
+    test_writev_delay = 0;
+    test_power_on_fd = -1;
+    test_power_on_packet = NULL;
+    test_pause_signals_lost = 0;
+    test_interrupt_busy = FALSE;
+    g_atomic_int_set(&test_interrupts_lost, 0);
 }
 
 static
@@ -134,8 +302,18 @@ void
 test_null(
     void)
 {
+    Pn54xIoStats stats;
+
     g_assert_null(pn54x_io_new(NULL));
     g_assert(!pn54x_io_set_power(NULL, FALSE));
+    memset(&stats, 0xff, sizeof(stats));
+    pn54x_io_get_stats(NULL, &stats);
+    g_assert_cmpuint(stats.reads, == ,0);
+    g_assert_cmpuint(stats.write_errors, == ,0);
+    pn54x_io_reset_stats(NULL);
+    pn54x_io_dump_latency(NULL);
+    pn54x_io_dump_packets(NULL, NULL);
+    pn54x_io_dump_packets_on_error(NULL, NULL);
     pn54x_io_free(NULL);
 }
 
@@ -169,6 +347,11 @@ typedef struct test_read_config {
     guint out_count;
 } TestReadConfig;
 
+typedef struct test_read_run {
+    PN54X_IO_READ_MODE mode;
+    const TestReadConfig* config;
+} TestReadRun;
+
 typedef struct test_read_data {
     NciHalClient client;
     const TestReadConfig* config;
@@ -211,15 +394,19 @@ test_read(
     int fd[2];
     TestRead test;
     Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
     NciHalIo* io;
     guint i;
-    const TestReadConfig* config = data;
+    const TestReadRun* run = data;
+    const TestReadConfig* config = run->config;
     static const NciHalClientFunctions test_read_fn = {
         test_no_error, test_read_proc
     };
 
     g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
     memset(&test, 0, sizeof(test));
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.read_mode = run->mode;
 
     test_reset();
     test_ioctl_ret = 0;
@@ -229,7 +416,7 @@ test_read(
     test.config = config;
     test.loop = g_main_loop_new(NULL, FALSE);
 
-    hal = pn54x_io_new("test");
+    hal = pn54x_io_new_full("test", &io_config);
     g_assert(hal);
     io = &hal->hal_io;
     io->fn->start(io, &test.client);
@@ -244,7 +431,7 @@ test_read(
             GDEBUG("Waiting for incoming packet(s)...");
             test_run(&test_opt, test.loop);
         } else {
-            /* Give the child a chance to read the data and pass it back */
+            /* Give the reader a chance to read the data and pass it back */
             g_timeout_add(100, test_unblock, test.loop);
             test_run(&test_opt, test.loop);
         }
@@ -330,43 +517,179 @@ static const TestReadConfig read_tests[] = {
 };
 
 /*==========================================================================*
- * basic_write
+ * stop
  *==========================================================================*/
 
-typedef struct test_basic_write_data {
+static
+void
+test_stop(
+    void)
+{
+    int fd[2];
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    NciHalClient client;
+    GMainLoop* loop = g_main_loop_new(NULL, FALSE);
+    struct pollfd pfd;
+    guint8 buf[1];
+    static const NciHalClientFunctions test_stop_fn = {
+        test_no_error, test_no_read
+    };
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&client, 0, sizeof(client));
+    memset(&io_config, 0, sizeof(io_config));
+    client.fn = &test_stop_fn;
+    io_config.read_mode = PN54X_IO_READ_THREAD;
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+    g_assert(io->fn->start(io, &client));
+
+    /* Let the reader block in read() */
+    g_timeout_add(100, test_unblock, loop);
+    test_run(&test_opt, loop);
+
+    /* Stopping must interrupt the read and release the descriptor */
+    io->fn->stop(io);
+    pn54x_io_free(hal);
+    close(test_fd);
+    test_reset();
+
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = fd[1];
+    pfd.events = POLLIN;
+    g_assert_cmpint(poll(&pfd, 1, TEST_TIMEOUT_SEC * 1000), ==, 1);
+    g_assert_cmpint(read(fd[1], buf, sizeof(buf)), ==, 0);
+    close(fd[1]);
+    g_main_loop_unref(loop);
+}
+
+/*==========================================================================*
+ * stop_in_callback
+ *==========================================================================*/
+
+typedef struct test_stop_in_callback {
     NciHalClient client;
+    NciHalIo* io;
     GMainLoop* loop;
-    int fd;
-} TestBasicWrite;
+    guint count;
+} TestStopInCallback;
 
 static
 void
-test_basic_write_ok(
+test_stop_in_callback_read(
     NciHalClient* client,
-    gboolean ok)
+    const void* data,
+    guint len)
 {
-    TestBasicWrite* test = G_CAST(client, TestBasicWrite, client);
+    TestStopInCallback* test = G_CAST(client, TestStopInCallback, client);
 
-    GDEBUG_("%d", ok);
-    g_assert(ok);
-    g_main_loop_quit(test->loop);
+    test->count++;
+    test->io->fn->stop(test->io);
+    test_quit_later_n(test->loop, 10);
 }
 
 static
 void
-test_basic_write(
-    void)
+test_stop_in_callback(
+    gconstpointer data)
 {
     int fd[2];
-    TestBasicWrite test;
     Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    TestStopInCallback test;
+    static const NciHalClientFunctions test_stop_in_callback_fn = {
+        test_no_error, test_stop_in_callback_read
+    };
+    static const guint8 in[] = {
+        0x60, 0x00, 0x02, 0x00, 0x01,
+        0x40, 0x00, 0x01, 0x00
+    };
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+    memset(&io_config, 0, sizeof(io_config));
+    test.client.fn = &test_stop_in_callback_fn;
+    test.loop = g_main_loop_new(NULL, FALSE);
+    io_config.read_mode = GPOINTER_TO_INT(data);
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    test.io = &hal->hal_io;
+
+    /* Two packets in one read, the second one is dropped */
+    g_assert(test.io->fn->start(test.io, &test.client));
+    g_assert_cmpint(write(fd[1], in, sizeof(in)), ==, sizeof(in));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.count, == ,1);
+
+    /* The next session works as usual */
+    g_assert(test.io->fn->start(test.io, &test.client));
+    g_assert_cmpint(write(fd[1], in, sizeof(in)), ==, sizeof(in));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.count, == ,2);
+
+    close(fd[0]);
+    close(fd[1]);
+    test_reset();
+    g_main_loop_unref(test.loop);
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * probe
+ *==========================================================================*/
+
+static
+void
+test_probe_read(
+    NciHalClient* client,
+    const void* data,
+    guint len)
+{
+    TestRead* test = G_CAST(client, TestRead, client);
+    const GUtilData* out = test->config->out + test->nout;
+
+    test->nout++;
+    g_assert_cmpint(out->size, ==, len);
+    g_assert(!memcmp(out->bytes, data, len));
+    if (test->nout == test->config->out_count) {
+        g_main_loop_quit(test->loop);
+    }
+}
+
+static
+void
+test_probe(
+    gconstpointer always_readable)
+{
+    int fd[2];
+    TestRead test;
+    Pn54xHalIo* hal;
+    Pn54xIoStats stats;
     NciHalIo* io;
-    static const NciHalClientFunctions test_write_fn = {
-        test_no_error, test_no_read
+    static const NciHalClientFunctions test_probe_fn = {
+        test_no_error, test_probe_read
+    };
+    static const guint8 ntf[] = { 0x60, 0x00, 0x02, 0x00, 0x01 };
+    static const guint8 rsp[] = { 0x40, 0x00, 0x01, 0x00 };
+    static const GUtilData out[] = {
+        { TEST_ARRAY_AND_SIZE(ntf) },
+        { TEST_ARRAY_AND_SIZE(rsp) }
+    };
+    static const TestReadConfig config = {
+        "probe", NULL, 0, TEST_ARRAY_AND_COUNT(out)
     };
-    static const guint8 rset[] = { 0x20, 0x01, 0x00 };
-    static const GUtilData rset_data = { rset, sizeof(rset) };
-    guint buf[sizeof(rset) + 1];
 
     g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
     memset(&test, 0, sizeof(test));
@@ -375,25 +698,47 @@ test_basic_write(
     test_ioctl_ret = 0;
     test_fd = fd[0];
     test.fd = fd[1];
-    test.client.fn = &test_write_fn;
+    test.client.fn = &test_probe_fn;
+    test.config = &config;
+    test.loop = g_main_loop_new(NULL, FALSE);
+    test_always_readable = GPOINTER_TO_INT(always_readable);
 
+    /* Default mode is auto, the probe picks up the pending packet */
     hal = pn54x_io_new("test");
     g_assert(hal);
     io = &hal->hal_io;
-    io->fn->start(io, &test.client);
+    g_assert_cmpint(write(fd[1], ntf, sizeof(ntf)), ==, sizeof(ntf));
+    g_assert(io->fn->start(io, &test.client));
+
+    /*
+     * If the descriptor remains readable after the pending packet has
+     * been consumed, the probe is inconclusive and blocking reads are
+     * used. Otherwise the descriptor is switched to non-blocking mode.
+     */
+    if (test_always_readable) {
+        g_assert(!(fcntl(test_fd, F_GETFL) & O_NONBLOCK));
+    } else {
+        g_assert(fcntl(test_fd, F_GETFL) & O_NONBLOCK);
+    }
 
-    /* Write completion will terminate the loop */
-    test.loop = g_main_loop_new(NULL, FALSE);
-    g_assert(io->fn->write(io, &rset_data, 1, test_basic_write_ok));
+    /* The next one arrives after the reader has been started */
+    g_assert_cmpint(write(fd[1], rsp, sizeof(rsp)), ==, sizeof(rsp));
     test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.nout, == ,config.out_count);
+
+    pn54x_io_get_stats(hal, &stats);
+    g_assert_cmpuint(stats.read_bytes, == ,sizeof(ntf) + sizeof(rsp));
+    g_assert_cmpuint(stats.packets, == ,2);
+    g_assert_cmpuint(stats.padding, == ,0);
+    g_assert_cmpuint(stats.writes, == ,0);
+    pn54x_io_dump_latency(hal);
+    pn54x_io_reset_stats(hal);
+    pn54x_io_get_stats(hal, &stats);
+    g_assert_cmpuint(stats.reads, == ,0);
+    g_assert_cmpuint(stats.packets, == ,0);
 
-    /* Read the data back from the other end of the pipe */
-    g_assert_cmpint(read(test.fd, buf, sizeof(buf)), ==, sizeof(rset));
-    g_assert(!memcmp(buf, rset, sizeof(rset)));
     g_assert_cmpint(close(test.fd), ==, 0);
-    test.fd = -1;
     io->fn->stop(io);
-
     g_main_loop_unref(test.loop);
     close(test_fd);
     test_reset();
@@ -401,24 +746,36 @@ test_basic_write(
 }
 
 /*==========================================================================*
- * cancel_write
+ * capture
  *==========================================================================*/
 
 static
 void
-test_cancel_write(
+test_capture(
     void)
 {
     int fd[2];
-    TestBasicWrite test;
+    TestRead test;
     Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
     NciHalIo* io;
-    static const NciHalClientFunctions test_write_fn = {
-        test_no_error, test_no_read
+    static const NciHalClientFunctions test_capture_fn = {
+        test_no_error, test_probe_read
     };
-    static const guint8 rset[] = { 0x20, 0x01, 0x00 };
-    static const GUtilData rset_data = { rset, sizeof(rset) };
-    guint buf[sizeof(rset) + 1];
+    static const guint8 cmd[] = { 0x20, 0x01, 0x00 };
+    static const guint8 rsp[] = { 0x40, 0x01, 0x01, 0x00 };
+    static const GUtilData cmd_data = { cmd, sizeof(cmd) };
+    static const GUtilData out[] = {
+        { TEST_ARRAY_AND_SIZE(rsp) }
+    };
+    static const TestReadConfig config = {
+        "capture", NULL, 0, TEST_ARRAY_AND_COUNT(out)
+    };
+    char* dir = g_dir_make_tmp("test_pn54x_io_XXXXXX", NULL);
+    char* path = g_build_filename(dir, "nci.pcapng", NULL);
+    guint8 buf[sizeof(cmd) + 1];
+    gchar* contents = NULL;
+    gsize size = 0;
 
     g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
     memset(&test, 0, sizeof(test));
@@ -427,58 +784,73 @@ test_cancel_write(
     test_ioctl_ret = 0;
     test_fd = fd[0];
     test.fd = fd[1];
-    test.client.fn = &test_write_fn;
+    test.client.fn = &test_capture_fn;
+    test.config = &config;
+    test.loop = g_main_loop_new(NULL, FALSE);
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.capture.path = path;
 
-    hal = pn54x_io_new("test");
+    hal = pn54x_io_new_full("test", &io_config);
     g_assert(hal);
     io = &hal->hal_io;
-    io->fn->start(io, &test.client);
-
-    test.loop = g_main_loop_new(NULL, FALSE);
-    g_assert(io->fn->write(io, &rset_data, 1, test_no_write));
-    io->fn->cancel_write(io);
-    io->fn->cancel_write(io); /* This one has no effect */
-
-    /* Make sure that write completion is not invoked */
-    test_quit_later_n(test.loop, 2);
+    g_assert(io->fn->start(io, &test.client));
+    g_assert(io->fn->write(io, &cmd_data, 1, NULL));
+    g_assert_cmpint(read(fd[1], buf, sizeof(buf)), ==, sizeof(cmd));
+    g_assert_cmpint(write(fd[1], rsp, sizeof(rsp)), ==, sizeof(rsp));
     test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.nout, == ,1);
 
-    /* The data is actually still written, read it */
-    g_assert_cmpint(read(test.fd, buf, sizeof(buf)), ==, sizeof(rset));
-    g_assert(!memcmp(buf, rset, sizeof(rset)));
-    g_assert_cmpint(close(test.fd), ==, 0);
-    test.fd = -1;
     io->fn->stop(io);
+    pn54x_io_free(hal);
 
+    /* Section and interface headers, and two 48-byte packet blocks */
+    g_assert(g_file_get_contents(path, &contents, &size, NULL));
+    g_assert_cmpuint(size, == ,48 + 2 * 48);
+    g_assert(!memcmp(contents + 48 + 28, cmd, sizeof(cmd)));
+    g_assert(!memcmp(contents + 96 + 28, rsp, sizeof(rsp)));
+    g_free(contents);
+
+    g_assert_cmpint(close(test.fd), ==, 0);
     g_main_loop_unref(test.loop);
     close(test_fd);
     test_reset();
-    pn54x_io_free(hal);
+    g_assert_cmpint(g_unlink(path), == ,0);
+    g_assert_cmpint(g_rmdir(dir), == ,0);
+    g_free(path);
+    g_free(dir);
 }
 
 /*==========================================================================*
- * write_chunks
+ * recorder
  *==========================================================================*/
 
 static
 void
-test_write_chunks(
+test_recorder(
     void)
 {
-    /* NOTE: reusing TestBasicWrite and test_basic_write_ok() here */
     int fd[2];
-    TestBasicWrite test;
+    TestRead test;
     Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
     NciHalIo* io;
-    static const NciHalClientFunctions test_write_chunks_fn = {
-        test_no_error, test_no_read
+    static const NciHalClientFunctions test_recorder_fn = {
+        test_no_error, test_probe_read
     };
-    static const guint8 rset[] = { 0x20, 0x01, 0x00 };
-    static const GUtilData data[] = {
-        { rset, 1 },
-        { rset + 1, sizeof(rset) - 1}
+    static const guint8 cmd[] = { 0x20, 0x01, 0x00 };
+    static const guint8 rsp[] = { 0x40, 0x01, 0x01, 0x00 };
+    static const GUtilData cmd_data = { cmd, sizeof(cmd) };
+    static const GUtilData out[] = {
+        { TEST_ARRAY_AND_SIZE(rsp) }
     };
-    guint buf[sizeof(rset) + 1];
+    static const TestReadConfig config = {
+        "recorder", NULL, 0, TEST_ARRAY_AND_COUNT(out)
+    };
+    char* dir = g_dir_make_tmp("test_pn54x_io_XXXXXX", NULL);
+    char* path = g_build_filename(dir, "packets.txt", NULL);
+    guint8 buf[sizeof(cmd) + 1];
+    gchar* contents = NULL;
+    gchar** lines;
 
     g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
     memset(&test, 0, sizeof(test));
@@ -487,54 +859,1745 @@ test_write_chunks(
     test_ioctl_ret = 0;
     test_fd = fd[0];
     test.fd = fd[1];
-    test.client.fn = &test_write_chunks_fn;
+    test.client.fn = &test_recorder_fn;
+    test.config = &config;
+    test.loop = g_main_loop_new(NULL, FALSE);
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.recorder.file = path;
 
-    hal = pn54x_io_new("test");
+    hal = pn54x_io_new_full("test", &io_config);
     g_assert(hal);
     io = &hal->hal_io;
-    io->fn->start(io, &test.client);
-
-    /* Write completion will terminate the loop */
-    test.loop = g_main_loop_new(NULL, FALSE);
-    g_assert(io->fn->write(io, data, G_N_ELEMENTS(data), test_basic_write_ok));
+    g_assert(io->fn->start(io, &test.client));
+    g_assert(io->fn->write(io, &cmd_data, 1, NULL));
+    g_assert_cmpint(read(fd[1], buf, sizeof(buf)), ==, sizeof(cmd));
+    g_assert_cmpint(write(fd[1], rsp, sizeof(rsp)), ==, sizeof(rsp));
     test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.nout, == ,1);
+
+    /* Both packets end up in the file */
+    pn54x_io_dump_packets_on_error(hal, "error");
+    g_assert(g_file_get_contents(path, &contents, NULL, NULL));
+    lines = g_strsplit(contents, "\n", -1);
+    g_assert_cmpuint(g_strv_length(lines), == ,4);
+    g_assert_cmpstr(lines[0], == ,"# error");
+    g_assert(g_str_has_suffix(lines[1], " < 3 20 01 00"));
+    g_assert(g_str_has_suffix(lines[2], " > 4 40 01 01 00"));
+    g_assert_cmpstr(lines[3], == ,"");
+    g_strfreev(lines);
+    g_free(contents);
+
+    /* Nothing new since the last dump, the file is left alone */
+    g_assert_cmpint(g_unlink(path), == ,0);
+    pn54x_io_dump_packets_on_error(hal, "error");
+    g_assert(!g_file_test(path, G_FILE_TEST_EXISTS));
+
+    /* Unless the dump is explicitly requested */
+    pn54x_io_dump_packets(hal, "request");
+    g_assert(g_file_test(path, G_FILE_TEST_EXISTS));
 
-    /* Read the data back from the other end of the pipe */
-    g_assert_cmpint(read(test.fd, buf, sizeof(buf)), ==, sizeof(rset));
-    g_assert(!memcmp(buf, rset, sizeof(rset)));
-    g_assert_cmpint(close(test.fd), ==, 0);
-    test.fd = -1;
     io->fn->stop(io);
+    pn54x_io_free(hal);
 
+    g_assert_cmpint(close(test.fd), ==, 0);
     g_main_loop_unref(test.loop);
     close(test_fd);
     test_reset();
-    pn54x_io_free(hal);
+    g_assert_cmpint(g_unlink(path), == ,0);
+    g_assert_cmpint(g_rmdir(dir), == ,0);
+    g_free(path);
+    g_free(dir);
 }
 
 /*==========================================================================*
- * Common
+ * hexdump
  *==========================================================================*/
 
-#define TEST_(name) "/pn54x_io/" name
-
-int main(int argc, char* argv[])
+static
+void
+test_hexdump(
+    void)
 {
-    guint i;
+    int fd[2];
+    TestRead test;
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    static const NciHalClientFunctions test_hexdump_fn = {
+        test_no_error, test_probe_read
+    };
+    static const guint8 cmd[] = { 0x20, 0x01, 0x00 };
+    static const guint8 rsp[] = { 0x40, 0x01, 0x01, 0x00 };
+    static const GUtilData cmd_data = { cmd, sizeof(cmd) };
+    static const GUtilData out[] = {
+        { TEST_ARRAY_AND_SIZE(rsp) }
+    };
+    static const TestReadConfig config = {
+        "hexdump", NULL, 0, TEST_ARRAY_AND_COUNT(out)
+    };
+    const int level = pn54x_hexdump_log.level;
+    guint8 buf[sizeof(cmd) + 1];
 
-    signal(SIGPIPE, SIG_IGN);
-    g_test_init(&argc, &argv, NULL);
-    g_test_add_func(TEST_("null"), test_null);
-    g_test_add_func(TEST_("open_error"), test_open_error);
-    g_test_add_func(TEST_("basic_write"), test_basic_write);
-    g_test_add_func(TEST_("cancel_write"), test_cancel_write);
-    g_test_add_func(TEST_("write_chunks"), test_write_chunks);
-    for (i = 0; i < G_N_ELEMENTS(read_tests); i++) {
-        const TestReadConfig* test = read_tests + i;
-        char* path = g_strconcat(TEST_("read/"), test->name, NULL);
-
-        g_test_add_data_func(path, test, test_read);
-        g_free(path);
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.fd = fd[1];
+    test.client.fn = &test_hexdump_fn;
+    test.config = &config;
+    test.loop = g_main_loop_new(NULL, FALSE);
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.hexdump_queue_size = 1024;
+
+    /* Packets are formatted by the hexdump thread */
+    pn54x_hexdump_log.level = GLOG_LEVEL_VERBOSE;
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+    g_assert(io->fn->start(io, &test.client));
+    g_assert(io->fn->write(io, &cmd_data, 1, NULL));
+    g_assert_cmpint(read(fd[1], buf, sizeof(buf)), ==, sizeof(cmd));
+    g_assert_cmpint(write(fd[1], rsp, sizeof(rsp)), ==, sizeof(rsp));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.nout, == ,1);
+
+    /* The recorder dump waits for the queue to drain */
+    pn54x_io_dump_packets(hal, "test");
+    io->fn->stop(io);
+    pn54x_io_free(hal);
+    pn54x_hexdump_log.level = level;
+
+    g_assert_cmpint(close(test.fd), ==, 0);
+    g_main_loop_unref(test.loop);
+    close(test_fd);
+    test_reset();
+}
+
+/*==========================================================================*
+ * basic_write
+ *==========================================================================*/
+
+typedef struct test_basic_write_data {
+    NciHalClient client;
+    GMainLoop* loop;
+    int fd;
+} TestBasicWrite;
+
+static
+void
+test_basic_write_ok(
+    NciHalClient* client,
+    gboolean ok)
+{
+    TestBasicWrite* test = G_CAST(client, TestBasicWrite, client);
+
+    GDEBUG_("%d", ok);
+    g_assert(ok);
+    g_main_loop_quit(test->loop);
+}
+
+static
+void
+test_basic_write(
+    gconstpointer data)
+{
+    int fd[2];
+    TestBasicWrite test;
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    static const NciHalClientFunctions test_write_fn = {
+        test_no_error, test_no_read
+    };
+    static const guint8 rset[] = { 0x20, 0x01, 0x00 };
+    static const GUtilData rset_data = { rset, sizeof(rset) };
+    guint buf[sizeof(rset) + 1];
+    Pn54xIoStats stats;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.fd = fd[1];
+    test.client.fn = &test_write_fn;
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.read_mode = GPOINTER_TO_INT(data);
+
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+    io->fn->start(io, &test.client);
+
+    /* Write completion will terminate the loop */
+    test.loop = g_main_loop_new(NULL, FALSE);
+    g_assert(io->fn->write(io, &rset_data, 1, test_basic_write_ok));
+    test_run(&test_opt, test.loop);
+
+    /* Read the data back from the other end of the pipe */
+    g_assert_cmpint(read(test.fd, buf, sizeof(buf)), ==, sizeof(rset));
+    g_assert(!memcmp(buf, rset, sizeof(rset)));
+
+    g_assert_cmpint(close(test.fd), ==, 0);
+    test.fd = -1;
+    io->fn->stop(io);
+
+    pn54x_io_get_stats(hal, &stats);
+    g_assert_cmpuint(stats.writes, == ,1);
+    g_assert_cmpuint(stats.write_bytes, == ,sizeof(rset));
+    g_assert_cmpuint(stats.write_errors, == ,0);
+
+    g_main_loop_unref(test.loop);
+    close(test_fd);
+    test_reset();
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * cancel_write
+ *==========================================================================*/
+
+static
+void
+test_cancel_write(
+    gconstpointer data)
+{
+    int fd[2];
+    TestBasicWrite test;
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    static const NciHalClientFunctions test_write_fn = {
+        test_no_error, test_no_read
+    };
+    static const guint8 rset[] = { 0x20, 0x01, 0x00 };
+    guint8* copy[2];
+    GUtilData chunks[2];
+    guint8 buf[2 * sizeof(rset) + 1];
+    gssize k;
+    gsize n;
+    guint i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.fd = fd[1];
+    test.client.fn = &test_write_fn;
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.write_gather = GPOINTER_TO_INT(data);
+
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+    io->fn->start(io, &test.client);
+
+    /* The data may be freed after cancel_write or if there's no callback */
+    for (i = 0; i < G_N_ELEMENTS(copy); i++) {
+        copy[i] = g_memdup(rset, sizeof(rset));
+    }
+    chunks[0].bytes = copy[0];
+    chunks[0].size = 1;
+    chunks[1].bytes = copy[0] + 1;
+    chunks[1].size = sizeof(rset) - 1;
+    test.loop = g_main_loop_new(NULL, FALSE);
+    if (GPOINTER_TO_INT(data) == PN54X_IO_WRITE_GATHER_ON) {
+        /* Cancel the write while the driver is busy with it */
+        test_writev_delay = 20000;
+        g_assert(io->fn->write(io, chunks, 2, test_no_write));
+        while (!g_atomic_int_get(&test_writev_count)) {
+            g_usleep(100);
+        }
+    } else {
+        g_assert(io->fn->write(io, chunks, 2, test_no_write));
+    }
+    io->fn->cancel_write(io);
+    io->fn->cancel_write(io); /* This one has no effect */
+    memset(copy[0], 0, sizeof(rset));
+    g_free(copy[0]);
+
+    chunks[0].bytes = copy[1];
+    chunks[1].bytes = copy[1] + 1;
+    g_assert(io->fn->write(io, chunks, 2, NULL));
+    memset(copy[1], 0, sizeof(rset));
+    g_free(copy[1]);
+
+    /* Make sure that write completion is not invoked */
+    test_quit_later_n(test.loop, 2);
+    test_run(&test_opt, test.loop);
+
+    /* The data are actually still written, read them */
+    for (n = 0; n < 2 * sizeof(rset); n += k) {
+        k = read(test.fd, buf + n, sizeof(buf) - n);
+        g_assert_cmpint(k, >, 0);
+    }
+    g_assert_cmpuint(n, ==, 2 * sizeof(rset));
+    g_assert(!memcmp(buf, rset, sizeof(rset)));
+    g_assert(!memcmp(buf + sizeof(rset), rset, sizeof(rset)));
+    g_assert_cmpint(close(test.fd), ==, 0);
+    test.fd = -1;
+    io->fn->stop(io);
+
+    g_main_loop_unref(test.loop);
+    close(test_fd);
+    test_reset();
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * write_chunks
+ *==========================================================================*/
+
+static
+void
+test_write_chunks(
+    gconstpointer data)
+{
+    /* NOTE: reusing TestBasicWrite and test_basic_write_ok() here */
+    int fd[2];
+    TestBasicWrite test;
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    static const NciHalClientFunctions test_write_chunks_fn = {
+        test_no_error, test_no_read
+    };
+    static const guint8 rset[] = { 0x20, 0x01, 0x00 };
+    static const GUtilData chunks[] = {
+        { rset, 1 },
+        { rset + 1, sizeof(rset) - 1}
+    };
+    guint buf[sizeof(rset) + 1];
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.fd = fd[1];
+    test.client.fn = &test_write_chunks_fn;
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.write_gather = GPOINTER_TO_INT(data);
+
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+    io->fn->start(io, &test.client);
+
+    /* Write completion will terminate the loop */
+    test.loop = g_main_loop_new(NULL, FALSE);
+    g_assert(io->fn->write(io, chunks, G_N_ELEMENTS(chunks),
+        test_basic_write_ok));
+    test_run(&test_opt, test.loop);
+
+    /* Read the data back from the other end of the pipe */
+    g_assert_cmpint(read(test.fd, buf, sizeof(buf)), ==, sizeof(rset));
+    g_assert(!memcmp(buf, rset, sizeof(rset)));
+
+    /* A socket is not a character device, auto means gather */
+    g_assert_cmpint(g_atomic_int_get(&test_writev_count), ==,
+        (GPOINTER_TO_INT(data) == PN54X_IO_WRITE_GATHER_OFF) ? 0 : 1);
+
+    g_assert_cmpint(close(test.fd), ==, 0);
+    test.fd = -1;
+    io->fn->stop(io);
+
+    g_main_loop_unref(test.loop);
+    close(test_fd);
+    test_reset();
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * write_retry
+ *==========================================================================*/
+
+typedef struct test_write_retry_data {
+    NciHalClient client;
+    GMainLoop* loop;
+    gboolean ok;
+} TestWriteRetry;
+
+static
+void
+test_write_retry_done(
+    NciHalClient* client,
+    gboolean ok)
+{
+    TestWriteRetry* test = G_CAST(client, TestWriteRetry, client);
+
+    GDEBUG_("%d", ok);
+    test->ok = ok;
+    g_main_loop_quit(test->loop);
+}
+
+#define TEST_WRITE_RETRY_FALLBACK (0x100)
+
+static
+void
+test_write_retry(
+    gconstpointer data)
+{
+    const int fail = GPOINTER_TO_INT(data) & ~TEST_WRITE_RETRY_FALLBACK;
+    const int retries = 2;
+    const gboolean recover = (fail <= retries);
+    int fd[2];
+    TestWriteRetry test;
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    static const NciHalClientFunctions test_write_retry_fn = {
+        test_no_error, test_no_read
+    };
+    static const guint8 rset[] = { 0x20, 0x01, 0x00 };
+    static const GUtilData rset_data = { rset, sizeof(rset) };
+    guint8 buf[sizeof(rset) + 1];
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.read_mode = PN54X_IO_READ_THREAD;
+    io_config.write_retries = retries;
+    io_config.write_retry_delay = 100;
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.client.fn = &test_write_retry_fn;
+
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+    g_assert(io->fn->start(io, &test.client));
+    if (GPOINTER_TO_INT(data) & TEST_WRITE_RETRY_FALLBACK) {
+        /* Writer can't be started, main thread has to write */
+        test_dup_fail = TRUE;
+    }
+
+    /* The chip NACKs the first transfer(s) */
+    g_atomic_int_set(&test_write_fail, fail);
+    test.loop = g_main_loop_new(NULL, FALSE);
+    g_assert(io->fn->write(io, &rset_data, 1, test_write_retry_done));
+    g_assert(!test.ok); /* Retries don't block the caller */
+    test_run(&test_opt, test.loop);
+    g_assert_cmpint(test.ok, == ,recover);
+    if (recover) {
+        g_assert_cmpint(read(fd[1], buf, sizeof(buf)), ==, sizeof(rset));
+        g_assert(!memcmp(buf, rset, sizeof(rset)));
+    }
+    io->fn->stop(io);
+
+    g_assert_cmpint(close(fd[1]), ==, 0);
+    g_main_loop_unref(test.loop);
+    close(test_fd);
+    test_reset();
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * write_nonblock
+ *==========================================================================*/
+
+typedef struct test_write_nonblock_data {
+    NciHalClient client;
+    GMainLoop* loop;
+    int fd;
+    gsize junk;
+    gboolean ok;
+} TestWriteNonblock;
+
+static
+void
+test_write_nonblock_done(
+    NciHalClient* client,
+    gboolean ok)
+{
+    TestWriteNonblock* test = G_CAST(client, TestWriteNonblock, client);
+
+    test->ok = ok;
+    g_main_loop_quit(test->loop);
+}
+
+static
+gboolean
+test_write_nonblock_drain(
+    gpointer user_data)
+{
+    TestWriteNonblock* test = user_data;
+    guint8 buf[4096];
+
+    /* Make room for the write */
+    g_assert(!test->ok);
+    while (test->junk > 0) {
+        const ssize_t n = read(test->fd, buf, MIN(test->junk, sizeof(buf)));
+
+        g_assert_cmpint(n, > ,0);
+        test->junk -= n;
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+test_write_nonblock(
+    void)
+{
+    int fd[2];
+    TestWriteNonblock test;
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    static const NciHalClientFunctions test_write_nonblock_fn = {
+        test_no_error, test_no_read
+    };
+    static const guint8 rset[] = { 0x20, 0x01, 0x00 };
+    static const GUtilData rset_data = { rset, sizeof(rset) };
+    guint8 buf[4096];
+    ssize_t n;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.read_mode = PN54X_IO_READ_DIRECT;
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.fd = fd[1];
+    test.client.fn = &test_write_nonblock_fn;
+    test.loop = g_main_loop_new(NULL, FALSE);
+
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+    g_assert(io->fn->start(io, &test.client));
+
+    /* The writer shares the non-blocking file with the direct reader */
+    g_assert(fcntl(test_fd, F_GETFL) & O_NONBLOCK);
+
+    /* The driver can't take any more data */
+    memset(buf, 0, sizeof(buf));
+    while ((n = write(test_fd, buf, sizeof(buf))) > 0) {
+        test.junk += n;
+    }
+    while ((n = write(test_fd, buf, 1)) > 0) {
+        test.junk += n;
+    }
+    g_assert_cmpint(errno, == ,EAGAIN);
+
+    /* EAGAIN is not an error, the writer waits */
+    g_assert(io->fn->write(io, &rset_data, 1, test_write_nonblock_done));
+    g_timeout_add(100, test_write_nonblock_drain, &test);
+    test_run(&test_opt, test.loop);
+    g_assert(test.ok);
+    g_assert_cmpint(read(test.fd, buf, sizeof(buf)), ==, sizeof(rset));
+    g_assert(!memcmp(buf, rset, sizeof(rset)));
+    io->fn->stop(io);
+
+    g_assert_cmpint(close(fd[1]), ==, 0);
+    g_main_loop_unref(test.loop);
+    close(test_fd);
+    test_reset();
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * write_queue
+ *==========================================================================*/
+
+typedef struct test_write_queue_data {
+    NciHalClient client;
+    GMainLoop* loop;
+    guint ndone;
+    guint count;
+} TestWriteQueue;
+
+static
+void
+test_write_queue_done(
+    NciHalClient* client,
+    gboolean ok)
+{
+    TestWriteQueue* test = G_CAST(client, TestWriteQueue, client);
+
+    GDEBUG_("%u", test->ndone);
+    g_assert(ok);
+    if (++test->ndone == test->count) {
+        g_main_loop_quit(test->loop);
+    }
+}
+
+static
+void
+test_write_queue(
+    gconstpointer data)
+{
+    int fd[2];
+    TestWriteQueue test;
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    guint i;
+    static const NciHalClientFunctions test_write_queue_fn = {
+        test_no_error, test_no_read
+    };
+    static const guint8 pkt[][4] = {
+        { 0x00, 0x00, 0x01, 0x01 },
+        { 0x00, 0x00, 0x01, 0x02 },
+        { 0x00, 0x00, 0x01, 0x03 }
+    };
+    static const GUtilData pkt_data[] = {
+        { TEST_ARRAY_AND_SIZE(pkt[0]) },
+        { TEST_ARRAY_AND_SIZE(pkt[1]) },
+        { TEST_ARRAY_AND_SIZE(pkt[2]) }
+    };
+    guint8 buf[sizeof(pkt) + 1];
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.read_mode = GPOINTER_TO_INT(data);
+    io_config.write_queue_size = G_N_ELEMENTS(pkt_data);
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.client.fn = &test_write_queue_fn;
+    test.count = G_N_ELEMENTS(pkt_data);
+
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+    g_assert(io->fn->start(io, &test.client));
+
+    /* Queue is full after that */
+    test.loop = g_main_loop_new(NULL, FALSE);
+    for (i = 0; i < G_N_ELEMENTS(pkt_data); i++) {
+        g_assert(io->fn->write(io, pkt_data + i, 1, test_write_queue_done));
+    }
+    g_assert(!io->fn->write(io, pkt_data, 1, test_no_write));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.ndone, == ,test.count);
+
+    /* The packets arrive in order */
+    for (i = 0; i < sizeof(pkt); i += sizeof(pkt[0])) {
+        g_assert_cmpint(read(fd[1], buf + i, sizeof(pkt[0])), ==,
+            sizeof(pkt[0]));
+    }
+    g_assert(!memcmp(buf, pkt, sizeof(pkt)));
+
+    /* And there's room in the queue again */
+    test.ndone = 0;
+    test.count = 1;
+    g_assert(io->fn->write(io, pkt_data, 1, test_write_queue_done));
+    test_run(&test_opt, test.loop);
+    io->fn->stop(io);
+
+    g_assert_cmpint(close(fd[1]), ==, 0);
+    g_main_loop_unref(test.loop);
+    close(test_fd);
+    test_reset();
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * write_error
+ *==========================================================================*/
+
+static
+void
+test_write_error_done(
+    NciHalClient* client,
+    gboolean ok)
+{
+    TestBasicWrite* test = G_CAST(client, TestBasicWrite, client);
+
+    GDEBUG_("%d", ok);
+    g_assert(!ok);
+    g_main_loop_quit(test->loop);
+}
+
+static
+void
+test_write_error(
+    void)
+{
+    /* NOTE: reusing TestBasicWrite here */
+    int fd[2];
+    TestBasicWrite test;
+    Pn54xHalIo* hal;
+    Pn54xIoStats stats;
+    NciHalIo* io;
+    static const NciHalClientFunctions test_write_error_fn = {
+        test_no_error, test_no_read
+    };
+    static const guint8 rset[] = { 0x20, 0x01, 0x00 };
+    static const GUtilData rset_data = { rset, sizeof(rset) };
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.fd = fd[1];
+    test.client.fn = &test_write_error_fn;
+
+    hal = pn54x_io_new("test");
+    g_assert(hal);
+    io = &hal->hal_io;
+    io->fn->start(io, &test.client);
+
+    /* The other end doesn't accept data, the write fails with EPIPE */
+    g_assert_cmpint(shutdown(test.fd, SHUT_RD), ==, 0);
+    test.loop = g_main_loop_new(NULL, FALSE);
+    g_assert(io->fn->write(io, &rset_data, 1, test_write_error_done));
+    test_run(&test_opt, test.loop);
+    io->fn->stop(io);
+    pn54x_io_get_stats(hal, &stats);
+    g_assert_cmpuint(stats.writes, == ,0);
+    g_assert_cmpuint(stats.write_errors, == ,1);
+
+    g_assert_cmpint(close(test.fd), ==, 0);
+    g_main_loop_unref(test.loop);
+    close(test_fd);
+    test_reset();
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * overflow
+ *==========================================================================*/
+
+static
+void
+test_overflow(
+    gconstpointer data)
+{
+    int fd[2];
+    TestRead test;
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    guint i;
+    static const NciHalClientFunctions test_overflow_fn = {
+        test_no_error, test_probe_read
+    };
+    static const guint8 ntf1[] = { 0x60, 0x00, 0x02, 0x00, 0x01 };
+    static const guint8 ntf2[] = { 0x60, 0x06, 0x03, 0x01, 0x00, 0x01 };
+    static const guint8 rsp[] = { 0x40, 0x00, 0x01, 0x00 };
+    static const GUtilData out[] = {
+        { TEST_ARRAY_AND_SIZE(ntf1) },
+        { TEST_ARRAY_AND_SIZE(ntf2) },
+        { TEST_ARRAY_AND_SIZE(rsp) },
+        { TEST_ARRAY_AND_SIZE(ntf1) },
+        { TEST_ARRAY_AND_SIZE(ntf2) }
+    };
+    static const TestReadConfig config = {
+        "overflow", NULL, 0, TEST_ARRAY_AND_COUNT(out)
+    };
+
+    /* Each packet is a separate read, more than fits into the ring */
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.read_mode = GPOINTER_TO_INT(data);
+    io_config.read_ring_size = 1;
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.fd = fd[1];
+    test.client.fn = &test_overflow_fn;
+    test.config = &config;
+    test.loop = g_main_loop_new(NULL, FALSE);
+
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+    g_assert(io->fn->start(io, &test.client));
+    for (i = 0; i < G_N_ELEMENTS(out); i++) {
+        const GUtilData* pkt = out + i;
+
+        g_assert_cmpint(write(fd[1], pkt->bytes, pkt->size), ==, pkt->size);
+    }
+
+    /* Nothing gets lost, the reader waits for a free buffer */
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.nout, == ,config.out_count);
+
+    g_assert_cmpint(close(test.fd), ==, 0);
+    io->fn->stop(io);
+    g_main_loop_unref(test.loop);
+    close(test_fd);
+    test_reset();
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * power_cycle
+ *==========================================================================*/
+
+static
+void
+test_power_cycle(
+    gconstpointer data)
+{
+    int fd[2];
+    TestRead test;
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    guint i;
+    static const NciHalClientFunctions test_power_cycle_fn = {
+        test_no_error, test_read_proc
+    };
+    static const guint8 ntf[] = { 0x60, 0x00, 0x02, 0x00, 0x01 };
+    static const guint8 rsp[] = { 0x40, 0x00, 0x01, 0x00 };
+    static const GUtilData out[] = {
+        { TEST_ARRAY_AND_SIZE(ntf) },
+        { TEST_ARRAY_AND_SIZE(rsp) },
+        { TEST_ARRAY_AND_SIZE(ntf) }
+    };
+    static const TestReadConfig config = {
+        "power_cycle", NULL, 0, TEST_ARRAY_AND_COUNT(out)
+    };
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.read_mode = GPOINTER_TO_INT(data);
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.fd = fd[1];
+    test.client.fn = &test_power_cycle_fn;
+    test.config = &config;
+    test.loop = g_main_loop_new(NULL, FALSE);
+
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+
+    /* The reader keeps working across power cycles */
+    for (i = 0; i < G_N_ELEMENTS(out); i++) {
+        const GUtilData* pkt = out + i;
+
+        g_assert(pn54x_io_set_power(hal, TRUE));
+        g_assert(io->fn->start(io, &test.client));
+        g_assert_cmpint(write(fd[1], pkt->bytes, pkt->size), ==, pkt->size);
+        test_run(&test_opt, test.loop);
+        g_assert_cmpuint(test.nout, == ,i + 1);
+        io->fn->stop(io);
+        g_assert(pn54x_io_set_power(hal, FALSE));
+    }
+
+    g_assert_cmpint(close(test.fd), ==, 0);
+    g_main_loop_unref(test.loop);
+    close(test_fd);
+    test_reset();
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * power_on_data
+ *==========================================================================*/
+
+#define TEST_POWER_ON_DATA_CYCLES (20)
+
+typedef struct test_power_on_data {
+    NciHalClient client;
+    GMainLoop* loop;
+    guint count;
+} TestPowerOnData;
+
+static const guint8 test_power_on_ntf[] = { 0x60, 0x00, 0x02, 0x00, 0x01 };
+
+static
+void
+test_power_on_data_read(
+    NciHalClient* client,
+    const void* data,
+    guint len)
+{
+    TestPowerOnData* test = G_CAST(client, TestPowerOnData, client);
+
+    test->count++;
+    g_assert_cmpuint(len, == ,sizeof(test_power_on_ntf));
+    g_assert(!memcmp(data, test_power_on_ntf, len));
+    g_main_loop_quit(test->loop);
+}
+
+static
+void
+test_power_on_data(
+    gconstpointer data)
+{
+    int fd[2];
+    TestPowerOnData test;
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    guint i;
+    static const NciHalClientFunctions test_power_on_data_fn = {
+        test_no_error, test_power_on_data_read
+    };
+    static const GUtilData ntf = { TEST_ARRAY_AND_SIZE(test_power_on_ntf) };
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.read_mode = GPOINTER_TO_INT(data);
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test_power_on_fd = fd[1];
+    test_power_on_packet = &ntf;
+    test.client.fn = &test_power_on_data_fn;
+    test.loop = g_main_loop_new(NULL, FALSE);
+
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+
+    /*
+     * Power goes back on right after it has gone off, without letting
+     * the main loop run. The signal pausing the read process gets lost,
+     * leaving the child stuck in read(). It must not pick up (and drop)
+     * the packet sent by the chip at power-on.
+     */
+    for (i = 0; i < TEST_POWER_ON_DATA_CYCLES; i++) {
+        g_assert(pn54x_io_set_power(hal, TRUE));
+        g_assert(io->fn->start(io, &test.client));
+        test_run(&test_opt, test.loop);
+        g_assert_cmpuint(test.count, == ,i + 1);
+        test_pause_signals_lost = 1;
+        g_assert(pn54x_io_set_power(hal, FALSE));
+    }
+
+    g_assert_cmpint(close(fd[1]), ==, 0);
+    g_main_loop_unref(test.loop);
+    close(test_fd);
+    test_reset();
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * interrupt_taken
+ *==========================================================================*/
+
+static
+void
+test_interrupt_taken(
+    void)
+{
+    int fd[2];
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    NciHalClient client;
+    static const NciHalClientFunctions test_interrupt_taken_fn = {
+        test_no_error, test_no_read
+    };
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&client, 0, sizeof(client));
+    memset(&io_config, 0, sizeof(io_config));
+    client.fn = &test_interrupt_taken_fn;
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test_interrupt_busy = TRUE;
+
+    /* Reader thread can't be stopped without the signal */
+    io_config.read_mode = PN54X_IO_READ_THREAD;
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+    g_assert(!io->fn->start(io, &client));
+    pn54x_io_free(hal);
+
+    /* But the read process works */
+    io_config.read_mode = PN54X_IO_READ_PROCESS;
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+    g_assert(io->fn->start(io, &client));
+    io->fn->stop(io);
+    pn54x_io_free(hal);
+
+    close(test_fd);
+    close(fd[1]);
+    test_reset();
+}
+
+/*==========================================================================*
+ * thread_deferred
+ *==========================================================================*/
+
+typedef struct test_thread_deferred {
+    NciHalClient client;
+    GMainLoop* loop;
+    int fd;
+    guint count;
+} TestThreadDeferred;
+
+static const guint8 test_thread_deferred_ntf[] = {
+    0x60, 0x00, 0x02, 0x00, 0x01
+};
+
+static
+void
+test_thread_deferred_read(
+    NciHalClient* client,
+    const void* data,
+    guint len)
+{
+    TestThreadDeferred* test = G_CAST(client, TestThreadDeferred, client);
+
+    test->count++;
+    g_assert_cmpuint(len, == ,sizeof(test_thread_deferred_ntf));
+    g_assert(!memcmp(data, test_thread_deferred_ntf, len));
+    g_main_loop_quit(test->loop);
+}
+
+static
+gboolean
+test_thread_deferred_write(
+    gpointer user_data)
+{
+    TestThreadDeferred* test = user_data;
+
+    g_assert_cmpint(write(test->fd, test_thread_deferred_ntf,
+        sizeof(test_thread_deferred_ntf)), == ,
+        sizeof(test_thread_deferred_ntf));
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+test_thread_deferred(
+    void)
+{
+    int fd[2];
+    TestThreadDeferred test;
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    static const NciHalClientFunctions test_thread_deferred_fn = {
+        test_no_error, test_thread_deferred_read
+    };
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.read_mode = PN54X_IO_READ_THREAD;
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.fd = fd[1];
+    test.client.fn = &test_thread_deferred_fn;
+    test.loop = g_main_loop_new(NULL, FALSE);
+
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+    g_assert(io->fn->start(io, &test.client));
+
+    /* Let the reader block in read() */
+    g_timeout_add(100, test_unblock, test.loop);
+    test_run(&test_opt, test.loop);
+
+    /*
+     * The signals get lost and the old thread stays in read(). The new
+     * one has to wait for it, start must not block in the meantime.
+     */
+    g_atomic_int_set(&test_interrupts_lost, G_MAXINT);
+    io->fn->stop(io);
+    g_assert(io->fn->start(io, &test.client));
+
+    /* Stopping a thread which hasn't started yet */
+    io->fn->stop(io);
+    g_assert(io->fn->start(io, &test.client));
+
+    /* The kick timer gets rid of the old thread and starts the new one */
+    g_atomic_int_set(&test_interrupts_lost, 0);
+    g_timeout_add(100, test_thread_deferred_write, &test);
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.count, == ,1);
+
+    io->fn->stop(io);
+    g_main_loop_unref(test.loop);
+    close(test_fd);
+    close(fd[1]);
+    test_reset();
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * thread_stuck
+ *==========================================================================*/
+
+typedef struct test_thread_stuck {
+    NciHalClient client;
+    GMainLoop* loop;
+    guint errors;
+} TestThreadStuck;
+
+static
+void
+test_thread_stuck_error(
+    NciHalClient* client)
+{
+    TestThreadStuck* test = G_CAST(client, TestThreadStuck, client);
+
+    test->errors++;
+    g_main_loop_quit(test->loop);
+}
+
+static
+void
+test_thread_stuck(
+    void)
+{
+    int fd[2];
+    TestThreadStuck test;
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    static const NciHalClientFunctions test_thread_stuck_fn = {
+        test_thread_stuck_error, test_no_read
+    };
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.read_mode = PN54X_IO_READ_THREAD;
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.client.fn = &test_thread_stuck_fn;
+    test.loop = g_main_loop_new(NULL, FALSE);
+
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+    g_assert(io->fn->start(io, &test.client));
+
+    /* Let the reader block in read() */
+    g_timeout_add(100, test_unblock, test.loop);
+    test_run(&test_opt, test.loop);
+
+    /* The old thread never leaves read(), the new one fails to start */
+    g_atomic_int_set(&test_interrupts_lost, G_MAXINT);
+    io->fn->stop(io);
+    g_assert(io->fn->start(io, &test.client));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.errors, == ,1);
+    io->fn->stop(io);
+
+    /* Let the kick timer get rid of the old thread */
+    g_atomic_int_set(&test_interrupts_lost, 0);
+    g_timeout_add(100, test_unblock, test.loop);
+    test_run(&test_opt, test.loop);
+
+    g_main_loop_unref(test.loop);
+    close(test_fd);
+    close(fd[1]);
+    test_reset();
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * wait_ready
+ *==========================================================================*/
+
+typedef struct test_wait_ready {
+    NciHalClient client;
+    GMainLoop* loop;
+    guint count;
+    guint nread;
+    gboolean signaled;
+} TestWaitReady;
+
+static
+void
+test_wait_ready_cb(
+    Pn54xHalIo* io,
+    gboolean signaled,
+    void* user_data)
+{
+    TestWaitReady* test = user_data;
+
+    test->count++;
+    test->signaled = signaled;
+    g_main_loop_quit(test->loop);
+}
+
+static
+void
+test_wait_ready_read(
+    NciHalClient* client,
+    const void* data,
+    guint len)
+{
+    TestWaitReady* test = G_CAST(client, TestWaitReady, client);
+    static const guint8 rsp[] = { 0x40, 0x00, 0x01, 0x00 };
+
+    /* CORE_RESET_NTF received while booting is not passed to the client */
+    test->nread++;
+    g_assert_cmpuint(len, == ,sizeof(rsp));
+    g_assert(!memcmp(data, rsp, len));
+    g_main_loop_quit(test->loop);
+}
+
+static
+gboolean
+test_wait_ready_blocking(
+    int fd)
+{
+    return !(fcntl(fd, F_GETFL) & O_NONBLOCK);
+}
+
+static
+void
+test_wait_ready(
+    gconstpointer data)
+{
+    const PN54X_IO_READ_MODE mode = GPOINTER_TO_INT(data);
+    int fd[2];
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    Pn54xIoStats stats;
+    NciHalIo* io;
+    TestWaitReady test;
+    struct pollfd pfd;
+    static const NciHalClientFunctions test_wait_ready_fn = {
+        test_no_error, test_wait_ready_read
+    };
+    static const guint8 pad[] = { 0xff, 0xff, 0xff, 0xff };
+    static const guint8 ntf[] = { 0x60, 0x00, 0x02, 0x00, 0x01 };
+    static const guint8 rsp[] = { 0x40, 0x00, 0x01, 0x00 };
+
+    memset(&test, 0, sizeof(test));
+    memset(&io_config, 0, sizeof(io_config));
+    test.client.fn = &test_wait_ready_fn;
+    io_config.read_mode = mode;
+    g_assert(!pn54x_io_wait_ready(NULL, 0, test_wait_ready_cb, &test));
+    pn54x_io_cancel_ready(NULL);
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.loop = g_main_loop_new(NULL, FALSE);
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+
+    /* Nothing to wait for when power is off */
+    g_assert(!pn54x_io_wait_ready(hal, 1000, NULL, &test));
+    g_assert(!pn54x_io_wait_ready(hal, 1000, test_wait_ready_cb, &test));
+
+    /* CORE_RESET_NTF is already there (and gets consumed) */
+    g_assert(pn54x_io_set_power(hal, TRUE));
+    g_assert_cmpint(write(fd[1], ntf, sizeof(ntf)), ==, sizeof(ntf));
+    g_assert(pn54x_io_wait_ready(hal, 10000, test_wait_ready_cb, &test));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.count, == ,1);
+    g_assert(test.signaled);
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = fd[0];
+    pfd.events = POLLIN;
+    g_assert_cmpint(poll(&pfd, 1, 0), == ,0);
+
+    /* It went through the framer, like any other packet */
+    pn54x_io_get_stats(hal, &stats);
+    g_assert_cmpuint(stats.read_bytes, == ,sizeof(ntf));
+    g_assert_cmpuint(stats.packets, == ,1);
+
+    /* The reader selected by the configuration has been used */
+    if (mode == PN54X_IO_READ_AUTO || mode == PN54X_IO_READ_DIRECT) {
+        g_assert(!test_wait_ready_blocking(fd[0]));
+    } else {
+        g_assert(test_wait_ready_blocking(fd[0]));
+    }
+
+    /* CORE_RESET_NTF arrives later */
+    g_assert(pn54x_io_wait_ready(hal, 10000, test_wait_ready_cb, &test));
+    g_assert_cmpint(write(fd[1], pad, sizeof(pad)), ==, sizeof(pad));
+    test_quit_later_n(test.loop, 10);
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.count, == ,1); /* Padding doesn't count */
+    g_assert_cmpint(write(fd[1], ntf, sizeof(ntf)), ==, sizeof(ntf));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.count, == ,2);
+    g_assert(test.signaled);
+
+    /* Nothing arrives */
+    g_assert(pn54x_io_wait_ready(hal, 10, test_wait_ready_cb, &test));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.count, == ,3);
+    g_assert(!test.signaled);
+
+    /* Cancelled */
+    g_assert(pn54x_io_wait_ready(hal, 10, test_wait_ready_cb, &test));
+    pn54x_io_cancel_ready(hal);
+    pn54x_io_cancel_ready(hal);
+    g_usleep(20000);
+    test_quit_later_n(test.loop, 10);
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.count, == ,3);
+
+    /* Power goes off while waiting */
+    g_assert(pn54x_io_wait_ready(hal, 10, test_wait_ready_cb, &test));
+    g_assert(pn54x_io_set_power(hal, FALSE));
+    g_usleep(20000);
+    test_quit_later_n(test.loop, 10);
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.count, == ,3);
+
+    /* Nothing to wait for while the client is reading */
+    g_assert(pn54x_io_set_power(hal, TRUE));
+    g_assert(io->fn->start(io, &test.client));
+    g_assert(!pn54x_io_wait_ready(hal, 10, test_wait_ready_cb, &test));
+    g_assert_cmpint(write(fd[1], rsp, sizeof(rsp)), ==, sizeof(rsp));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.nread, == ,1);
+
+    /* But there is after power off/on */
+    g_assert(pn54x_io_set_power(hal, FALSE));
+    g_assert(pn54x_io_set_power(hal, TRUE));
+    g_assert_cmpint(write(fd[1], ntf, sizeof(ntf)), ==, sizeof(ntf));
+    g_assert(pn54x_io_wait_ready(hal, 10000, test_wait_ready_cb, &test));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.count, == ,4);
+    g_assert(test.signaled);
+
+    /* The client picks up the reader started for the boot */
+    g_assert(io->fn->start(io, &test.client));
+    g_assert_cmpint(write(fd[1], rsp, sizeof(rsp)), ==, sizeof(rsp));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.nread, == ,2);
+
+    io->fn->stop(io);
+    close(fd[0]);
+    close(fd[1]);
+    test_reset();
+    g_main_loop_unref(test.loop);
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * update_firmware
+ *==========================================================================*/
+
+/* Stand-in DL mode chip, each response is written in two pieces */
+typedef struct test_update_firmware {
+    GMainLoop* loop;
+    int fd;
+    guint16 version;
+    gboolean mute;
+    guint chunks;
+    GByteArray* rest;
+    guint rest_id;
+    guint count;
+    PN54X_FW_RESULT result;
+    Pn54xFwStats stats;
+} TestUpdateFirmware;
+
+static
+void
+test_update_firmware_done(
+    Pn54xHalIo* io,
+    PN54X_FW_RESULT result,
+    const Pn54xFwStats* stats,
+    void* user_data)
+{
+    TestUpdateFirmware* test = user_data;
+
+    /* Power is already off */
+    g_assert_cmpuint(test_ioctl_arg, == ,0);
+    test->count++;
+    test->result = result;
+    test->stats = *stats;
+    g_main_loop_quit(test->loop);
+}
+
+static
+gboolean
+test_update_firmware_rest(
+    gpointer user_data)
+{
+    TestUpdateFirmware* test = user_data;
+
+    test->rest_id = 0;
+    g_assert_cmpint(write(test->fd, test->rest->data, test->rest->len), == ,
+        test->rest->len);
+    g_byte_array_set_size(test->rest, 0);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+test_update_firmware_read(
+    int fd,
+    guint8* buf,
+    guint len)
+{
+    while (len) {
+        const ssize_t n = read(fd, buf, len);
+
+        g_assert_cmpint(n, > ,0);
+        buf += n;
+        len -= n;
+    }
+}
+
+static
+gboolean
+test_update_firmware_chip(
+    gint fd,
+    GIOCondition condition,
+    gpointer user_data)
+{
+    TestUpdateFirmware* test = user_data;
+    guint8 buf[0x3ff + 4];
+    guint8 rsp[9];
+    guint len;
+    guint16 crc;
+
+    test_update_firmware_read(fd, buf, 2);
+    len = ((buf[0] & 0x03) << 8) | buf[1];
+    test_update_firmware_read(fd, buf + 2, len + 2);
+    test->chunks++;
+    if (!test->mute) {
+        if (len == 4 && buf[2] == 0xf1) {
+            /* GET_VERSION: status, hw, rom, fw minor, fw major */
+            rsp[1] = 5;
+            rsp[2] = 0x00;
+            rsp[3] = 0x11;
+            rsp[4] = 0x10;
+            rsp[5] = (guint8)test->version;
+            rsp[6] = (guint8)(test->version >> 8);
+        } else {
+            rsp[1] = 1;
+            rsp[2] = 0x00;
+        }
+        rsp[0] = 0;
+        len = rsp[1] + 2;
+        crc = pn54x_fw_crc16(0xffff, rsp, len);
+        rsp[len++] = (guint8)(crc >> 8);
+        rsp[len++] = (guint8)crc;
+        g_assert_cmpint(write(fd, rsp, 3), == ,3);
+        g_byte_array_append(test->rest, rsp + 3, len - 3);
+        test->rest_id = g_timeout_add(10, test_update_firmware_rest, test);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static
+void
+test_update_firmware(
+    gconstpointer data)
+{
+    int fd[2];
+    guint watch_id;
+    Pn54xHalIo* hal;
+    Pn54xFwImage* image;
+    Pn54xIoConfig io_config;
+    Pn54xFwConfig config;
+    TestUpdateFirmware test;
+    static const guint8 fw[] = {
+        0x00, 0x04, 0xc0, 0x00, 0x12, 0x0a,
+        0x00, 0x03, 0x01, 0x02, 0x03
+    };
+
+    memset(&test, 0, sizeof(test));
+    test.loop = g_main_loop_new(NULL, FALSE);
+    test.rest = g_byte_array_new();
+    image = pn54x_fw_image_new(fw, sizeof(fw));
+    g_assert(image);
+    g_assert(!pn54x_io_update_firmware(NULL, image, NULL,
+        test_update_firmware_done, &test));
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.fd = fd[1];
+    watch_id = g_unix_fd_add(fd[1], G_IO_IN, test_update_firmware_chip,
+        &test);
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.read_mode = GPOINTER_TO_INT(data);
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    g_assert(!pn54x_io_update_firmware(hal, NULL, NULL,
+        test_update_firmware_done, &test));
+    g_assert(!pn54x_io_update_firmware(hal, image, NULL, NULL, NULL));
+
+    /* Not while it's powered on */
+    g_assert(pn54x_io_set_power(hal, TRUE));
+    g_assert(!pn54x_io_update_firmware(hal, image, NULL,
+        test_update_firmware_done, &test));
+    g_assert(pn54x_io_set_power(hal, FALSE));
+
+    /* Chip is up to date, the callback is invoked asynchronously */
+    test.version = 0x0a12;
+    g_assert(pn54x_io_update_firmware(hal, image, NULL,
+        test_update_firmware_done, &test));
+    g_assert_cmpuint(test_ioctl_arg, == ,2);
+    g_assert(!pn54x_io_update_firmware(hal, image, NULL,
+        test_update_firmware_done, &test));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.count, == ,1);
+    g_assert_cmpint(test.result, == ,PN54X_FW_CURRENT);
+    g_assert_cmpuint(test.stats.chip_version, == ,0x0a12);
+    g_assert_cmpuint(test.chunks, == ,1);
+
+    /* Older firmware gets updated */
+    test.version = 0x0a11;
+    g_assert(pn54x_io_update_firmware(hal, image, NULL,
+        test_update_firmware_done, &test));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.count, == ,2);
+    g_assert_cmpint(test.result, == ,PN54X_FW_UPDATED);
+    g_assert_cmpuint(test.stats.frames, == ,2);
+    g_assert_cmpuint(test.stats.chunks, == ,3);
+    g_assert_cmpuint(test.chunks, == ,4);
+
+    /* The chip doesn't respond */
+    memset(&config, 0, sizeof(config));
+    config.timeout = 10;
+    test.mute = TRUE;
+    g_assert(pn54x_io_update_firmware(hal, image, &config,
+        test_update_firmware_done, &test));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.count, == ,3);
+    g_assert_cmpint(test.result, == ,PN54X_FW_ERROR);
+
+    /* Failure to enter download mode */
+    test_ioctl_ret = -1;
+    g_assert(!pn54x_io_update_firmware(hal, image, NULL,
+        test_update_firmware_done, &test));
+    test_ioctl_ret = 0;
+
+    /* Cancelled download doesn't complete (the chip is still mute) */
+    g_assert(pn54x_io_update_firmware(hal, image, NULL,
+        test_update_firmware_done, &test));
+    pn54x_io_cancel_firmware(hal);
+    g_assert_cmpuint(test_ioctl_arg, == ,0);
+    pn54x_io_cancel_firmware(NULL);
+
+    /* Neither does the one in progress when the object is freed */
+    g_assert(pn54x_io_update_firmware(hal, image, NULL,
+        test_update_firmware_done, &test));
+    pn54x_io_free(hal);
+    g_assert_cmpuint(test.count, == ,3);
+
+    if (test.rest_id) {
+        g_source_remove(test.rest_id);
+    }
+    g_source_remove(watch_id);
+    close(fd[0]);
+    close(fd[1]);
+    test_reset();
+    pn54x_fw_image_free(image);
+    g_byte_array_free(test.rest, TRUE);
+    g_main_loop_unref(test.loop);
+}
+
+/*==========================================================================*
+ * sched
+ *==========================================================================*/
+
+static
+void
+test_sched(
+    gconstpointer data)
+{
+    int fd[2];
+    TestRead test;
+    Pn54xHalIo* hal;
+    Pn54xIoConfig io_config;
+    NciHalIo* io;
+    static const NciHalClientFunctions test_sched_fn = {
+        test_no_error, test_read_proc
+    };
+    static const guint8 ntf[] = { 0x60, 0x00, 0x02, 0x00, 0x01 };
+    static const GUtilData out[] = {
+        { TEST_ARRAY_AND_SIZE(ntf) }
+    };
+    static const TestReadConfig config = {
+        "sched", NULL, 0, TEST_ARRAY_AND_COUNT(out)
+    };
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), ==, 0);
+    memset(&test, 0, sizeof(test));
+    memset(&io_config, 0, sizeof(io_config));
+    io_config.read_mode = GPOINTER_TO_INT(data);
+
+    /* Things that don't require any privileges, failures aren't fatal */
+    io_config.read_sched.policy = PN54X_READER_POLICY_OTHER;
+    io_config.read_sched.flags = PN54X_READER_SCHED_NICE |
+        PN54X_READER_SCHED_MLOCK;
+    io_config.read_sched.nice = 1;
+    io_config.read_sched.cpus = 1;
+
+    test_reset();
+    test_ioctl_ret = 0;
+    test_fd = fd[0];
+    test.fd = fd[1];
+    test.client.fn = &test_sched_fn;
+    test.config = &config;
+    test.loop = g_main_loop_new(NULL, FALSE);
+
+    hal = pn54x_io_new_full("test", &io_config);
+    g_assert(hal);
+    io = &hal->hal_io;
+    g_assert(io->fn->start(io, &test.client));
+    g_assert_cmpint(write(fd[1], ntf, sizeof(ntf)), ==, sizeof(ntf));
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.nout, == ,config.out_count);
+
+    g_assert_cmpint(close(test.fd), ==, 0);
+    io->fn->stop(io);
+    g_main_loop_unref(test.loop);
+    close(test_fd);
+    test_reset();
+    pn54x_io_free(hal);
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+#define TEST_(name) "/pn54x_io/" name
+
+static const struct test_read_mode {
+    const char* name;
+    PN54X_IO_READ_MODE mode;
+} read_modes[] = {
+    { "auto", PN54X_IO_READ_AUTO },
+    { "direct", PN54X_IO_READ_DIRECT },
+    { "thread", PN54X_IO_READ_THREAD },
+    { "process", PN54X_IO_READ_PROCESS },
+    { "uring", PN54X_IO_READ_URING }
+};
+
+int main(int argc, char* argv[])
+{
+    TestReadRun runs[G_N_ELEMENTS(read_modes) * G_N_ELEMENTS(read_tests)];
+    guint i, k;
+
+    signal(SIGPIPE, SIG_IGN);
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func(TEST_("null"), test_null);
+    g_test_add_func(TEST_("open_error"), test_open_error);
+    g_test_add_func(TEST_("stop"), test_stop);
+    g_test_add_data_func(TEST_("stop_in_callback/direct"),
+        GINT_TO_POINTER(PN54X_IO_READ_DIRECT), test_stop_in_callback);
+    g_test_add_data_func(TEST_("stop_in_callback/thread"),
+        GINT_TO_POINTER(PN54X_IO_READ_THREAD), test_stop_in_callback);
+    g_test_add_data_func(TEST_("stop_in_callback/process"),
+        GINT_TO_POINTER(PN54X_IO_READ_PROCESS), test_stop_in_callback);
+    g_test_add_data_func(TEST_("stop_in_callback/uring"),
+        GINT_TO_POINTER(PN54X_IO_READ_URING), test_stop_in_callback);
+    g_test_add_data_func(TEST_("probe/poll"),
+        GINT_TO_POINTER(FALSE), test_probe);
+    g_test_add_data_func(TEST_("probe/no_poll"),
+        GINT_TO_POINTER(TRUE), test_probe);
+    g_test_add_data_func(TEST_("overflow/thread"),
+        GINT_TO_POINTER(PN54X_IO_READ_THREAD), test_overflow);
+    g_test_add_data_func(TEST_("overflow/process"),
+        GINT_TO_POINTER(PN54X_IO_READ_PROCESS), test_overflow);
+    g_test_add_data_func(TEST_("power_cycle/thread"),
+        GINT_TO_POINTER(PN54X_IO_READ_THREAD), test_power_cycle);
+    g_test_add_data_func(TEST_("power_cycle/process"),
+        GINT_TO_POINTER(PN54X_IO_READ_PROCESS), test_power_cycle);
+    g_test_add_data_func(TEST_("power_cycle/uring"),
+        GINT_TO_POINTER(PN54X_IO_READ_URING), test_power_cycle);
+    g_test_add_data_func(TEST_("power_on_data/thread"),
+        GINT_TO_POINTER(PN54X_IO_READ_THREAD), test_power_on_data);
+    g_test_add_data_func(TEST_("power_on_data/process"),
+        GINT_TO_POINTER(PN54X_IO_READ_PROCESS), test_power_on_data);
+    g_test_add_func(TEST_("interrupt_taken"), test_interrupt_taken);
+    g_test_add_func(TEST_("thread_deferred"), test_thread_deferred);
+    g_test_add_func(TEST_("thread_stuck"), test_thread_stuck);
+    g_test_add_data_func(TEST_("wait_ready/auto"),
+        GINT_TO_POINTER(PN54X_IO_READ_AUTO), test_wait_ready);
+    g_test_add_data_func(TEST_("wait_ready/thread"),
+        GINT_TO_POINTER(PN54X_IO_READ_THREAD), test_wait_ready);
+    g_test_add_data_func(TEST_("wait_ready/process"),
+        GINT_TO_POINTER(PN54X_IO_READ_PROCESS), test_wait_ready);
+    g_test_add_data_func(TEST_("wait_ready/uring"),
+        GINT_TO_POINTER(PN54X_IO_READ_URING), test_wait_ready);
+    g_test_add_data_func(TEST_("update_firmware/auto"),
+        GINT_TO_POINTER(PN54X_IO_READ_AUTO), test_update_firmware);
+    g_test_add_data_func(TEST_("update_firmware/thread"),
+        GINT_TO_POINTER(PN54X_IO_READ_THREAD), test_update_firmware);
+    g_test_add_data_func(TEST_("update_firmware/process"),
+        GINT_TO_POINTER(PN54X_IO_READ_PROCESS), test_update_firmware);
+    g_test_add_data_func(TEST_("update_firmware/uring"),
+        GINT_TO_POINTER(PN54X_IO_READ_URING), test_update_firmware);
+    g_test_add_func(TEST_("capture"), test_capture);
+    g_test_add_func(TEST_("recorder"), test_recorder);
+    g_test_add_func(TEST_("hexdump"), test_hexdump);
+    g_test_add_data_func(TEST_("sched/thread"),
+        GINT_TO_POINTER(PN54X_IO_READ_THREAD), test_sched);
+    g_test_add_data_func(TEST_("sched/process"),
+        GINT_TO_POINTER(PN54X_IO_READ_PROCESS), test_sched);
+    g_test_add_data_func(TEST_("basic_write"),
+        GINT_TO_POINTER(PN54X_IO_READ_AUTO), test_basic_write);
+    g_test_add_data_func(TEST_("basic_write/uring"),
+        GINT_TO_POINTER(PN54X_IO_READ_URING), test_basic_write);
+    g_test_add_data_func(TEST_("cancel_write/gather"),
+        GINT_TO_POINTER(PN54X_IO_WRITE_GATHER_ON), test_cancel_write);
+    g_test_add_data_func(TEST_("cancel_write/copy"),
+        GINT_TO_POINTER(PN54X_IO_WRITE_GATHER_OFF), test_cancel_write);
+    g_test_add_data_func(TEST_("write_chunks/gather"),
+        GINT_TO_POINTER(PN54X_IO_WRITE_GATHER_ON), test_write_chunks);
+    g_test_add_data_func(TEST_("write_chunks/auto"),
+        GINT_TO_POINTER(PN54X_IO_WRITE_GATHER_AUTO), test_write_chunks);
+    g_test_add_data_func(TEST_("write_chunks/copy"),
+        GINT_TO_POINTER(PN54X_IO_WRITE_GATHER_OFF), test_write_chunks);
+    g_test_add_func(TEST_("write_error"), test_write_error);
+    g_test_add_data_func(TEST_("write_retry/recovered"),
+        GINT_TO_POINTER(2), test_write_retry);
+    g_test_add_data_func(TEST_("write_retry/unrecovered"),
+        GINT_TO_POINTER(3), test_write_retry);
+    g_test_add_data_func(TEST_("write_retry/fallback/recovered"),
+        GINT_TO_POINTER(TEST_WRITE_RETRY_FALLBACK | 2), test_write_retry);
+    g_test_add_data_func(TEST_("write_retry/fallback/unrecovered"),
+        GINT_TO_POINTER(TEST_WRITE_RETRY_FALLBACK | 3), test_write_retry);
+    g_test_add_func(TEST_("write_nonblock"), test_write_nonblock);
+    g_test_add_data_func(TEST_("write_queue/thread"),
+        GINT_TO_POINTER(PN54X_IO_READ_THREAD), test_write_queue);
+    g_test_add_data_func(TEST_("write_queue/uring"),
+        GINT_TO_POINTER(PN54X_IO_READ_URING), test_write_queue);
+    for (k = 0; k < G_N_ELEMENTS(read_modes); k++) {
+        for (i = 0; i < G_N_ELEMENTS(read_tests); i++) {
+            const TestReadConfig* test = read_tests + i;
+            TestReadRun* run = runs + k * G_N_ELEMENTS(read_tests) + i;
+            char* path = g_strconcat(TEST_("read/"), read_modes[k].name,
+                "/", test->name, NULL);
+
+            run->mode = read_modes[k].mode;
+            run->config = test;
+            g_test_add_data_func(path, run, test_read);
+            g_free(path);
+        }
     }
     test_init(&test_opt, argc, argv);
     return g_test_run();
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "test_common.h"
+
+#include "pn54x_latency.h"
+
+static TestOpt test_opt;
+
+/*==========================================================================*
+ * bucket
+ *==========================================================================*/
+
+static
+void
+test_bucket(
+    void)
+{
+    guint i;
+
+    /* Small values get a bucket each */
+    for (i = 0; i < 2 * PN54X_HISTOGRAM_SUB; i++) {
+        g_assert_cmpuint(pn54x_histogram_bucket(i), == ,i);
+        g_assert_cmpuint(pn54x_histogram_bucket_min(i), == ,i);
+    }
+
+    /* Then the buckets get wider */
+    g_assert_cmpuint(pn54x_histogram_bucket(16), == ,16);
+    g_assert_cmpuint(pn54x_histogram_bucket(17), == ,16);
+    g_assert_cmpuint(pn54x_histogram_bucket(18), == ,17);
+    g_assert_cmpuint(pn54x_histogram_bucket(31), == ,23);
+    g_assert_cmpuint(pn54x_histogram_bucket(32), == ,24);
+    g_assert_cmpuint(pn54x_histogram_bucket(35), == ,24);
+    g_assert_cmpuint(pn54x_histogram_bucket(36), == ,25);
+    g_assert_cmpuint(pn54x_histogram_bucket(G_MAXUINT32), == ,
+        PN54X_HISTOGRAM_BUCKETS - 1);
+
+    /* Buckets are contiguous */
+    for (i = 1; i < PN54X_HISTOGRAM_BUCKETS; i++) {
+        const guint32 min = pn54x_histogram_bucket_min(i);
+
+        g_assert_cmpuint(min, > ,pn54x_histogram_bucket_min(i - 1));
+        g_assert_cmpuint(pn54x_histogram_bucket(min), == ,i);
+        g_assert_cmpuint(pn54x_histogram_bucket(min - 1), == ,i - 1);
+    }
+}
+
+/*==========================================================================*
+ * percentile
+ *==========================================================================*/
+
+static
+void
+test_percentile(
+    void)
+{
+    Pn54xHistogram h;
+    guint i;
+
+    memset(&h, 0, sizeof(h));
+    g_assert_cmpuint(pn54x_histogram_percentile(&h, 50), == ,0);
+
+    /* 1..100 */
+    for (i = 1; i <= 100; i++) {
+        pn54x_histogram_add(&h, i);
+    }
+    g_assert_cmpuint(h.count, == ,100);
+    g_assert_cmpuint(h.sum, == ,5050);
+    g_assert_cmpuint(h.max, == ,100);
+
+    /* Upper bounds of the buckets, within 1/8 of the value */
+    g_assert_cmpuint(pn54x_histogram_percentile(&h, 0), == ,1);
+    g_assert_cmpuint(pn54x_histogram_percentile(&h, 10), == ,10);
+    g_assert_cmpuint(pn54x_histogram_percentile(&h, 50), == ,51);
+    g_assert_cmpuint(pn54x_histogram_percentile(&h, 90), == ,95);
+    g_assert_cmpuint(pn54x_histogram_percentile(&h, 100), == ,100);
+    g_assert_cmpuint(pn54x_histogram_percentile(&h, 200), == ,100);
+}
+
+/*==========================================================================*
+ * rsp
+ *==========================================================================*/
+
+static
+void
+test_rsp(
+    void)
+{
+    static const guint8 reset_cmd[] = { 0x20, 0x00, 0x01, 0x00 };
+    static const guint8 reset_rsp[] = { 0x40, 0x00, 0x03, 0x00, 0x11, 0x00 };
+    static const guint8 init_cmd[] = { 0x20, 0x01, 0x00 };
+    static const guint8 init_rsp[] = { 0x40, 0x01, 0x00 };
+    static const guint8 prop_cmd[] = { 0x2f, 0x3e, 0x00 };
+    static const guint8 prop_rsp[] = { 0x4f, 0x3e, 0x00 };
+    static const guint8 seg_cmd[] = { 0x30, 0x01, 0x00 };
+    static const guint8 seg_rsp[] = { 0x50, 0x01, 0x00 };
+    static const guint8 data[] = { 0x00, 0x00, 0x00 };
+    Pn54xLatency* latency = pn54x_latency_new();
+    const Pn54xHistogram* h;
+
+    pn54x_latency_sent(latency, reset_cmd, 1000);
+    pn54x_latency_received(latency, reset_rsp, 1300);
+    pn54x_latency_sent(latency, reset_cmd, 2000);
+    pn54x_latency_received(latency, data, 2050);
+    pn54x_latency_received(latency, reset_rsp, 2100);
+    h = pn54x_latency_rsp(latency, 0, 0);
+    g_assert(h);
+    g_assert_cmpuint(h->count, == ,2);
+    g_assert_cmpuint(h->sum, == ,400);
+    g_assert_cmpuint(h->max, == ,300);
+
+    /* Proprietary GID */
+    pn54x_latency_sent(latency, prop_cmd, 3000);
+    pn54x_latency_received(latency, prop_rsp, 3010);
+    h = pn54x_latency_rsp(latency, 0x0f, 0x3e);
+    g_assert(h);
+    g_assert_cmpuint(h->count, == ,1);
+    g_assert_cmpuint(h->sum, == ,10);
+
+    /* Response to a different command and without a command */
+    pn54x_latency_sent(latency, reset_cmd, 4000);
+    pn54x_latency_received(latency, init_rsp, 4100);
+    pn54x_latency_received(latency, reset_rsp, 4200);
+    g_assert_cmpuint(pn54x_latency_unmatched(latency), == ,2);
+    g_assert_null(pn54x_latency_rsp(latency, 0, 1));
+    g_assert_cmpuint(pn54x_latency_rsp(latency, 0, 0)->count, == ,2);
+
+    /* Segmented command and response are timed from last to last */
+    pn54x_latency_sent(latency, seg_cmd, 5000);
+    pn54x_latency_sent(latency, init_cmd, 5100);
+    pn54x_latency_received(latency, seg_rsp, 5200);
+    pn54x_latency_received(latency, init_rsp, 5300);
+    h = pn54x_latency_rsp(latency, 0, 1);
+    g_assert(h);
+    g_assert_cmpuint(h->count, == ,1);
+    g_assert_cmpuint(h->sum, == ,200);
+
+    pn54x_latency_log(latency, FALSE);
+    pn54x_latency_log(latency, FALSE); /* Nothing new */
+    pn54x_latency_log(latency, TRUE);
+    pn54x_latency_log(NULL, TRUE);
+
+    pn54x_latency_reset(latency);
+    g_assert_null(pn54x_latency_rsp(latency, 0, 0));
+    g_assert_cmpuint(pn54x_latency_unmatched(latency), == ,0);
+    pn54x_latency_free(latency);
+    pn54x_latency_free(NULL);
+}
+
+/*==========================================================================*
+ * written
+ *==========================================================================*/
+
+static
+void
+test_written(
+    void)
+{
+    static const guint8 reset_cmd[] = { 0x20, 0x00, 0x01, 0x00 };
+    static const guint8 reset_rsp[] = { 0x40, 0x00, 0x03, 0x00, 0x11, 0x00 };
+    static const guint8 init_cmd[] = { 0x20, 0x01, 0x00 };
+    static const guint8 reset_ntf[] = { 0x60, 0x00, 0x02, 0x00, 0x01 };
+    Pn54xLatency* latency = pn54x_latency_new();
+    const Pn54xHistogram* h;
+
+    /* Queued at 1000, written at 1200 */
+    pn54x_latency_sent(latency, reset_cmd, 1000);
+    pn54x_latency_written(latency, reset_cmd, 1200);
+    pn54x_latency_received(latency, reset_rsp, 1300);
+    h = pn54x_latency_rsp(latency, 0, 0);
+    g_assert(h);
+    g_assert_cmpuint(h->count, == ,1);
+    g_assert_cmpuint(h->sum, == ,100);
+
+    /* Completion after the response changes nothing */
+    pn54x_latency_sent(latency, reset_cmd, 2000);
+    pn54x_latency_received(latency, reset_rsp, 2300);
+    pn54x_latency_written(latency, reset_cmd, 2100);
+    g_assert_cmpuint(h->count, == ,2);
+    g_assert_cmpuint(h->sum, == ,400);
+
+    /* Neither does a late completion of an earlier command */
+    pn54x_latency_sent(latency, reset_cmd, 3000);
+    pn54x_latency_written(latency, reset_cmd, 2900);
+    pn54x_latency_received(latency, reset_rsp, 3100);
+    g_assert_cmpuint(h->count, == ,3);
+    g_assert_cmpuint(h->sum, == ,500);
+
+    /* Nor a completion of something else */
+    pn54x_latency_sent(latency, reset_cmd, 4000);
+    pn54x_latency_written(latency, init_cmd, 4050);
+    pn54x_latency_written(latency, reset_ntf, 4060);
+    pn54x_latency_received(latency, reset_rsp, 4100);
+    g_assert_cmpuint(h->count, == ,4);
+    g_assert_cmpuint(h->sum, == ,600);
+    pn54x_latency_free(latency);
+}
+
+/*==========================================================================*
+ * ntf
+ *==========================================================================*/
+
+static
+void
+test_ntf(
+    void)
+{
+    static const guint8 reset_ntf[] = { 0x60, 0x00, 0x02, 0x00, 0x01 };
+    static const guint8 intf_ntf[] = { 0x61, 0x05, 0x00 };
+    static const guint8 reset_cmd[] = { 0x20, 0x00, 0x01, 0x00 };
+    static const guint8 deact_cmd[] = { 0x21, 0x06, 0x01, 0x03 };
+    Pn54xLatency* latency = pn54x_latency_new();
+    const Pn54xHistogram* h;
+
+    /* Only the last notification before the command counts */
+    pn54x_latency_received(latency, reset_ntf, 1000);
+    pn54x_latency_received(latency, reset_ntf, 1500);
+    pn54x_latency_sent(latency, reset_cmd, 1600);
+    pn54x_latency_sent(latency, reset_cmd, 1700);
+    h = pn54x_latency_ntf(latency, 0, 0);
+    g_assert(h);
+    g_assert_cmpuint(h->count, == ,1);
+    g_assert_cmpuint(h->sum, == ,100);
+
+    pn54x_latency_received(latency, intf_ntf, 2000);
+    pn54x_latency_sent(latency, deact_cmd, 2250);
+    h = pn54x_latency_ntf(latency, 1, 5);
+    g_assert(h);
+    g_assert_cmpuint(h->count, == ,1);
+    g_assert_cmpuint(h->max, == ,250);
+    g_assert_null(pn54x_latency_rsp(latency, 1, 6));
+
+    pn54x_latency_log(latency, TRUE);
+    pn54x_latency_free(latency);
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+#define TEST_(name) "/pn54x_latency/" name
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func(TEST_("bucket"), test_bucket);
+    g_test_add_func(TEST_("percentile"), test_percentile);
+    g_test_add_func(TEST_("rsp"), test_rsp);
+    g_test_add_func(TEST_("written"), test_written);
+    g_test_add_func(TEST_("ntf"), test_ntf);
+    test_init(&test_opt, argc, argv);
+    return g_test_run();
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
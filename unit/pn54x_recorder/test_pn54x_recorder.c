@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "test_common.h"
+
+#include "pn54x_recorder.h"
+
+static TestOpt test_opt;
+
+/*==========================================================================*
+ * null
+ *==========================================================================*/
+
+static
+void
+test_null(
+    void)
+{
+    Pn54xRecorder* recorder = pn54x_recorder_new(NULL);
+    Pn54xRecorderPacket packet;
+
+    g_assert_cmpuint(pn54x_recorder_count(recorder), == ,0);
+    g_assert(!pn54x_recorder_get(recorder, 0, &packet));
+    g_assert(!pn54x_recorder_save(recorder, "test"));
+    pn54x_recorder_free(recorder);
+    pn54x_recorder_free(NULL);
+}
+
+/*==========================================================================*
+ * ring
+ *==========================================================================*/
+
+static
+void
+test_ring(
+    void)
+{
+    Pn54xRecorderConfig config;
+    Pn54xRecorder* recorder;
+    Pn54xRecorderPacket packet;
+    guint8 buf[8];
+    GUtilData chunk;
+    guint i;
+
+    memset(&config, 0, sizeof(config));
+    config.packets = 4;
+    config.bytes = 4;
+    recorder = pn54x_recorder_new(&config);
+
+    chunk.bytes = buf;
+    for (i = 0; i < 6; i++) {
+        memset(buf, i, sizeof(buf));
+        chunk.size = i + 1;
+        pn54x_recorder_record(recorder, i & 1, 100 + i, &chunk, 1);
+    }
+
+    /* The first two are gone */
+    g_assert_cmpuint(pn54x_recorder_count(recorder), == ,4);
+    for (i = 0; i < 4; i++) {
+        const guint k = i + 2;
+
+        g_assert(pn54x_recorder_get(recorder, i, &packet));
+        g_assert_cmpint(packet.time, == ,100 + k);
+        g_assert_cmpint(packet.out, == ,k & 1);
+        g_assert_cmpuint(packet.len, == ,k + 1);
+        g_assert_cmpuint(packet.size, == ,MIN(k + 1, 4));
+        g_assert_cmpuint(packet.data[0], == ,k);
+        g_assert_cmpuint(packet.data[packet.size - 1], == ,k);
+    }
+    g_assert(!pn54x_recorder_get(recorder, 4, &packet));
+    pn54x_recorder_free(recorder);
+}
+
+/*==========================================================================*
+ * chunks
+ *==========================================================================*/
+
+static
+void
+test_chunks(
+    void)
+{
+    static const guint8 hdr[] = { 0x20, 0x03, 0x05 };
+    static const guint8 payload[] = { 0x01, 0x02, 0x03, 0x04, 0x05 };
+    static const guint8 expected[] = { 0x20, 0x03, 0x05, 0x01, 0x02, 0x03 };
+    static const GUtilData chunks[] = {
+        { TEST_ARRAY_AND_SIZE(hdr) },
+        { TEST_ARRAY_AND_SIZE(payload) }
+    };
+    Pn54xRecorderConfig config;
+    Pn54xRecorder* recorder;
+    Pn54xRecorderPacket packet;
+
+    /* Too many bytes get capped */
+    memset(&config, 0, sizeof(config));
+    config.packets = 1;
+    config.bytes = 100000;
+    recorder = pn54x_recorder_new(&config);
+    pn54x_recorder_free(recorder);
+
+    config.bytes = sizeof(expected);
+    recorder = pn54x_recorder_new(&config);
+    pn54x_recorder_record(recorder, TRUE, 1, TEST_ARRAY_AND_COUNT(chunks));
+    g_assert(pn54x_recorder_get(recorder, 0, &packet));
+    g_assert(packet.out);
+    g_assert_cmpuint(packet.len, == ,sizeof(hdr) + sizeof(payload));
+    g_assert_cmpuint(packet.size, == ,sizeof(expected));
+    g_assert(!memcmp(packet.data, expected, sizeof(expected)));
+    pn54x_recorder_free(recorder);
+}
+
+/*==========================================================================*
+ * save
+ *==========================================================================*/
+
+static
+void
+test_save(
+    void)
+{
+    static const guint8 cmd[] = { 0x20, 0x01, 0x00 };
+    static const guint8 rsp[] = { 0x40, 0x01, 0x03, 0x00, 0x01, 0x02 };
+    static const char expected[] =
+        "# test\n"
+        "5 < 3 20 01 00\n"
+        "7 > 6 40 01 03 00 ...\n";
+    char* dir = g_dir_make_tmp("test_pn54x_recorder_XXXXXX", NULL);
+    char* file = g_build_filename(dir, "packets", NULL);
+    char* bad = g_build_filename(dir, "no", "such", "file", NULL);
+    Pn54xRecorderConfig config;
+    Pn54xRecorder* recorder;
+    GUtilData chunk;
+    gchar* contents = NULL;
+    gsize size = 0;
+
+    memset(&config, 0, sizeof(config));
+    config.bytes = 4;
+    config.file = file;
+    recorder = pn54x_recorder_new(&config);
+    TEST_BYTES_SET(chunk, cmd);
+    pn54x_recorder_record(recorder, TRUE, 5, &chunk, 1);
+    TEST_BYTES_SET(chunk, rsp);
+    pn54x_recorder_record(recorder, FALSE, 7, &chunk, 1);
+    g_assert(pn54x_recorder_save(recorder, "test"));
+    pn54x_recorder_free(recorder);
+
+    g_assert(g_file_get_contents(file, &contents, &size, NULL));
+    g_assert_cmpstr(contents, == ,expected);
+    g_free(contents);
+
+    config.file = bad;
+    recorder = pn54x_recorder_new(&config);
+    g_assert(!pn54x_recorder_save(recorder, "test"));
+    pn54x_recorder_free(recorder);
+
+    g_assert_cmpint(g_unlink(file), == ,0);
+    g_assert_cmpint(g_rmdir(dir), == ,0);
+    g_free(file);
+    g_free(bad);
+    g_free(dir);
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+#define TEST_(name) "/pn54x_recorder/" name
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func(TEST_("null"), test_null);
+    g_test_add_func(TEST_("ring"), test_ring);
+    g_test_add_func(TEST_("chunks"), test_chunks);
+    g_test_add_func(TEST_("save"), test_save);
+    test_init(&test_opt, argc, argv);
+    return g_test_run();
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
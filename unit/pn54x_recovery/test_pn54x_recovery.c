@@ -0,0 +1,466 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "test_common.h"
+
+#include "pn54x_recovery.h"
+
+static TestOpt test_opt;
+
+#define TEST_MAX_RESETS (16)
+
+/*
+ * The script tells what happens after each restart:
+ * 'e' - chip fails again, 'o' - chip is fine.
+ */
+typedef struct test_recovery {
+    GMainLoop* loop;
+    Pn54xRecovery* recovery;
+    const char* script;
+    guint restarts;
+    guint power_on_fail;
+    gboolean power;
+    gboolean failed;
+    guint resets;
+    gint64 reset_time[TEST_MAX_RESETS];
+} TestRecovery;
+
+static
+gboolean
+test_power(
+    gboolean on,
+    void* user_data)
+{
+    TestRecovery* test = user_data;
+
+    if (on) {
+        if (test->power_on_fail) {
+            test->power_on_fail--;
+            return FALSE;
+        }
+    } else {
+        g_assert_cmpuint(test->resets, < ,TEST_MAX_RESETS);
+        test->reset_time[test->resets++] = g_get_monotonic_time();
+    }
+    test->power = on;
+    return TRUE;
+}
+
+static
+void
+test_restart(
+    void* user_data)
+{
+    TestRecovery* test = user_data;
+    const char outcome = test->script[test->restarts];
+
+    g_assert(test->power);
+    g_assert_cmpint(pn54x_recovery_state(test->recovery), == ,
+        PN54X_RECOVERY_VERIFY);
+    g_assert(outcome);
+    test->restarts++;
+    if (outcome == 'e') {
+        pn54x_recovery_error(test->recovery);
+    } else {
+        pn54x_recovery_ok(test->recovery);
+    }
+    if (!test->script[test->restarts]) {
+        g_main_loop_quit(test->loop);
+    }
+}
+
+static
+void
+test_failed(
+    void* user_data)
+{
+    TestRecovery* test = user_data;
+
+    g_assert(!test->power);
+    test->failed = TRUE;
+    g_main_loop_quit(test->loop);
+}
+
+static const Pn54xRecoveryFunctions test_fn = {
+    test_power, test_restart, test_failed
+};
+
+static
+void
+test_recovery_init(
+    TestRecovery* test,
+    const Pn54xRecoveryConfig* config,
+    const char* script)
+{
+    memset(test, 0, sizeof(*test));
+    test->loop = g_main_loop_new(NULL, FALSE);
+    test->recovery = pn54x_recovery_new(config, &test_fn, test);
+    test->script = script;
+    test->power = TRUE;
+}
+
+static
+void
+test_recovery_deinit(
+    TestRecovery* test)
+{
+    pn54x_recovery_free(test->recovery);
+    g_main_loop_unref(test->loop);
+}
+
+static
+void
+test_assert_gap(
+    const TestRecovery* test,
+    guint i,
+    guint ms)
+{
+    g_assert_cmpint(test->reset_time[i] - test->reset_time[i - 1], >= ,
+        (gint64)ms * 1000);
+}
+
+static
+gboolean
+test_quit_cb(
+    gpointer loop)
+{
+    g_main_loop_quit(loop);
+    return G_SOURCE_REMOVE;
+}
+
+/*==========================================================================*
+ * null
+ *==========================================================================*/
+
+static
+void
+test_null(
+    void)
+{
+    g_assert_cmpint(pn54x_recovery_state(NULL), == ,PN54X_RECOVERY_IDLE);
+    g_assert(!pn54x_recovery_stats(NULL));
+    pn54x_recovery_error(NULL);
+    pn54x_recovery_ok(NULL);
+    pn54x_recovery_cancel(NULL);
+    pn54x_recovery_reset(NULL);
+    pn54x_recovery_reset_stats(NULL);
+    pn54x_recovery_free(NULL);
+}
+
+/*==========================================================================*
+ * basic
+ *==========================================================================*/
+
+static
+void
+test_basic(
+    void)
+{
+    TestRecovery test;
+    const Pn54xRecoveryStats* stats;
+    Pn54xRecoveryConfig config;
+
+    memset(&config, 0, sizeof(config));
+    config.pulse = 10;
+    test_recovery_init(&test, &config, "o");
+    stats = pn54x_recovery_stats(test.recovery);
+
+    /* Recovery isn't in progress */
+    pn54x_recovery_ok(test.recovery);
+    pn54x_recovery_cancel(test.recovery);
+    g_assert_cmpuint(stats->recovered, == ,0);
+
+    /* Several errors in a row result in a single reset */
+    pn54x_recovery_error(test.recovery);
+    pn54x_recovery_error(test.recovery);
+    g_assert_cmpint(pn54x_recovery_state(test.recovery), == ,
+        PN54X_RECOVERY_BACKOFF);
+    test_run(&test_opt, test.loop);
+
+    g_assert(test.power);
+    g_assert(!test.failed);
+    g_assert_cmpuint(test.resets, == ,1);
+    g_assert_cmpint(pn54x_recovery_state(test.recovery), == ,
+        PN54X_RECOVERY_IDLE);
+    g_assert_cmpuint(stats->errors, == ,2);
+    g_assert_cmpuint(stats->resets, == ,1);
+    g_assert_cmpuint(stats->recovered, == ,1);
+    g_assert_cmpuint(stats->failed, == ,0);
+    g_assert_cmpint(stats->time, >= ,10000);
+
+    /* Counters can be reset */
+    pn54x_recovery_reset_stats(test.recovery);
+    g_assert_cmpuint(stats->errors, == ,0);
+    g_assert_cmpuint(stats->resets, == ,0);
+    g_assert_cmpuint(stats->recovered, == ,0);
+    g_assert_cmpint(stats->time, == ,0);
+    test_recovery_deinit(&test);
+}
+
+/*==========================================================================*
+ * backoff
+ *==========================================================================*/
+
+static
+void
+test_backoff(
+    void)
+{
+    TestRecovery test;
+    const Pn54xRecoveryStats* stats;
+    Pn54xRecoveryConfig config;
+
+    memset(&config, 0, sizeof(config));
+    config.pulse = 1;
+    config.backoff_min = 20;
+    config.backoff_max = 50;
+    config.max_attempts = 10;
+    config.rate_limit = 10;
+    test_recovery_init(&test, &config, "eeeeo");
+    stats = pn54x_recovery_stats(test.recovery);
+    pn54x_recovery_error(test.recovery);
+    test_run(&test_opt, test.loop);
+
+    /* Delays double until they hit the ceiling */
+    g_assert_cmpuint(test.resets, == ,5);
+    test_assert_gap(&test, 1, 20);
+    test_assert_gap(&test, 2, 40);
+    test_assert_gap(&test, 3, 50);
+    test_assert_gap(&test, 4, 50);
+    g_assert_cmpuint(stats->errors, == ,5);
+    g_assert_cmpuint(stats->resets, == ,5);
+    g_assert_cmpuint(stats->recovered, == ,1);
+    g_assert_cmpint(pn54x_recovery_state(test.recovery), == ,
+        PN54X_RECOVERY_IDLE);
+
+    /* Next episode starts from scratch */
+    test.script = "eo";
+    test.restarts = 0;
+    pn54x_recovery_error(test.recovery);
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.resets, == ,7);
+    g_assert_cmpint(test.reset_time[6] - test.reset_time[5], < ,40000);
+    g_assert_cmpuint(stats->recovered, == ,2);
+    test_recovery_deinit(&test);
+}
+
+/*==========================================================================*
+ * rate
+ *==========================================================================*/
+
+static
+void
+test_rate(
+    void)
+{
+    TestRecovery test;
+    Pn54xRecoveryConfig config;
+
+    memset(&config, 0, sizeof(config));
+    config.pulse = 1;
+    config.backoff_min = 1;
+    config.backoff_max = 1;
+    config.rate_limit = 2;
+    config.rate_period = 200;
+    test_recovery_init(&test, &config, "eeo");
+    pn54x_recovery_error(test.recovery);
+    test_run(&test_opt, test.loop);
+
+    /* The third reset had to wait until the first one got old enough */
+    g_assert_cmpuint(test.resets, == ,3);
+    g_assert_cmpint(test.reset_time[1] - test.reset_time[0], < ,100000);
+    g_assert_cmpint(test.reset_time[2] - test.reset_time[0], >= ,200000);
+    test_recovery_deinit(&test);
+}
+
+/*==========================================================================*
+ * breaker
+ *==========================================================================*/
+
+static
+void
+test_breaker(
+    void)
+{
+    TestRecovery test;
+    const Pn54xRecoveryStats* stats;
+    Pn54xRecoveryConfig config;
+
+    memset(&config, 0, sizeof(config));
+    config.pulse = 1;
+    config.backoff_min = 1;
+    config.max_attempts = 3;
+    test_recovery_init(&test, &config, "eeeo");
+    stats = pn54x_recovery_stats(test.recovery);
+    pn54x_recovery_error(test.recovery);
+    test_run(&test_opt, test.loop);
+
+    /* Gave up after 3 resets, power is off */
+    g_assert(test.failed);
+    g_assert(!test.power);
+    g_assert_cmpuint(test.resets, == ,4);
+    g_assert_cmpuint(test.restarts, == ,3);
+    g_assert_cmpuint(stats->resets, == ,3);
+    g_assert_cmpuint(stats->recovered, == ,0);
+    g_assert_cmpuint(stats->failed, == ,1);
+    g_assert_cmpint(pn54x_recovery_state(test.recovery), == ,
+        PN54X_RECOVERY_FAILED);
+
+    /* Until it's reset, nothing happens */
+    pn54x_recovery_error(test.recovery);
+    pn54x_recovery_cancel(test.recovery);
+    g_assert_cmpint(pn54x_recovery_state(test.recovery), == ,
+        PN54X_RECOVERY_FAILED);
+    g_timeout_add(20, test_quit_cb, test.loop);
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(stats->resets, == ,3);
+
+    pn54x_recovery_reset(test.recovery);
+    g_assert_cmpint(pn54x_recovery_state(test.recovery), == ,
+        PN54X_RECOVERY_IDLE);
+    test.power = TRUE;
+    pn54x_recovery_error(test.recovery);
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(stats->resets, == ,4);
+    g_assert_cmpuint(stats->recovered, == ,1);
+    test_recovery_deinit(&test);
+}
+
+/*==========================================================================*
+ * power_fail
+ *==========================================================================*/
+
+static
+void
+test_power_fail(
+    void)
+{
+    TestRecovery test;
+    const Pn54xRecoveryStats* stats;
+    Pn54xRecoveryConfig config;
+
+    memset(&config, 0, sizeof(config));
+    config.pulse = 1;
+    config.backoff_min = 1;
+    test_recovery_init(&test, &config, "o");
+    stats = pn54x_recovery_stats(test.recovery);
+
+    /* Failure to power the chip back on counts as a failed attempt */
+    test.power_on_fail = 1;
+    pn54x_recovery_error(test.recovery);
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.resets, == ,2);
+    g_assert_cmpuint(stats->resets, == ,2);
+    g_assert_cmpuint(stats->recovered, == ,1);
+    test_recovery_deinit(&test);
+}
+
+/*==========================================================================*
+ * cancel
+ *==========================================================================*/
+
+static
+void
+test_cancel(
+    void)
+{
+    TestRecovery test;
+    const Pn54xRecoveryStats* stats;
+    Pn54xRecoveryConfig config;
+
+    memset(&config, 0, sizeof(config));
+    config.pulse = 1000;
+    test_recovery_init(&test, &config, "o");
+    stats = pn54x_recovery_stats(test.recovery);
+
+    /* Cancelled before the first reset */
+    pn54x_recovery_error(test.recovery);
+    pn54x_recovery_cancel(test.recovery);
+    g_assert_cmpint(pn54x_recovery_state(test.recovery), == ,
+        PN54X_RECOVERY_IDLE);
+    g_timeout_add(20, test_quit_cb, test.loop);
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.resets, == ,0);
+
+    /* And in the middle of the reset pulse */
+    pn54x_recovery_error(test.recovery);
+    g_timeout_add(20, test_quit_cb, test.loop);
+    test_run(&test_opt, test.loop);
+    g_assert_cmpint(pn54x_recovery_state(test.recovery), == ,
+        PN54X_RECOVERY_RESET);
+    g_assert_cmpuint(test.resets, == ,1);
+    pn54x_recovery_cancel(test.recovery);
+    g_assert_cmpint(pn54x_recovery_state(test.recovery), == ,
+        PN54X_RECOVERY_IDLE);
+    g_assert(!test.power);
+    g_assert_cmpuint(stats->recovered, == ,0);
+    g_assert_cmpuint(stats->failed, == ,0);
+
+    /* Reset pulse is still in progress when it's freed */
+    pn54x_recovery_error(test.recovery);
+    g_timeout_add(20, test_quit_cb, test.loop);
+    test_run(&test_opt, test.loop);
+    g_assert_cmpuint(test.resets, == ,2);
+    test_recovery_deinit(&test);
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+#define TEST_(name) "/pn54x_recovery/" name
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func(TEST_("null"), test_null);
+    g_test_add_func(TEST_("basic"), test_basic);
+    g_test_add_func(TEST_("backoff"), test_backoff);
+    g_test_add_func(TEST_("rate"), test_rate);
+    g_test_add_func(TEST_("breaker"), test_breaker);
+    g_test_add_func(TEST_("power_fail"), test_power_fail);
+    g_test_add_func(TEST_("cancel"), test_cancel);
+    test_init(&test_opt, argc, argv);
+    return g_test_run();
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "test_common.h"
+
+#include "pn54x_util.h"
+
+#include <errno.h>
+
+static TestOpt test_opt;
+
+#define TEST_BUF_SIZE (600)
+
+/*==========================================================================*
+ * skip_ff
+ *==========================================================================*/
+
+static
+void
+test_skip_ff_check(
+    const guint8* buf,
+    gsize len)
+{
+    const gsize expected = pn54x_util_skip_ff_scalar(buf, len);
+
+    g_assert_cmpuint(pn54x_util_skip_ff(buf, len), == ,expected);
+}
+
+static
+void
+test_skip_ff_empty(
+    void)
+{
+    static const guint8 data[] = { 0x00 };
+
+    g_assert_cmpuint(pn54x_util_skip_ff(data, 0), == ,0);
+    g_assert_cmpuint(pn54x_util_skip_ff_scalar(data, 0), == ,0);
+    g_assert_cmpuint(pn54x_util_skip_ff(data, 1), == ,0);
+}
+
+static
+void
+test_skip_ff_position(
+    void)
+{
+    guint8* mem = g_malloc(TEST_BUF_SIZE + 64);
+    guint align, len, pos;
+
+    /* Every alignment, length and position of the first non-ff byte */
+    for (align = 0; align < 64; align += 7) {
+        guint8* buf = mem + align;
+
+        for (len = 0; len <= TEST_BUF_SIZE; len += (len < 80) ? 1 : 37) {
+            memset(buf, 0xff, len);
+            test_skip_ff_check(buf, len);
+            g_assert_cmpuint(pn54x_util_skip_ff(buf, len), == ,len);
+            for (pos = 0; pos < len; pos++) {
+                memset(buf, 0xff, len);
+                buf[pos] = 0xfe;
+                test_skip_ff_check(buf, len);
+                g_assert_cmpuint(pn54x_util_skip_ff(buf, len), == ,pos);
+            }
+        }
+    }
+    g_free(mem);
+}
+
+static
+void
+test_skip_ff_random(
+    void)
+{
+    guint8 buf[TEST_BUF_SIZE];
+    GRand* rand = g_rand_new_with_seed(42);
+    guint i, k;
+
+    /* Runs of padding followed by random data */
+    for (i = 0; i < 1000; i++) {
+        const guint pad = g_rand_int_range(rand, 0, TEST_BUF_SIZE);
+        const guint len = g_rand_int_range(rand, pad, TEST_BUF_SIZE + 1);
+
+        memset(buf, 0xff, pad);
+        for (k = pad; k < len; k++) {
+            buf[k] = (guint8)g_rand_int_range(rand, 0xf0, 0x100);
+        }
+        test_skip_ff_check(buf, len);
+    }
+    g_rand_free(rand);
+}
+
+/*==========================================================================*
+ * write_error
+ *==========================================================================*/
+
+static
+void
+test_write_error(
+    void)
+{
+    g_assert(pn54x_util_write_error_transient(EREMOTEIO));
+    g_assert(pn54x_util_write_error_transient(EIO));
+    g_assert(!pn54x_util_write_error_transient(EAGAIN));
+    g_assert(!pn54x_util_write_error_transient(0));
+    g_assert(!pn54x_util_write_error_transient(EPIPE));
+    g_assert(!pn54x_util_write_error_transient(ENODEV));
+    g_assert(!pn54x_util_write_error_transient(EINVAL));
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+#define TEST_(name) "/pn54x_util/" name
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func(TEST_("skip_ff/empty"), test_skip_ff_empty);
+    g_test_add_func(TEST_("skip_ff/position"), test_skip_ff_position);
+    g_test_add_func(TEST_("skip_ff/random"), test_skip_ff_random);
+    g_test_add_func(TEST_("write_error"), test_write_error);
+    test_init(&test_opt, argc, argv);
+    return g_test_run();
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */